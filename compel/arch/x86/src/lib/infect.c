@@ -508,50 +508,29 @@ void parasite_setup_regs(unsigned long new_ip, void *stack, user_regs_struct_t *
 #define USER32_CS 0x23
 #define USER_CS	  0x33
 
-static bool ldt_task_selectors(pid_t pid)
+static bool ldt_task_selectors(user_regs_struct_t *regs)
 {
-	unsigned long cs;
-
-	errno = 0;
-	/*
-	 * Offset of register must be from 64-bit set even for
-	 * compatible tasks. Fix this to support native i386 tasks
-	 */
-	cs = ptrace(PTRACE_PEEKUSER, pid, offsetof(user_regs_struct64, cs), 0);
-	if (errno != 0) {
-		pr_perror("Can't get CS register for %d", pid);
-		return -1;
-	}
+	unsigned long cs = get_user_reg(regs, cs);
 
 	return cs != USER_CS && cs != USER32_CS;
 }
 
-static int arch_task_compatible(pid_t pid)
-{
-	user_regs_struct_t r;
-	int ret = ptrace_get_regs(pid, &r);
-
-	if (ret)
-		return -1;
-
-	return !user_regs_native(&r);
-}
-
+/*
+ * The registers were fetched by compel_prepare() and are kept in
+ * ctl->orig till the cure, there's no need to ask ptrace for them
+ * (or for a single CS with PEEKUSER) once more.
+ */
 bool arch_can_dump_task(struct parasite_ctl *ctl)
 {
+	user_regs_struct_t *regs = &ctl->orig.regs;
 	pid_t pid = ctl->rpid;
-	int ret;
-
-	ret = arch_task_compatible(pid);
-	if (ret < 0)
-		return false;
 
-	if (ret && !(ctl->ictx.flags & INFECT_COMPATIBLE)) {
+	if (!user_regs_native(regs) && !(ctl->ictx.flags & INFECT_COMPATIBLE)) {
 		pr_err("Can't dump task %d running in 32-bit mode\n", pid);
 		return false;
 	}
 
-	if (ldt_task_selectors(pid)) {
+	if (ldt_task_selectors(regs)) {
 		pr_err("Can't dump task %d with LDT descriptors\n", pid);
 		return false;
 	}
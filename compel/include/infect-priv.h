@@ -43,6 +43,15 @@ struct parasite_ctl {
 	int tsock; /* transport socket for transferring fds */
 
 	struct parasite_blob_desc pblob;
+
+	/*
+	 * While hold_code is set, the syscall code injected by the first
+	 * compel_syscall() stays at ictx.syscall_ip for the next ones,
+	 * held_orig keeps the original bytes to put back on release.
+	 */
+	bool hold_code;
+	const char *held_code;
+	uint8_t held_orig[BUILTIN_SYSCALL_SIZE];
 };
 
 struct parasite_thread_ctl {
@@ -628,6 +628,13 @@ int compel_execute_syscall(struct parasite_ctl *ctl, user_regs_struct_t *regs, c
 	int err;
 	uint8_t code_orig[BUILTIN_SYSCALL_SIZE];
 
+	if (ctl->held_code == code_syscall) {
+		err = parasite_run(pid, PTRACE_CONT, ctl->ictx.syscall_ip, 0, regs, &ctl->orig);
+		if (!err)
+			err = parasite_trap(ctl, pid, regs, &ctl->orig, false);
+		return err;
+	}
+
 	/*
 	 * Inject syscall instruction and remember original code,
 	 * we will need it to restore original program content.
@@ -642,6 +649,12 @@ int compel_execute_syscall(struct parasite_ctl *ctl, user_regs_struct_t *regs, c
 	if (!err)
 		err = parasite_trap(ctl, pid, regs, &ctl->orig, false);
 
+	if (ctl->hold_code && !ctl->held_code) {
+		memcpy(ctl->held_orig, code_orig, sizeof(code_orig));
+		ctl->held_code = code_syscall;
+		return err;
+	}
+
 	if (ptrace_poke_area(pid, (void *)code_orig, (void *)ctl->ictx.syscall_ip, sizeof(code_orig))) {
 		pr_err("Can't restore syscall blob (pid: %d)\n", ctl->rpid);
 		err = -1;
@@ -650,6 +663,35 @@ int compel_execute_syscall(struct parasite_ctl *ctl, user_regs_struct_t *regs, c
 	return err;
 }
 
+/*
+ * Each compel_syscall() injects the syscall code and puts the original
+ * one back, that's three ptrace requests on top of running the syscall
+ * itself. Setting the parasite up takes several syscalls in a row, so
+ * the code is injected once for all of them and restored at the end.
+ */
+static void syscall_code_hold(struct parasite_ctl *ctl)
+{
+	ctl->hold_code = true;
+}
+
+static int syscall_code_release(struct parasite_ctl *ctl)
+{
+	const char *code = ctl->held_code;
+	pid_t pid = ctl->rpid;
+
+	ctl->hold_code = false;
+	ctl->held_code = NULL;
+	if (!code)
+		return 0;
+
+	if (ptrace_poke_area(pid, (void *)ctl->held_orig, (void *)ctl->ictx.syscall_ip, sizeof(ctl->held_orig))) {
+		pr_err("Can't restore syscall blob (pid: %d)\n", pid);
+		return -1;
+	}
+
+	return 0;
+}
+
 int compel_run_at(struct parasite_ctl *ctl, unsigned long ip, user_regs_struct_t *ret_regs)
 {
 	user_regs_struct_t regs = ctl->orig.regs;
@@ -948,22 +990,24 @@ static int compel_map_exchange(struct parasite_ctl *ctl, unsigned long size)
 	else
 		remote_prot = PROT_READ | PROT_WRITE | PROT_EXEC;
 
+	syscall_code_hold(ctl);
+
 	ret = parasite_memfd_exchange(ctl, size, remote_prot);
 	if (ret == 1) {
 		pr_info("MemFD parasite doesn't work, goto legacy mmap\n");
 		ret = parasite_mmap_exchange(ctl, size, remote_prot);
-		if (ret)
-			return ret;
 	}
 
-	if (!ctl->pblob.hdr.data_off)
-		return 0;
+	if (ret || !ctl->pblob.hdr.data_off)
+		goto out;
 
 	ret = remote_mprotect(ctl, ctl->remote_map + ctl->pblob.hdr.data_off, size - ctl->pblob.hdr.data_off,
 			      PROT_READ | PROT_WRITE);
 	if (ret)
 		pr_err("remote_mprotect failed\n");
-
+out:
+	if (syscall_code_release(ctl))
+		ret = -1;
 	return ret;
 }
 
@@ -0,0 +1,572 @@
+/*
+ * Benchmark of the memory data path: the pages of a synthetic memory
+ * layout go through page-pipe and page-xfer into images the way dump
+ * puts them there, then are read back with page-read like on restore.
+ * Runs in-process, the pages are spliced from the bench itself rather
+ * than by a parasite.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "int.h"
+#include "page.h"
+#include "cr_options.h"
+#include "criu-log.h"
+#include "image.h"
+#include "imgset.h"
+#include "log.h"
+#include "page-pipe.h"
+#include "page-xfer.h"
+#include "pagemap.h"
+#include "protobuf-desc.h"
+#include "stats.h"
+#include "util.h"
+#include "xmalloc.h"
+
+#define BENCH_ID 1
+
+#ifndef SPLICE_F_GIFT
+#define SPLICE_F_GIFT 0x08
+#endif
+
+enum {
+	PH_PIPE,
+	PH_XFER,
+	PH_READ,
+	PH_NR,
+};
+
+static const char *ph_names[PH_NR] = { "pipe", "xfer", "read" };
+
+enum {
+	PC_SYSCALLS,
+	PC_CYCLES,
+	PC_INSTRUCTIONS,
+	PC_CACHE_MISSES,
+	PC_NR,
+};
+
+struct phase {
+	u64 ns;
+	u64 start;
+	int fd[PC_NR];
+	u64 cnt[PC_NR];
+};
+
+static struct phase phases[PH_NR];
+static bool have_cnt[PC_NR];
+
+enum {
+	PAT_DENSE,
+	PAT_STRIDE,
+	PAT_RUNS,
+	PAT_RANDOM,
+};
+
+static struct {
+	unsigned long size;
+	int pattern;
+	unsigned long a, b;
+	bool holes;
+	bool chunk;
+	bool perf;
+	int iterations;
+	char *dir;
+} bo = {
+	.size = 256 << 20,
+	.chunk = true,
+	.iterations = 3,
+};
+
+/* The synthetic memory, the pages marked in @present are dumped */
+static char *src, *dst;
+static unsigned long nr_pages, nr_present;
+static unsigned char *present;
+
+/* Shape of what was dumped, summed over the iterations */
+static unsigned long nr_pipes, nr_bufs, nr_iovs, nr_holes, nr_pmes;
+
+static u64 now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int syscall_tp_id(void)
+{
+	static const char *paths[] = {
+		"/sys/kernel/tracing/events/raw_syscalls/sys_enter/id",
+		"/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id",
+	};
+	int i, id = -1;
+	FILE *f;
+
+	for (i = 0; i < ARRAY_SIZE(paths) && id < 0; i++) {
+		f = fopen(paths[i], "r");
+		if (!f)
+			continue;
+		if (fscanf(f, "%d", &id) != 1)
+			id = -1;
+		fclose(f);
+	}
+
+	return id;
+}
+
+static int perf_open(u32 type, u64 config)
+{
+	struct perf_event_attr attr = {
+		.size = sizeof(attr),
+		.type = type,
+		.config = config,
+		.disabled = 1,
+		.exclude_hv = 1,
+	};
+
+	return syscall(__NR_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+}
+
+/*
+ * The syscalls are counted whenever the tracepoint is accessible, the
+ * hardware counters only on request. A counter that can't be opened
+ * is reported as missing.
+ */
+static void perf_init(void)
+{
+	int i, c, tp;
+
+	tp = syscall_tp_id();
+
+	for (i = 0; i < PH_NR; i++) {
+		for (c = 0; c < PC_NR; c++)
+			phases[i].fd[c] = -1;
+
+		if (tp >= 0)
+			phases[i].fd[PC_SYSCALLS] = perf_open(PERF_TYPE_TRACEPOINT, tp);
+		if (!bo.perf)
+			continue;
+
+		phases[i].fd[PC_CYCLES] = perf_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+		phases[i].fd[PC_INSTRUCTIONS] = perf_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+		phases[i].fd[PC_CACHE_MISSES] = perf_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+	}
+
+	for (c = 0; c < PC_NR; c++)
+		have_cnt[c] = phases[0].fd[c] >= 0;
+}
+
+static void phase_start(int ph)
+{
+	struct phase *p = &phases[ph];
+	int c;
+
+	/* The syscall counter goes last not to count the ioctl()-s */
+	for (c = PC_NR - 1; c >= 0; c--)
+		if (p->fd[c] >= 0)
+			ioctl(p->fd[c], PERF_EVENT_IOC_ENABLE, 0);
+	p->start = now_ns();
+}
+
+static void phase_stop(int ph)
+{
+	struct phase *p = &phases[ph];
+	int c;
+
+	p->ns += now_ns() - p->start;
+	for (c = 0; c < PC_NR; c++)
+		if (p->fd[c] >= 0)
+			ioctl(p->fd[c], PERF_EVENT_IOC_DISABLE, 0);
+}
+
+static void perf_fini(void)
+{
+	int i, c;
+
+	for (i = 0; i < PH_NR; i++) {
+		for (c = 0; c < PC_NR; c++) {
+			struct phase *p = &phases[i];
+
+			if (p->fd[c] < 0)
+				continue;
+			if (read(p->fd[c], &p->cnt[c], sizeof(p->cnt[c])) != sizeof(p->cnt[c]))
+				p->cnt[c] = 0;
+			close(p->fd[c]);
+			p->fd[c] = -1;
+		}
+	}
+}
+
+static int parse_pattern(char *arg)
+{
+	if (!strcmp(arg, "dense")) {
+		bo.pattern = PAT_DENSE;
+		return 0;
+	}
+	if (sscanf(arg, "stride:%lu", &bo.a) == 1 && bo.a) {
+		bo.pattern = PAT_STRIDE;
+		return 0;
+	}
+	if (sscanf(arg, "runs:%lu:%lu", &bo.a, &bo.b) == 2 && bo.a) {
+		bo.pattern = PAT_RUNS;
+		return 0;
+	}
+	if (sscanf(arg, "random:%lu", &bo.a) == 1 && bo.a && bo.a <= 100) {
+		bo.pattern = PAT_RANDOM;
+		return 0;
+	}
+
+	return -1;
+}
+
+static bool page_wanted(unsigned long pfn)
+{
+	switch (bo.pattern) {
+	case PAT_STRIDE:
+		return pfn % bo.a == 0;
+	case PAT_RUNS:
+		return pfn % (bo.a + bo.b) < bo.a;
+	case PAT_RANDOM:
+		return (unsigned long)random() % 100 < bo.a;
+	}
+
+	return true;
+}
+
+static int memory_init(void)
+{
+	unsigned long pfn;
+
+	nr_pages = bo.size / PAGE_SIZE;
+	present = xzalloc(nr_pages);
+	if (!present)
+		return -1;
+
+	src = mmap(NULL, bo.size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	dst = mmap(NULL, bo.size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (src == MAP_FAILED || dst == MAP_FAILED) {
+		pr_perror("Can't map %lu bytes", bo.size);
+		return -1;
+	}
+
+	/* Pages are read into memory already there, it's not faults that are measured */
+	memset(dst, 0, bo.size);
+
+	srandom(1);
+	for (pfn = 0; pfn < nr_pages; pfn++) {
+		if (!page_wanted(pfn))
+			continue;
+
+		present[pfn] = 1;
+		nr_present++;
+		memset(src + pfn * PAGE_SIZE, pfn & 0xff, PAGE_SIZE);
+		*(unsigned long *)(src + pfn * PAGE_SIZE) = pfn;
+	}
+
+	if (!nr_present) {
+		pr_err("The pattern leaves no pages to dump\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Like generate_iovs() does on dump, stops when the chunk is full */
+static int fill_page_pipe(struct page_pipe *pp, unsigned long *pfn)
+{
+	unsigned long addr;
+	int ret = 0;
+
+	for (; *pfn < nr_pages; (*pfn)++) {
+		addr = (unsigned long)src + *pfn * PAGE_SIZE;
+
+		if (present[*pfn])
+			ret = page_pipe_add_page(pp, addr, 0);
+		else if (bo.holes)
+			ret = page_pipe_add_hole(pp, addr, PP_HOLE_PARENT);
+		else
+			continue;
+
+		if (ret)
+			break;
+	}
+
+	return ret;
+}
+
+/* What the parasite does on dump */
+static int splice_page_pipe(struct page_pipe *pp)
+{
+	struct page_pipe_buf *ppb;
+
+	list_for_each_entry(ppb, &pp->bufs, l) {
+		unsigned int off, nr;
+		ssize_t ret;
+
+		nr_bufs++;
+		for (off = 0; off < ppb->nr_segs; off += nr) {
+			nr = min_t(unsigned int, ppb->nr_segs - off, IOV_MAX);
+			ret = vmsplice(ppb->p[1], &ppb->iov[off], nr, SPLICE_F_GIFT | SPLICE_F_NONBLOCK);
+			if (ret < 0) {
+				pr_perror("Can't splice pages to pipe");
+				return -1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+static int bench_dump(void)
+{
+	struct page_xfer xfer;
+	struct page_pipe *pp;
+	unsigned long pfn = 0;
+	int ret, exit_code = -1;
+
+	pp = create_page_pipe(nr_present, NULL, bo.chunk ? PP_CHUNK_MODE : 0);
+	if (!pp)
+		return -1;
+
+	if (open_page_xfer(&xfer, CR_FD_PAGEMAP, BENCH_ID))
+		goto out_pp;
+
+	while (1) {
+		phase_start(PH_PIPE);
+		ret = fill_page_pipe(pp, &pfn);
+		if (ret == 0 || ret == -EAGAIN) {
+			nr_holes += pp->free_hole;
+			if (splice_page_pipe(pp))
+				ret = -1;
+		}
+		phase_stop(PH_PIPE);
+		if (ret && ret != -EAGAIN)
+			goto out_xfer;
+
+		phase_start(PH_XFER);
+		if (page_xfer_dump_pages(&xfer, pp))
+			ret = -1;
+		phase_stop(PH_XFER);
+
+		/* Chunks reuse the pipes, count every one of them */
+		nr_pipes += pp->nr_pipes;
+		nr_iovs += pp->free_iov;
+		if (ret != -EAGAIN)
+			break;
+
+		page_pipe_reinit(pp);
+	}
+
+	if (ret)
+		goto out_xfer;
+
+	exit_code = 0;
+out_xfer:
+	xfer.close(&xfer);
+out_pp:
+	destroy_page_pipe(pp);
+	return exit_code;
+}
+
+static int bench_read(void)
+{
+	struct page_read pr;
+	unsigned long pfn;
+	int ret;
+
+	phase_start(PH_READ);
+	ret = open_page_read(BENCH_ID, &pr, PR_TASK);
+	if (ret <= 0) {
+		phase_stop(PH_READ);
+		pr_err("Can't open the pages just dumped\n");
+		return -1;
+	}
+
+	while (pr.advance(&pr)) {
+		unsigned long len = pagemap_len(pr.pe);
+
+		if (!pagemap_present(pr.pe)) {
+			pr.skip_pages(&pr, len);
+			continue;
+		}
+
+		ret = pr.read_pages(&pr, pr.pe->vaddr, pr.pe->nr_pages, dst + (pr.pe->vaddr - (unsigned long)src),
+				    PR_ASYNC);
+		if (ret < 0)
+			break;
+	}
+
+	if (ret >= 0)
+		ret = pr.sync(&pr);
+	nr_pmes += pr.nr_pmes;
+	pr.close(&pr);
+	phase_stop(PH_READ);
+
+	if (ret < 0)
+		return -1;
+
+	for (pfn = 0; pfn < nr_pages; pfn++) {
+		if (!present[pfn])
+			continue;
+		if (memcmp(src + pfn * PAGE_SIZE, dst + pfn * PAGE_SIZE, PAGE_SIZE)) {
+			pr_err("Page %lu differs after the read\n", pfn);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void print_counter(struct phase *p, int c, double per)
+{
+	if (have_cnt[c])
+		printf(" %12.1f", p->cnt[c] / per);
+	else
+		printf(" %12s", "-");
+}
+
+static void report(void)
+{
+	unsigned long pages = nr_present * bo.iterations;
+	double gb = (double)pages * PAGE_SIZE / (1UL << 30);
+	int i, c;
+
+	printf("%lu MB, %lu of %lu pages present, %d iterations\n", bo.size >> 20, nr_present, nr_pages,
+	       bo.iterations);
+	printf("pipes %lu, bufs %lu, iovs %lu, holes %lu, pagemap entries %lu (per iteration)\n",
+	       nr_pipes / bo.iterations, nr_bufs / bo.iterations, nr_iovs / bo.iterations, nr_holes / bo.iterations,
+	       nr_pmes / bo.iterations);
+
+	printf("%-6s %12s %12s", "phase", "ns/page", "syscalls/GB");
+	if (bo.perf)
+		printf(" %12s %12s %12s", "cycles/page", "insns/page", "misses/page");
+	printf("\n");
+
+	for (i = 0; i < PH_NR; i++) {
+		struct phase *p = &phases[i];
+
+		printf("%-6s %12.1f", ph_names[i], (double)p->ns / pages);
+		print_counter(p, PC_SYSCALLS, gb);
+		for (c = PC_CYCLES; bo.perf && c < PC_NR; c++)
+			print_counter(p, c, pages);
+		printf("\n");
+	}
+}
+
+static void usage(void)
+{
+	printf("Usage: page-bench [options]\n"
+	       "  -s|--size MB           size of the memory (256)\n"
+	       "  -p|--pattern PATTERN   which pages are present:\n"
+	       "                         dense, stride:N, runs:PRESENT:ABSENT, random:PERCENT\n"
+	       "  -H|--holes             dump the absent pages as holes in parent\n"
+	       "  -n|--no-chunk          keep all the pages in one page-pipe like pre-dump\n"
+	       "  -i|--iterations N      repeat N times (3)\n"
+	       "  -D|--images-dir DIR    where to put the images (a temporary directory)\n"
+	       "  -P|--perf              collect hardware performance counters\n"
+	       "  -v                     be more verbose\n");
+}
+
+int main(int argc, char *argv[])
+{
+	static const struct option lopts[] = {
+		{ "size", required_argument, 0, 's' },	     { "pattern", required_argument, 0, 'p' },
+		{ "holes", no_argument, 0, 'H' },	     { "no-chunk", no_argument, 0, 'n' },
+		{ "iterations", required_argument, 0, 'i' }, { "images-dir", required_argument, 0, 'D' },
+		{ "perf", no_argument, 0, 'P' },	     { "help", no_argument, 0, 'h' },
+		{},
+	};
+	char tmp[] = "/tmp/criu-page-bench.XXXXXX";
+	int opt, i, ret = 1;
+
+	init_opts();
+	opts.log_level = LOG_ERROR;
+
+	while ((opt = getopt_long(argc, argv, "s:p:Hni:D:Pvh", lopts, NULL)) != -1) {
+		switch (opt) {
+		case 's':
+			bo.size = strtoul(optarg, NULL, 0) << 20;
+			break;
+		case 'p':
+			if (parse_pattern(optarg)) {
+				fprintf(stderr, "Bad pattern %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'H':
+			bo.holes = true;
+			break;
+		case 'n':
+			bo.chunk = false;
+			break;
+		case 'i':
+			bo.iterations = atoi(optarg);
+			break;
+		case 'D':
+			bo.dir = optarg;
+			break;
+		case 'P':
+			bo.perf = true;
+			break;
+		case 'v':
+			opts.log_level++;
+			break;
+		case 'h':
+			usage();
+			return 0;
+		default:
+			usage();
+			return 1;
+		}
+	}
+
+	if (!bo.size || bo.iterations <= 0) {
+		usage();
+		return 1;
+	}
+
+	cr_pb_init();
+	util_init();
+	log_set_loglevel(opts.log_level);
+	if (log_init(NULL))
+		return 1;
+
+	if (!bo.dir) {
+		bo.dir = mkdtemp(tmp);
+		if (!bo.dir) {
+			pr_perror("Can't create images dir");
+			return 1;
+		}
+	}
+
+	if (open_image_dir(bo.dir, O_DUMP) || init_stats(DUMP_STATS) || memory_init())
+		goto out;
+
+	perf_init();
+	for (i = 0; i < bo.iterations; i++)
+		if (bench_dump() || bench_read())
+			goto out_perf;
+
+	ret = 0;
+out_perf:
+	perf_fini();
+	if (!ret)
+		report();
+out:
+	close_image_dir();
+	if (bo.dir == tmp)
+		rmrf(tmp);
+	return ret;
+}
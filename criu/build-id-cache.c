@@ -0,0 +1,312 @@
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+
+#include "common/lock.h"
+#include "build-id-cache.h"
+#include "cr_options.h"
+#include "imgset.h"
+#include "image.h"
+#include "util.h"
+#include "log.h"
+
+#include "protobuf.h"
+#include "images/regfile.pb-c.h"
+
+#undef LOG_PREFIX
+#define LOG_PREFIX "build-id-cache: "
+
+#define BUILD_ID_CACHE_SLOTS 4096
+/* SHA1 and shorter build-ids fit, longer ones are parsed every time */
+#define BUILD_ID_CACHE_MAX 64
+
+struct build_id_key {
+	u64 dev;
+	u64 ino;
+	u64 size;
+	u64 mtime;
+	u64 ctime;
+};
+
+struct build_id_slot {
+	struct build_id_key key;
+	/* 0 for a free slot, -1 for a file without a build-id */
+	int size;
+	unsigned char build_id[BUILD_ID_CACHE_MAX];
+};
+
+/*
+ * The cache lives in shared memory, so that the tasks forked on
+ * restore see the build-ids found by each other. It is loaded from
+ * and saved to a node-wide directory (--build-id-cache-dir), thus
+ * dumps and restores on the node don't parse the same libraries
+ * again, whatever images and work dirs they use.
+ */
+struct build_id_cache {
+	mutex_t lock;
+	bool dirty;
+	unsigned int hits;
+	unsigned int misses;
+	struct build_id_slot slots[BUILD_ID_CACHE_SLOTS];
+};
+
+static struct build_id_cache *cache;
+
+static void build_id_key_fill(struct build_id_key *key, const struct stat *st)
+{
+	key->dev = st->st_dev;
+	key->ino = st->st_ino;
+	key->size = st->st_size;
+	key->mtime = st->st_mtim.tv_sec * NSEC_PER_SEC + st->st_mtim.tv_nsec;
+	key->ctime = st->st_ctim.tv_sec * NSEC_PER_SEC + st->st_ctim.tv_nsec;
+}
+
+/*
+ * Returns the slot of the inode or the free slot to put it to, NULL
+ * if the cache is full. The inode may have changed since it was put
+ * into the slot, the caller has to compare the whole key.
+ */
+static struct build_id_slot *build_id_slot_find(const struct build_id_key *key)
+{
+	unsigned int i, hv;
+
+	hv = (key->dev * 31 + key->ino) % BUILD_ID_CACHE_SLOTS;
+	for (i = 0; i < BUILD_ID_CACHE_SLOTS; i++) {
+		struct build_id_slot *s = &cache->slots[(hv + i) % BUILD_ID_CACHE_SLOTS];
+
+		if (!s->size || (s->key.dev == key->dev && s->key.ino == key->ino))
+			return s;
+	}
+
+	return NULL;
+}
+
+static void build_id_slot_set(const struct build_id_key *key, const unsigned char *build_id, int size)
+{
+	struct build_id_slot *s;
+
+	if (size > BUILD_ID_CACHE_MAX)
+		return;
+
+	s = build_id_slot_find(key);
+	if (!s) {
+		pr_debug("Cache is full\n");
+		return;
+	}
+
+	s->key = *key;
+	if (size > 0) {
+		memcpy(s->build_id, build_id, size);
+		s->size = size;
+	} else
+		s->size = -1;
+}
+
+/*
+ * Opens the cache directory and locks it against other criu-s loading
+ * or saving the cache at the same time. Returns -ENOENT if there's no
+ * directory and @create is not set.
+ */
+static int build_id_cache_dir_open(bool create)
+{
+	const char *dir = opts.build_id_cache_dir ?: DEFAULT_BUILD_ID_CACHE_DIR;
+	int fd;
+
+	if (create && mkdirpat(AT_FDCWD, dir, 0700))
+		return -1;
+
+	fd = open(dir, O_RDONLY | O_DIRECTORY);
+	if (fd < 0) {
+		if (errno == ENOENT)
+			return -ENOENT;
+		pr_perror("Can't open %s", dir);
+		return -1;
+	}
+
+	if (flock(fd, LOCK_EX)) {
+		pr_perror("Can't lock %s", dir);
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static int build_id_cache_load(void)
+{
+	struct cr_img *img;
+	int dfd, ret;
+
+	dfd = build_id_cache_dir_open(false);
+	if (dfd == -ENOENT)
+		return 0;
+	if (dfd < 0)
+		return -1;
+
+	img = open_image_at(dfd, CR_FD_BUILD_ID_CACHE, O_RSTR);
+	if (!img) {
+		close(dfd);
+		return -1;
+	}
+
+	if (empty_image(img)) {
+		close_image(img);
+		close(dfd);
+		return 0;
+	}
+
+	while (1) {
+		BuildIdCacheEntry *be;
+		struct build_id_key key;
+
+		ret = pb_read_one_eof(img, &be, PB_BUILD_ID_CACHE);
+		if (ret <= 0)
+			break;
+
+		key.dev = be->dev;
+		key.ino = be->ino;
+		key.size = be->size;
+		key.mtime = be->mtime;
+		key.ctime = be->ctime;
+		build_id_slot_set(&key, be->build_id.data, be->has_build_id ? be->build_id.len : -1);
+
+		build_id_cache_entry__free_unpacked(be, NULL);
+	}
+
+	close_image(img);
+	close(dfd);
+	return ret;
+}
+
+/*
+ * Sets the cache up for --file-validation buildid. Must be called
+ * before the restore forks. A broken cache file is not fatal, we
+ * just parse everything again.
+ */
+int build_id_cache_init(void)
+{
+	if (cache || opts.file_validation_method != FILE_VALIDATION_BUILD_ID)
+		return 0;
+
+	cache = mmap(NULL, sizeof(*cache), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (cache == MAP_FAILED) {
+		pr_perror("Can't allocate build-id cache");
+		cache = NULL;
+		return -1;
+	}
+	mutex_init(&cache->lock);
+
+	if (build_id_cache_load()) {
+		pr_warn("Can't load build-id cache, starting from scratch\n");
+		memset(cache->slots, 0, sizeof(cache->slots));
+	}
+
+	return 0;
+}
+
+static int build_id_cache_save(void)
+{
+	struct cr_img *img;
+	int dfd, i, ret = 0;
+
+	dfd = build_id_cache_dir_open(true);
+	if (dfd < 0)
+		return -1;
+
+	img = open_image_at(dfd, CR_FD_BUILD_ID_CACHE, O_DUMP);
+	if (!img) {
+		close(dfd);
+		return -1;
+	}
+
+	for (i = 0; i < BUILD_ID_CACHE_SLOTS && !ret; i++) {
+		struct build_id_slot *s = &cache->slots[i];
+		BuildIdCacheEntry be = BUILD_ID_CACHE_ENTRY__INIT;
+
+		if (!s->size)
+			continue;
+
+		be.dev = s->key.dev;
+		be.ino = s->key.ino;
+		be.size = s->key.size;
+		be.mtime = s->key.mtime;
+		be.ctime = s->key.ctime;
+		if (s->size > 0) {
+			be.has_build_id = true;
+			be.build_id.data = s->build_id;
+			be.build_id.len = s->size;
+		}
+
+		ret = pb_write_one(img, &be, PB_BUILD_ID_CACHE);
+	}
+
+	close_image(img);
+	close(dfd);
+	return ret;
+}
+
+void build_id_cache_fini(void)
+{
+	if (!cache)
+		return;
+
+	pr_info("%u hits, %u misses\n", cache->hits, cache->misses);
+	if (cache->dirty && build_id_cache_save())
+		pr_warn("Can't save build-id cache\n");
+
+	munmap(cache, sizeof(*cache));
+	cache = NULL;
+}
+
+/*
+ * Same as get_build_id(): returns the size of the build-id put to
+ * @build_id or -1 if the file has none, but without reading the file.
+ */
+int build_id_cache_get(const struct stat *st, unsigned char **build_id)
+{
+	struct build_id_slot *s;
+	struct build_id_key key;
+	int ret = BUILD_ID_CACHE_MISS;
+
+	if (!cache)
+		return BUILD_ID_CACHE_MISS;
+
+	build_id_key_fill(&key, st);
+
+	mutex_lock(&cache->lock);
+	s = build_id_slot_find(&key);
+	if (s && s->size && !memcmp(&s->key, &key, sizeof(key))) {
+		ret = s->size;
+		if (ret > 0) {
+			*build_id = xmemdup(s->build_id, ret);
+			if (!*build_id)
+				ret = BUILD_ID_CACHE_MISS;
+		}
+	}
+
+	if (ret == BUILD_ID_CACHE_MISS)
+		cache->misses++;
+	else
+		cache->hits++;
+	mutex_unlock(&cache->lock);
+
+	return ret;
+}
+
+/* Remembers what get_build_id() returned for the file */
+void build_id_cache_put(const struct stat *st, const unsigned char *build_id, int size)
+{
+	struct build_id_key key;
+
+	if (!cache)
+		return;
+
+	build_id_key_fill(&key, st);
+
+	mutex_lock(&cache->lock);
+	build_id_slot_set(&key, build_id, build_id ? size : -1);
+	cache->dirty = true;
+	mutex_unlock(&cache->lock);
+}
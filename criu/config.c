@@ -1,6 +1,7 @@
 #include <ctype.h>
 #include <getopt.h>
 #include <limits.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -19,10 +20,12 @@
 #include "filesystems.h"
 #include "file-lock.h"
 #include "irmap.h"
+#include "mem.h"
 #include "mount.h"
 #include "mount-v2.h"
 #include "namespaces.h"
 #include "net.h"
+#include "page.h"
 #include "sk-inet.h"
 #include "sockets.h"
 #include "tty.h"
@@ -418,6 +421,7 @@ void init_opts(void)
 	INIT_LIST_HEAD(&opts.join_ns);
 	INIT_LIST_HEAD(&opts.new_cgroup_roots);
 	INIT_LIST_HEAD(&opts.irmap_scan_paths);
+	INIT_LIST_HEAD(&opts.discard_regions);
 
 	opts.cpu_cap = CPU_CAP_DEFAULT;
 	opts.manage_cgroups = CG_MODE_DEFAULT;
@@ -431,6 +435,7 @@ void init_opts(void)
 	opts.file_validation_method = FILE_VALIDATION_DEFAULT;
 	opts.network_lock_method = NETWORK_LOCK_DEFAULT;
 	opts.ghost_fiemap = FIEMAP_DEFAULT;
+	opts.freeze_notify_timeout = DEFAULT_FREEZE_NOTIFY_TIMEOUT;
 }
 
 bool deprecated_ok(char *what)
@@ -548,6 +553,18 @@ static size_t parse_size(char *optarg)
 	return (size_t)atol(optarg);
 }
 
+/* PID:START-END, with START and END in hex as in /proc/PID/maps */
+static int parse_discard_region(const char *ptr)
+{
+	unsigned long start, end;
+	int pid, n = 0;
+
+	if (sscanf(ptr, "%d:%lx-%lx%n", &pid, &start, &end, &n) != 3 || ptr[n] != '\0')
+		return -1;
+
+	return discard_region_add(pid, start, end - start);
+}
+
 static int parse_join_ns(const char *ptr)
 {
 	char *aux, *ns_file, *extra_opts = NULL;
@@ -686,6 +703,7 @@ int parse_options(int argc, char **argv, bool *usage_error, bool *has_exec_cmd,
 		{ "verbosity", optional_argument, 0, 'v' },
 		{ "ps-socket", required_argument, 0, 1091 },
 		BOOL_OPT("stream", &opts.stream),
+		BOOL_OPT("mem-images", &opts.mem_images),
 		{ "config", required_argument, 0, 1089 },
 		{ "no-default-config", no_argument, 0, 1090 },
 		{ "tls-cacert", required_argument, 0, 1092 },
@@ -703,6 +721,25 @@ int parse_options(int argc, char **argv, bool *usage_error, bool *has_exec_cmd,
 		BOOL_OPT("mntns-compat-mode", &opts.mntns_compat_mode),
 		BOOL_OPT("unprivileged", &opts.unprivileged),
 		BOOL_OPT("ghost-fiemap", &opts.ghost_fiemap),
+		BOOL_OPT("compact-pagemap", &opts.compact_pagemap),
+		BOOL_OPT("delta-pages", &opts.delta_pages),
+		{ "delta-pages-max", required_argument, 0, 1101 },
+		BOOL_OPT("page-cache-warmth", &opts.page_cache_warmth),
+		{ "page-cache-rate", required_argument, 0, 1102 },
+		BOOL_OPT("cold-pages", &opts.cold_pages),
+		BOOL_OPT("cold-pages-pageout", &opts.cold_pages_pageout),
+		BOOL_OPT("discard-dontdump", &opts.discard_dontdump),
+		{ "discard-region", required_argument, 0, 1103 },
+		BOOL_OPT("discard-unmap", &opts.discard_unmap),
+		{ "discard-signal", required_argument, 0, 1104 },
+		BOOL_OPT("numa", &opts.numa),
+		{ "io-rate", required_argument, 0, 1105 },
+		{ "io-iops", required_argument, 0, 1106 },
+		{ "io-burst", required_argument, 0, 1107 },
+		BOOL_OPT("io-full-speed-frozen", &opts.io_full_speed_frozen),
+		{ "freeze-notify", required_argument, 0, 1108 },
+		{ "freeze-notify-timeout", required_argument, 0, 1109 },
+		{ "build-id-cache-dir", required_argument, 0, 1110 },
 		{},
 	};
 
@@ -1041,6 +1078,45 @@ int parse_options(int argc, char **argv, bool *usage_error, bool *has_exec_cmd,
 				return 1;
 			}
 			break;
+		case 1101:
+			opts.delta_pages_max = parse_size(optarg);
+			break;
+		case 1102:
+			opts.page_cache_rate = parse_size(optarg);
+			break;
+		case 1103:
+			if (parse_discard_region(optarg)) {
+				pr_err("Failed while parsing --discard-region option: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 1104:
+			opts.discard_signal = atoi(optarg);
+			if (opts.discard_signal <= 0 || opts.discard_signal >= _NSIG) {
+				pr_err("Bad signal for --discard-signal: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 1105:
+			opts.io_rate = parse_size(optarg);
+			break;
+		case 1106:
+			opts.io_iops = atoi(optarg);
+			if ((int)opts.io_iops <= 0)
+				goto bad_arg;
+			break;
+		case 1107:
+			opts.io_burst = parse_size(optarg);
+			break;
+		case 1108:
+			SET_CHAR_OPTS(freeze_notify, optarg);
+			break;
+		case 1109:
+			opts.freeze_notify_timeout = atoi(optarg);
+			break;
+		case 1110:
+			SET_CHAR_OPTS(build_id_cache_dir, optarg);
+			break;
 		case 'V':
 			pr_msg("Version: %s\n", CRIU_VERSION);
 			if (strcmp(CRIU_GITID, "0"))
@@ -1122,6 +1198,32 @@ int check_options(void)
 		}
 	}
 
+	if (opts.mem_images) {
+		if (opts.mode != CR_DUMP && opts.mode != CR_PAGE_SERVER && opts.mode != CR_RESTORE) {
+			pr_err("--mem-images is only valid for dump, page-server and restore\n");
+			return 1;
+		}
+		if (opts.stream || opts.lazy_pages || opts.auto_dedup) {
+			pr_err("--mem-images can't be used with --stream, --lazy-pages or --auto-dedup\n");
+			return 1;
+		}
+		if (opts.mode == CR_DUMP && !opts.use_page_server) {
+			pr_err("--mem-images requires --page-server on dump\n");
+			return 1;
+		}
+	}
+
+	/* Non-realtime signals coalesce, one per discarded range is needed */
+	if (opts.discard_signal && (opts.discard_signal < SIGRTMIN || opts.discard_signal > SIGRTMAX)) {
+		pr_err("--discard-signal must be a realtime signal (%d-%d)\n", SIGRTMIN, SIGRTMAX);
+		return 1;
+	}
+
+	if (opts.delta_pages_max >= PAGE_SIZE) {
+		pr_err("--delta-pages-max must be less than the page size\n");
+		return 1;
+	}
+
 	if (opts.track_mem && !kdat.has_dirty_track) {
 		pr_err("Tracking memory is not available. Consider omitting --track-mem option.\n");
 		return 1;
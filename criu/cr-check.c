@@ -136,7 +136,7 @@ static int check_sock_diag(void)
 		return -1;
 	}
 
-	ret = collect_sockets(&ns);
+	ret = collect_sockets(&ns, false);
 	if (!ret)
 		return 0;
 
@@ -88,7 +88,8 @@ static int cr_dedup_one_pagemap(unsigned long img_id, int flags)
 			goto exit;
 
 		pr_debug("dedup iovec base=%" PRIx64 ", len=%lu\n", pr.pe->vaddr, pagemap_len(pr.pe));
-		if (!pagemap_in_parent(pr.pe)) {
+		/* Deltas are applied over the parent pages, keep them */
+		if (!pagemap_in_parent(pr.pe) && !pagemap_delta(pr.pe)) {
 			ret = dedup_one_iovec(prp, pr.pe->vaddr, pagemap_len(pr.pe));
 			if (ret)
 				goto exit;
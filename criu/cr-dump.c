@@ -64,7 +64,12 @@
 #include "kerndat.h"
 #include "stats.h"
 #include "mem.h"
+#include "numa.h"
 #include "page-pipe.h"
+#include "page-idle.h"
+#include "io-limit.h"
+#include "build-id-cache.h"
+#include "freeze-notify.h"
 #include "posix-timer.h"
 #include "vdso.h"
 #include "vma.h"
@@ -113,6 +118,7 @@ void free_mappings(struct vm_area_list *vma_area_list)
 		free(vma_area);
 	}
 
+	xfree(vma_area_list->discard);
 	vm_area_list_init(vma_area_list);
 }
 
@@ -482,6 +488,36 @@ err:
 	return ret;
 }
 
+static int dump_discard_ranges(pid_t pid, MmEntry *mme, const struct vm_area_list *vma_area_list)
+{
+	MmDiscardEntry *de;
+	unsigned int i;
+
+	if (!vma_area_list->nr_discard)
+		return 0;
+
+	mme->discard = xmalloc(vma_area_list->nr_discard * (sizeof(MmDiscardEntry *) + sizeof(MmDiscardEntry)));
+	if (!mme->discard)
+		return -1;
+
+	de = (MmDiscardEntry *)(mme->discard + vma_area_list->nr_discard);
+	for (i = 0; i < vma_area_list->nr_discard; i++, de++) {
+		struct discard_range *d = &vma_area_list->discard[i];
+
+		mm_discard_entry__init(de);
+		de->start = d->start;
+		de->end = d->end;
+		mme->discard[i] = de;
+
+		pr_info("Discarded %lx-%lx: %lu pages\n", d->start, d->end, d->nr_skipped);
+		if (stats_add_discard(pid, d->start, d->end, d->nr_skipped * PAGE_SIZE))
+			return -1;
+	}
+	mme->n_discard = vma_area_list->nr_discard;
+
+	return 0;
+}
+
 static int dump_task_mm(pid_t pid, const struct proc_pid_stat *stat, const struct parasite_dump_misc *misc,
 			const struct vm_area_list *vma_area_list, const struct cr_imgset *imgset)
 {
@@ -554,10 +590,14 @@ static int dump_task_mm(pid_t pid, const struct proc_pid_stat *stat, const struc
 	if (dump_task_exe_link(pid, &mme))
 		goto err;
 
+	if (dump_discard_ranges(pid, &mme, vma_area_list))
+		goto err;
+
 	ret = pb_write_one(img_from_set(imgset, CR_FD_MM), &mme, PB_MM);
 	xfree(mme.mm_saved_auxv);
 	free_aios(&mme);
 err:
+	xfree(mme.discard);
 	xfree(mme.vmas);
 	return ret;
 }
@@ -734,6 +774,8 @@ int dump_thread_core(int pid, CoreEntry *core, const struct parasite_dump_thread
 		if (tc->comm == NULL)
 			return -1;
 	}
+	if (!ret)
+		ret = dump_thread_mempolicy(tc, &ti->mpol);
 	if (!ret)
 		ret = seccomp_dump_thread(pid, tc);
 
@@ -1746,6 +1788,12 @@ static int dump_one_task(struct pstree_item *item, InventoryEntry *parent_ie)
 		goto err;
 	}
 
+	ret = dump_task_numa(pid, &vmas, item->core[0]->thread_core);
+	if (ret) {
+		pr_err("Dump NUMA placement (pid: %d) failed with %d\n", pid, ret);
+		goto err;
+	}
+
 	ret = dump_task_fs(pid, &misc, cr_imgset);
 	if (ret) {
 		pr_err("Dump fs (pid: %d) failed with %d\n", pid, ret);
@@ -1823,6 +1871,10 @@ static int cr_pre_dump_finish(int status)
 	he.has_pre_dump_mode = true;
 	he.pre_dump_mode = opts.pre_dump_mode;
 
+	/* Plugins may still be working on the frozen tasks */
+	if (cr_plugin_join() && status == 0)
+		status = -1;
+
 	pstree_switch_state(root_item, TASK_ALIVE);
 
 	timing_stop(TIME_FROZEN);
@@ -1863,11 +1915,17 @@ static int cr_pre_dump_finish(int status)
 
 		timing_stop(TIME_MEMWRITE);
 
+		if (opts.cold_pages && page_idle_mark(item->pid->real, mem_pp)) {
+			ret = -1;
+			goto err;
+		}
+
 		destroy_page_pipe(mem_pp);
 		if (compel_cure_local(ctl))
 			pr_err("Can't cure local: something happened with mapping?\n");
 	}
 
+	page_idle_fini();
 	free_pstree(root_item);
 	seccomp_free_entries();
 
@@ -1930,6 +1988,9 @@ int cr_pre_dump_tasks(pid_t pid)
 	if (cr_plugin_init(CR_PLUGIN_STAGE__PRE_DUMP))
 		goto err;
 
+	if (io_limit_init())
+		goto err;
+
 	if (lsm_check_opts())
 		goto err;
 
@@ -1948,6 +2009,9 @@ int cr_pre_dump_tasks(pid_t pid)
 	if (setup_alarm_handler())
 		goto err;
 
+	if (freeze_notify(true))
+		goto err;
+
 	if (collect_pstree())
 		goto err;
 
@@ -2015,16 +2079,22 @@ static int cr_dump_finish(int ret)
 {
 	int post_dump_ret = 0;
 
-	if (disconnect_from_page_server())
+	/* Plugins may still be writing images of the frozen tasks */
+	if (cr_plugin_join())
 		ret = -1;
 
+	/* With --mem-images the images are sent to the page server on close */
 	close_cr_imgset(&glob_imgset);
 
+	if (disconnect_from_page_server())
+		ret = -1;
+
 	if (bfd_flush_images())
 		ret = -1;
 
 	cr_plugin_fini(CR_PLUGIN_STAGE__DUMP, ret);
 	cgp_fini();
+	build_id_cache_fini();
 
 	if (!ret) {
 		/*
@@ -2133,6 +2203,12 @@ int cr_dump_tasks(pid_t pid)
 	if (cr_plugin_init(CR_PLUGIN_STAGE__DUMP))
 		goto err;
 
+	if (io_limit_init())
+		goto err;
+
+	if (build_id_cache_init())
+		goto err;
+
 	if (lsm_check_opts())
 		goto err;
 
@@ -2165,6 +2241,9 @@ int cr_dump_tasks(pid_t pid)
 	if (setup_alarm_handler())
 		goto err;
 
+	if (freeze_notify(false))
+		goto err;
+
 	/*
 	 * The collect_pstree will also stop (PTRACE_SEIZE) the tasks
 	 * thus ensuring that they don't modify anything we collect
@@ -2174,6 +2253,12 @@ int cr_dump_tasks(pid_t pid)
 	if (collect_pstree())
 		goto err;
 
+	if (opts.io_full_speed_frozen) {
+		io_limit_full_speed();
+		if (page_server_full_speed())
+			goto err;
+	}
+
 	if (collect_pstree_ids())
 		goto err;
 
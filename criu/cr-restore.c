@@ -37,6 +37,7 @@
 #include "sk-packet.h"
 #include "common/lock.h"
 #include "files.h"
+#include "page-cache.h"
 #include "pipes.h"
 #include "fifo.h"
 #include "sk-inet.h"
@@ -49,6 +50,9 @@
 #include "uffd.h"
 #include "namespaces.h"
 #include "mem.h"
+#include "numa.h"
+#include "io-limit.h"
+#include "build-id-cache.h"
 #include "mount.h"
 #include "fsnotify.h"
 #include "pstree.h"
@@ -972,6 +976,10 @@ static int restore_one_alive_task(int pid, CoreEntry *core)
 	if (setup_uffd(pid, ta))
 		return -1;
 
+	/* CRIU code is not there after the switch to the restorer */
+	if (cr_plugin_join())
+		return -1;
+
 	return sigreturn_restore(pid, ta, args_len, core);
 }
 
@@ -1766,6 +1774,9 @@ static int restore_task_with_children(void *_arg)
 
 	current = ca->item;
 
+	/* The RPC socket is criu's, its number means nothing here */
+	io_limit_set_rpc_sk(-1);
+
 	if (current != root_item) {
 		char buf[12];
 		int fd;
@@ -2259,6 +2270,10 @@ static int restore_root_task(struct pstree_item *init)
 	if (prepare_namespace_before_tasks())
 		return -1;
 
+	/* After the mount images are read, the prefetcher looks files up by mnt_id */
+	if (start_page_cache_prefetch())
+		return -1;
+
 	if (vpid(init) == INIT_PID) {
 		if (!(root_ns_mask & CLONE_NEWPID)) {
 			pr_err("This process tree can only be restored "
@@ -2335,6 +2350,8 @@ static int restore_root_task(struct pstree_item *init)
 	if (ret)
 		goto out_kill;
 
+	page_cache_prefetch_mounts_ready();
+
 	if (root_ns_mask & CLONE_NEWNS) {
 		mnt_ns_fd = open_proc(init->pid->real, "ns/mnt");
 		if (mnt_ns_fd < 0)
@@ -2392,6 +2409,9 @@ skip_ns_bouncing:
 	if (ret < 0)
 		goto out_kill;
 
+	/* The stats should show what was read ahead during the restore */
+	stop_page_cache_prefetch();
+
 	ret = move_veth_to_bridge();
 	if (ret < 0)
 		goto out_kill;
@@ -2443,6 +2463,8 @@ skip_ns_bouncing:
 		goto out_kill_network_unlocked;
 
 	timing_stop(TIME_RESTORE);
+	/* The restorer can't count it in the stats itself */
+	timing_add(TIME_THREAD_CREATE, atomic_read(&task_entries->thread_create_time));
 
 	if (catch_tasks(root_seized)) {
 		pr_err("Can't catch all tasks\n");
@@ -2485,6 +2507,11 @@ skip_ns_bouncing:
 			pr_debug("restore late stage hook for external plugin failed\n");
 	}
 
+	if (cr_plugin_join()) {
+		pr_err("Pending plugin operations failed\n");
+		goto out_kill_network_unlocked;
+	}
+
 	ret = run_scripts(ACT_PRE_RESUME);
 	if (ret)
 		pr_err("Pre-resume script ret code %d\n", ret);
@@ -2563,6 +2590,7 @@ int prepare_task_entries(void)
 	futex_set(&task_entries->start, CR_STATE_FAIL);
 	mutex_init(&task_entries->userns_sync_lock);
 	mutex_init(&task_entries->last_pid_mutex);
+	atomic_set(&task_entries->thread_create_time, 0);
 
 	return 0;
 }
@@ -2590,12 +2618,19 @@ int cr_restore_tasks(void)
 	if (cr_plugin_init(CR_PLUGIN_STAGE__RESTORE))
 		return -1;
 
-	if (check_img_inventory(/* restore = */ true) < 0)
+	if (io_limit_init())
+		goto err;
+
+	if (build_id_cache_init())
 		goto err;
 
+	/* Before the first image is read to account for waiting on it */
 	if (init_stats(RESTORE_STATS))
 		goto err;
 
+	if (check_img_inventory(/* restore = */ true) < 0)
+		goto err;
+
 	if (lsm_check_opts())
 		goto err;
 
@@ -2641,8 +2676,10 @@ int cr_restore_tasks(void)
 
 	ret = restore_root_task(root_item);
 clean_cgroup:
+	stop_page_cache_prefetch();
 	fini_cgroup();
 err:
+	build_id_cache_fini();
 	cr_plugin_fini(CR_PLUGIN_STAGE__RESTORE, ret);
 	return ret;
 }
@@ -3262,6 +3299,35 @@ static int prepare_one_signal_queue(SignalQueueEntry *sqe, unsigned int *nr)
 	return 0;
 }
 
+/*
+ * Queue --discard-signal once per discarded range, so that the
+ * application can rebuild it. The range start is in si_value.
+ */
+static int prepare_discard_signals(unsigned int *nr)
+{
+	MmEntry *mm = rsti(current)->mm;
+	int i;
+
+	if (!opts.discard_signal || !mm)
+		return 0;
+
+	for (i = 0; i < mm->n_discard; i++) {
+		siginfo_t *t;
+
+		t = rst_mem_alloc(sizeof(siginfo_t), RM_PRIVATE);
+		if (!t)
+			return -1;
+
+		memset(t, 0, sizeof(*t));
+		t->si_signo = opts.discard_signal;
+		t->si_code = SI_QUEUE;
+		t->si_value.sival_ptr = decode_pointer(mm->discard[i]->start);
+		(*nr)++;
+	}
+
+	return 0;
+}
+
 static unsigned int *siginfo_priv_nr; /* FIXME -- put directly on thread_args */
 
 static int prepare_signals(int pid, struct task_restore_args *ta, CoreEntry *leader_core)
@@ -3282,6 +3348,10 @@ static int prepare_signals(int pid, struct task_restore_args *ta, CoreEntry *lea
 	if (ret < 0)
 		goto out;
 
+	ret = prepare_discard_signals(&ta->siginfo_n);
+	if (ret < 0)
+		goto out;
+
 	for (i = 0; i < current->nr_threads; i++) {
 		if (!current->core[i]->thread_core->signals_p) /*backward compatibility*/
 			ret = open_signal_image(CR_FD_PSIGNAL, current->threads[i].ns[0].virt, &siginfo_priv_nr[i]);
@@ -3748,6 +3818,10 @@ static int sigreturn_restore(pid_t pid, struct task_restore_args *task_args, uns
 	RST_MEM_FIXUP_PPTR(task_args->helpers);
 	RST_MEM_FIXUP_PPTR(task_args->zombies);
 	RST_MEM_FIXUP_PPTR(task_args->vma_ios);
+	RST_MEM_FIXUP_PPTR(task_args->cold);
+	RST_MEM_FIXUP_PPTR(task_args->discard);
+	RST_MEM_FIXUP_PPTR(task_args->numa_vmas);
+	RST_MEM_FIXUP_PPTR(task_args->numa_ranges);
 	RST_MEM_FIXUP_PPTR(task_args->inotify_fds);
 
 	task_args->compatible_mode = core_is_compat(core);
@@ -3853,6 +3927,8 @@ static int sigreturn_restore(pid_t pid, struct task_restore_args *task_args, uns
 		if (ret)
 			goto err;
 
+		prepare_thread_mempolicy(&thread_args[i].mpol, tcore->thread_core);
+
 		seccomp_rst_reloc(&thread_args[i]);
 		thread_args[i].seccomp_force_tsync = rsti(current)->has_old_seccomp_filter;
 
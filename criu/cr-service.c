@@ -37,6 +37,7 @@
 #include "action-scripts.h"
 #include "sockets.h"
 #include "irmap.h"
+#include "mem.h"
 #include "kerndat.h"
 #include "proc_parse.h"
 #include "common/scm.h"
@@ -44,13 +45,26 @@
 #include "pidfd-store.h"
 
 #include "setproctitle.h"
+#include "io-limit.h"
 
 #include "cr-errno.h"
 #include "namespaces.h"
 
 unsigned int service_sk_ino = -1;
 
-static int recv_criu_msg(int socket_fd, CriuReq **req)
+static void apply_io_limits(CriuOpts *req)
+{
+	if (!req)
+		return;
+
+	io_limit_set(req->has_io_rate ? req->io_rate : IO_LIMIT_KEEP,
+		     req->has_io_iops ? req->io_iops : IO_LIMIT_KEEP,
+		     req->has_io_burst ? req->io_burst : IO_LIMIT_KEEP);
+	if (req->has_io_full_speed_frozen)
+		opts.io_full_speed_frozen = req->io_full_speed_frozen;
+}
+
+static int __recv_criu_msg(int socket_fd, CriuReq **req)
 {
 	u8 local[PB_PKOBJ_LOCAL_SIZE];
 	void *buf = (void *)&local;
@@ -93,6 +107,57 @@ err:
 	return exit_code;
 }
 
+/*
+ * IO_LIMITS requests can come at any time and get no response,
+ * they are applied and skipped here.
+ */
+static int recv_criu_msg(int socket_fd, CriuReq **req)
+{
+	while (1) {
+		if (__recv_criu_msg(socket_fd, req))
+			return -1;
+
+		if ((*req)->type != CRIU_REQ_TYPE__IO_LIMITS)
+			return 0;
+
+		apply_io_limits((*req)->opts);
+		criu_req__free_unpacked(*req, NULL);
+	}
+}
+
+/*
+ * Called while a request is being served to pick up an IO_LIMITS
+ * request if the client has sent one. Whatever else there is stays
+ * in the socket.
+ */
+int io_limit_recv_rpc(int sk)
+{
+	u8 buf[PB_PKOBJ_LOCAL_SIZE];
+	CriuReq *req;
+	int len, ret = 0;
+
+	len = recv(sk, buf, sizeof(buf), MSG_PEEK | MSG_DONTWAIT | MSG_TRUNC);
+	if (len <= 0 || len > sizeof(buf))
+		return 0;
+
+	req = criu_req__unpack(NULL, len, buf);
+	if (!req)
+		return 0;
+
+	if (req->type == CRIU_REQ_TYPE__IO_LIMITS) {
+		if (recv(sk, buf, sizeof(buf), MSG_DONTWAIT) != len) {
+			pr_perror("Can't read I/O limits request");
+			ret = -1;
+		} else {
+			apply_io_limits(req->opts);
+			ret = 1;
+		}
+	}
+
+	criu_req__free_unpacked(req, NULL);
+	return ret;
+}
+
 static int send_criu_msg_with_fd(int socket_fd, CriuResp *msg, int fd)
 {
 	u8 local[PB_PKOBJ_LOCAL_SIZE];
@@ -474,6 +539,64 @@ static int setup_opts_from_req(int sk, CriuOpts *req)
 	if (req->has_skip_file_rwx_check)
 		opts.skip_file_rwx_check = req->skip_file_rwx_check;
 
+	if (req->has_compact_pagemap)
+		opts.compact_pagemap = req->compact_pagemap;
+
+	if (req->has_delta_pages)
+		opts.delta_pages = req->delta_pages;
+
+	if (req->has_delta_pages_max)
+		opts.delta_pages_max = req->delta_pages_max;
+
+	if (req->has_page_cache_warmth)
+		opts.page_cache_warmth = req->page_cache_warmth;
+
+	if (req->has_page_cache_rate)
+		opts.page_cache_rate = req->page_cache_rate;
+
+	if (req->has_cold_pages)
+		opts.cold_pages = req->cold_pages;
+
+	if (req->has_cold_pages_pageout)
+		opts.cold_pages_pageout = req->cold_pages_pageout;
+
+	if (req->has_discard_dontdump)
+		opts.discard_dontdump = req->discard_dontdump;
+
+	for (i = 0; i < req->n_discard_regions; i++) {
+		DiscardRegion *dr = req->discard_regions[i];
+
+		if (discard_region_add(dr->pid, dr->start, dr->len))
+			goto err;
+	}
+
+	if (req->has_discard_unmap)
+		opts.discard_unmap = req->discard_unmap;
+
+	if (req->has_discard_signal)
+		opts.discard_signal = req->discard_signal;
+
+	if (req->has_numa)
+		opts.numa = req->numa;
+
+	if (req->has_io_rate)
+		opts.io_rate = req->io_rate;
+
+	if (req->has_io_iops)
+		opts.io_iops = req->io_iops;
+
+	if (req->has_io_burst)
+		opts.io_burst = req->io_burst;
+
+	if (req->has_io_full_speed_frozen)
+		opts.io_full_speed_frozen = req->io_full_speed_frozen;
+
+	if (req->freeze_notify)
+		SET_CHAR_OPTS(freeze_notify, req->freeze_notify);
+
+	if (req->has_freeze_notify_timeout)
+		opts.freeze_notify_timeout = req->freeze_notify_timeout;
+
 	if (req->has_file_locks)
 		opts.handle_file_locks = req->file_locks;
 
@@ -753,6 +876,7 @@ static int dump_using_req(int sk, CriuOpts *req)
 		goto exit;
 
 	__setproctitle("dump --rpc -t %d -D %s", req->pid, images_dir);
+	io_limit_set_rpc_sk(sk);
 
 	if (init_pidfd_store_hash())
 		goto pidfd_store_err;
@@ -796,6 +920,7 @@ static int restore_using_req(int sk, CriuOpts *req)
 		goto exit;
 
 	__setproctitle("restore --rpc -D %s", images_dir);
+	io_limit_set_rpc_sk(sk);
 
 	if (cr_restore_tasks())
 		goto exit;
@@ -880,6 +1005,7 @@ static int pre_dump_using_req(int sk, CriuOpts *req, bool single)
 			goto cout;
 
 		__setproctitle("pre-dump --rpc -t %d -D %s", req->pid, images_dir);
+		io_limit_set_rpc_sk(sk);
 
 		if (init_pidfd_store_hash())
 			goto pidfd_store_err;
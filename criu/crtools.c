@@ -411,6 +411,8 @@ usage:
 	       "                        in lazy-pages mode: 'criu lazy-pages -D DIR'\n"
 	       "                        --lazy-pages and lazy-pages mode require userfaultfd\n"
 	       "  --stream              dump/restore images using criu-image-streamer\n"
+	       "  --mem-images          keep images in memory: dump sends all images to the\n"
+	       "                        page server, which serves them to restore\n"
 	       "  --mntns-compat-mode   Use mount engine in compatibility mode. By default criu\n"
 	       "                        tries to use mount-v2 mode with more reliable algorithm\n"
 	       "                        based on MOVE_MOUNT_SET_GROUP kernel feature\n"
@@ -509,6 +511,9 @@ usage:
 	       "  --file-validation METHOD\n"
 	       "			pass the validation method to be used; argument\n"
 	       "			can be 'filesize' or 'buildid' (default).\n"
+	       "  --build-id-cache-dir DIR\n"
+	       "			directory to keep build-IDs of files in between\n"
+	       "			dumps and restores (default " DEFAULT_BUILD_ID_CACHE_DIR ")\n"
 	       "  --skip-file-rwx-check\n"
 	       "			Skip checking file permissions\n"
 	       "			(r/w/x for u/g/o) on restore.\n"
@@ -543,6 +548,38 @@ usage:
 	       "                        will be punched from the image\n"
 	       "  --pre-dump-mode       splice - parasite based pre-dumping (default)\n"
 	       "                        read   - process_vm_readv syscall based pre-dumping\n"
+	       "  --compact-pagemap     write pagemap images in the compact encoding\n"
+	       "  --delta-pages         store pages that changed a little since the parent\n"
+	       "                        dump as deltas against the parent copy\n"
+	       "  --delta-pages-max SIZE\n"
+	       "                        largest delta of a page, a quarter of a page by default\n"
+	       "  --page-cache-warmth   on dump, record which pages of regular files are in the\n"
+	       "                        page cache; on restore, read them ahead in the background\n"
+	       "  --page-cache-rate SIZE\n"
+	       "                        read ahead at most SIZE bytes per second on restore\n"
+	       "  --cold-pages          on dump, mark pages not accessed since the last pre-dump\n"
+	       "                        as cold; on restore, keep such pages off the active list\n"
+	       "  --cold-pages-pageout  on restore, page cold pages out instead\n"
+	       "  --discard-dontdump    do not dump pages of private mappings marked with\n"
+	       "                        MADV_DONTDUMP, they are restored zero-filled\n"
+	       "  --discard-region PID:START-END\n"
+	       "                        do not dump pages of PID in the START-END range (hex)\n"
+	       "  --discard-unmap       on restore, unmap the discarded ranges\n"
+	       "  --discard-signal SIG  on restore, queue realtime SIG to the task for each\n"
+	       "                        discarded range, with the range start in si_value\n"
+	       "  --numa                dump memory policies and the nodes pages are on,\n"
+	       "                        restore puts them back\n"
+	       "  --io-rate SIZE        write and read images at most at SIZE bytes per second\n"
+	       "  --io-iops NUM         do at most NUM image writes and reads per second\n"
+	       "  --io-burst SIZE       let SIZE bytes through at once, a second of --io-rate\n"
+	       "                        by default\n"
+	       "  --io-full-speed-frozen\n"
+	       "                        lift the limits above once the tasks are frozen for\n"
+	       "                        the final dump\n"
+	       "  --freeze-notify PATH  ask the application listening on the unix socket PATH\n"
+	       "                        to get ready before its tasks are frozen\n"
+	       "  --freeze-notify-timeout MS\n"
+	       "                        wait at most MS milliseconds for it, 1000 by default\n"
 	       "\n"
 	       "Page/Service server options:\n"
 	       "  --address ADDR        address of server or service\n"
@@ -47,11 +47,14 @@
 #include "fs-magic.h"
 #include "namespaces.h"
 #include "proc_parse.h"
+#include "page-cache.h"
 #include "pstree.h"
 #include "string.h"
 #include "fault-injection.h"
 #include "external.h"
 #include "memfd.h"
+#include "build-id-cache.h"
+#include "fdstore.h"
 
 #include "protobuf.h"
 #include "util.h"
@@ -1729,15 +1732,19 @@ static int store_validation_data_build_id(RegFileEntry *rfe, int lfd, const stru
 	if (p->stat.st_size < SELFMAG + 1)
 		return 0;
 
-	fd = open_proc(PROC_SELF, "fd/%d", lfd);
-	if (fd < 0) {
-		pr_err("Build-ID (For validation) could not be obtained for file %s because can't open the file\n",
-		       rfe->name);
-		return -1;
-	}
+	build_id_size = build_id_cache_get(&p->stat, &build_id);
+	if (build_id_size == BUILD_ID_CACHE_MISS) {
+		fd = open_proc(PROC_SELF, "fd/%d", lfd);
+		if (fd < 0) {
+			pr_err("Build-ID (For validation) could not be obtained for file %s because can't open the file\n",
+			       rfe->name);
+			return -1;
+		}
 
-	build_id_size = get_build_id(fd, &(p->stat), &build_id);
-	close(fd);
+		build_id_size = get_build_id(fd, &(p->stat), &build_id);
+		close(fd);
+		build_id_cache_put(&p->stat, build_id, build_id_size);
+	}
 	if (!build_id || build_id_size == -1)
 		return 0;
 
@@ -1848,6 +1855,9 @@ ext:
 	rfe.has_mode = true;
 	rfe.mode = p->stat.st_mode;
 
+	if (opts.page_cache_warmth && !rfe.ext && dump_page_cache(lfd, id, p))
+		return -1;
+
 	if (S_ISREG(p->stat.st_mode) && should_check_size(rfe.flags) && !store_validation_data(&rfe, p, lfd))
 		return -1;
 
@@ -2162,7 +2172,11 @@ static int validate_with_build_id(const int fd, const struct stat *fd_status, co
 		return 0;
 
 	build_id = NULL;
-	build_id_size = get_build_id(fd, fd_status, &build_id);
+	build_id_size = build_id_cache_get(fd_status, &build_id);
+	if (build_id_size == BUILD_ID_CACHE_MISS) {
+		build_id_size = get_build_id(fd, fd_status, &build_id);
+		build_id_cache_put(fd_status, build_id, build_id_size);
+	}
 	if (!build_id || build_id_size == -1)
 		return 0;
 
@@ -2487,6 +2501,40 @@ void filemap_ctx_fini(void)
 	}
 }
 
+/*
+ * The first task mapping the file opens it and puts the fd into the
+ * fdstore, the others get it from there. Thus the path is resolved
+ * and the file is validated once per restore, not once per task.
+ * Mappings of a file with other flags open it on their own.
+ */
+static int open_filemap_fd(struct file_desc *d, u32 *flags)
+{
+	struct reg_file_info *rfi = container_of(d, struct reg_file_info, d);
+	int fd, id;
+
+	mutex_lock(&rfi->vma_fd_lock);
+	if (rfi->vma_fd_id >= 0 && rfi->vma_fd_flags == *flags) {
+		fd = fdstore_get(rfi->vma_fd_id);
+		goto out;
+	}
+
+	fd = open_path(d, do_open_reg_noseek_flags, flags);
+	if (fd < 0 || rfi->vma_fd_id >= 0)
+		goto out;
+
+	id = fdstore_add(fd);
+	if (id < 0) {
+		close(fd);
+		fd = -1;
+		goto out;
+	}
+	rfi->vma_fd_id = id;
+	rfi->vma_fd_flags = *flags;
+out:
+	mutex_unlock(&rfi->vma_fd_lock);
+	return fd;
+}
+
 static int open_filemap(int pid, struct vma_area *vma)
 {
 	u32 flags;
@@ -2531,7 +2579,7 @@ static int open_filemap(int pid, struct vma_area *vma)
 		} else if (vma->e->status & VMA_AREA_MEMFD) {
 			ret = memfd_open(vma->vmfd, &flags);
 		} else {
-			ret = open_path(vma->vmfd, do_open_reg_noseek_flags, &flags);
+			ret = open_filemap_fd(vma->vmfd, &flags);
 		}
 		if (ret < 0)
 			return ret;
@@ -2632,6 +2680,8 @@ static int collect_one_regfile(void *o, ProtobufCMessage *base, struct cr_img *i
 		rfi->path = rfi->rfe->name + 1;
 	rfi->remap = NULL;
 	rfi->size_mode_checked = false;
+	mutex_init(&rfi->vma_fd_lock);
+	rfi->vma_fd_id = -1;
 
 	pr_info("Collected [%s] ID %#x\n", rfi->path, rfi->rfe->id);
 	return file_desc_add(&rfi->d, rfi->rfe->id, &reg_desc_ops);
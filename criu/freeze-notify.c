@@ -0,0 +1,168 @@
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "cr_options.h"
+#include "freeze-notify.h"
+#include "proc_parse.h"
+#include "stats.h"
+#include "util.h"
+#include "log.h"
+
+#include "protobuf.h"
+#include "images/rpc.pb-c.h"
+
+#undef LOG_PREFIX
+#define LOG_PREFIX "freeze-notify: "
+
+/* Whether @pid is the root of the tree being dumped or its descendant */
+static bool in_dumped_tree(pid_t pid)
+{
+	struct proc_pid_stat st;
+
+	while (pid > 1) {
+		if (pid == opts.tree_id)
+			return true;
+		if (parse_pid_stat(pid, &st))
+			return false;
+		pid = st.ppid;
+	}
+
+	return false;
+}
+
+static int notify_connect(void)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	int sk;
+
+	if (strlen(opts.freeze_notify) >= sizeof(addr.sun_path)) {
+		pr_err("Socket path %s is too long\n", opts.freeze_notify);
+		return -1;
+	}
+	strcpy(addr.sun_path, opts.freeze_notify);
+
+	sk = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	if (sk < 0) {
+		pr_perror("Can't create socket");
+		return -1;
+	}
+
+	if (connect(sk, (struct sockaddr *)&addr, sizeof(addr))) {
+		pr_warn("Can't connect to %s (%s), nobody is notified\n", opts.freeze_notify, strerror(errno));
+		close(sk);
+		return -1;
+	}
+
+	return sk;
+}
+
+static int notify_send(int sk, bool pre_dump)
+{
+	CriuFreezeNotify fn = CRIU_FREEZE_NOTIFY__INIT;
+	u8 buf[64];
+	size_t len;
+
+	fn.deadline_ms = opts.freeze_notify_timeout;
+	fn.has_pre_dump = true;
+	fn.pre_dump = pre_dump;
+
+	len = criu_freeze_notify__get_packed_size(&fn);
+	BUG_ON(len > sizeof(buf));
+	criu_freeze_notify__pack(&fn, buf);
+
+	if (send(sk, buf, len, 0) != len) {
+		pr_perror("Can't send notification");
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Returns 1 if the application is ready, 0 if it is not answering */
+static int notify_wait(int sk)
+{
+	struct pollfd pfd = { .fd = sk, .events = POLLIN };
+	CriuFreezeAck *ack;
+	u8 buf[64];
+	int ret;
+
+	ret = poll(&pfd, 1, opts.freeze_notify_timeout);
+	if (ret < 0) {
+		pr_perror("Can't wait for acknowledgement");
+		return -1;
+	}
+	if (ret == 0) {
+		pr_warn("No acknowledgement in %u ms, freezing anyway\n", opts.freeze_notify_timeout);
+		return 0;
+	}
+
+	ret = recv(sk, buf, sizeof(buf), 0);
+	if (ret <= 0) {
+		pr_warn("The application closed the socket, freezing anyway\n");
+		return 0;
+	}
+
+	ack = criu_freeze_ack__unpack(NULL, ret, buf);
+	if (!ack) {
+		pr_err("Can't unpack acknowledgement\n");
+		return -1;
+	}
+
+	ret = !ack->has_ready || ack->ready;
+	criu_freeze_ack__free_unpacked(ack, NULL);
+	return ret;
+}
+
+/*
+ * Tell the application listening on the --freeze-notify socket that
+ * its tasks are about to be frozen and give it the time to get ready:
+ * run GC, give freed memory back, flush buffers. The application not
+ * listening or not answering in time doesn't stop the dump, one that
+ * is not in the dumped tree is not told anything. What it gives back
+ * shows in the pages written compared to the parent pre-dump.
+ */
+int freeze_notify(bool pre_dump)
+{
+	struct ucred ucred;
+	socklen_t len = sizeof(ucred);
+	int sk, ret;
+
+	if (!opts.freeze_notify)
+		return 0;
+
+	sk = notify_connect();
+	if (sk < 0)
+		return 0;
+
+	if (getsockopt(sk, SOL_SOCKET, SO_PEERCRED, &ucred, &len)) {
+		pr_perror("Can't get the application credentials");
+		close(sk);
+		return -1;
+	}
+
+	if (!in_dumped_tree(ucred.pid)) {
+		pr_warn("%d listening on %s is not in the dumped tree, nobody is notified\n", ucred.pid,
+			opts.freeze_notify);
+		close(sk);
+		return 0;
+	}
+
+	timing_start(TIME_FREEZE_NOTIFY);
+
+	ret = notify_send(sk, pre_dump);
+	if (!ret)
+		ret = notify_wait(sk);
+	close(sk);
+
+	timing_stop(TIME_FREEZE_NOTIFY);
+	if (ret < 0)
+		return -1;
+
+	pr_info("Application %d is %sready\n", ucred.pid, ret ? "" : "not ");
+	stats_load_parent();
+	return 0;
+}
@@ -89,6 +89,7 @@ struct cr_fd_desc_tmpl imgset_template[CR_FD_MAX] = {
 	FD_ENTRY(FILE_LOCKS,	"filelocks"),
 	FD_ENTRY(RLIMIT,	"rlimit-%u"),
 	FD_ENTRY_F(PAGES,	"pages-%u", O_NOBUF),
+	FD_ENTRY_F(PAGES_DELTA,	"pages-delta-%u", O_NOBUF),
 	FD_ENTRY_F(PAGES_OLD,	"pages-%d", O_NOBUF),
 	FD_ENTRY_F(SHM_PAGES_OLD, "pages-shmem-%ld", O_NOBUF),
 	FD_ENTRY(SIGNAL,	"signal-s-%u"),
@@ -107,6 +108,8 @@ struct cr_fd_desc_tmpl imgset_template[CR_FD_MAX] = {
 	FD_ENTRY_F(BPFMAP_FILE,	"bpfmap-file", O_NOBUF),
 	FD_ENTRY_F(BPFMAP_DATA,	"bpfmap-data", O_NOBUF),
 	FD_ENTRY(APPARMOR,	"apparmor"),
+	FD_ENTRY(PAGE_CACHE,	"page-cache"),
+	FD_ENTRY(NUMA,		"numa-%u"),
 
 	[CR_FD_STATS] = {
 		.fmt	= "stats-%s",
@@ -119,4 +122,10 @@ struct cr_fd_desc_tmpl imgset_template[CR_FD_MAX] = {
 		.magic	= IRMAP_CACHE_MAGIC,
 		.oflags = O_SERVICE | O_FORCE_LOCAL,
 	},
+
+	[CR_FD_BUILD_ID_CACHE] = {
+		.fmt	= "build-id-cache",
+		.magic	= BUILD_ID_CACHE_MAGIC,
+		.oflags = O_SERVICE | O_FORCE_LOCAL,
+	},
 };
@@ -18,6 +18,7 @@
 #include "images/pagemap.pb-c.h"
 #include "proc_parse.h"
 #include "img-streamer.h"
+#include "img-store.h"
 #include "namespaces.h"
 
 bool ns_per_id = false;
@@ -449,6 +450,9 @@ static int do_open_image(struct cr_img *img, int dfd, int type, unsigned long of
 	if (opts.stream && !(oflags & O_FORCE_LOCAL)) {
 		ret = img_streamer_open(path, flags);
 		errno = EIO; /* errno value is meaningless, only the ret value is meaningful */
+	} else if (!(oflags & O_FORCE_LOCAL) && img_store_handles(dfd, flags)) {
+		ret = img_store_open(path, flags);
+		errno = EIO;
 	} else if (root_ns_mask & CLONE_NEWUSER && type == CR_FD_PAGES && oflags & O_RDWR) {
 		/*
 		 * For pages images dedup we need to open images read-write on
@@ -534,8 +538,13 @@ void close_image(struct cr_img *img)
 		 */
 		unlinkat(get_service_fd(IMG_FD_OFF), img->path, 0);
 		xfree(img->path);
-	} else if (!empty_image(img))
+	} else if (!empty_image(img)) {
+		int fd = img->_x.fd;
+
 		bclose(&img->_x);
+		if (opts.mem_images)
+			img_store_close(fd);
+	}
 
 	xfree(img);
 }
@@ -595,6 +604,9 @@ int open_image_dir(char *dir, int mode)
 				"may not work on restore!\n");
 	}
 
+	if (opts.mem_images && img_store_init(fd) < 0)
+		goto err;
+
 	return 0;
 
 err:
@@ -606,6 +618,8 @@ void close_image_dir(void)
 {
 	if (opts.stream)
 		img_streamer_finish();
+	if (opts.mem_images)
+		img_store_fini();
 	close_service_fd(IMG_FD_OFF);
 }
 
@@ -645,17 +659,23 @@ void up_page_ids_base(void)
 	page_ids += 0x10000;
 }
 
-struct cr_img *open_pages_image_at(int dfd, unsigned long flags, struct cr_img *pmi, u32 *id)
+struct cr_img *open_pages_image_at(int dfd, unsigned long flags, struct cr_img *pmi, u32 *id, bool *compact)
 {
 	if (flags == O_RDONLY || flags == O_RDWR) {
 		PagemapHead *h;
 		if (pb_read_one(pmi, &h, PB_PAGEMAP_HEAD) < 0)
 			return NULL;
 		*id = h->pages_id;
+		*compact = h->has_compact && h->compact;
 		pagemap_head__free_unpacked(h, NULL);
 	} else {
 		PagemapHead h = PAGEMAP_HEAD__INIT;
 		*id = h.pages_id = page_ids++;
+		if (opts.compact_pagemap) {
+			h.has_compact = true;
+			h.compact = true;
+		}
+		*compact = opts.compact_pagemap;
 		if (pb_write_one(pmi, &h, PB_PAGEMAP_HEAD) < 0)
 			return NULL;
 	}
@@ -663,9 +683,9 @@ struct cr_img *open_pages_image_at(int dfd, unsigned long flags, struct cr_img *
 	return open_image_at(dfd, CR_FD_PAGES, flags, *id);
 }
 
-struct cr_img *open_pages_image(unsigned long flags, struct cr_img *pmi, u32 *id)
+struct cr_img *open_pages_image(unsigned long flags, struct cr_img *pmi, u32 *id, bool *compact)
 {
-	return open_pages_image_at(get_service_fd(IMG_FD_OFF), flags, pmi, id);
+	return open_pages_image_at(get_service_fd(IMG_FD_OFF), flags, pmi, id, compact);
 }
 
 /*
@@ -0,0 +1,618 @@
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <sys/time.h>
+
+#include "cr_options.h"
+#include "img-store.h"
+#include "image.h"
+#include "memfd.h"
+#include "page-xfer.h"
+#include "servicefd.h"
+#include "stats.h"
+#include "rst-malloc.h"
+#include "util.h"
+#include "xmalloc.h"
+#include "common/list.h"
+#include "common/scm.h"
+#include "common/lock.h"
+
+#undef LOG_PREFIX
+#define LOG_PREFIX "img-store: "
+
+#define IMG_STORE_SOCKET_NAME "img-store.sock"
+
+/*
+ * Wire format of the restore <-> page server conversation. The
+ * request carries the image name right after the header, the reply
+ * is followed by the image fd (SCM_RIGHTS) when status is zero.
+ */
+struct img_store_req {
+	u32 len; /* of the name, including the trailing \0 */
+};
+
+struct img_store_rep {
+	s32 status;   /* 0 or -ENOENT */
+	u32 deferred; /* the image was not there at the time of request */
+};
+
+struct img_store_entry {
+	struct list_head l;
+	char *name;
+	int fd;	    /* memfd with the image contents */
+	int img_fd; /* what open_image() got, -1 once the image is closed */
+};
+
+static LIST_HEAD(img_store_entries);
+
+/* dump side */
+enum {
+	IMG_STORE_COLLECT, /* no page server connection yet */
+	IMG_STORE_SHIP,	   /* send images as soon as they are closed */
+	IMG_STORE_DONE,	   /* disconnected from the page server */
+};
+
+static int ship_state = IMG_STORE_COLLECT;
+static bool ship_failed;
+
+/* page server side */
+struct img_store_client {
+	struct list_head l;
+	int sk;
+	char *pending; /* name of the image the client waits for */
+	bool deferred;
+};
+
+static LIST_HEAD(img_store_clients);
+static int img_store_lsk = -1;
+static bool transfer_done;
+static bool had_clients;
+
+/* restore side, all requests go through the same socket connection */
+static mutex_t *img_store_lock;
+
+static struct img_store_entry *find_entry(const char *name)
+{
+	struct img_store_entry *e;
+
+	list_for_each_entry(e, &img_store_entries, l)
+		if (!strcmp(e->name, name))
+			return e;
+
+	return NULL;
+}
+
+static void free_entry(struct img_store_entry *e)
+{
+	list_del(&e->l);
+	close(e->fd);
+	xfree(e->name);
+	xfree(e);
+}
+
+bool img_store_handles(int dfd, unsigned long flags)
+{
+	if (!opts.mem_images || dfd != get_service_fd(IMG_FD_OFF))
+		return false;
+
+	switch (opts.mode) {
+	case CR_PAGE_SERVER:
+		return true;
+	case CR_DUMP:
+		return flags & O_CREAT;
+	case CR_RESTORE:
+		return !(flags & O_CREAT);
+	default:
+		return false;
+	}
+}
+
+static int img_store_create(const char *name)
+{
+	struct img_store_entry *e;
+	int fd;
+
+	fd = memfd_create(name, 0);
+	if (fd < 0) {
+		pr_perror("Can't create memfd for %s", name);
+		return -1;
+	}
+
+	e = find_entry(name);
+	if (e) {
+		/* Re-created image replaces the old contents */
+		close(e->fd);
+	} else {
+		e = xzalloc(sizeof(*e));
+		if (!e)
+			goto err;
+		e->name = xstrdup(name);
+		if (!e->name) {
+			xfree(e);
+			goto err;
+		}
+		list_add_tail(&e->l, &img_store_entries);
+	}
+
+	e->fd = fd;
+	e->img_fd = dup(fd);
+	if (e->img_fd < 0) {
+		pr_perror("Can't dup memfd for %s", name);
+		free_entry(e);
+		return -1;
+	}
+
+	return e->img_fd;
+
+err:
+	close(fd);
+	return -1;
+}
+
+/*
+ * Each reader gets its own file description for the memfd, so that
+ * file positions are not shared between the readers.
+ */
+static int img_store_reopen(struct img_store_entry *e)
+{
+	int fd;
+
+	fd = open_proc(PROC_SELF, "fd/%d", e->fd);
+	if (fd < 0)
+		pr_err("Can't reopen %s\n", e->name);
+
+	return fd;
+}
+
+static int img_store_lookup(const char *name)
+{
+	struct img_store_entry *e;
+
+	e = find_entry(name);
+	if (!e || e->img_fd >= 0)
+		return -ENOENT;
+
+	return img_store_reopen(e);
+}
+
+static int img_store_fetch(const char *name)
+{
+	struct img_store_req req = { .len = strlen(name) + 1 };
+	struct img_store_rep rep;
+	struct timeval start;
+	int sk, fd = -1;
+
+	sk = get_service_fd(IMG_STORE_SK_OFF);
+	if (sk < 0) {
+		pr_err("No connection to the image store\n");
+		return -1;
+	}
+
+	mutex_lock(img_store_lock);
+	gettimeofday(&start, NULL);
+
+	if (send(sk, &req, sizeof(req), MSG_MORE) != sizeof(req) || send(sk, name, req.len, 0) != req.len) {
+		pr_perror("Can't request %s", name);
+		goto out;
+	}
+
+	if (recv(sk, &rep, sizeof(rep), MSG_WAITALL) != sizeof(rep)) {
+		pr_perror("Can't get reply for %s", name);
+		goto out;
+	}
+
+	/* Restore got ahead of the transfer and had to wait */
+	if (rep.deferred)
+		account_img_wait(&start);
+
+	if (rep.status)
+		fd = rep.status;
+	else
+		fd = recv_fd(sk);
+out:
+	mutex_unlock(img_store_lock);
+	return fd;
+}
+
+/*
+ * Return:
+ *	A file descriptor on success
+ *	-ENOENT when the image is not in the store
+ *	-1 on any other error
+ */
+int img_store_open(const char *name, unsigned long flags)
+{
+	if (opts.mode == CR_RESTORE)
+		return img_store_fetch(name);
+	if (flags & O_CREAT)
+		return img_store_create(name);
+	return img_store_lookup(name);
+}
+
+static void img_store_ship(struct img_store_entry *e)
+{
+	if (page_xfer_send_image(e->name, e->fd)) {
+		pr_err("Can't send %s to the page server\n", e->name);
+		ship_failed = true;
+	}
+
+	free_entry(e);
+}
+
+static void img_store_complete(struct img_store_entry *e);
+
+void img_store_close(int fd)
+{
+	struct img_store_entry *e;
+
+	list_for_each_entry(e, &img_store_entries, l) {
+		if (e->img_fd != fd)
+			continue;
+
+		e->img_fd = -1;
+		if (opts.mode == CR_PAGE_SERVER)
+			img_store_complete(e);
+		else if (ship_state == IMG_STORE_SHIP)
+			img_store_ship(e);
+		else if (ship_state == IMG_STORE_DONE)
+			pr_warn("%s is closed after disconnect, not sent\n", e->name);
+		return;
+	}
+}
+
+/*
+ * Images written before the page server connection was established
+ * are sent out here, all the others -- right on close_image().
+ */
+int img_store_flush(void)
+{
+	struct img_store_entry *e, *n;
+
+	ship_state = IMG_STORE_SHIP;
+
+	list_for_each_entry_safe(e, n, &img_store_entries, l)
+		if (e->img_fd < 0)
+			img_store_ship(e);
+
+	return ship_failed ? -1 : 0;
+}
+
+void img_store_stop_shipping(void)
+{
+	struct img_store_entry *e;
+
+	ship_state = IMG_STORE_DONE;
+
+	list_for_each_entry(e, &img_store_entries, l)
+		pr_warn("%s is still open, not sent\n", e->name);
+}
+
+static void drop_client(struct img_store_client *c)
+{
+	list_del(&c->l);
+	close(c->sk);
+	xfree(c->pending);
+	xfree(c);
+}
+
+static int img_store_try_reply(struct img_store_client *c)
+{
+	struct img_store_entry *e;
+	struct img_store_rep rep = { .deferred = c->deferred };
+	int fd = -1, ret = 0;
+
+	e = find_entry(c->pending);
+	if (!e || e->img_fd >= 0) {
+		/* The image may be still on its way */
+		if (!transfer_done) {
+			c->deferred = true;
+			return 0;
+		}
+		rep.status = -ENOENT;
+	} else {
+		fd = img_store_reopen(e);
+		if (fd < 0)
+			return -1;
+		rep.status = 0;
+	}
+
+	pr_debug("Serving %s: %d\n", c->pending, rep.status);
+
+	if (send(c->sk, &rep, sizeof(rep), 0) != sizeof(rep)) {
+		pr_perror("Can't send reply for %s", c->pending);
+		ret = -1;
+	} else if (fd >= 0 && send_fd(c->sk, NULL, 0, fd) < 0) {
+		pr_err("Can't send %s\n", c->pending);
+		ret = -1;
+	}
+
+	close_safe(&fd);
+	xfree(c->pending);
+	c->pending = NULL;
+	c->deferred = false;
+
+	return ret;
+}
+
+static void img_store_complete(struct img_store_entry *e)
+{
+	struct img_store_client *c, *n;
+
+	list_for_each_entry_safe(c, n, &img_store_clients, l)
+		if (c->pending && !strcmp(c->pending, e->name) && img_store_try_reply(c))
+			drop_client(c);
+}
+
+void img_store_transfer_done(void)
+{
+	struct img_store_client *c, *n;
+
+	transfer_done = true;
+
+	list_for_each_entry_safe(c, n, &img_store_clients, l)
+		if (c->pending && img_store_try_reply(c))
+			drop_client(c);
+}
+
+static int img_store_accept(void)
+{
+	struct img_store_client *c;
+	int sk;
+
+	sk = accept4(img_store_lsk, NULL, NULL, SOCK_CLOEXEC);
+	if (sk < 0) {
+		if (errno == EAGAIN)
+			return 0;
+		pr_perror("Can't accept image store connection");
+		return -1;
+	}
+
+	c = xzalloc(sizeof(*c));
+	if (!c) {
+		close(sk);
+		return -1;
+	}
+
+	c->sk = sk;
+	list_add_tail(&c->l, &img_store_clients);
+	had_clients = true;
+	pr_info("Restore connected\n");
+
+	return 0;
+}
+
+/*
+ * Returns 1 when the client has gone, 0 when the request is either
+ * served or queued, -1 on error.
+ */
+static int img_store_handle_request(struct img_store_client *c)
+{
+	struct img_store_req req;
+	int ret;
+
+	if (c->pending) {
+		pr_err("Request while %s is pending\n", c->pending);
+		return -1;
+	}
+
+	ret = recv(c->sk, &req, sizeof(req), MSG_WAITALL);
+	if (ret == 0)
+		return 1;
+	if (ret != sizeof(req) || req.len == 0 || req.len > PATH_MAX) {
+		pr_perror("Bad image store request");
+		return -1;
+	}
+
+	c->pending = xmalloc(req.len);
+	if (!c->pending)
+		return -1;
+
+	if (recv(c->sk, c->pending, req.len, MSG_WAITALL) != req.len) {
+		pr_perror("Can't read image name");
+		return -1;
+	}
+	c->pending[req.len - 1] = '\0';
+
+	return img_store_try_reply(c);
+}
+
+/*
+ * Serve the image store until @sk (the page server connection) has
+ * something to read. With @sk < 0 just process one batch of events.
+ * Returns 1 if @sk is readable, 0 if not, -1 on error.
+ */
+static int img_store_poll(int sk)
+{
+	struct img_store_client *c, *n;
+	struct pollfd *pfd;
+	int nr = 0, i, ret;
+
+	list_for_each_entry(c, &img_store_clients, l)
+		nr++;
+
+	pfd = xmalloc((nr + 2) * sizeof(*pfd));
+	if (!pfd)
+		return -1;
+
+	pfd[0].fd = sk;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = img_store_lsk;
+	pfd[1].events = POLLIN;
+	i = 2;
+	list_for_each_entry(c, &img_store_clients, l) {
+		pfd[i].fd = c->sk;
+		pfd[i].events = POLLIN;
+		i++;
+	}
+
+	ret = poll(pfd, nr + 2, -1);
+	if (ret < 0) {
+		if (errno == EINTR)
+			ret = 0;
+		else
+			pr_perror("Can't poll image store sockets");
+		goto out;
+	}
+
+	i = 2;
+	list_for_each_entry_safe(c, n, &img_store_clients, l) {
+		if (pfd[i++].revents) {
+			ret = img_store_handle_request(c);
+			if (ret) {
+				if (ret < 0)
+					pr_err("Dropping image store client\n");
+				else
+					pr_info("Restore disconnected\n");
+				drop_client(c);
+			}
+		}
+	}
+
+	if (pfd[1].revents && img_store_accept()) {
+		ret = -1;
+		goto out;
+	}
+
+	ret = sk >= 0 && pfd[0].revents;
+out:
+	xfree(pfd);
+	return ret;
+}
+
+int img_store_wait(int sk)
+{
+	int ret;
+
+	/*
+	 * With TLS the data may sit in the session buffers and poll()
+	 * on the socket would not notice it. Restore is served only
+	 * once the transfer is over in this case.
+	 */
+	if (img_store_lsk < 0 || opts.tls)
+		return 0;
+
+	do {
+		ret = img_store_poll(sk);
+	} while (ret == 0);
+
+	return ret < 0 ? -1 : 0;
+}
+
+int img_store_serve(void)
+{
+	struct img_store_entry *e;
+	unsigned long nr = 0;
+
+	if (img_store_lsk < 0)
+		return 0;
+
+	list_for_each_entry(e, &img_store_entries, l)
+		nr++;
+
+	pr_info("Serving %lu images to restore\n", nr);
+	img_store_transfer_done();
+
+	while (!had_clients || !list_empty(&img_store_clients))
+		if (img_store_poll(-1) < 0)
+			return -1;
+
+	pr_info("All images served\n");
+	return 0;
+}
+
+static int img_store_sock_path(int dfd, struct sockaddr_un *addr)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	/*
+	 * The images directory may be given relative to the cwd, which
+	 * changes to --work-dir later, so go via the service fd.
+	 */
+	if (snprintf(addr->sun_path, sizeof(addr->sun_path), "/proc/self/fd/%d/%s", dfd, IMG_STORE_SOCKET_NAME) >=
+	    sizeof(addr->sun_path)) {
+		pr_err("Image store socket path is too long\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int img_store_listen(int dfd)
+{
+	struct sockaddr_un addr;
+	int sk;
+
+	if (img_store_sock_path(dfd, &addr))
+		return -1;
+
+	sk = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (sk < 0) {
+		pr_perror("Unable to create image store socket");
+		return -1;
+	}
+
+	unlink(addr.sun_path);
+	if (bind(sk, (struct sockaddr *)&addr, sizeof(addr)) || listen(sk, 16)) {
+		pr_perror("Unable to listen on %s", addr.sun_path);
+		close(sk);
+		return -1;
+	}
+
+	/* Every image is an open memfd here */
+	rlimit_unlimit_nofile();
+
+	img_store_lsk = sk;
+	return 0;
+}
+
+static int img_store_connect(int dfd)
+{
+	struct sockaddr_un addr;
+	int sk;
+
+	if (img_store_sock_path(dfd, &addr))
+		return -1;
+
+	sk = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sk < 0) {
+		pr_perror("Unable to create image store socket");
+		return -1;
+	}
+
+	if (connect(sk, (struct sockaddr *)&addr, sizeof(addr))) {
+		pr_perror("Unable to connect to image store: %s", addr.sun_path);
+		close(sk);
+		return -1;
+	}
+
+	img_store_lock = shmalloc(sizeof(*img_store_lock));
+	if (!img_store_lock) {
+		close(sk);
+		return -1;
+	}
+	mutex_init(img_store_lock);
+
+	if (install_service_fd(IMG_STORE_SK_OFF, sk) < 0)
+		return -1;
+
+	return 0;
+}
+
+int img_store_init(int dfd)
+{
+	if (opts.mode == CR_PAGE_SERVER && !opts.lazy_pages)
+		return img_store_listen(dfd);
+	if (opts.mode == CR_RESTORE)
+		return img_store_connect(dfd);
+
+	return 0;
+}
+
+void img_store_fini(void)
+{
+	if (get_service_fd(IMG_STORE_SK_OFF) >= 0)
+		close_service_fd(IMG_STORE_SK_OFF);
+	close_safe(&img_store_lsk);
+}
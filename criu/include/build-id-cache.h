@@ -0,0 +1,14 @@
+#ifndef __CR_BUILD_ID_CACHE_H__
+#define __CR_BUILD_ID_CACHE_H__
+
+#include <sys/stat.h>
+
+/* Returned by build_id_cache_get() if the file is not in the cache */
+#define BUILD_ID_CACHE_MISS (-2)
+
+extern int build_id_cache_init(void);
+extern void build_id_cache_fini(void);
+extern int build_id_cache_get(const struct stat *st, unsigned char **build_id);
+extern void build_id_cache_put(const struct stat *st, const unsigned char *build_id, int size);
+
+#endif /* __CR_BUILD_ID_CACHE_H__ */
@@ -78,6 +78,12 @@ enum NETWORK_LOCK_METHOD {
 
 #define DEFAULT_TIMEOUT 10
 
+/* How long to wait for the application to get ready for freezing, ms */
+#define DEFAULT_FREEZE_NOTIFY_TIMEOUT 1000
+
+/* Where build-ids found by dumps and restores are kept for the next ones */
+#define DEFAULT_BUILD_ID_CACHE_DIR "/var/lib/criu"
+
 enum FILE_VALIDATION_OPTIONS {
 	/*
 	 * This constant indicates that the file validation should be tried with the
@@ -100,6 +106,13 @@ enum FILE_VALIDATION_OPTIONS {
 
 struct irmap;
 
+struct discard_region_opt {
+	struct list_head node;
+	pid_t pid;
+	unsigned long start;
+	unsigned long end;
+};
+
 struct irmap_path_opt {
 	struct list_head node;
 	struct irmap *ir;
@@ -186,6 +199,7 @@ struct cr_options {
 	char *work_dir;
 	int network_lock_method;
 	int skip_file_rwx_check;
+	char *build_id_cache_dir;
 
 	/*
 	 * When we scheduler for removal some functionality we first
@@ -199,6 +213,25 @@ struct cr_options {
 	int status_fd;
 	bool orphan_pts_master;
 	int stream;
+	int mem_images;
+	int compact_pagemap;
+	int delta_pages;
+	unsigned int delta_pages_max;
+	int page_cache_warmth;
+	u64 page_cache_rate;
+	int cold_pages;
+	int cold_pages_pageout;
+	int discard_dontdump;
+	struct list_head discard_regions;
+	int discard_unmap;
+	int discard_signal;
+	int numa;
+	u64 io_rate;
+	unsigned int io_iops;
+	u64 io_burst;
+	int io_full_speed_frozen;
+	char *freeze_notify;
+	unsigned int freeze_notify_timeout;
 	pid_t tree_id;
 	int log_level;
 	char *imgs_dir;
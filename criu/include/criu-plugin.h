@@ -27,7 +27,7 @@
 
 #define CRIU_PLUGIN_GEN_VERSION(a, b, c) (((a) << 16) + ((b) << 8) + (c))
 #define CRIU_PLUGIN_VERSION_MAJOR	 0
-#define CRIU_PLUGIN_VERSION_MINOR	 2
+#define CRIU_PLUGIN_VERSION_MINOR	 3
 #define CRIU_PLUGIN_VERSION_SUBLEVEL	 0
 
 #define CRIU_PLUGIN_VERSION_OLD CRIU_PLUGIN_GEN_VERSION(0, 1, 0)
@@ -130,6 +130,25 @@ static inline void cr_plugin_dummy_exit(int stage, int ret)
 /* Public API */
 extern int criu_get_image_dir(void);
 
+/*
+ * Asynchronous hooks. A hook may start a long operation (e.g. copying
+ * device memory in its own thread), register a completion handle with
+ * criu_plugin_add_pending() and return right away. CRIU goes on with
+ * other work and calls @wait(@arg) at the next barrier of the current
+ * process, where a non-zero return fails the dump or restore:
+ *
+ *  - dump: before the images are closed and the tasks are resumed
+ *    or killed (the same for pre-dump);
+ *  - restore: in each task right before switching to the restorer
+ *    blob, and in the main process after the RESUME_DEVICES_LATE
+ *    hooks, before the tasks are released.
+ *
+ * The pending operations are bound to the process which registered
+ * them, processes forked by CRIU don't wait for the parent's ones.
+ */
+typedef int(cr_plugin_wait_t)(void *arg);
+extern int criu_plugin_add_pending(cr_plugin_wait_t *wait, void *arg);
+
 /*
  * Deprecated, will be removed in next version.
  */
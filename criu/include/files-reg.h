@@ -1,6 +1,7 @@
 #ifndef __CR_FILES_REG_H__
 #define __CR_FILES_REG_H__
 
+#include "common/lock.h"
 #include "files.h"
 #include "util.h"
 
@@ -25,6 +26,11 @@ struct reg_file_info {
 	bool size_mode_checked;
 	bool is_dir;
 	char *path;
+
+	/* The fd for file mappings, shared by all tasks via fdstore */
+	mutex_t vma_fd_lock;
+	int vma_fd_id;
+	u32 vma_fd_flags;
 };
 
 extern int open_reg_by_id(u32 id);
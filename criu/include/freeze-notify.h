@@ -0,0 +1,8 @@
+#ifndef __CR_FREEZE_NOTIFY_H__
+#define __CR_FREEZE_NOTIFY_H__
+
+#include <stdbool.h>
+
+extern int freeze_notify(bool pre_dump);
+
+#endif /* __CR_FREEZE_NOTIFY_H__ */
@@ -71,6 +71,7 @@ enum {
 	CR_FD_MEMFD_INODE,
 	CR_FD_BPFMAP_FILE,
 	CR_FD_BPFMAP_DATA,
+	CR_FD_PAGE_CACHE,
 	_CR_FD_GLOB_TO,
 
 	CR_FD_TMPFS_IMG,
@@ -78,6 +79,8 @@ enum {
 	CR_FD_BINFMT_MISC,
 	CR_FD_BINFMT_MISC_OLD,
 	CR_FD_PAGES,
+	CR_FD_PAGES_DELTA,
+	CR_FD_NUMA,
 
 	CR_FD_SIGACT,
 	CR_FD_VMAS,
@@ -88,6 +91,7 @@ enum {
 	CR_FD_POSIX_TIMERS,
 
 	CR_FD_IRMAP_CACHE,
+	CR_FD_BUILD_ID_CACHE,
 	CR_FD_CPUINFO,
 
 	CR_FD_SIGNAL,
@@ -0,0 +1,33 @@
+#ifndef __CR_IMG_STORE_H__
+#define __CR_IMG_STORE_H__
+
+#include <stdbool.h>
+
+/*
+ * In-memory image store used for diskless migration (--mem-images).
+ *
+ * Every image lives in a memfd. On dump the images are created in
+ * memory and shipped to the page server as soon as they are closed,
+ * the pages are streamed to it with the page-xfer protocol while the
+ * memory is dumped. The page server keeps everything it receives in
+ * memory and serves it to "criu restore" over a UNIX socket in the
+ * images directory.
+ */
+
+extern int img_store_init(int dfd);
+extern void img_store_fini(void);
+
+extern bool img_store_handles(int dfd, unsigned long flags);
+extern int img_store_open(const char *name, unsigned long flags);
+extern void img_store_close(int fd);
+
+/* dump side */
+extern int img_store_flush(void);
+extern void img_store_stop_shipping(void);
+
+/* page server side */
+extern int img_store_wait(int sk);
+extern void img_store_transfer_done(void);
+extern int img_store_serve(void);
+
+#endif /* __CR_IMG_STORE_H__ */
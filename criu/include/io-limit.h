@@ -0,0 +1,20 @@
+#ifndef __CR_IO_LIMIT_H__
+#define __CR_IO_LIMIT_H__
+
+#include <stdbool.h>
+
+#include "int.h"
+
+/* Passed to io_limit_set() to leave a setting as it is */
+#define IO_LIMIT_KEEP ((u64)-1)
+
+extern int io_limit_init(void);
+extern void io_limit_set(u64 rate, u64 iops, u64 burst);
+extern void io_limit_full_speed(void);
+extern bool io_limit_active(void);
+extern void io_limit(unsigned long bytes);
+
+extern void io_limit_set_rpc_sk(int sk);
+extern int io_limit_recv_rpc(int sk);
+
+#endif /* __CR_IO_LIMIT_H__ */
@@ -38,6 +38,7 @@
 #define PAGEMAP_MAGIC	     0x56084025 /* Vladimir */
 #define SHMEM_PAGEMAP_MAGIC  PAGEMAP_MAGIC
 #define PAGES_MAGIC	     RAW_IMAGE_MAGIC
+#define PAGES_DELTA_MAGIC    RAW_IMAGE_MAGIC
 #define CORE_MAGIC	     0x55053847 /* Kolomna */
 #define IDS_MAGIC	     0x54432030 /* Konigsberg */
 #define VMAS_MAGIC	     0x54123737 /* Tula */
@@ -100,6 +101,8 @@
 #define BPFMAP_FILE_MAGIC    0x57506142 /* Alapayevsk */
 #define BPFMAP_DATA_MAGIC    0x64324033 /* Arkhangelsk */
 #define APPARMOR_MAGIC	     0x59423047 /* Nikolskoye */
+#define PAGE_CACHE_MAGIC     0x58263944 /* Kirzhach */
+#define NUMA_MAGIC	     0x55384127 /* Yuryev-Polsky */
 
 #define IFADDR_MAGIC	RAW_IMAGE_MAGIC
 #define ROUTE_MAGIC	RAW_IMAGE_MAGIC
@@ -120,8 +123,9 @@
 /*
  * These are special files, not exactly images
  */
-#define STATS_MAGIC	  0x57093306 /* Ostashkov */
-#define IRMAP_CACHE_MAGIC 0x57004059 /* Ivanovo */
+#define STATS_MAGIC	     0x57093306 /* Ostashkov */
+#define IRMAP_CACHE_MAGIC    0x57004059 /* Ivanovo */
+#define BUILD_ID_CACHE_MAGIC 0x57185240 /* Kimry */
 
 /*
  * Main magic for kerndat_s structure.
@@ -42,6 +42,8 @@ extern int parasite_dump_pages_seized(struct pstree_item *item, struct vm_area_l
 #define PME_PFRAME_MASK	  ((1ULL << PME_PSHIFT_OFFSET) - 1)
 #define PME_PFRAME(x)	  ((x)&PME_PFRAME_MASK)
 
+extern int discard_region_add(pid_t pid, unsigned long start, unsigned long len);
+
 struct task_restore_args;
 int open_vmas(struct pstree_item *t);
 int prepare_vmas(struct pstree_item *t, struct task_restore_args *ta);
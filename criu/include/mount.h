@@ -40,8 +40,14 @@ struct ns_id;
  */
 #define REMOUNTED_RW_SERVICE 2
 
+/*
+ * Restore-time state of a mount which is shared between processes,
+ * e.g. the ones assembling mount namespaces in parallel.
+ */
 struct rst_mount_info {
 	int remounted_rw;
+	int mp_fd_id;
+	int mnt_fd_id;
 };
 
 struct mount_info {
@@ -66,8 +72,6 @@ struct mount_info {
 	/* Mount-v2 specific */
 	char *plain_mountpoint;
 	int is_dir;
-	int mp_fd_id;
-	int mnt_fd_id;
 	struct sharing_group *sg;
 	struct list_head mnt_sharing;
 
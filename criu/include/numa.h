@@ -0,0 +1,66 @@
+#ifndef __CR_NUMA_H__
+#define __CR_NUMA_H__
+
+#include <linux/mempolicy.h>
+
+#include "int.h"
+#include "bitsperlong.h"
+
+#include "images/core.pb-c.h"
+
+#ifndef MPOL_LOCAL
+#define MPOL_LOCAL 4
+#endif
+#ifndef MPOL_PREFERRED_MANY
+#define MPOL_PREFERRED_MANY 5
+#endif
+#ifndef MPOL_WEIGHTED_INTERLEAVE
+#define MPOL_WEIGHTED_INTERLEAVE 6
+#endif
+#ifndef MPOL_F_NUMA_BALANCING
+#define MPOL_F_NUMA_BALANCING (1 << 13)
+#endif
+
+#define NUMA_MAX_NODES	 1024
+#define NUMA_NODE_LONGS	 (NUMA_MAX_NODES / BITS_PER_LONG)
+#define NUMA_NO_POLICY	 -1
+
+/*
+ * A memory policy in the form get_mempolicy() reports it and
+ * set_mempolicy() and mbind() take it. NUMA_NO_POLICY in the
+ * mode means the policy was not dumped and is left alone.
+ */
+struct numa_policy {
+	int mode;
+	unsigned long nodes[NUMA_NODE_LONGS];
+};
+
+/* A VMA the restorer sets the policy on */
+struct rst_numa_vma {
+	u64 start;
+	u64 end;
+	/* Has ranges below, the policy is set after the pages are read */
+	bool placed;
+	struct numa_policy pol;
+};
+
+/* Pages the restorer reads onto a given node */
+struct rst_numa_range {
+	u64 start;
+	u64 end;
+	int node;
+};
+
+struct pstree_item;
+struct vm_area_list;
+struct task_restore_args;
+
+extern int dump_thread_mempolicy(ThreadCoreEntry *tc, const struct numa_policy *pol);
+extern int dump_task_numa(pid_t pid, struct vm_area_list *vmas, ThreadCoreEntry *leader);
+
+extern void prepare_thread_mempolicy(struct numa_policy *pol, ThreadCoreEntry *tc);
+extern int prepare_numa(struct pstree_item *t);
+extern int numa_place_premapped(struct pstree_item *t, bool done);
+extern int prepare_numa_args(struct pstree_item *t, struct task_restore_args *ta);
+
+#endif /* __CR_NUMA_H__ */
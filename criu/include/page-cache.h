@@ -0,0 +1,14 @@
+#ifndef __CR_PAGE_CACHE_H__
+#define __CR_PAGE_CACHE_H__
+
+#include "int.h"
+
+struct fd_parms;
+
+extern int dump_page_cache(int lfd, u32 id, const struct fd_parms *p);
+
+extern int start_page_cache_prefetch(void);
+extern void page_cache_prefetch_mounts_ready(void);
+extern void stop_page_cache_prefetch(void);
+
+#endif /* __CR_PAGE_CACHE_H__ */
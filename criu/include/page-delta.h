@@ -0,0 +1,25 @@
+#ifndef __CR_PAGE_DELTA_H__
+#define __CR_PAGE_DELTA_H__
+
+/*
+ * Page deltas
+ *
+ * A page that differs from its copy in the parent images only a little
+ * may be stored as a delta against that copy. The delta is a sequence of
+ * runs, each a u16 offset, a u16 length minus one and the new bytes.
+ * Equal stretches shorter than a run header are folded into the runs
+ * around them. An empty delta means the page didn't change.
+ */
+
+#define PAGE_DELTA_RUN_HDR 4
+
+/*
+ * Encode @page against @base into @out. Returns the delta size, or -1
+ * if it would be larger than @max bytes.
+ */
+extern int page_delta_encode(const void *page, const void *base, void *out, unsigned int max);
+
+/* Apply @len bytes of delta to @page. Returns -1 if the delta is malformed. */
+extern int page_delta_apply(void *page, const void *delta, unsigned int len);
+
+#endif /* __CR_PAGE_DELTA_H__ */
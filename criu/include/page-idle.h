@@ -0,0 +1,14 @@
+#ifndef __CR_PAGE_IDLE_H__
+#define __CR_PAGE_IDLE_H__
+
+#include <stdbool.h>
+
+#include "int.h"
+
+struct page_pipe;
+
+extern bool page_is_cold(u64 pme);
+extern int page_idle_mark(int pid, struct page_pipe *pp);
+extern void page_idle_fini(void);
+
+#endif /* __CR_PAGE_IDLE_H__ */
@@ -1,6 +1,7 @@
 #ifndef __CR_PAGE_PIPE_H__
 #define __CR_PAGE_PIPE_H__
 
+#include <stdbool.h>
 #include <sys/uio.h>
 #include "common/list.h"
 
@@ -111,6 +112,7 @@ struct page_pipe_buf {
 #define PP_PIPE_TYPES 2
 
 #define PP_HOLE_PARENT (1 << 0)
+#define PP_HOLE_COLD   (1 << 1)
 
 struct page_pipe {
 	unsigned int nr_pipes;			   /* how many page_pipe_bufs in there */
@@ -127,6 +129,11 @@ struct page_pipe {
 	unsigned int free_hole; /* number of holes in use */
 	struct iovec *holes;	/* holes */
 	unsigned int *hole_flags;
+
+	unsigned int nr_cold;	/* number of cold iovs allocated */
+	unsigned int free_cold; /* number of cold iovs in use */
+	struct iovec *cold;	/* pages found cold, sorted by address */
+
 	unsigned int flags; /* PP_FOO flags below */
 };
 
@@ -137,6 +144,8 @@ struct page_pipe *create_page_pipe(unsigned int nr_segs, struct iovec *iovs, uns
 extern void destroy_page_pipe(struct page_pipe *p);
 extern int page_pipe_add_page(struct page_pipe *p, unsigned long addr, unsigned int flags);
 extern int page_pipe_add_hole(struct page_pipe *pp, unsigned long addr, unsigned int flags);
+extern int page_pipe_add_cold(struct page_pipe *pp, unsigned long addr);
+extern unsigned long page_pipe_cold_split(struct page_pipe *pp, unsigned long addr, unsigned long end, bool *cold);
 
 extern void debug_show_page_pipe(struct page_pipe *pp);
 void page_pipe_reinit(struct page_pipe *pp);
@@ -1,6 +1,7 @@
 #ifndef __CR_PAGE_XFER__H__
 #define __CR_PAGE_XFER__H__
 #include "pagemap.h"
+#include "pagemap-compact.h"
 
 struct ps_info {
 	int pid;
@@ -18,6 +19,8 @@ extern int cr_page_server(bool daemon_mode, bool lazy_dump, int cfd);
  * and page-server image file.
  */
 
+struct page_xfer_delta;
+
 struct page_xfer {
 	/* transfers one vaddr:len entry */
 	int (*write_pagemap)(struct page_xfer *self, struct iovec *iov, u32 flags);
@@ -37,6 +40,9 @@ struct page_xfer {
 		struct /* local */ {
 			struct cr_img *pmi; /* pagemaps */
 			struct cr_img *pi;  /* pages */
+			bool compact;	    /* pmi uses the compact encoding */
+			struct pmc_state pmc;
+			struct page_xfer_delta *delta;
 		};
 
 		struct /* page-server */ {
@@ -50,11 +56,15 @@ struct page_xfer {
 
 extern int open_page_xfer(struct page_xfer *xfer, int fd_type, unsigned long id);
 struct page_pipe;
+struct page_pipe_buf;
 extern int page_xfer_dump_pages(struct page_xfer *, struct page_pipe *);
+extern int page_xfer_dump_buf(struct page_xfer *, struct page_pipe *, struct page_pipe_buf *, unsigned int *cur_hole);
 extern int page_xfer_predump_pages(int pid, struct page_xfer *, struct page_pipe *);
 extern int connect_to_page_server_to_send(void);
 extern int connect_to_page_server_to_recv(int epfd);
 extern int disconnect_from_page_server(void);
+extern int page_xfer_send_image(const char *name, int fd);
+extern int page_server_full_speed(void);
 
 extern int check_parent_page_xfer(int fd_type, unsigned long id);
 
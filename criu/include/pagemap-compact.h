@@ -0,0 +1,52 @@
+#ifndef __CR_PAGEMAP_COMPACT_H__
+#define __CR_PAGEMAP_COMPACT_H__
+
+#include <stddef.h>
+
+#include "int.h"
+
+/*
+ * Compact pagemap encoding
+ *
+ * When pagemap_head.compact is set, the pagemap_head message is followed
+ * by a plain stream of records instead of pagemap_entry messages. Each
+ * record is three LEB128 varints:
+ *
+ *   zigzag(vaddr - end of previous entry) / PAGE_SIZE
+ *   nr_pages
+ *   flags
+ *
+ * Entries with PMC_DELTA in flags have a fourth varint, delta_size.
+ *
+ * The first entry is relative to zero. Entries of a pagemap mostly follow
+ * each other closely, so a typical record takes 3-5 bytes instead of the
+ * 15-20 a length-prefixed pagemap_entry costs, and a reader can decode a
+ * whole block of them without unpacking or allocating anything per entry.
+ */
+
+/* Four varints: two 32-bit (5 bytes) and two 64-bit (10 bytes) */
+#define PMC_RECORD_MAX 30
+
+/* Same as PE_DELTA */
+#define PMC_DELTA (1 << 3)
+
+struct pmc_state {
+	u64 prev_end;
+};
+
+/*
+ * Encode one entry into @buf, which must have room for PMC_RECORD_MAX
+ * bytes. Returns the number of bytes used, or -1 if @vaddr is not page
+ * aligned.
+ */
+extern int pmc_encode(struct pmc_state *st, void *buf, u64 vaddr, u32 nr_pages, u32 flags, u64 delta_size);
+
+/*
+ * Decode one entry from @len bytes at @buf. Returns the number of bytes
+ * consumed, 0 if @buf ends in the middle of a record or -1 if the record
+ * is malformed.
+ */
+extern int pmc_decode(struct pmc_state *st, const void *buf, size_t len, u64 *vaddr, u32 *nr_pages, u32 *flags,
+		      u64 *delta_size);
+
+#endif /* __CR_PAGEMAP_COMPACT_H__ */
@@ -61,6 +61,7 @@ struct page_read {
 	/* Private data of reader */
 	struct cr_img *pmi;
 	struct cr_img *pi;
+	struct cr_img *pdi; /* page deltas, only opened with a parent */
 	u32 pages_img_id;
 
 	PagemapEntry *pe;	  /* current pagemap we are on */
@@ -68,12 +69,13 @@ struct page_read {
 				   * then go to this guy for page, see read_pagemap_page */
 	unsigned long cvaddr;	  /* vaddr we are on */
 	off_t pi_off;		  /* current offset in pages file */
+	off_t pd_off;		  /* offset of the current PE_DELTA entry in page deltas */
 
 	struct iovec bunch;   /* record consequent neighbour iovecs to punch together */
 	unsigned id;	      /* for logging */
 	unsigned long img_id; /* pagemap image file ID */
 
-	PagemapEntry **pmes;
+	PagemapEntry *pmes;
 	int nr_pmes;
 	int curr_pme;
 
@@ -113,6 +115,7 @@ int pagemap_render_iovec(struct list_head *from, struct task_restore_args *ta);
 extern void dup_page_read(struct page_read *src, struct page_read *dst);
 
 extern int dedup_one_iovec(struct page_read *pr, unsigned long base, unsigned long len);
+extern int page_read_peek(struct page_read *pr, unsigned long vaddr, void *buf);
 
 static inline unsigned long pagemap_len(PagemapEntry *pe)
 {
@@ -128,6 +131,8 @@ static inline bool page_read_has_parent(struct page_read *pr)
 #define PE_PARENT  (1 << 0) /* pages are in parent snapshot */
 #define PE_LAZY	   (1 << 1) /* pages can be lazily restored */
 #define PE_PRESENT (1 << 2) /* pages are present in pages*img */
+#define PE_DELTA   (1 << 3) /* pages are deltas against parent in pages-delta*img */
+#define PE_COLD	   (1 << 4) /* pages were cold at dump time */
 
 static inline bool pagemap_in_parent(PagemapEntry *pe)
 {
@@ -144,4 +149,14 @@ static inline bool pagemap_present(PagemapEntry *pe)
 	return !!(pe->flags & PE_PRESENT);
 }
 
+static inline bool pagemap_delta(PagemapEntry *pe)
+{
+	return !!(pe->flags & PE_DELTA);
+}
+
+static inline bool pagemap_cold(PagemapEntry *pe)
+{
+	return !!(pe->flags & PE_COLD);
+}
+
 #endif /* __CR_PAGE_READ_H__ */
@@ -16,6 +16,7 @@
 #include "util-pie.h"
 #include "common/lock.h"
 #include "infect-rpc.h"
+#include "numa.h"
 
 #include "images/vma.pb-c.h"
 #include "images/tty.pb-c.h"
@@ -180,6 +181,7 @@ struct parasite_dump_thread {
 	stack_t sas;
 	int pdeath_sig;
 	char comm[TASK_COMM_LEN];
+	struct numa_policy mpol; /* in: NUMA_NO_POLICY to skip */
 	struct parasite_dump_creds creds[0];
 };
 
@@ -11,6 +11,7 @@
 
 void cr_plugin_fini(int stage, int err);
 int cr_plugin_init(int stage);
+int cr_plugin_join(void);
 
 typedef struct {
 	struct list_head head;
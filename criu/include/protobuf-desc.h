@@ -70,6 +70,9 @@ enum {
 	PB_BPFMAP_FILE,
 	PB_BPFMAP_DATA,
 	PB_APPARMOR,
+	PB_PAGE_CACHE,
+	PB_NUMA,
+	PB_BUILD_ID_CACHE,
 
 	/* PB_AUTOGEN_STOP */
 
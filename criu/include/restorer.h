@@ -20,6 +20,7 @@
 #include "shmem.h"
 #include "parasite-vdso.h"
 #include "fault-injection.h"
+#include "numa.h"
 
 #include <time.h>
 
@@ -100,6 +101,7 @@ struct thread_restore_args {
 	u32 futex_rla_len;
 
 	struct rst_sched_param sp;
+	struct numa_policy mpol;
 
 	struct task_restore_args *ta;
 
@@ -162,6 +164,18 @@ struct task_restore_args {
 	struct restore_vma_io *vma_ios;
 	unsigned int vma_ios_n;
 
+	struct iovec *cold;
+	unsigned int cold_n;
+	int cold_advice;
+
+	struct iovec *discard;
+	unsigned int discard_n;
+
+	struct rst_numa_vma *numa_vmas;
+	unsigned int numa_vmas_n;
+	struct rst_numa_range *numa_ranges;
+	unsigned int numa_ranges_n;
+
 	struct restore_posix_timer *posix_timers;
 	unsigned int posix_timers_n;
 
@@ -7,6 +7,7 @@
 #include "kerndat.h"
 #include "images/mm.pb-c.h"
 #include "images/core.pb-c.h"
+#include "images/numa.pb-c.h"
 
 struct task_entries {
 	int nr_threads, nr_tasks, nr_helpers;
@@ -15,6 +16,7 @@ struct task_entries {
 	atomic_t cr_err;
 	mutex_t userns_sync_lock;
 	mutex_t last_pid_mutex;
+	atomic_t thread_create_time; /* us, summed over the tasks */
 };
 
 struct fdt {
@@ -49,6 +51,13 @@ struct rst_info {
 	struct list_head vma_io;
 	unsigned int pages_img_id;
 
+	/* Ranges of pages that were cold at dump time */
+	struct iovec *cold;
+	unsigned int nr_cold;
+
+	/* Memory policies and page nodes from the numa image */
+	NumaEntry *numa;
+
 	u32 cg_set;
 
 	union {
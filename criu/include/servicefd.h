@@ -15,6 +15,7 @@ enum sfd_type {
 	LOG_FD_OFF,
 	IMG_FD_OFF,
 	IMG_STREAMER_FD_OFF,
+	IMG_STORE_SK_OFF, /* Connection to the in-memory image store */
 	PROC_FD_OFF, /* fd with /proc for all proc_ calls */
 	PROC_PID_FD_OFF,
 	PROC_SELF_FD_OFF,
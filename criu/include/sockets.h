@@ -36,7 +36,7 @@ extern bool socket_test_collect_bit(unsigned int family, unsigned int proto);
 
 extern int sk_collect_one(unsigned ino, int family, struct socket_desc *d, struct ns_id *ns);
 struct ns_id;
-extern int collect_sockets(struct ns_id *);
+extern int collect_sockets(struct ns_id *, bool for_dump);
 extern struct collect_image_info inet_sk_cinfo;
 extern struct collect_image_info unix_sk_cinfo;
 extern int add_fake_unix_queuers(void);
@@ -48,6 +48,8 @@ extern struct collect_image_info netlink_sk_cinfo;
 
 extern struct socket_desc *lookup_socket_ino(unsigned int ino, int family);
 extern struct socket_desc *lookup_socket(unsigned int ino, int family, int proto);
+extern int for_each_ns_socket(struct ns_id *ns, int family, int (*cb)(struct socket_desc *sd, void *arg),
+			     void *arg);
 
 extern const struct fdtype_ops unix_dump_ops;
 extern const struct fdtype_ops inet_dump_ops;
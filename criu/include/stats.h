@@ -1,12 +1,20 @@
 #ifndef __CR_STATS_H__
 #define __CR_STATS_H__
 
+#include <sys/types.h>
+
 enum {
 	TIME_FREEZING,
 	TIME_FROZEN,
 	TIME_MEMDUMP,
 	TIME_MEMWRITE,
 	TIME_IRMAP_RESOLVE,
+	TIME_MEMWRITE_OVERLAP,
+	TIME_FREEZE_NOTIFY,
+	TIME_SK_COLLECT,
+	TIME_NF_CT_DUMP,
+	TIME_PARASITE_INFECT,
+	TIME_PARASITE_INFECT_MAX,
 
 	DUMP_TIME_NR_STATS,
 };
@@ -14,12 +22,15 @@ enum {
 enum {
 	TIME_FORK,
 	TIME_RESTORE,
+	TIME_NF_CT_RESTORE,
+	TIME_THREAD_CREATE,
 
 	RESTORE_TIME_NS_STATS,
 };
 
 extern void timing_start(int t);
 extern void timing_stop(int t);
+extern void timing_add(int t, unsigned long usec);
 
 enum {
 	CNT_PAGES_SCANNED,
@@ -33,6 +44,13 @@ enum {
 	CNT_SHPAGES_SKIPPED_PARENT,
 	CNT_SHPAGES_WRITTEN,
 
+	CNT_PAGES_COLD,
+	CNT_SK_COLLECTED,
+	CNT_SK_DIAG_BYTES,
+	CNT_NF_CT_DUMPED,
+	CNT_NF_CT_DUMP_BYTES,
+	CNT_PARASITE_INFECTED,
+
 	DUMP_CNT_NR_STATS,
 };
 
@@ -40,6 +58,11 @@ enum {
 	CNT_PAGES_COMPARED,
 	CNT_PAGES_SKIPPED_COW,
 	CNT_PAGES_RESTORED,
+	CNT_PAGES_PREFETCHED,
+	CNT_PAGES_PLACED_COLD,
+	CNT_PAGES_RESTORE_LAZY,
+	CNT_NF_CT_RESTORED,
+	CNT_NF_CT_BATCHES,
 
 	RESTORE_CNT_NR_STATS,
 };
@@ -47,6 +70,12 @@ enum {
 extern void cnt_add(int c, unsigned long val);
 extern void cnt_sub(int c, unsigned long val);
 
+struct timeval;
+extern void account_img_wait(const struct timeval *start);
+extern void account_parasite_infect(pid_t pid, const struct timeval *start);
+extern int stats_add_discard(int pid, unsigned long start, unsigned long end, unsigned long bytes);
+extern void stats_load_parent(void);
+
 #define DUMP_STATS    1
 #define RESTORE_STATS 2
 
@@ -9,6 +9,13 @@
 #include <sys/mman.h>
 #include <string.h>
 
+/* Range of a private mapping whose pages are not dumped */
+struct discard_range {
+	unsigned long start;
+	unsigned long end;
+	unsigned long nr_skipped; /* pages that would have been dumped */
+};
+
 struct vm_area_list {
 	struct list_head h;   /* list of VMAs */
 	unsigned nr;	      /* nr of all VMAs in the list */
@@ -19,6 +26,10 @@ struct vm_area_list {
 	};
 	unsigned long nr_priv_pages_longest;   /* nr of pages in longest private VMA */
 	unsigned long nr_shared_pages_longest; /* nr of pages in longest shared VMA */
+
+	/* dmp: sorted ranges not to dump, see collect_discard_ranges() */
+	struct discard_range *discard;
+	unsigned int nr_discard;
 };
 
 static inline void vm_area_list_init(struct vm_area_list *vml)
@@ -0,0 +1,210 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "common/lock.h"
+#include "cr_options.h"
+#include "io-limit.h"
+#include "util.h"
+#include "log.h"
+
+#undef LOG_PREFIX
+#define LOG_PREFIX "io-limit: "
+
+/* Idle time is not saved up for longer than that */
+#define IO_IDLE_MAX	 (10 * USEC_PER_SEC)
+/* How often the RPC socket is checked for new limits */
+#define IO_RPC_INTERVAL	 (USEC_PER_SEC / 10)
+
+/*
+ * A token bucket. Tokens come at @rate per second and are saved up
+ * to @burst. Taking more than there are puts the bucket in debt and
+ * the caller sleeps until it is paid off. Zero @rate means no limit.
+ */
+struct io_bucket {
+	u64 rate;
+	u64 burst;
+	s64 tokens;
+	u64 stamp;
+};
+
+/*
+ * The limits live in shared memory, so that the tasks forked on
+ * restore all draw from one budget and see the changes made via RPC.
+ */
+struct io_limits {
+	mutex_t lock;
+	bool full_speed;
+	struct io_bucket bytes;
+	struct io_bucket ops;
+};
+
+static struct io_limits *limits;
+static int rpc_sk = -1;
+static u64 rpc_checked;
+
+static u64 now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * USEC_PER_SEC + ts.tv_nsec / 1000;
+}
+
+static void bucket_setup(struct io_bucket *b, u64 rate, u64 burst)
+{
+	b->rate = rate;
+	b->burst = burst ?: rate;
+	if (b->tokens > (s64)b->burst)
+		b->tokens = b->burst;
+}
+
+/* Returns how long to sleep in us to pay for @n tokens */
+static u64 bucket_take(struct io_bucket *b, u64 n, u64 now)
+{
+	u64 add;
+
+	if (!b->rate)
+		return 0;
+
+	if (now - b->stamp > IO_IDLE_MAX)
+		b->stamp = now - IO_IDLE_MAX;
+
+	/* Only move the stamp by whole tokens, not to lose the rest at low rates */
+	add = (now - b->stamp) * b->rate / USEC_PER_SEC;
+	b->stamp += add * USEC_PER_SEC / b->rate;
+	b->tokens = min_t(s64, b->tokens + add, b->burst);
+	b->tokens -= n;
+	if (b->tokens >= 0)
+		return 0;
+
+	return -b->tokens * USEC_PER_SEC / b->rate;
+}
+
+static void limits_setup(void)
+{
+	bucket_setup(&limits->bytes, opts.io_rate, opts.io_burst);
+	/* Operations are let through in bursts of a second's worth */
+	bucket_setup(&limits->ops, opts.io_iops, 0);
+}
+
+/*
+ * Nothing is set up unless there are limits to start with or they
+ * can be set later via RPC. Must be called before the restore forks.
+ */
+int io_limit_init(void)
+{
+	u64 now;
+
+	if (limits)
+		return 0;
+
+	if (!opts.io_rate && !opts.io_iops && rpc_sk < 0)
+		return 0;
+
+	limits = mmap(NULL, sizeof(*limits), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (limits == MAP_FAILED) {
+		pr_perror("Can't allocate I/O limits");
+		limits = NULL;
+		return -1;
+	}
+
+	mutex_init(&limits->lock);
+	limits_setup();
+
+	now = now_us();
+	limits->bytes.tokens = limits->bytes.burst;
+	limits->bytes.stamp = now;
+	limits->ops.tokens = limits->ops.burst;
+	limits->ops.stamp = now;
+
+	pr_info("Limits set to %" PRIu64 " bytes/s (burst %" PRIu64 "), %u ops/s\n", opts.io_rate,
+		limits->bytes.burst, opts.io_iops);
+	return 0;
+}
+
+/*
+ * Change the limits, IO_LIMIT_KEEP leaves the setting as it is.
+ * The new values are also kept in opts for what comes next.
+ */
+void io_limit_set(u64 rate, u64 iops, u64 burst)
+{
+	if (rate != IO_LIMIT_KEEP)
+		opts.io_rate = rate;
+	if (iops != IO_LIMIT_KEEP)
+		opts.io_iops = iops;
+	if (burst != IO_LIMIT_KEEP)
+		opts.io_burst = burst;
+
+	if (!limits)
+		return;
+
+	mutex_lock(&limits->lock);
+	limits_setup();
+	mutex_unlock(&limits->lock);
+
+	pr_info("Limits changed to %" PRIu64 " bytes/s (burst %" PRIu64 "), %u ops/s\n", opts.io_rate,
+		limits->bytes.burst, opts.io_iops);
+}
+
+/* The tasks are frozen, there is no one to be polite to anymore */
+void io_limit_full_speed(void)
+{
+	if (!limits || limits->full_speed)
+		return;
+
+	pr_info("Tasks are frozen, lifting the limits\n");
+	limits->full_speed = true;
+}
+
+bool io_limit_active(void)
+{
+	return limits && !limits->full_speed && (limits->bytes.rate || limits->ops.rate);
+}
+
+/*
+ * Account for one image read or write of @bytes and wait if it goes
+ * over the limits. Called after the I/O is done, so the time spent
+ * on it counts as well.
+ */
+void io_limit(unsigned long bytes)
+{
+	struct timespec ts;
+	u64 now, wait = 0;
+
+	if (!limits)
+		return;
+
+	now = now_us();
+	if (rpc_sk >= 0 && now - rpc_checked >= IO_RPC_INTERVAL) {
+		rpc_checked = now;
+		io_limit_recv_rpc(rpc_sk);
+	}
+
+	if (limits->full_speed)
+		return;
+
+	mutex_lock(&limits->lock);
+	wait = bucket_take(&limits->bytes, bytes, now);
+	wait = max(wait, bucket_take(&limits->ops, 1, now));
+	mutex_unlock(&limits->lock);
+
+	if (!wait)
+		return;
+
+	ts.tv_sec = wait / USEC_PER_SEC;
+	ts.tv_nsec = (wait % USEC_PER_SEC) * 1000;
+	while (nanosleep(&ts, &ts) && errno == EINTR)
+		;
+}
+
+/*
+ * The RPC socket to take new limits from while a request is served.
+ * Only the process that set it checks it, tasks forked on restore
+ * reset it with -1.
+ */
+void io_limit_set_rpc_sk(int sk)
+{
+	rpc_sk = sk;
+}
@@ -27,8 +27,12 @@
 #include "sk-packet.h"
 #include "files-reg.h"
 #include "pagemap-cache.h"
+#include "page-idle.h"
+#include "numa.h"
+#include "io-limit.h"
 #include "fault-injection.h"
 #include "prctl.h"
+#include "mman.h"
 #include "compel/infect-util.h"
 #include "pidfd-store.h"
 
@@ -141,6 +145,140 @@ bool page_in_parent(bool dirty)
 	return __page_in_parent(dirty);
 }
 
+int discard_region_add(pid_t pid, unsigned long start, unsigned long len)
+{
+	struct discard_region_opt *o;
+
+	if (!len || (start | len) & ~PAGE_MASK) {
+		pr_err("Discard region %d:%lx+%lx is not page aligned\n", pid, start, len);
+		return -1;
+	}
+
+	o = xmalloc(sizeof(*o));
+	if (!o)
+		return -1;
+
+	o->pid = pid;
+	o->start = start;
+	o->end = start + len;
+	list_add_tail(&o->node, &opts.discard_regions);
+	return 0;
+}
+
+static int add_discard_range(struct vm_area_list *vmas, unsigned long start, unsigned long end)
+{
+	struct discard_range *d;
+
+	if (!(vmas->nr_discard % 16) &&
+	    xrealloc_safe(&vmas->discard, (vmas->nr_discard + 16) * sizeof(struct discard_range)))
+		return -1;
+
+	d = &vmas->discard[vmas->nr_discard++];
+	d->start = start;
+	d->end = end;
+	d->nr_skipped = 0;
+	return 0;
+}
+
+static int discard_range_cmp(const void *a, const void *b)
+{
+	const struct discard_range *x = a, *y = b;
+
+	if (x->start == y->start)
+		return 0;
+	return x->start < y->start ? -1 : 1;
+}
+
+/* Whether any thread of @item has its stack pointer in @vma */
+static bool vma_has_stack(struct pstree_item *item, struct vma_area *vma)
+{
+	int i;
+
+	for (i = 0; i < item->nr_threads; i++) {
+		uint64_t sp = dmpi(item)->thread_sp[i];
+
+		if (sp >= vma->e->start && sp < vma->e->end)
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Find the parts of private mappings that the application asked not to
+ * checkpoint: VMAs marked with MADV_DONTDUMP if --discard-dontdump is on,
+ * and the regions registered for this task. Mappings with a thread's
+ * stack in them are always dumped, so this runs once the parasite has
+ * collected the stack pointers. The pages found are skipped by
+ * generate_iovs() and come back zero-filled, or with the file contents
+ * for private file mappings.
+ */
+static int collect_discard_ranges(struct pstree_item *item, struct vm_area_list *vmas)
+{
+	struct discard_region_opt *o;
+	struct vma_area *vma;
+	unsigned int i, n;
+
+	list_for_each_entry(vma, &vmas->h, list) {
+		unsigned long start = vma->e->start, end = vma->e->end;
+
+		if (!vma_area_is_private(vma, kdat.task_size) || !vma_area_is(vma, VMA_AREA_REGULAR) ||
+		    vma_area_is(vma, VMA_AREA_STACK) || vma_area_is(vma, VMA_AREA_AIORING) ||
+		    vma_area_is(vma, VMA_AREA_VDSO) || vma_area_is(vma, VMA_AREA_VVAR) || vma_has_stack(item, vma))
+			continue;
+
+		if (opts.discard_dontdump && (vma->e->madv & (1ul << MADV_DONTDUMP))) {
+			if (add_discard_range(vmas, start, end))
+				return -1;
+			continue;
+		}
+
+		list_for_each_entry(o, &opts.discard_regions, node) {
+			if (o->pid != item->pid->real || o->end <= start || o->start >= end)
+				continue;
+			if (add_discard_range(vmas, max(o->start, start), min(o->end, end)))
+				return -1;
+		}
+	}
+
+	if (!vmas->nr_discard)
+		return 0;
+
+	/* Registered regions may overlap each other */
+	qsort(vmas->discard, vmas->nr_discard, sizeof(struct discard_range), discard_range_cmp);
+	for (i = 1, n = 0; i < vmas->nr_discard; i++) {
+		struct discard_range *d = &vmas->discard[i];
+
+		if (d->start <= vmas->discard[n].end)
+			vmas->discard[n].end = max(vmas->discard[n].end, d->end);
+		else
+			vmas->discard[++n] = *d;
+	}
+	vmas->nr_discard = n + 1;
+
+	for (i = 0; i < vmas->nr_discard; i++)
+		pr_info("Discarding %lx-%lx\n", vmas->discard[i].start, vmas->discard[i].end);
+
+	return 0;
+}
+
+static struct discard_range *find_discard_range(struct vm_area_list *vmas, unsigned long addr)
+{
+	unsigned int lo = 0, hi = vmas->nr_discard;
+
+	/* The first range ending after @addr */
+	while (lo < hi) {
+		unsigned int mid = (lo + hi) / 2;
+
+		if (vmas->discard[mid].end <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo < vmas->nr_discard ? &vmas->discard[lo] : NULL;
+}
+
 static bool is_stack(struct pstree_item *item, unsigned long vaddr)
 {
 	int i;
@@ -164,19 +302,22 @@ static bool is_stack(struct pstree_item *item, unsigned long vaddr)
  * the memory contents is present in the parent image set.
  */
 
-static int generate_iovs(struct pstree_item *item, struct vma_area *vma, struct page_pipe *pp, u64 *map, u64 *off,
-			 bool has_parent)
+static int generate_iovs(struct pstree_item *item, struct vm_area_list *vmas, struct vma_area *vma,
+			 struct page_pipe *pp, u64 *map, u64 *off, bool has_parent)
 {
 	u64 *at = &map[PAGE_PFN(*off)];
 	unsigned long pfn, nr_to_scan;
-	unsigned long pages[3] = {};
+	unsigned long pages[3] = {}, nr_cold = 0;
+	struct discard_range *discard;
 	int ret = 0;
 
 	nr_to_scan = (vma_area_len(vma) - *off) / PAGE_SIZE;
+	discard = find_discard_range(vmas, vma->e->start + *off);
 
 	for (pfn = 0; pfn < nr_to_scan; pfn++) {
 		unsigned long vaddr;
 		unsigned int ppb_flags = 0;
+		bool cold;
 		int st;
 
 		if (!should_dump_page(vma->e, at[pfn]))
@@ -184,7 +325,20 @@ static int generate_iovs(struct pstree_item *item, struct vma_area *vma, struct
 
 		vaddr = vma->e->start + *off + pfn * PAGE_SIZE;
 
-		if (vma_entry_can_be_lazy(vma->e) && !is_stack(item, vaddr))
+		while (discard && vaddr >= discard->end)
+			discard = discard + 1 < vmas->discard + vmas->nr_discard ? discard + 1 : NULL;
+		if (discard && vaddr >= discard->start) {
+			discard->nr_skipped++;
+			continue;
+		}
+
+		cold = opts.cold_pages && page_is_cold(at[pfn]);
+
+		/*
+		 * With --cold-pages only the cold pages are left for
+		 * the lazy restore, the rest is restored in advance.
+		 */
+		if (vma_entry_can_be_lazy(vma->e) && !is_stack(item, vaddr) && (cold || !opts.cold_pages))
 			ppb_flags |= PPB_LAZY;
 
 		/*
@@ -195,10 +349,12 @@ static int generate_iovs(struct pstree_item *item, struct vma_area *vma, struct
 		 */
 
 		if (has_parent && page_in_parent(at[pfn] & PME_SOFT_DIRTY)) {
-			ret = page_pipe_add_hole(pp, vaddr, PP_HOLE_PARENT);
+			ret = page_pipe_add_hole(pp, vaddr, PP_HOLE_PARENT | (cold ? PP_HOLE_COLD : 0));
 			st = 0;
 		} else {
 			ret = page_pipe_add_page(pp, vaddr, ppb_flags);
+			if (!ret && cold)
+				ret = page_pipe_add_cold(pp, vaddr);
 			if (ppb_flags & PPB_LAZY && opts.lazy_pages)
 				st = 1;
 			else
@@ -212,6 +368,8 @@ static int generate_iovs(struct pstree_item *item, struct vma_area *vma, struct
 		}
 
 		pages[st]++;
+		if (cold)
+			nr_cold++;
 	}
 
 	*off += pfn * PAGE_SIZE;
@@ -220,8 +378,10 @@ static int generate_iovs(struct pstree_item *item, struct vma_area *vma, struct
 	cnt_add(CNT_PAGES_SKIPPED_PARENT, pages[0]);
 	cnt_add(CNT_PAGES_LAZY, pages[1]);
 	cnt_add(CNT_PAGES_WRITTEN, pages[2]);
+	cnt_add(CNT_PAGES_COLD, nr_cold);
 
-	pr_info("Pagemap generated: %lu pages (%lu lazy) %lu holes\n", pages[2] + pages[1], pages[1], pages[0]);
+	pr_info("Pagemap generated: %lu pages (%lu lazy, %lu cold) %lu holes\n", pages[2] + pages[1], pages[1], nr_cold,
+		pages[0]);
 	return ret;
 }
 
@@ -297,21 +457,66 @@ static int drain_pages(struct page_pipe *pp, struct parasite_ctl *ctl, struct pa
 	return 0;
 }
 
-static int xfer_pages(struct page_pipe *pp, struct page_xfer *xfer)
+static int xfer_pages_buf(struct page_pipe *pp, struct page_pipe_buf *ppb, struct page_xfer *xfer,
+			  unsigned int *cur_hole, bool overlap)
 {
 	int ret;
 
-	/*
-	 * Step 3 -- write pages into image (or delay writing for
-	 *           pre-dump action (see pre_dump_one_task)
-	 */
 	timing_start(TIME_MEMWRITE);
-	ret = page_xfer_dump_pages(xfer, pp);
+	if (overlap)
+		timing_start(TIME_MEMWRITE_OVERLAP);
+	ret = page_xfer_dump_buf(xfer, pp, ppb, cur_hole);
+	if (overlap)
+		timing_stop(TIME_MEMWRITE_OVERLAP);
 	timing_stop(TIME_MEMWRITE);
 
 	return ret;
 }
 
+/*
+ * Steps 2 and 3 -- grab pages into page-pipe and write them into image
+ * (pre-dump delays writing, see pre_dump_one_task). These are pipelined,
+ * while the parasite is splicing pages into the next buffer, the previous
+ * one is written out. Buffers sharing a pipe are fine with that, as the
+ * new pages are queued after the ones being read.
+ */
+static int drain_xfer_pages(struct page_pipe *pp, struct parasite_ctl *ctl, struct parasite_dump_pages_args *args,
+			    struct page_xfer *xfer)
+{
+	struct page_pipe_buf *ppb, *prev = NULL;
+	unsigned int cur_hole = 0;
+	int ret;
+
+	debug_show_page_pipe(pp);
+
+	list_for_each_entry(ppb, &pp->bufs, l) {
+		args->nr_segs = ppb->nr_segs;
+		args->nr_pages = ppb->pages_in;
+		pr_debug("PPB: %d pages %d segs %u pipe %d off\n", args->nr_pages, args->nr_segs, ppb->pipe_size,
+			 args->off);
+
+		ret = compel_rpc_call(PARASITE_CMD_DUMPPAGES, ctl);
+		if (ret < 0)
+			return -1;
+		ret = compel_util_send_fd(ctl, ppb->p[1]);
+		if (ret)
+			return -1;
+
+		ret = prev ? xfer_pages_buf(pp, prev, xfer, &cur_hole, true) : 0;
+
+		if (compel_rpc_sync(PARASITE_CMD_DUMPPAGES, ctl) < 0 || ret)
+			return -1;
+
+		args->off += args->nr_segs;
+		prev = ppb;
+	}
+
+	if (prev && xfer_pages_buf(pp, prev, xfer, &cur_hole, false))
+		return -1;
+
+	return xfer_pages_buf(pp, NULL, xfer, &cur_hole, false);
+}
+
 static int detect_pid_reuse(struct pstree_item *item, struct proc_pid_stat *pps, InventoryEntry *parent_ie)
 {
 	unsigned long long dump_ticks;
@@ -352,9 +557,9 @@ static int detect_pid_reuse(struct pstree_item *item, struct proc_pid_stat *pps,
 	return 0;
 }
 
-static int generate_vma_iovs(struct pstree_item *item, struct vma_area *vma, struct page_pipe *pp,
-			     struct page_xfer *xfer, struct parasite_dump_pages_args *args, struct parasite_ctl *ctl,
-			     pmc_t *pmc, bool has_parent, bool pre_dump, int parent_predump_mode)
+static int generate_vma_iovs(struct pstree_item *item, struct vm_area_list *vmas, struct vma_area *vma,
+			     struct page_pipe *pp, struct page_xfer *xfer, struct parasite_dump_pages_args *args,
+			     struct parasite_ctl *ctl, pmc_t *pmc, bool has_parent, bool pre_dump, int parent_predump_mode)
 {
 	u64 off = 0;
 	u64 *map;
@@ -429,13 +634,11 @@ static int generate_vma_iovs(struct pstree_item *item, struct vma_area *vma, str
 		return add_shmem_area(item->pid->real, vma->e, map);
 
 again:
-	ret = generate_iovs(item, vma, pp, map, &off, has_parent);
+	ret = generate_iovs(item, vmas, vma, pp, map, &off, has_parent);
 	if (ret == -EAGAIN) {
 		BUG_ON(!(pp->flags & PP_CHUNK_MODE));
 
-		ret = drain_pages(pp, ctl, args);
-		if (!ret)
-			ret = xfer_pages(pp, xfer);
+		ret = drain_xfer_pages(pp, ctl, args, xfer);
 		if (!ret) {
 			page_pipe_reinit(pp);
 			goto again;
@@ -522,8 +725,8 @@ static int __parasite_dump_pages_seized(struct pstree_item *item, struct parasit
 		parent_predump_mode = mdc->parent_ie->pre_dump_mode;
 
 	list_for_each_entry(vma_area, &vma_area_list->h, list) {
-		ret = generate_vma_iovs(item, vma_area, pp, &xfer, args, ctl, &pmc, has_parent, mdc->pre_dump,
-					parent_predump_mode);
+		ret = generate_vma_iovs(item, vma_area_list, vma_area, pp, &xfer, args, ctl, &pmc, has_parent,
+					mdc->pre_dump, parent_predump_mode);
 		if (ret < 0)
 			goto out_xfer;
 	}
@@ -539,11 +742,10 @@ static int __parasite_dump_pages_seized(struct pstree_item *item, struct parasit
 	 */
 	if (mdc->pre_dump && opts.pre_dump_mode == PRE_DUMP_READ)
 		ret = 0;
-	else
+	else if (mdc->pre_dump)
 		ret = drain_pages(pp, ctl, args);
-
-	if (!ret && !mdc->pre_dump)
-		ret = xfer_pages(pp, &xfer);
+	else
+		ret = drain_xfer_pages(pp, ctl, args, &xfer);
 	if (ret)
 		goto out_xfer;
 
@@ -577,6 +779,9 @@ int parasite_dump_pages_seized(struct pstree_item *item, struct vm_area_list *vm
 	int ret;
 	struct parasite_dump_pages_args *pargs;
 
+	if (collect_discard_ranges(item, vma_area_list))
+		return -1;
+
 	pargs = prep_dump_pages_args(ctl, vma_area_list, mdc->pre_dump);
 
 	/*
@@ -994,7 +1199,11 @@ static int premap_priv_vmas(struct pstree_item *t, struct vm_area_list *vmas, vo
 		if (vma->e->status & VMA_EXT_PLUGIN)
 			continue;
 
-		if (vma->pvma == NULL && pr->pieok && !vma_force_premap(vma, &vmas->h)) {
+		/*
+		 * The restorer reads pages on its own and can't be held
+		 * back, so with I/O limits all of them are read by criu.
+		 */
+		if (vma->pvma == NULL && pr->pieok && !io_limit_active() && !vma_force_premap(vma, &vmas->h)) {
 			/*
 			 * VMA in question is not shared with anyone. We'll
 			 * restore it with its contents in restorer.
@@ -1023,6 +1232,28 @@ static int premap_priv_vmas(struct pstree_item *t, struct vm_area_list *vmas, vo
 	return ret;
 }
 
+/*
+ * Remember pages marked cold in the images for the restorer to
+ * madvise() them once they are in place. Adjacent ranges are merged.
+ */
+static int add_cold_range(struct rst_info *ri, unsigned long va, unsigned long nr_pages)
+{
+	struct iovec *last = ri->nr_cold ? &ri->cold[ri->nr_cold - 1] : NULL;
+
+	if (last && (unsigned long)last->iov_base + last->iov_len == va) {
+		last->iov_len += nr_pages * PAGE_SIZE;
+		return 0;
+	}
+
+	if (!(ri->nr_cold % 64) && xrealloc_safe(&ri->cold, (ri->nr_cold + 64) * sizeof(struct iovec)))
+		return -1;
+
+	ri->cold[ri->nr_cold].iov_base = (void *)va;
+	ri->cold[ri->nr_cold].iov_len = nr_pages * PAGE_SIZE;
+	ri->nr_cold++;
+	return 0;
+}
+
 static int restore_priv_vma_content(struct pstree_item *t, struct page_read *pr)
 {
 	struct vma_area *vma;
@@ -1035,6 +1266,7 @@ static int restore_priv_vma_content(struct pstree_item *t, struct page_read *pr)
 	unsigned int nr_dropped = 0;
 	unsigned int nr_compared = 0;
 	unsigned int nr_lazy = 0;
+	unsigned int nr_cold = 0;
 	unsigned long va;
 
 	vma = list_first_entry(vmas, struct vma_area, list);
@@ -1064,6 +1296,12 @@ static int restore_priv_vma_content(struct pstree_item *t, struct page_read *pr)
 			continue;
 		}
 
+		if (opts.cold_pages && pagemap_cold(pr->pe)) {
+			if (add_cold_range(rsti(t), va, nr_pages))
+				return -1;
+			nr_cold += nr_pages;
+		}
+
 		for (i = 0; i < nr_pages; i++) {
 			unsigned char buf[PAGE_SIZE];
 			void *p;
@@ -1202,11 +1440,14 @@ err_read:
 	cnt_add(CNT_PAGES_COMPARED, nr_compared);
 	cnt_add(CNT_PAGES_SKIPPED_COW, nr_shared);
 	cnt_add(CNT_PAGES_RESTORED, nr_restored);
+	cnt_add(CNT_PAGES_PLACED_COLD, nr_cold);
+	cnt_add(CNT_PAGES_RESTORE_LAZY, nr_lazy);
 
 	pr_info("nr_restored_pages: %d\n", nr_restored);
 	pr_info("nr_shared_pages:   %d\n", nr_shared);
 	pr_info("nr_dropped_pages:   %d\n", nr_dropped);
 	pr_info("nr_lazy:           %d\n", nr_lazy);
+	pr_info("nr_cold:           %d\n", nr_cold);
 
 	return 0;
 
@@ -1281,18 +1522,29 @@ int prepare_mappings(struct pstree_item *t)
 	if (maybe_disable_thp(t, &pr))
 		return -1;
 
+	if (prepare_numa(t))
+		return -1;
+
 	pr.advance(&pr); /* shift to the 1st iovec */
 
 	ret = premap_priv_vmas(t, vmas, &addr, &pr);
 	if (ret < 0)
 		goto out;
 
+	ret = numa_place_premapped(t, false);
+	if (ret < 0)
+		goto out;
+
 	pr.reset(&pr);
 
 	ret = restore_priv_vma_content(t, &pr);
 	if (ret < 0)
 		goto out;
 
+	ret = numa_place_premapped(t, true);
+	if (ret < 0)
+		goto out;
+
 	if (old_premmapped_addr) {
 		ret = munmap(old_premmapped_addr, old_premmapped_len);
 		if (ret < 0)
@@ -1417,6 +1669,59 @@ static int prepare_vma_ios(struct pstree_item *t, struct task_restore_args *ta)
 	return pagemap_render_iovec(&rsti(t)->vma_io, ta);
 }
 
+static int prepare_cold_pages(struct pstree_item *t, struct task_restore_args *ta)
+{
+	struct rst_info *ri = rsti(t);
+	size_t size = ri->nr_cold * sizeof(struct iovec);
+
+	void *cold;
+
+	ta->cold_advice = opts.cold_pages_pageout ? MADV_PAGEOUT : MADV_COLD;
+	ta->cold_n = 0;
+	ta->cold = NULL;
+	if (!ri->nr_cold)
+		return 0;
+
+	ta->cold = (struct iovec *)rst_mem_align_cpos(RM_PRIVATE);
+	cold = rst_mem_alloc(size, RM_PRIVATE);
+	if (!cold)
+		return -1;
+
+	memcpy(cold, ri->cold, size);
+	ta->cold_n = ri->nr_cold;
+
+	xfree(ri->cold);
+	ri->cold = NULL;
+	ri->nr_cold = 0;
+	return 0;
+}
+
+/* With --discard-unmap the restorer unmaps the discarded ranges */
+static int prepare_discard_ranges(struct pstree_item *t, struct task_restore_args *ta)
+{
+	MmEntry *mm = rsti(t)->mm;
+	struct iovec *iov;
+	int i;
+
+	ta->discard_n = 0;
+	ta->discard = NULL;
+	if (!opts.discard_unmap || !mm->n_discard)
+		return 0;
+
+	ta->discard = (struct iovec *)rst_mem_align_cpos(RM_PRIVATE);
+	iov = rst_mem_alloc(mm->n_discard * sizeof(*iov), RM_PRIVATE);
+	if (!iov)
+		return -1;
+
+	for (i = 0; i < mm->n_discard; i++) {
+		iov[i].iov_base = decode_pointer(mm->discard[i]->start);
+		iov[i].iov_len = mm->discard[i]->end - mm->discard[i]->start;
+	}
+	ta->discard_n = mm->n_discard;
+
+	return 0;
+}
+
 int prepare_vmas(struct pstree_item *t, struct task_restore_args *ta)
 {
 	struct vma_area *vma;
@@ -1442,5 +1747,14 @@ int prepare_vmas(struct pstree_item *t, struct task_restore_args *ta)
 			vma_premmaped_start(vme) = vma->premmaped_addr;
 	}
 
+	if (prepare_cold_pages(t, ta))
+		return -1;
+
+	if (prepare_discard_ranges(t, ta))
+		return -1;
+
+	if (prepare_numa_args(t, ta))
+		return -1;
+
 	return prepare_vma_ios(t, ta);
 }
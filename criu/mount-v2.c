@@ -4,6 +4,7 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/mount.h>
+#include <sys/wait.h>
 #include <sched.h>
 
 #include "kerndat.h"
@@ -19,6 +20,7 @@
 #include "path.h"
 #include "files-reg.h"
 #include "fdstore.h"
+#include "clone-noasan.h"
 #include "common/list.h"
 #include "common/bug.h"
 #include "common/compiler.h"
@@ -542,49 +544,6 @@ static int __set_unbindable_v2(struct mount_info *mi)
 	return 0;
 }
 
-/*
- * Setting MS_UNBINDABLE flag is slightly delayed,
- * obviousely until we finish bind-mounting everything.
- */
-static int set_unbindable_v2(void)
-{
-	int orig_nsfd = -1, nsfd = -1, exit_code = -1;
-	struct mount_info *mi;
-	struct ns_id *nsid;
-
-	for (nsid = ns_ids; nsid != NULL; nsid = nsid->next) {
-		bool ns_has_unbindable = false;
-
-		if (nsid->nd != &mnt_ns_desc)
-			continue;
-
-		for (mi = mntinfo; mi != NULL; mi = mi->next)
-			if (mi->nsid == nsid && mi->flags & MS_UNBINDABLE)
-				ns_has_unbindable = true;
-
-		if (!ns_has_unbindable)
-			continue;
-
-		nsfd = fdstore_get(nsid->mnt.nsfd_id);
-		if (nsfd < 0)
-			goto err;
-
-		if (switch_ns_by_fd(nsfd, &mnt_ns_desc, orig_nsfd == -1 ? &orig_nsfd : NULL))
-			goto err;
-		close_safe(&nsfd);
-
-		if (mnt_tree_for_each(nsid->mnt.mntinfo_tree, __set_unbindable_v2))
-			goto err;
-	}
-
-	exit_code = 0;
-err:
-	if (orig_nsfd >= 0 && restore_ns(orig_nsfd, &mnt_ns_desc))
-		exit_code = -1;
-	close_safe(&nsfd);
-	return exit_code;
-}
-
 /*
  * Detects if mount is a directory mount or file mount based on stat on
  * its mountpoint inside already mounted parent mount. This is deeply
@@ -662,49 +621,6 @@ static int create_plain_mountpoint(struct mount_info *mi)
 	return 0;
 }
 
-/*
- * At this point we already have a mount in service mount namespace now we
- * bind-mount it to the final restored mount namespace via new kernel mount
- * API.
- */
-static int do_mount_in_right_mntns(struct mount_info *mi)
-{
-	int nsfd = -1, orig_nsfd = -1, detached_fd = -1, exit_code = -1;
-
-	if (!mi->nsid)
-		return 0;
-
-	detached_fd =
-		sys_open_tree(AT_FDCWD, mi->plain_mountpoint, AT_NO_AUTOMOUNT | AT_SYMLINK_NOFOLLOW | OPEN_TREE_CLONE);
-	if (detached_fd == -1) {
-		pr_perror("Failed to open_tree %s", mi->plain_mountpoint);
-		goto err;
-	}
-
-	nsfd = fdstore_get(mi->nsid->mnt.nsfd_id);
-	if (nsfd < 0)
-		goto err;
-
-	if (switch_ns_by_fd(nsfd, &mnt_ns_desc, &orig_nsfd))
-		goto err;
-
-	if (create_plain_mountpoint(mi))
-		goto err;
-
-	if (sys_move_mount(detached_fd, "", AT_FDCWD, mi->plain_mountpoint, MOVE_MOUNT_F_EMPTY_PATH)) {
-		pr_perror("Failed to cross-mntns move_mount plain mount %d", mi->mnt_id);
-		goto err;
-	}
-
-	exit_code = 0;
-err:
-	if (orig_nsfd >= 0 && restore_ns(orig_nsfd, &mnt_ns_desc))
-		exit_code = -1;
-	close_safe(&nsfd);
-	close_safe(&detached_fd);
-	return exit_code;
-}
-
 static int do_mount_one_v2(struct mount_info *mi)
 {
 	int ret;
@@ -754,10 +670,167 @@ static int do_mount_one_v2(struct mount_info *mi)
 			mi->fstype = find_fstype_by_name("btrfs");
 	}
 
-	if (ret == 0 && do_mount_in_right_mntns(mi))
+	return ret;
+}
+
+/*
+ * Once all plain mounts are created in the service mount namespace, the
+ * restored mount namespaces don't depend on each other any more, so the
+ * per-namespace stages run in child processes, at most one per online
+ * cpu. Children can only leave their results in shared memory: fdstore,
+ * ns_id and mount_info->rmi.
+ */
+struct mntns_stage {
+	int (*fn)(struct ns_id *nsid);
+	struct ns_id *nsid;
+};
+
+static int mntns_stage_child(void *arg)
+{
+	struct mntns_stage *st = arg;
+
+	return st->fn(st->nsid) ? 1 : 0;
+}
+
+static int wait_mntns_stage(pid_t pid)
+{
+	int status;
+
+	errno = 0;
+	if (waitpid(pid, &status, __WALL) != pid || !WIFEXITED(status) || WEXITSTATUS(status)) {
+		pr_err("Mntns worker %d failed: errno=%d, status=%d\n", pid, errno, status);
 		return -1;
+	}
 
-	return ret;
+	return 0;
+}
+
+static int for_each_mntns_parallel(int (*fn)(struct ns_id *nsid))
+{
+	struct mntns_stage st = { .fn = fn };
+	int nr_workers, nr = 0, done = 0, exit_code = 0;
+	struct ns_id *nsid;
+	pid_t *workers;
+
+	nr_workers = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nr_workers < 1)
+		nr_workers = 1;
+
+	workers = xmalloc(nr_workers * sizeof(*workers));
+	if (!workers)
+		return -1;
+
+	for (nsid = ns_ids; nsid != NULL; nsid = nsid->next) {
+		pid_t pid;
+
+		if (nsid->nd != &mnt_ns_desc)
+			continue;
+
+		/* All workers are busy, wait for the oldest one */
+		if (nr - done == nr_workers && wait_mntns_stage(workers[done++ % nr_workers])) {
+			exit_code = -1;
+			break;
+		}
+
+		st.nsid = nsid;
+		/* No exit signal, SIGCHLD is blocked while we prepare namespaces */
+		pid = clone_noasan(mntns_stage_child, 0, &st);
+		if (pid == -1) {
+			pr_perror("Can't create mntns worker");
+			exit_code = -1;
+			break;
+		}
+		workers[nr++ % nr_workers] = pid;
+	}
+
+	while (done < nr)
+		if (wait_mntns_stage(workers[done++ % nr_workers]))
+			exit_code = -1;
+
+	xfree(workers);
+	return exit_code;
+}
+
+#define MNTNS_MOVE_BATCH 64
+
+/*
+ * At this point we already have the plain mounts in service mount
+ * namespace, now we bind-mount them to the final restored mount namespace
+ * via new kernel mount API. Detached clones are taken in batches, so that
+ * we switch mount namespaces twice per batch and not twice per mount.
+ *
+ * Setting MS_UNBINDABLE flag is slightly delayed, obviousely until we
+ * finish bind-mounting everything, unbindable mounts can't be cloned.
+ */
+static int move_plain_mounts_to_mntns(struct ns_id *nsid)
+{
+	struct mount_info *batch[MNTNS_MOVE_BATCH], *mi = mntinfo;
+	int detached_fds[MNTNS_MOVE_BATCH];
+	int service_nsfd, nsfd = -1, nr = 0, i, exit_code = -1;
+	bool ns_has_unbindable = false;
+
+	service_nsfd = open_proc(PROC_SELF, "ns/mnt");
+	if (service_nsfd < 0)
+		return -1;
+
+	nsfd = fdstore_get(nsid->mnt.nsfd_id);
+	if (nsfd < 0)
+		goto err;
+
+	while (mi) {
+		for (nr = 0; mi != NULL && nr < MNTNS_MOVE_BATCH; mi = mi->next) {
+			if (mi->nsid != nsid)
+				continue;
+
+			if (mi->flags & MS_UNBINDABLE)
+				ns_has_unbindable = true;
+
+			detached_fds[nr] = sys_open_tree(AT_FDCWD, mi->plain_mountpoint,
+							 AT_NO_AUTOMOUNT | AT_SYMLINK_NOFOLLOW | OPEN_TREE_CLONE);
+			if (detached_fds[nr] == -1) {
+				pr_perror("Failed to open_tree %s", mi->plain_mountpoint);
+				goto err;
+			}
+			batch[nr++] = mi;
+		}
+
+		if (!nr)
+			break;
+
+		if (switch_ns_by_fd(nsfd, &mnt_ns_desc, NULL))
+			goto err;
+
+		for (i = 0; i < nr; i++) {
+			if (create_plain_mountpoint(batch[i]))
+				goto err;
+
+			if (sys_move_mount(detached_fds[i], "", AT_FDCWD, batch[i]->plain_mountpoint,
+					   MOVE_MOUNT_F_EMPTY_PATH)) {
+				pr_perror("Failed to cross-mntns move_mount plain mount %d", batch[i]->mnt_id);
+				goto err;
+			}
+			close_safe(&detached_fds[i]);
+		}
+
+		if (switch_ns_by_fd(service_nsfd, &mnt_ns_desc, NULL))
+			goto err;
+	}
+
+	if (ns_has_unbindable) {
+		if (switch_ns_by_fd(nsfd, &mnt_ns_desc, NULL))
+			goto err;
+
+		if (mnt_tree_for_each(nsid->mnt.mntinfo_tree, __set_unbindable_v2))
+			goto err;
+	}
+
+	exit_code = 0;
+err:
+	for (i = 0; i < nr; i++)
+		close_safe(&detached_fds[i]);
+	close_safe(&nsfd);
+	close(service_nsfd);
+	return exit_code;
 }
 
 static int populate_mnt_ns_v2(void)
@@ -768,7 +841,7 @@ static int populate_mnt_ns_v2(void)
 	if (mnt_tree_for_each(root_yard_mp, do_mount_one_v2))
 		return -1;
 
-	return set_unbindable_v2();
+	return for_each_mntns_parallel(move_plain_mounts_to_mntns);
 }
 
 /*
@@ -790,9 +863,9 @@ static int move_mount_to_tree(struct mount_info *mi)
 		return -1;
 	}
 
-	mi->mp_fd_id = fdstore_add(fd);
+	mi->rmi->mp_fd_id = fdstore_add(fd);
 	close(fd);
-	if (mi->mp_fd_id < 0) {
+	if (mi->rmi->mp_fd_id < 0) {
 		pr_err("Can't add mountpoint of mount %d to fdstore\n", mi->mnt_id);
 		return -1;
 	}
@@ -809,9 +882,9 @@ static int move_mount_to_tree(struct mount_info *mi)
 		return -1;
 	}
 
-	mi->mnt_fd_id = fdstore_add(fd);
+	mi->rmi->mnt_fd_id = fdstore_add(fd);
 	close(fd);
-	if (mi->mnt_fd_id < 0) {
+	if (mi->rmi->mnt_fd_id < 0) {
 		pr_err("Can't add mount %d fd to fdstore\n", mi->mnt_id);
 		return -1;
 	}
@@ -930,7 +1003,7 @@ static int restore_one_sharing(struct sharing_group *sg, struct mount_info *targ
 	char target_path[PATH_MAX];
 	int target_fd;
 
-	target_fd = fdstore_get(target->mnt_fd_id);
+	target_fd = fdstore_get(target->rmi->mnt_fd_id);
 	BUG_ON(target_fd < 0);
 	snprintf(target_path, sizeof(target_path), "/proc/self/fd/%d", target_fd);
 
@@ -941,7 +1014,7 @@ static int restore_one_sharing(struct sharing_group *sg, struct mount_info *targ
 
 			/* Get shared_id from parent sharing group */
 			first = get_first_mount(sg->parent);
-			if (move_mount_set_group(first->mnt_fd_id, NULL, target->mnt_fd_id)) {
+			if (move_mount_set_group(first->rmi->mnt_fd_id, NULL, target->rmi->mnt_fd_id)) {
 				pr_err("Failed to copy sharing from %d to %d\n", first->mnt_id, target->mnt_id);
 				close(target_fd);
 				return -1;
@@ -954,7 +1027,7 @@ static int restore_one_sharing(struct sharing_group *sg, struct mount_info *targ
 			 * or non-shared slave). If source is a private mount
 			 * we would fail.
 			 */
-			if (move_mount_set_group(-1, sg->source, target->mnt_fd_id)) {
+			if (move_mount_set_group(-1, sg->source, target->rmi->mnt_fd_id)) {
 				pr_err("Failed to copy sharing from source %s to %d\n", sg->source, target->mnt_id);
 				close(target_fd);
 				return -1;
@@ -997,7 +1070,7 @@ static int restore_one_sharing_group(struct sharing_group *sg)
 			continue;
 
 		if (is_sub_path(other->root, first->root)) {
-			if (move_mount_set_group(first->mnt_fd_id, NULL, other->mnt_fd_id)) {
+			if (move_mount_set_group(first->rmi->mnt_fd_id, NULL, other->rmi->mnt_fd_id)) {
 				pr_err("Failed to copy sharing from %d to %d\n", first->mnt_id, other->mnt_id);
 				return -1;
 			}
@@ -1213,55 +1286,45 @@ err:
 }
 
 /*
- * Assemble the mount tree for each restored mount namespace
- * from pre-created plain mounts.
+ * Assemble the mount tree of the restored mount namespace from
+ * pre-created plain mounts. Runs in a mntns worker, so there is no
+ * need to switch back.
  */
-static int assemble_mount_namespaces(void)
+static int assemble_mount_namespace(struct ns_id *nsid)
 {
-	int orig_nsfd = -1, nsfd = -1, rootfd = -1, exit_code = -1;
 	char path[PATH_MAX];
-	struct ns_id *nsid;
-
-	for (nsid = ns_ids; nsid != NULL; nsid = nsid->next) {
-		if (nsid->nd != &mnt_ns_desc)
-			continue;
+	int nsfd, rootfd;
 
-		nsfd = fdstore_get(nsid->mnt.nsfd_id);
-		if (nsfd < 0)
-			goto err;
+	nsfd = fdstore_get(nsid->mnt.nsfd_id);
+	if (nsfd < 0)
+		return -1;
 
-		if (switch_ns_by_fd(nsfd, &mnt_ns_desc, orig_nsfd == -1 ? &orig_nsfd : NULL)) {
-			close(nsfd);
-			goto err;
-		}
+	if (switch_ns_by_fd(nsfd, &mnt_ns_desc, NULL)) {
 		close(nsfd);
+		return -1;
+	}
+	close(nsfd);
 
-		if (assemble_tree_from_plain_mounts(nsid))
-			goto err;
+	if (assemble_tree_from_plain_mounts(nsid))
+		return -1;
 
-		/* Set its root */
-		print_ns_root(nsid, 0, path, sizeof(path) - 1);
-		if (cr_pivot_root(path))
-			goto err;
+	/* Set its root */
+	print_ns_root(nsid, 0, path, sizeof(path) - 1);
+	if (cr_pivot_root(path))
+		return -1;
 
-		/* root fd is used to restore file mappings */
-		rootfd = open_proc(PROC_SELF, "root");
-		if (rootfd < 0)
-			goto err;
-		nsid->mnt.root_fd_id = fdstore_add(rootfd);
-		if (nsid->mnt.root_fd_id < 0) {
-			pr_err("Can't add root fd to fdstore\n");
-			close(rootfd);
-			goto err;
-		}
-		close(rootfd);
+	/* root fd is used to restore file mappings */
+	rootfd = open_proc(PROC_SELF, "root");
+	if (rootfd < 0)
+		return -1;
+	nsid->mnt.root_fd_id = fdstore_add(rootfd);
+	close(rootfd);
+	if (nsid->mnt.root_fd_id < 0) {
+		pr_err("Can't add root fd to fdstore\n");
+		return -1;
 	}
 
-	exit_code = 0;
-err:
-	if (orig_nsfd >= 0 && restore_ns(orig_nsfd, &mnt_ns_desc))
-		exit_code = -1;
-	return exit_code;
+	return 0;
 }
 
 /* The main entry point of mount-v2 for creating mounts */
@@ -1292,7 +1355,7 @@ int prepare_mnt_ns_v2(void)
 	if (populate_mnt_ns_v2())
 		return -1;
 
-	if (assemble_mount_namespaces())
+	if (for_each_mntns_parallel(assemble_mount_namespace))
 		return -1;
 
 	if (restore_mount_sharing_options())
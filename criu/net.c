@@ -13,6 +13,7 @@
 #include <sys/types.h>
 #include <net/if.h>
 #include <linux/sockios.h>
+#include <arpa/inet.h>
 #include <libnl3/netlink/attr.h>
 #include <libnl3/netlink/msg.h>
 #include <libnl3/netlink/netlink.h>
@@ -46,6 +47,7 @@
 #include "external.h"
 #include "fdstore.h"
 #include "netfilter.h"
+#include "stats.h"
 
 #include "protobuf.h"
 #include "images/netdev.pb-c.h"
@@ -937,19 +939,245 @@ static int dump_one_link(struct nlmsghdr *hdr, struct ns_id *ns, void *arg)
 	return ret;
 }
 
-static int dump_one_nf(struct nlmsghdr *hdr, struct ns_id *ns, void *arg)
+#ifndef SOL_NETLINK
+#define SOL_NETLINK 270
+#endif
+
+#ifndef NETLINK_CAP_ACK
+#define NETLINK_CAP_ACK 10
+#endif
+
+/* Conntrack messages are received and sent in chunks of that size */
+#define NF_CT_BUF_SIZE	  (64 << 10)
+/* Enough for the errors of a whole batch not to be lost */
+#define NF_CT_SK_BUF_SIZE (4 << 20)
+
+static void nf_ct_setup_sk(int sk)
+{
+	int size = NF_CT_SK_BUF_SIZE, on = 1;
+
+	/* Bigger buffers only make it faster, the default ones work as well */
+	if (setsockopt(sk, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) &&
+	    setsockopt(sk, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)))
+		pr_debug("Can't grow the conntrack socket receive buffer\n");
+	if (setsockopt(sk, SOL_SOCKET, SO_SNDBUFFORCE, &size, sizeof(size)) &&
+	    setsockopt(sk, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size)))
+		pr_debug("Can't grow the conntrack socket send buffer\n");
+
+	/* Don't get the failed messages back with the errors */
+	if (setsockopt(sk, SOL_NETLINK, NETLINK_CAP_ACK, &on, sizeof(on)))
+		pr_debug("Can't cap netlink acks\n");
+}
+
+/*
+ * A local endpoint of a dumped inet socket. When the netns is shared
+ * with others (an external one) only the conntrack entries of these
+ * are dumped, the rest belong to somebody else.
+ */
+struct nf_ct_ep {
+	int family;
+	int proto;
+	u16 port;
+	u32 addr[4];
+};
+
+struct nf_ct_filter {
+	struct nf_ct_ep *ep;
+	unsigned int nr;
+};
+
+static int nf_ct_add_ep(struct socket_desc *sd, void *arg)
 {
-	struct cr_img *img = arg;
+	struct inet_sk_desc *sk = container_of(sd, struct inet_sk_desc, sd);
+	struct nf_ct_filter *f = arg;
+	struct nf_ct_ep *ep;
+	int proto;
+
+	if (sk->type == SOCK_STREAM)
+		proto = IPPROTO_TCP;
+	else if (sk->type == SOCK_DGRAM)
+		proto = IPPROTO_UDP;
+	else
+		return 0;
 
-	if (lazy_image(img) && open_image_lazy(img))
+	if (!sk->src_port)
+		return 0;
+
+	if (xrealloc_safe(&f->ep, (f->nr + 1) * sizeof(*f->ep)))
 		return -1;
 
-	if (write_img_buf(img, hdr, hdr->nlmsg_len))
+	ep = &f->ep[f->nr++];
+	ep->family = sd->family;
+	ep->proto = proto;
+	ep->port = sk->src_port;
+	memcpy(ep->addr, sk->src_addr, sizeof(ep->addr));
+
+	return 0;
+}
+
+static int nf_ct_filter_init(struct ns_id *ns, struct nf_ct_filter *f)
+{
+	if (for_each_ns_socket(ns, AF_INET, nf_ct_add_ep, f) || for_each_ns_socket(ns, AF_INET6, nf_ct_add_ep, f))
 		return -1;
 
+	pr_info("Only conntrack entries of %u sockets are dumped\n", f->nr);
 	return 0;
 }
 
+static bool nf_ct_ep_match(struct nf_ct_ep *ep, int family, int proto, u32 *addr, u16 port)
+{
+	static const u32 any[4];
+
+	if (ep->port != port)
+		return false;
+	if (ep->proto != proto && !(ep->proto == IPPROTO_UDP && proto == IPPROTO_UDPLITE))
+		return false;
+
+	/* Wildcard-bound sockets see all addresses, IPv6 ones IPv4 too */
+	if (!memcmp(ep->addr, any, sizeof(any)))
+		return ep->family == family || ep->family == AF_INET6;
+
+	if (ep->family != family)
+		return false;
+
+	return !memcmp(ep->addr, addr, family == AF_INET ? sizeof(u32) : sizeof(ep->addr));
+}
+
+static bool nf_ct_tuple_wanted(struct nf_ct_filter *f, int family, struct nlattr *attr)
+{
+	struct nlattr *tb[CTA_TUPLE_MAX + 1], *ip[CTA_IP_MAX + 1], *proto[CTA_PROTO_MAX + 1];
+	u32 src[4] = {}, dst[4] = {};
+	u16 sport, dport;
+	unsigned int i;
+	int num;
+
+	if (!attr || nla_parse_nested(tb, CTA_TUPLE_MAX, attr, NULL) < 0)
+		return false;
+	if (!tb[CTA_TUPLE_IP] || !tb[CTA_TUPLE_PROTO])
+		return false;
+	if (nla_parse_nested(ip, CTA_IP_MAX, tb[CTA_TUPLE_IP], NULL) < 0 ||
+	    nla_parse_nested(proto, CTA_PROTO_MAX, tb[CTA_TUPLE_PROTO], NULL) < 0)
+		return false;
+	if (!proto[CTA_PROTO_NUM] || !proto[CTA_PROTO_SRC_PORT] || !proto[CTA_PROTO_DST_PORT])
+		return false;
+
+	if (family == AF_INET && ip[CTA_IP_V4_SRC] && ip[CTA_IP_V4_DST]) {
+		src[0] = nla_get_u32(ip[CTA_IP_V4_SRC]);
+		dst[0] = nla_get_u32(ip[CTA_IP_V4_DST]);
+	} else if (family == AF_INET6 && ip[CTA_IP_V6_SRC] && ip[CTA_IP_V6_DST]) {
+		memcpy(src, nla_data(ip[CTA_IP_V6_SRC]), sizeof(src));
+		memcpy(dst, nla_data(ip[CTA_IP_V6_DST]), sizeof(dst));
+	} else
+		return false;
+
+	num = nla_get_u8(proto[CTA_PROTO_NUM]);
+	sport = ntohs(nla_get_u16(proto[CTA_PROTO_SRC_PORT]));
+	dport = ntohs(nla_get_u16(proto[CTA_PROTO_DST_PORT]));
+
+	for (i = 0; i < f->nr; i++)
+		if (nf_ct_ep_match(&f->ep[i], family, num, src, sport) ||
+		    nf_ct_ep_match(&f->ep[i], family, num, dst, dport))
+			return true;
+
+	return false;
+}
+
+static bool nf_ct_wanted(struct nf_ct_filter *f, struct nlmsghdr *nlh, int type)
+{
+	struct nfgenmsg *msg = NLMSG_DATA(nlh);
+	struct nlattr *tb[CTA_MAX + 1], *tbe[CTA_EXPECT_MAX + 1];
+
+	if (!f)
+		return true;
+
+	if (type == CR_FD_NETNF_CT) {
+		if (nlmsg_parse(nlh, sizeof(*msg), tb, CTA_MAX, NULL) < 0)
+			return false;
+
+		return nf_ct_tuple_wanted(f, msg->nfgen_family, tb[CTA_TUPLE_ORIG]) ||
+		       nf_ct_tuple_wanted(f, msg->nfgen_family, tb[CTA_TUPLE_REPLY]);
+	}
+
+	/* Expectations go with the connections that expect them */
+	if (nlmsg_parse(nlh, sizeof(*msg), tbe, CTA_EXPECT_MAX, NULL) < 0)
+		return false;
+
+	return nf_ct_tuple_wanted(f, msg->nfgen_family, tbe[CTA_EXPECT_MASTER]);
+}
+
+struct nf_ct_dump {
+	struct cr_img *img;
+	struct nf_ct_filter *filter;
+	int type;
+	unsigned long nr, skipped, bytes;
+};
+
+static int nf_ct_write(struct nf_ct_dump *d, char *start, char *end)
+{
+	if (start == end)
+		return 0;
+
+	if (lazy_image(d->img) && open_image_lazy(d->img))
+		return -1;
+
+	return write_img_buf(d->img, start, end - start);
+}
+
+/*
+ * Writes the wanted messages of a received chunk into the image, the
+ * ones following each other at once. Returns 1 if more is to come.
+ */
+static int nf_ct_dump_chunk(struct nf_ct_dump *d, char *buf, int len)
+{
+	char *start = NULL, *end = NULL;
+	struct nlmsghdr *hdr;
+	int ret = 1;
+
+	for (hdr = (struct nlmsghdr *)buf; NLMSG_OK(hdr, len); hdr = NLMSG_NEXT(hdr, len)) {
+		if (hdr->nlmsg_seq != CR_NLMSG_SEQ)
+			continue;
+
+		if (hdr->nlmsg_type == NLMSG_DONE) {
+			int *err = NLMSG_DATA(hdr);
+
+			if (*err < 0) {
+				errno = -*err;
+				pr_perror("Can't dump conntrack");
+				return -1;
+			}
+			ret = 0;
+			break;
+		}
+
+		if (hdr->nlmsg_type == NLMSG_ERROR) {
+			struct nlmsgerr *err = NLMSG_DATA(hdr);
+
+			errno = -err->error;
+			pr_perror("%d reported by netlink", err->error);
+			return -1;
+		}
+
+		d->bytes += hdr->nlmsg_len;
+		if (!nf_ct_wanted(d->filter, hdr, d->type)) {
+			d->skipped++;
+			continue;
+		}
+		d->nr++;
+
+		if ((char *)hdr != end) {
+			if (nf_ct_write(d, start, end))
+				return -1;
+			start = (char *)hdr;
+		}
+		end = (char *)hdr + hdr->nlmsg_len;
+	}
+
+	if (nf_ct_write(d, start, end))
+		return -1;
+
+	return ret;
+}
+
 static int ct_restore_callback(struct nlmsghdr *nlh)
 {
 	struct nfgenmsg *msg;
@@ -998,11 +1226,77 @@ static int ct_restore_callback(struct nlmsghdr *nlh)
 	return 0;
 }
 
+struct nf_ct_batch {
+	int sk;
+	char *buf;
+	int len;
+	int last;
+	unsigned int nr;
+};
+
+/*
+ * Sends all the messages of the batch at once. Only the last one asks
+ * for an ack, the kernel reports the failed ones anyway and handles
+ * them in order, so when the last one is acked the batch is done.
+ */
+static int nf_ct_batch_flush(struct nf_ct_batch *b, char *rbuf)
+{
+	struct nlmsghdr *last = (struct nlmsghdr *)(b->buf + b->last);
+
+	if (!b->nr)
+		return 0;
+
+	last->nlmsg_flags |= NLM_F_ACK;
+	if (send(b->sk, b->buf, b->len, 0) != b->len) {
+		pr_perror("Can't send %u conntrack messages", b->nr);
+		return -1;
+	}
+
+	while (1) {
+		struct nlmsghdr *hdr;
+		int len;
+
+		len = recv(b->sk, rbuf, NF_CT_BUF_SIZE, 0);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			pr_perror("Error receiving conntrack acks");
+			return -1;
+		}
+
+		for (hdr = (struct nlmsghdr *)rbuf; NLMSG_OK(hdr, len); hdr = NLMSG_NEXT(hdr, len)) {
+			struct nlmsgerr *err;
+
+			if (hdr->nlmsg_type != NLMSG_ERROR)
+				continue;
+
+			err = NLMSG_DATA(hdr);
+			if (err->error) {
+				errno = -err->error;
+				pr_perror("%d reported by netlink", err->error);
+				return -1;
+			}
+
+			if (hdr->nlmsg_seq == last->nlmsg_seq)
+				goto done;
+		}
+	}
+done:
+	cnt_add(CNT_NF_CT_RESTORED, b->nr);
+	cnt_add(CNT_NF_CT_BATCHES, 1);
+
+	b->len = 0;
+	b->nr = 0;
+	return 0;
+}
+
 static int restore_nf_ct(int pid, int type)
 {
-	struct nlmsghdr *nlh = NULL;
-	int exit_code = -1, sk;
+	struct nf_ct_batch b = {};
+	u32 seq = CR_NLMSG_SEQ;
+	int exit_code = -1;
 	struct cr_img *img;
+	char *rbuf = NULL;
 
 	img = open_image(type, O_RSTR, pid);
 	if (img == NULL)
@@ -1012,32 +1306,41 @@ static int restore_nf_ct(int pid, int type)
 		return 0;
 	}
 
-	sk = socket(AF_NETLINK, SOCK_RAW, NETLINK_NETFILTER);
-	if (sk < 0) {
+	b.sk = socket(AF_NETLINK, SOCK_RAW, NETLINK_NETFILTER);
+	if (b.sk < 0) {
 		pr_perror("Can't open rtnl sock for net dump");
 		goto out_img;
 	}
+	nf_ct_setup_sk(b.sk);
 
-	nlh = xmalloc(sizeof(struct nlmsghdr));
-	if (nlh == NULL)
+	b.buf = xmalloc(NF_CT_BUF_SIZE);
+	rbuf = xmalloc(NF_CT_BUF_SIZE);
+	if (!b.buf || !rbuf)
 		goto out;
 
+	timing_start(TIME_NF_CT_RESTORE);
 	while (1) {
-		struct nlmsghdr *p;
+		struct nlmsghdr hdr, *nlh;
 		int ret;
 
-		ret = read_img_buf_eof(img, nlh, sizeof(struct nlmsghdr));
+		ret = read_img_eof(img, &hdr);
 		if (ret < 0)
 			goto out;
 		if (ret == 0)
 			break;
 
-		p = xrealloc(nlh, nlh->nlmsg_len);
-		if (p == NULL)
+		if (hdr.nlmsg_len < sizeof(hdr) || hdr.nlmsg_len > NF_CT_BUF_SIZE) {
+			pr_err("Bad conntrack message length %u\n", hdr.nlmsg_len);
 			goto out;
-		nlh = p;
+		}
 
-		ret = read_img_buf_eof(img, nlh + 1, nlh->nlmsg_len - sizeof(struct nlmsghdr));
+		if (b.len + NLMSG_ALIGN(hdr.nlmsg_len) > NF_CT_BUF_SIZE && nf_ct_batch_flush(&b, rbuf))
+			goto out;
+
+		nlh = (struct nlmsghdr *)(b.buf + b.len);
+		*nlh = hdr;
+
+		ret = read_img_buf_eof(img, nlh + 1, hdr.nlmsg_len - sizeof(hdr));
 		if (ret < 0)
 			goto out;
 		if (ret == 0) {
@@ -1049,37 +1352,58 @@ static int restore_nf_ct(int pid, int type)
 			if (ct_restore_callback(nlh))
 				goto out;
 
-		nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | NLM_F_CREATE;
-		ret = do_rtnl_req(sk, nlh, nlh->nlmsg_len, NULL, NULL, NULL, NULL);
-		if (ret)
-			goto out;
+		nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_CREATE;
+		nlh->nlmsg_seq = seq++;
+		memset(b.buf + b.len + hdr.nlmsg_len, 0, NLMSG_ALIGN(hdr.nlmsg_len) - hdr.nlmsg_len);
+
+		b.last = b.len;
+		b.len += NLMSG_ALIGN(hdr.nlmsg_len);
+		b.nr++;
 	}
 
+	if (nf_ct_batch_flush(&b, rbuf))
+		goto out;
+	timing_stop(TIME_NF_CT_RESTORE);
+
 	exit_code = 0;
 out:
-	xfree(nlh);
-	close(sk);
+	xfree(rbuf);
+	xfree(b.buf);
+	close(b.sk);
 out_img:
 	close_image(img);
 	return exit_code;
 }
 
-static int dump_nf_ct(struct cr_imgset *fds, int type)
+static int dump_nf_ct(struct ns_id *ns, struct cr_imgset *fds, int type)
 {
-	struct cr_img *img;
+	struct nf_ct_dump d = { .type = type };
+	struct nf_ct_filter filter = {};
 	struct {
 		struct nlmsghdr nlh;
 		struct nfgenmsg g;
 	} req;
-	int sk, ret;
+	char *buf = NULL;
+	int sk, len, ret = -1;
 
-	pr_info("Dumping netns links\n");
+	pr_info("Dumping netns conntrack %s\n", type == CR_FD_NETNF_CT ? "entries" : "expectations");
 
-	ret = sk = socket(AF_NETLINK, SOCK_RAW, NETLINK_NETFILTER);
+	sk = socket(AF_NETLINK, SOCK_RAW, NETLINK_NETFILTER);
 	if (sk < 0) {
 		pr_perror("Can't open rtnl sock for net dump");
-		goto out;
+		return -1;
 	}
+	nf_ct_setup_sk(sk);
+
+	if (ns->ext_key) {
+		if (nf_ct_filter_init(ns, &filter))
+			goto out;
+		d.filter = &filter;
+	}
+
+	buf = xmalloc(NF_CT_BUF_SIZE);
+	if (!buf)
+		goto out;
 
 	memset(&req, 0, sizeof(req));
 	req.nlh.nlmsg_len = sizeof(req);
@@ -1097,11 +1421,47 @@ static int dump_nf_ct(struct cr_imgset *fds, int type)
 	req.nlh.nlmsg_seq = CR_NLMSG_SEQ;
 	req.g.nfgen_family = AF_UNSPEC;
 
-	img = img_from_set(fds, type);
+	d.img = img_from_set(fds, type);
 
-	ret = do_rtnl_req(sk, &req, sizeof(req), dump_one_nf, NULL, NULL, img);
-	close(sk);
+	timing_start(TIME_NF_CT_DUMP);
+	if (send(sk, &req, sizeof(req), 0) != sizeof(req)) {
+		pr_perror("Can't request conntrack dump");
+		goto out;
+	}
+
+	/*
+	 * The kernel fills each dump message batch up to the size of
+	 * the buffer the previous recv was given (but not over 32K),
+	 * so a big buffer means fewer trips for the same entries.
+	 */
+	while (1) {
+		len = recv(sk, buf, NF_CT_BUF_SIZE, MSG_TRUNC);
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len <= 0) {
+			pr_perror("Error receiving conntrack dump");
+			goto out;
+		}
+		if (len > NF_CT_BUF_SIZE) {
+			pr_err("Conntrack message truncated\n");
+			goto out;
+		}
+
+		ret = nf_ct_dump_chunk(&d, buf, len);
+		if (ret < 0)
+			goto out;
+		if (ret == 0)
+			break;
+	}
+
+	timing_stop(TIME_NF_CT_DUMP);
+	cnt_add(CNT_NF_CT_DUMPED, d.nr);
+	cnt_add(CNT_NF_CT_DUMP_BYTES, d.bytes);
+	pr_info("Dumped %lu conntrack messages of %lu bytes, skipped %lu\n", d.nr, d.bytes, d.skipped);
 out:
+	xfree(filter.ep);
+	xfree(buf);
+	close(sk);
 	return ret;
 }
 
@@ -2737,9 +3097,9 @@ int dump_net_ns(struct ns_id *ns)
 		ret = -1;
 	}
 	if (!ret)
-		ret = dump_nf_ct(fds, CR_FD_NETNF_CT);
+		ret = dump_nf_ct(ns, fds, CR_FD_NETNF_CT);
 	if (!ret)
-		ret = dump_nf_ct(fds, CR_FD_NETNF_EXP);
+		ret = dump_nf_ct(ns, fds, CR_FD_NETNF_EXP);
 
 out:
 	close(ns_sysfs_fd);
@@ -3406,7 +3766,7 @@ static int collect_net_ns(struct ns_id *ns, void *oarg)
 	if (!for_dump)
 		return 0;
 
-	return collect_sockets(ns);
+	return collect_sockets(ns, true);
 }
 
 int collect_net_namespaces(bool for_dump)
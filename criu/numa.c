@@ -0,0 +1,694 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+
+#include "bitops.h"
+#include "cr_options.h"
+#include "image.h"
+#include "kerndat.h"
+#include "log.h"
+#include "numa.h"
+#include "page.h"
+#include "pstree.h"
+#include "restorer.h"
+#include "rst-malloc.h"
+#include "rst_info.h"
+#include "util.h"
+#include "vma.h"
+#include "xmalloc.h"
+#include "protobuf.h"
+#include "images/numa.pb-c.h"
+
+#undef LOG_PREFIX
+#define LOG_PREFIX "numa: "
+
+#define NODE_ONLINE_PATH "/sys/devices/system/node/online"
+#define NUMA_BATCH	 512 /* pages per move_pages() call */
+/*
+ * Each range the restorer places is an mbind() that can split a VMA in
+ * three, so their number is kept well below vm.max_map_count.
+ */
+#define NUMA_RST_RANGES_MAX 1024
+
+static unsigned long online_nodes[NUMA_NODE_LONGS];
+static int nr_online_nodes = -1;
+
+static char *parse_nodelist(char *str, unsigned long *nodes)
+{
+	while (1) {
+		unsigned long first, last;
+		char *end;
+
+		first = last = strtoul(str, &end, 10);
+		if (end == str)
+			return NULL;
+
+		if (*end == '-') {
+			str = end + 1;
+			last = strtoul(str, &end, 10);
+			if (end == str)
+				return NULL;
+		}
+
+		if (first > last || last >= NUMA_MAX_NODES)
+			return NULL;
+
+		for (; first <= last; first++)
+			set_bit(first, nodes);
+
+		str = end;
+		if (*str != ',')
+			return str;
+		str++;
+	}
+}
+
+/* Zero if the kernel knows nothing about nodes */
+static int get_online_nodes(void)
+{
+	char buf[1024];
+	int fd, i;
+	ssize_t ret;
+
+	if (nr_online_nodes >= 0)
+		return nr_online_nodes;
+
+	nr_online_nodes = 0;
+	fd = open(NODE_ONLINE_PATH, O_RDONLY);
+	if (fd < 0) {
+		pr_warn("Can't open " NODE_ONLINE_PATH " (%s), NUMA is off\n", strerror(errno));
+		return 0;
+	}
+
+	ret = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (ret <= 0) {
+		pr_warn("Can't read " NODE_ONLINE_PATH "\n");
+		return 0;
+	}
+	buf[ret] = '\0';
+
+	if (!parse_nodelist(buf, online_nodes)) {
+		pr_warn("Can't parse online nodes %s\n", buf);
+		memset(online_nodes, 0, sizeof(online_nodes));
+		return 0;
+	}
+
+	for (i = 0; i < NUMA_MAX_NODES; i++)
+		if (test_bit(i, online_nodes))
+			nr_online_nodes++;
+
+	pr_info("%d nodes online\n", nr_online_nodes);
+	return nr_online_nodes;
+}
+
+/*
+ * The names mpol_to_str() puts into numa_maps. Longer names go
+ * first, as some of them start with the shorter ones.
+ */
+static const struct {
+	const char *name;
+	int mode;
+} policy_names[] = {
+	{ "weighted interleave", MPOL_WEIGHTED_INTERLEAVE },
+	{ "prefer (many)", MPOL_PREFERRED_MANY },
+	{ "interleave", MPOL_INTERLEAVE },
+	{ "prefer", MPOL_PREFERRED },
+	{ "default", MPOL_DEFAULT },
+	{ "local", MPOL_LOCAL },
+	{ "bind", MPOL_BIND },
+};
+
+static char *parse_policy(char *str, struct numa_policy *pol)
+{
+	size_t i, len = 0;
+
+	memset(pol, 0, sizeof(*pol));
+
+	for (i = 0; i < ARRAY_SIZE(policy_names); i++) {
+		len = strlen(policy_names[i].name);
+		if (!strncmp(str, policy_names[i].name, len))
+			break;
+	}
+	if (i == ARRAY_SIZE(policy_names))
+		return NULL;
+
+	pol->mode = policy_names[i].mode;
+	str += len;
+
+	if (*str == '=') {
+		str++;
+		if (!strncmp(str, "static", 6)) {
+			pol->mode |= MPOL_F_STATIC_NODES;
+			str += 6;
+		} else if (!strncmp(str, "relative", 8)) {
+			pol->mode |= MPOL_F_RELATIVE_NODES;
+			str += 8;
+		}
+		if (*str == '|')
+			str++;
+		if (!strncmp(str, "balancing", 9)) {
+			pol->mode |= MPOL_F_NUMA_BALANCING;
+			str += 9;
+		}
+	}
+
+	if (*str == ':')
+		str = parse_nodelist(str + 1, pol->nodes);
+
+	return str;
+}
+
+static bool policy_equal(const struct numa_policy *a, const struct numa_policy *b)
+{
+	return a->mode == b->mode && !memcmp(a->nodes, b->nodes, sizeof(a->nodes));
+}
+
+static NumaPolicyEntry *policy_to_entry(const struct numa_policy *pol)
+{
+	NumaPolicyEntry *pe;
+	int i;
+
+	pe = xmalloc(sizeof(*pe));
+	if (!pe)
+		return NULL;
+	numa_policy_entry__init(pe);
+
+	pe->mode = pol->mode;
+	for (i = 0; i < NUMA_MAX_NODES; i++) {
+		if (!test_bit(i, pol->nodes))
+			continue;
+
+		if (xrealloc_safe(&pe->nodes, (pe->n_nodes + 1) * sizeof(*pe->nodes))) {
+			xfree(pe);
+			return NULL;
+		}
+		pe->nodes[pe->n_nodes++] = i;
+	}
+
+	return pe;
+}
+
+static void free_policy_entry(NumaPolicyEntry *pe)
+{
+	if (pe)
+		xfree(pe->nodes);
+	xfree(pe);
+}
+
+/*
+ * Nodes that are not here are dropped from the policy. When that
+ * leaves a policy that needs nodes with none, it falls back to the
+ * default one.
+ */
+static void entry_to_policy(const NumaPolicyEntry *pe, struct numa_policy *pol)
+{
+	int i, mode = pe->mode & ~MPOL_MODE_FLAGS;
+	bool relative = pe->mode & MPOL_F_RELATIVE_NODES;
+	bool empty = true;
+
+	memset(pol, 0, sizeof(*pol));
+	pol->mode = pe->mode;
+
+	for (i = 0; i < pe->n_nodes; i++) {
+		if (pe->nodes[i] >= NUMA_MAX_NODES || (!relative && !test_bit(pe->nodes[i], online_nodes))) {
+			pr_warn("Node %u is not online, dropped from the policy\n", pe->nodes[i]);
+			continue;
+		}
+		set_bit(pe->nodes[i], pol->nodes);
+		empty = false;
+	}
+
+	if (empty && pe->n_nodes && mode != MPOL_PREFERRED) {
+		pr_warn("No nodes left for policy %#x, using the default one\n", pe->mode);
+		pol->mode = MPOL_DEFAULT;
+	}
+}
+
+int dump_thread_mempolicy(ThreadCoreEntry *tc, const struct numa_policy *pol)
+{
+	if (!opts.numa || pol->mode == NUMA_NO_POLICY)
+		return 0;
+
+	tc->mempolicy = policy_to_entry(pol);
+	return tc->mempolicy ? 0 : -1;
+}
+
+static int add_vma_policy(NumaEntry *ne, struct vma_area *vma, const struct numa_policy *pol)
+{
+	NumaVmaEntry *ve;
+
+	if (xrealloc_safe(&ne->vmas, (ne->n_vmas + 1) * sizeof(*ne->vmas)))
+		return -1;
+
+	ve = xmalloc(sizeof(*ve));
+	if (!ve)
+		return -1;
+	numa_vma_entry__init(ve);
+
+	ve->start = vma->e->start;
+	ve->end = vma->e->end;
+	ve->policy = policy_to_entry(pol);
+	if (!ve->policy) {
+		xfree(ve);
+		return -1;
+	}
+
+	ne->vmas[ne->n_vmas++] = ve;
+	return 0;
+}
+
+/*
+ * Pages of a VMA on the same node form one range. Pages that are not
+ * there do not break it, they are not read on restore anyway.
+ */
+static int add_range(NumaEntry *ne, struct vma_area *vma, unsigned long addr, int node)
+{
+	NumaRangeEntry *re = ne->n_ranges ? ne->ranges[ne->n_ranges - 1] : NULL;
+
+	if (re && re->start >= vma->e->start && re->node == node) {
+		re->nr_pages = (addr - re->start) / PAGE_SIZE + 1;
+		return 0;
+	}
+
+	if (!(ne->n_ranges % 64) && xrealloc_safe(&ne->ranges, (ne->n_ranges + 64) * sizeof(*ne->ranges)))
+		return -1;
+
+	re = xmalloc(sizeof(*re));
+	if (!re)
+		return -1;
+	numa_range_entry__init(re);
+
+	re->start = addr;
+	re->nr_pages = 1;
+	re->node = node;
+	ne->ranges[ne->n_ranges++] = re;
+	return 0;
+}
+
+static int query_vma_nodes(pid_t pid, struct vma_area *vma, NumaEntry *ne)
+{
+	unsigned long addr = vma->e->start;
+	void *pages[NUMA_BATCH];
+	int status[NUMA_BATCH];
+
+	while (addr < vma->e->end) {
+		unsigned long i, n = min_t(unsigned long, (vma->e->end - addr) / PAGE_SIZE, NUMA_BATCH);
+
+		for (i = 0; i < n; i++)
+			pages[i] = (void *)(addr + i * PAGE_SIZE);
+
+		if (syscall(__NR_move_pages, pid, n, pages, NULL, status, 0)) {
+			pr_perror("Can't get nodes of %d's pages at %#lx", pid, addr);
+			return -1;
+		}
+
+		for (i = 0; i < n; i++) {
+			if (status[i] < 0)
+				continue;
+			if (add_range(ne, vma, (unsigned long)pages[i], status[i]))
+				return -1;
+		}
+
+		addr += n * PAGE_SIZE;
+	}
+
+	return 0;
+}
+
+/* Only private pages are read on restore, so only they need placing */
+static bool vma_wants_placement(struct vma_area *vma, const struct numa_policy *pol)
+{
+	int mode = pol->mode & ~MPOL_MODE_FLAGS;
+
+	if (!vma_area_is_private(vma, kdat.task_size) || (vma->e->flags & MAP_HUGETLB))
+		return false;
+
+	/* The policy itself spreads the pages the way they were */
+	return mode != MPOL_INTERLEAVE && mode != MPOL_WEIGHTED_INTERLEAVE;
+}
+
+static int dump_vma_numa(pid_t pid, struct vma_area *vma, char *str, const struct numa_policy *task_pol,
+			 NumaEntry *ne)
+{
+	struct numa_policy pol;
+	int node = -1, nr_nodes = 0;
+
+	str = parse_policy(str, &pol);
+	if (!str) {
+		pr_err("Can't parse policy of %d's VMA %#" PRIx64 "\n", pid, vma->e->start);
+		return -1;
+	}
+
+	/*
+	 * VMAs without a policy of their own show the task one, which
+	 * is dumped with the thread. Setting it on the VMA as well would
+	 * change nothing for the pages in it.
+	 */
+	if (pol.mode != MPOL_DEFAULT && !policy_equal(&pol, task_pol) && add_vma_policy(ne, vma, &pol))
+		return -1;
+
+	if (nr_online_nodes < 2 || !vma_wants_placement(vma, &pol))
+		return 0;
+
+	while ((str = strstr(str, " N"))) {
+		char *end;
+		int n;
+
+		n = strtol(str + 2, &end, 10);
+		str += 2;
+		if (end == str || *end != '=')
+			continue;
+		if (n != node)
+			nr_nodes++;
+		node = n;
+	}
+
+	if (nr_nodes == 0)
+		return 0;
+
+	/* All the pages are on one node, no need to ask for each */
+	if (nr_nodes == 1) {
+		if (add_range(ne, vma, vma->e->start, node))
+			return -1;
+		ne->ranges[ne->n_ranges - 1]->nr_pages = vma_entry_len(vma->e) / PAGE_SIZE;
+		return 0;
+	}
+
+	return query_vma_nodes(pid, vma, ne);
+}
+
+/*
+ * Dump the policies set on VMAs with mbind() and, when there is more
+ * than one node, the nodes the private pages sit on. Both come from
+ * numa_maps, which shows the policy of each VMA and how many pages of
+ * it are on each node. VMAs with pages on several nodes are looked at
+ * page by page with move_pages().
+ */
+int dump_task_numa(pid_t pid, struct vm_area_list *vmas, ThreadCoreEntry *leader)
+{
+	NumaEntry ne = NUMA_ENTRY__INIT;
+	struct numa_policy task_pol = { .mode = NUMA_NO_POLICY };
+	struct vma_area *vma;
+	struct cr_img *img;
+	char *line = NULL;
+	size_t len = 0;
+	int ret = -1, i;
+	FILE *f;
+
+	if (!opts.numa)
+		return 0;
+
+	if (!get_online_nodes())
+		return 0;
+
+	if (leader->mempolicy)
+		entry_to_policy(leader->mempolicy, &task_pol);
+
+	f = fopen_proc(pid, "numa_maps");
+	if (!f)
+		return -1;
+
+	vma = list_first_entry(&vmas->h, struct vma_area, list);
+	while (getline(&line, &len, f) > 0) {
+		unsigned long start;
+		char *end;
+
+		start = strtoul(line, &end, 16);
+		if (*end != ' ') {
+			pr_err("Can't parse numa_maps line %s", line);
+			goto out;
+		}
+
+		while (&vma->list != &vmas->h && vma->e->start < start)
+			vma = vma_next(vma);
+		if (&vma->list == &vmas->h)
+			break;
+
+		/* Not dumped or not mapped back by us, like vDSO */
+		if (vma->e->start != start || !vma_area_is(vma, VMA_AREA_REGULAR) ||
+		    vma_area_is(vma, VMA_AREA_VDSO) || vma_area_is(vma, VMA_AREA_VVAR))
+			continue;
+
+		if (dump_vma_numa(pid, vma, end + 1, &task_pol, &ne))
+			goto out;
+	}
+
+	pr_info("%d: %zu VMA policies, %zu node ranges\n", pid, ne.n_vmas, ne.n_ranges);
+
+	img = open_image(CR_FD_NUMA, O_DUMP, pid);
+	if (!img)
+		goto out;
+	ret = pb_write_one(img, &ne, PB_NUMA);
+	close_image(img);
+out:
+	for (i = 0; i < ne.n_vmas; i++) {
+		free_policy_entry(ne.vmas[i]->policy);
+		xfree(ne.vmas[i]);
+	}
+	xfree(ne.vmas);
+	for (i = 0; i < ne.n_ranges; i++)
+		xfree(ne.ranges[i]);
+	xfree(ne.ranges);
+	free(line);
+	fclose(f);
+	return ret;
+}
+
+void prepare_thread_mempolicy(struct numa_policy *pol, ThreadCoreEntry *tc)
+{
+	pol->mode = NUMA_NO_POLICY;
+	if (!tc->mempolicy || !get_online_nodes())
+		return;
+
+	entry_to_policy(tc->mempolicy, pol);
+}
+
+int prepare_numa(struct pstree_item *t)
+{
+	struct cr_img *img;
+	int ret;
+
+	img = open_image(CR_FD_NUMA, O_RSTR, vpid(t));
+	if (!img)
+		return -1;
+
+	ret = pb_read_one_eof(img, &rsti(t)->numa, PB_NUMA);
+	close_image(img);
+	if (ret < 0)
+		return -1;
+
+	if (ret > 0 && !get_online_nodes()) {
+		pr_warn("NUMA is off, memory policies of %d are not restored\n", vpid(t));
+		numa_entry__free_unpacked(rsti(t)->numa, NULL);
+		rsti(t)->numa = NULL;
+	}
+
+	return 0;
+}
+
+static struct vma_area *find_vma(struct vm_area_list *vmas, struct vma_area *vma, u64 addr)
+{
+	while (&vma->list != &vmas->h && vma->e->end <= addr)
+		vma = vma_next(vma);
+
+	if (&vma->list == &vmas->h || vma->e->start > addr)
+		return NULL;
+
+	return vma;
+}
+
+static inline void *premapped_addr(struct vma_area *vma, u64 addr)
+{
+	return decode_pointer(vma->premmaped_addr + addr - vma->e->start);
+}
+
+static void move_range(struct vma_area *vma, NumaRangeEntry *re)
+{
+	void *pages[NUMA_BATCH];
+	int nodes[NUMA_BATCH], status[NUMA_BATCH];
+	unsigned long done = 0;
+
+	while (done < re->nr_pages) {
+		unsigned long i, n = min_t(unsigned long, re->nr_pages - done, NUMA_BATCH);
+
+		for (i = 0; i < n; i++) {
+			pages[i] = premapped_addr(vma, re->start + (done + i) * PAGE_SIZE);
+			nodes[i] = re->node;
+		}
+
+		/* Absent and shared pages are reported in status, both are fine */
+		if (syscall(__NR_move_pages, 0, n, pages, nodes, status, MPOL_MF_MOVE) < 0)
+			pr_warn("Can't move pages at %#" PRIx64 " to node %u: %s\n", re->start + done * PAGE_SIZE,
+				re->node, strerror(errno));
+
+		done += n;
+	}
+}
+
+/*
+ * Premapped VMAs are filled here rather than in the restorer. Their
+ * policies are set before the pages are read. The pages that were on
+ * a node the policy would not pick are moved there once they are in.
+ */
+int numa_place_premapped(struct pstree_item *t, bool done)
+{
+	struct vm_area_list *vmas = &rsti(t)->vmas;
+	NumaEntry *ne = rsti(t)->numa;
+	struct vma_area *vma;
+	int i;
+
+	if (!ne)
+		return 0;
+
+	vma = list_first_entry(&vmas->h, struct vma_area, list);
+	if (done) {
+		for (i = 0; i < ne->n_ranges; i++) {
+			NumaRangeEntry *re = ne->ranges[i];
+
+			vma = find_vma(vmas, vma, re->start);
+			if (!vma)
+				break;
+			if (!vma_area_is(vma, VMA_PREMMAPED) || !test_bit(re->node, online_nodes))
+				continue;
+
+			move_range(vma, re);
+		}
+
+		return 0;
+	}
+
+	for (i = 0; i < ne->n_vmas; i++) {
+		NumaVmaEntry *ve = ne->vmas[i];
+		struct numa_policy pol;
+
+		vma = find_vma(vmas, vma, ve->start);
+		if (!vma)
+			break;
+		if (!vma_area_is(vma, VMA_PREMMAPED))
+			continue;
+
+		entry_to_policy(ve->policy, &pol);
+		if (syscall(__NR_mbind, premapped_addr(vma, ve->start), ve->end - ve->start, pol.mode, pol.nodes,
+			    NUMA_MAX_NODES + 1, 0)) {
+			pr_perror("Can't set policy %#x on %#" PRIx64 "-%#" PRIx64, pol.mode, ve->start, ve->end);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * The rest goes to the restorer. It sets the policies of VMAs without
+ * node ranges before reading the pages in, has every range read onto
+ * its node, then sets the policies of VMAs with ranges. Adjacent ranges
+ * on the same node are merged, past NUMA_RST_RANGES_MAX the pages are
+ * left where they land.
+ */
+int prepare_numa_args(struct pstree_item *t, struct task_restore_args *ta)
+{
+	struct vm_area_list *vmas = &rsti(t)->vmas;
+	NumaEntry *ne = rsti(t)->numa;
+	struct rst_numa_range *rr;
+	struct rst_numa_vma *rv;
+	struct vma_area *vma;
+	unsigned long *copied;
+	int i, j, k, nr_ranges;
+
+	ta->numa_vmas = NULL;
+	ta->numa_vmas_n = 0;
+	ta->numa_ranges = NULL;
+	ta->numa_ranges_n = 0;
+	if (!ne)
+		return 0;
+
+	/* Which of the image ranges got to the restorer, alone or merged */
+	copied = xzalloc(BITS_TO_LONGS(ne->n_ranges) * sizeof(long));
+	if (!copied)
+		return -1;
+
+	ta->numa_ranges = (struct rst_numa_range *)rst_mem_align_cpos(RM_PRIVATE);
+	rr = NULL;
+	vma = list_first_entry(&vmas->h, struct vma_area, list);
+	for (i = 0; i < ne->n_ranges; i++) {
+		NumaRangeEntry *re = ne->ranges[i];
+		u64 end;
+
+		vma = find_vma(vmas, vma, re->start);
+		if (!vma)
+			break;
+		if (vma_area_is(vma, VMA_PREMMAPED) || !test_bit(re->node, online_nodes))
+			continue;
+
+		end = min_t(u64, re->start + re->nr_pages * PAGE_SIZE, vma->e->end);
+
+		/* Neighbouring VMAs can have their pages on the same node */
+		if (rr && rr->node == re->node && rr->end == re->start) {
+			rr->end = end;
+			set_bit(i, copied);
+			continue;
+		}
+
+		if (ta->numa_ranges_n == NUMA_RST_RANGES_MAX) {
+			pr_warn("%d has too many node ranges, only the first %d are placed\n", vpid(t),
+				NUMA_RST_RANGES_MAX);
+			break;
+		}
+
+		rr = rst_mem_alloc(sizeof(*rr), RM_PRIVATE);
+		if (!rr)
+			goto err;
+
+		rr->start = re->start;
+		rr->end = end;
+		rr->node = re->node;
+		ta->numa_ranges_n++;
+		set_bit(i, copied);
+	}
+	nr_ranges = i;
+
+	ta->numa_vmas = (struct rst_numa_vma *)rst_mem_align_cpos(RM_PRIVATE);
+	vma = list_first_entry(&vmas->h, struct vma_area, list);
+	for (i = 0, j = 0; i < ne->n_vmas; i++) {
+		NumaVmaEntry *ve = ne->vmas[i];
+
+		vma = find_vma(vmas, vma, ve->start);
+		if (!vma)
+			break;
+		if (vma_area_is(vma, VMA_PREMMAPED))
+			continue;
+
+		rv = rst_mem_alloc(sizeof(*rv), RM_PRIVATE);
+		if (!rv)
+			goto err;
+
+		rv->start = ve->start;
+		rv->end = ve->end;
+		entry_to_policy(ve->policy, &rv->pol);
+
+		/* Skipped or capped ranges leave the pages where they are */
+		while (j < nr_ranges && ne->ranges[j]->start < ve->start)
+			j++;
+		rv->placed = false;
+		for (k = j; k < nr_ranges && ne->ranges[k]->start < ve->end; k++) {
+			if (test_bit(k, copied)) {
+				rv->placed = true;
+				break;
+			}
+		}
+		ta->numa_vmas_n++;
+	}
+
+	xfree(copied);
+	numa_entry__free_unpacked(ne, NULL);
+	rsti(t)->numa = NULL;
+	return 0;
+err:
+	xfree(copied);
+	return -1;
+}
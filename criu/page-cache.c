@@ -0,0 +1,478 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#include "cr_options.h"
+#include "files.h"
+#include "files-reg.h"
+#include "imgset.h"
+#include "image.h"
+#include "page.h"
+#include "page-cache.h"
+#include "pstree.h"
+#include "mount.h"
+#include "namespaces.h"
+#include "stats.h"
+#include "util.h"
+#include "xmalloc.h"
+#include "log.h"
+
+#include "protobuf.h"
+#include "images/page-cache.pb-c.h"
+
+#undef LOG_PREFIX
+#define LOG_PREFIX "page-cache: "
+
+#ifndef __NR_cachestat
+#define __NR_cachestat 451
+#endif
+
+struct pc_cachestat_range {
+	u64 off;
+	u64 len;
+};
+
+struct pc_cachestat {
+	u64 nr_cache;
+	u64 nr_dirty;
+	u64 nr_writeback;
+	u64 nr_evicted;
+	u64 nr_recently_evicted;
+};
+
+/* The file is mapped and mincore()-ed by this many pages at a time */
+#define RESIDENCY_WINDOW (1UL << 16)
+
+/* Largest readahead request, so that the rate limit is kept smoothly */
+#define PREFETCH_CHUNK 512UL
+
+static inline bool pc_test_bit(const u8 *bitmap, unsigned long nr)
+{
+	return bitmap[nr / 8] & (1 << (nr % 8));
+}
+
+/*
+ * Files with nothing cached are common (logs opened for appending,
+ * big files read long ago), so cachestat() lets us skip them without
+ * mapping. Returns -1 if the kernel doesn't have it.
+ */
+static int file_nr_cached(int fd, u64 size, u64 *nr)
+{
+	struct pc_cachestat_range range = { .off = 0, .len = size };
+	struct pc_cachestat cs;
+
+	if (syscall(__NR_cachestat, fd, &range, &cs, 0))
+		return -1;
+
+	*nr = cs.nr_cache;
+	return 0;
+}
+
+static int collect_residency(int fd, u64 size, u8 **bitmap, unsigned long *nr_bits, u64 *nr_cached)
+{
+	unsigned long nr_pages = DIV_ROUND_UP(size, PAGE_SIZE), off, i;
+	unsigned char *vec;
+	u8 *bm;
+
+	vec = xmalloc(min(nr_pages, RESIDENCY_WINDOW));
+	bm = xzalloc(DIV_ROUND_UP(nr_pages, 8));
+	if (!vec || !bm)
+		goto err;
+
+	*nr_bits = 0;
+	*nr_cached = 0;
+
+	for (off = 0; off < nr_pages; off += RESIDENCY_WINDOW) {
+		unsigned long n = min(nr_pages - off, RESIDENCY_WINDOW);
+		void *addr;
+		int ret;
+
+		addr = mmap(NULL, n * PAGE_SIZE, PROT_READ, MAP_SHARED, fd, off * PAGE_SIZE);
+		if (addr == MAP_FAILED) {
+			pr_warn("Can't map fd %d at page %lu: %s\n", fd, off, strerror(errno));
+			goto err;
+		}
+
+		ret = mincore(addr, n * PAGE_SIZE, vec);
+		munmap(addr, n * PAGE_SIZE);
+		if (ret) {
+			pr_warn("Can't get residency of fd %d: %s\n", fd, strerror(errno));
+			goto err;
+		}
+
+		for (i = 0; i < n; i++) {
+			if (!(vec[i] & 1))
+				continue;
+			bm[(off + i) / 8] |= 1 << ((off + i) % 8);
+			*nr_bits = off + i + 1;
+			(*nr_cached)++;
+		}
+	}
+
+	xfree(vec);
+	*bitmap = bm;
+	return 0;
+
+err:
+	xfree(vec);
+	xfree(bm);
+	return -1;
+}
+
+/*
+ * Residency is a hint for restore, so failing to get it is
+ * not fatal and the file is just not recorded.
+ */
+int dump_page_cache(int lfd, u32 id, const struct fd_parms *p)
+{
+	PageCacheEntry pce = PAGE_CACHE_ENTRY__INIT;
+	unsigned long nr_bits;
+	u64 nr_cached;
+	u8 *bitmap;
+	int ret;
+
+	if (!S_ISREG(p->stat.st_mode) || !p->stat.st_size)
+		return 0;
+
+	if (!file_nr_cached(lfd, p->stat.st_size, &nr_cached) && !nr_cached)
+		return 0;
+
+	if (collect_residency(lfd, p->stat.st_size, &bitmap, &nr_bits, &nr_cached))
+		return 0;
+
+	if (!nr_cached) {
+		xfree(bitmap);
+		return 0;
+	}
+
+	pce.id = id;
+	pce.size = p->stat.st_size;
+	pce.nr_cached = nr_cached;
+	pce.bitmap.data = bitmap;
+	pce.bitmap.len = DIV_ROUND_UP(nr_bits, 8);
+	/* Only mappings and the exe file come here without an fd */
+	if (p->fd == FD_DESC_INVALID) {
+		pce.has_mapped = true;
+		pce.mapped = true;
+	}
+
+	pr_debug("%#x: %" PRIu64 " of %lu pages cached\n", id, nr_cached, DIV_ROUND_UP(pce.size, PAGE_SIZE));
+
+	ret = pb_write_one(img_from_set(glob_imgset, CR_FD_PAGE_CACHE), &pce, PB_PAGE_CACHE);
+	xfree(bitmap);
+	return ret;
+}
+
+static pid_t prefetch_pid;
+static int prefetch_ctl = -1;
+
+struct prefetch {
+	int ctl;
+	bool mounts_ready;
+	struct timespec start;
+	u64 bytes;
+	unsigned long pages;
+	int nr_files;
+
+	struct stat *seen;
+	int nr_seen;
+};
+
+/*
+ * Mapped files first, as the restored tasks touch them right away,
+ * then by the share of the file that was cached.
+ */
+static int cmp_hotness(const void *a, const void *b)
+{
+	const PageCacheEntry *x = *(PageCacheEntry **)a, *y = *(PageCacheEntry **)b;
+	u64 dx, dy;
+
+	if (x->mapped != y->mapped)
+		return x->mapped ? -1 : 1;
+
+	dx = x->nr_cached * DIV_ROUND_UP(y->size, PAGE_SIZE);
+	dy = y->nr_cached * DIV_ROUND_UP(x->size, PAGE_SIZE);
+	if (dx != dy)
+		return dx > dy ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Criu sends a byte when the mount namespaces are restored and closes
+ * the pipe when the restore is over. Returns 1 for the latter.
+ */
+static int prefetch_ctl_read(struct prefetch *pf)
+{
+	char c;
+
+	if (read(pf->ctl, &c, 1) != 1)
+		return 1;
+
+	pf->mounts_ready = true;
+	return 0;
+}
+
+/* Waits for the next message from criu, returns 1 when the restore is over */
+static int prefetch_wait(struct prefetch *pf)
+{
+	struct pollfd pfd = { .fd = pf->ctl, .events = POLLIN };
+
+	while (poll(&pfd, 1, -1) < 0)
+		if (errno != EINTR)
+			return 1;
+
+	return prefetch_ctl_read(pf);
+}
+
+/* Returns 1 when the restore is over and prefetching should stop */
+static int prefetch_throttle(struct prefetch *pf, u64 bytes)
+{
+	struct pollfd pfd = { .fd = pf->ctl, .events = POLLIN };
+	int timeout = 0;
+
+	pf->bytes += bytes;
+	if (opts.page_cache_rate) {
+		struct timespec now;
+		long ahead_ms;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		ahead_ms = pf->bytes * 1000 / opts.page_cache_rate;
+		ahead_ms -= (now.tv_sec - pf->start.tv_sec) * 1000 + (now.tv_nsec - pf->start.tv_nsec) / 1000000;
+		if (ahead_ms > 0)
+			timeout = ahead_ms;
+	}
+
+	if (poll(&pfd, 1, timeout) <= 0)
+		return 0;
+	return prefetch_ctl_read(pf);
+}
+
+static bool prefetch_seen(struct prefetch *pf, struct stat *st)
+{
+	struct stat *seen;
+	int i;
+
+	for (i = 0; i < pf->nr_seen; i++)
+		if (pf->seen[i].st_dev == st->st_dev && pf->seen[i].st_ino == st->st_ino)
+			return true;
+
+	seen = xrealloc(pf->seen, (pf->nr_seen + 1) * sizeof(*seen));
+	if (seen) {
+		pf->seen = seen;
+		pf->seen[pf->nr_seen++] = *st;
+	}
+	return false;
+}
+
+static int prefetch_file(struct prefetch *pf, PageCacheEntry *pce)
+{
+	unsigned long nr_bits = pce->bitmap.len * 8, i, start;
+	struct reg_file_info *rfi;
+	struct file_desc *d;
+	struct stat st;
+	int mntns_root, fd, ret = 0;
+
+	d = find_file_desc_raw(FD_TYPES__REG, pce->id);
+	if (!d) {
+		pr_warn("No file for %#x\n", pce->id);
+		return 0;
+	}
+
+	/* Ghost and linked remaps have no path to read */
+	rfi = container_of(d, struct reg_file_info, d);
+	if (rfi->remap || rfi->rfe->ext)
+		return 0;
+
+	/* Same as open_path() does, the file may be in any of the restored mount namespaces */
+	mntns_root = mntns_get_root_by_mnt_id(rfi->rfe->mnt_id);
+	if (mntns_root < 0) {
+		pr_debug("No root for %s\n", rfi->rfe->name);
+		return 0;
+	}
+
+	fd = openat(mntns_root, rfi->path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		pr_debug("Can't open %s: %s\n", rfi->rfe->name, strerror(errno));
+		return 0;
+	}
+
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode) || st.st_size != pce->size) {
+		pr_debug("%s changed since dump, skipping\n", rfi->rfe->name);
+		goto out;
+	}
+
+	if (prefetch_seen(pf, &st))
+		goto out;
+
+	for (i = 0; i < nr_bits;) {
+		if (!pc_test_bit(pce->bitmap.data, i)) {
+			i++;
+			continue;
+		}
+
+		start = i;
+		while (i < nr_bits && i - start < PREFETCH_CHUNK && pc_test_bit(pce->bitmap.data, i))
+			i++;
+
+		if (posix_fadvise(fd, start * PAGE_SIZE, (i - start) * PAGE_SIZE, POSIX_FADV_WILLNEED))
+			break;
+
+		pf->pages += i - start;
+		cnt_add(CNT_PAGES_PREFETCHED, i - start);
+
+		ret = prefetch_throttle(pf, (i - start) * PAGE_SIZE);
+		if (ret)
+			break;
+	}
+
+	pf->nr_files++;
+out:
+	close(fd);
+	return ret;
+}
+
+static void NORETURN prefetch_main(PageCacheEntry **pces, int nr, int ctl)
+{
+	struct prefetch pf = { .ctl = ctl };
+	int i, stop = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &pf.start);
+
+	/* Restored mount namespaces have no roots until the root task mounts them */
+	while (!stop && (root_ns_mask & CLONE_NEWNS) && !pf.mounts_ready)
+		stop = prefetch_wait(&pf);
+
+	for (i = 0; i < nr && !stop; i++)
+		stop = prefetch_file(&pf, pces[i]);
+
+	pr_info("Read ahead %lu pages of %d files%s\n", pf.pages, pf.nr_files, stop ? ", stopped by restore end" : "");
+
+	/* Exiting before the restore is over would be taken for a failure, see sigchld_handler() */
+	while (!stop)
+		stop = prefetch_wait(&pf);
+
+	exit(0);
+}
+
+/*
+ * The page cache is read into in a separate process, so that the tasks
+ * being restored don't wait for it. It starts with the mapped files and
+ * keeps going until stop_page_cache_prefetch() is called at the end of
+ * the restore.
+ */
+int start_page_cache_prefetch(void)
+{
+	PageCacheEntry **pces = NULL, **tmp;
+	struct cr_img *img;
+	int nr = 0, ret = -1, ctl[2], i;
+
+	if (!opts.page_cache_warmth)
+		return 0;
+
+	img = open_image(CR_FD_PAGE_CACHE, O_RSTR);
+	if (!img)
+		return -1;
+
+	while (1) {
+		PageCacheEntry *pce;
+
+		ret = pb_read_one_eof(img, &pce, PB_PAGE_CACHE);
+		if (ret <= 0)
+			break;
+
+		tmp = xrealloc(pces, (nr + 1) * sizeof(*pces));
+		if (!tmp) {
+			page_cache_entry__free_unpacked(pce, NULL);
+			ret = -1;
+			break;
+		}
+		pces = tmp;
+		pces[nr++] = pce;
+	}
+	close_image(img);
+
+	if (ret < 0 || !nr)
+		goto out;
+
+	qsort(pces, nr, sizeof(*pces), cmp_hotness);
+
+	ret = -1;
+	if (pipe(ctl)) {
+		pr_perror("Can't create prefetch pipe");
+		goto out;
+	}
+
+	prefetch_pid = fork();
+	if (prefetch_pid < 0) {
+		pr_perror("Can't fork prefetcher");
+		prefetch_pid = 0;
+		close(ctl[0]);
+		close(ctl[1]);
+		goto out;
+	}
+
+	if (prefetch_pid == 0) {
+		close(ctl[1]);
+		prefetch_main(pces, nr, ctl[0]);
+	}
+
+	close(ctl[0]);
+	prefetch_ctl = ctl[1];
+	pr_info("Started prefetcher %d for %d files\n", prefetch_pid, nr);
+
+	/* Don't let it take a pid the restored tasks need */
+	if (!(root_ns_mask & CLONE_NEWPID) && pstree_item_by_virt(prefetch_pid)) {
+		pr_warn("Prefetcher took pid %d of a restored task, stopping it\n", prefetch_pid);
+		stop_page_cache_prefetch();
+	}
+	ret = 0;
+out:
+	for (i = 0; i < nr; i++)
+		page_cache_entry__free_unpacked(pces[i], NULL);
+	xfree(pces);
+	return ret;
+}
+
+void page_cache_prefetch_mounts_ready(void)
+{
+	char c = 0;
+
+	if (prefetch_ctl < 0)
+		return;
+
+	if (write(prefetch_ctl, &c, 1) != 1)
+		pr_perror("Can't wake the prefetcher up");
+}
+
+void stop_page_cache_prefetch(void)
+{
+	sigset_t blockmask, oldmask;
+	int status;
+
+	if (!prefetch_pid)
+		return;
+
+	/* Don't let sigchld_handler() reap it, same as in stop_usernsd() */
+	sigemptyset(&blockmask);
+	sigaddset(&blockmask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &blockmask, &oldmask);
+
+	close_safe(&prefetch_ctl);
+	if (waitpid(prefetch_pid, &status, 0) < 0)
+		pr_perror("Can't wait prefetcher %d", prefetch_pid);
+	else if (!WIFEXITED(status) || WEXITSTATUS(status))
+		pr_warn("Prefetcher %d exited with %#x\n", prefetch_pid, status);
+
+	prefetch_pid = 0;
+	sigprocmask(SIG_SETMASK, &oldmask, NULL);
+}
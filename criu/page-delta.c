@@ -0,0 +1,90 @@
+#include <stdbool.h>
+#include <string.h>
+
+#include "int.h"
+#include "page.h"
+#include "page-delta.h"
+
+static inline bool word_aligned(unsigned long i)
+{
+	return !(i & (sizeof(u64) - 1));
+}
+
+int page_delta_encode(const void *page, const void *base, void *out, unsigned int max)
+{
+	const u8 *p = page, *b = base;
+	unsigned long i = 0, ps = PAGE_SIZE;
+	unsigned int len = 0;
+	u8 *o = out;
+
+	while (i < ps) {
+		unsigned long start, end;
+		u16 hdr[2];
+
+		/* Pages are page aligned, compare by words where we can */
+		while (i < ps && word_aligned(i) && *(u64 *)(p + i) == *(u64 *)(b + i))
+			i += sizeof(u64);
+		while (i < ps && p[i] == b[i])
+			i++;
+		if (i == ps)
+			break;
+
+		start = i;
+		end = i + 1;
+		while (end < ps) {
+			unsigned long gap;
+
+			if (p[end] != b[end]) {
+				end++;
+				continue;
+			}
+
+			/* Merge with the next run if the equal bytes are cheaper to keep */
+			for (gap = end; gap < ps && gap - end < PAGE_DELTA_RUN_HDR && p[gap] == b[gap]; gap++)
+				;
+			if (gap == ps || gap - end >= PAGE_DELTA_RUN_HDR)
+				break;
+			end = gap;
+		}
+
+		if (len + PAGE_DELTA_RUN_HDR + (end - start) > max)
+			return -1;
+
+		hdr[0] = start;
+		hdr[1] = end - start - 1;
+		memcpy(o + len, hdr, sizeof(hdr));
+		len += PAGE_DELTA_RUN_HDR;
+		memcpy(o + len, p + start, end - start);
+		len += end - start;
+
+		i = end;
+	}
+
+	return len;
+}
+
+int page_delta_apply(void *page, const void *delta, unsigned int len)
+{
+	const u8 *d = delta;
+	unsigned int pos = 0;
+
+	while (pos < len) {
+		unsigned long off, rlen;
+		u16 hdr[2];
+
+		if (len - pos < PAGE_DELTA_RUN_HDR)
+			return -1;
+		memcpy(hdr, d + pos, sizeof(hdr));
+		pos += PAGE_DELTA_RUN_HDR;
+
+		off = hdr[0];
+		rlen = (unsigned long)hdr[1] + 1;
+		if (off + rlen > PAGE_SIZE || rlen > len - pos)
+			return -1;
+
+		memcpy(page + off, d + pos, rlen);
+		pos += rlen;
+	}
+
+	return 0;
+}
@@ -0,0 +1,189 @@
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+
+#include "mem.h"
+#include "page.h"
+#include "page-idle.h"
+#include "page-pipe.h"
+#include "util.h"
+#include "xmalloc.h"
+#include "log.h"
+
+#undef LOG_PREFIX
+#define LOG_PREFIX "page-idle: "
+
+/*
+ * The kernel keeps one bit per PFN in the idle bitmap. Writing a bit
+ * marks the page idle and clears the young bits in all PTEs mapping it.
+ * Reading reports the page as idle if nobody has accessed it since.
+ * The bitmap is accessed in whole 64-bit words, we cache a window of
+ * them on reads and batch them on writes.
+ */
+#define PAGE_IDLE_BITMAP "/sys/kernel/mm/page_idle/bitmap"
+#define IDLE_WINDOW	 64 /* words, i.e. 4096 PFNs */
+#define IDLE_WINDOW_PFNS (IDLE_WINDOW * 64)
+
+static int idle_fd = -2;
+
+static u64 window[IDLE_WINDOW];
+static unsigned long window_start = -1UL; /* first PFN in the window */
+static bool window_dirty;
+
+static int idle_bitmap_fd(void)
+{
+	if (idle_fd != -2)
+		return idle_fd;
+
+	idle_fd = open(PAGE_IDLE_BITMAP, O_RDWR);
+	if (idle_fd < 0) {
+		pr_warn("Can't open " PAGE_IDLE_BITMAP " (%s), only swapped pages are found cold\n",
+			strerror(errno));
+		idle_fd = -1;
+	}
+
+	return idle_fd;
+}
+
+static int window_flush(int fd)
+{
+	if (!window_dirty)
+		return 0;
+
+	window_dirty = false;
+	/* Writes past the last PFN are cut short, which is fine */
+	if (pwrite(fd, window, sizeof(window), window_start / 8) < 0) {
+		pr_perror("Can't mark pages at PFN %#lx idle", window_start);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int window_load(int fd, unsigned long pfn, bool mark)
+{
+	unsigned long start = pfn & ~(IDLE_WINDOW_PFNS - 1UL);
+	ssize_t ret;
+
+	if (start == window_start)
+		return 0;
+
+	if (window_flush(fd))
+		return -1;
+
+	window_start = start;
+	memset(window, 0, sizeof(window));
+	if (mark)
+		return 0;
+
+	/* Reads past the last PFN come up short, the rest is left not idle */
+	ret = pread(fd, window, sizeof(window), start / 8);
+	if (ret < 0) {
+		pr_perror("Can't read idle bits at PFN %#lx", start);
+		window_start = -1UL;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Tell whether a page of the dumpee was not accessed since it was
+ * last marked idle. Swapped out pages are cold without asking.
+ */
+bool page_is_cold(u64 pme)
+{
+	unsigned long pfn;
+	int fd;
+
+	if (pme & PME_SWAP)
+		return true;
+
+	pfn = PME_PFRAME(pme);
+	if (!(pme & PME_PRESENT) || !pfn)
+		return false;
+
+	fd = idle_bitmap_fd();
+	if (fd < 0 || window_load(fd, pfn, false))
+		return false;
+
+	pfn -= window_start;
+	return window[pfn / 64] & (1ULL << (pfn % 64));
+}
+
+static int mark_iov_idle(int fd, int pm_fd, struct iovec *iov)
+{
+	unsigned long vaddr = (unsigned long)iov->iov_base;
+	unsigned long nr = iov->iov_len / PAGE_SIZE, i;
+	u64 pmes[512];
+
+	for (i = 0; i < nr; i += ARRAY_SIZE(pmes)) {
+		unsigned long n = min_t(unsigned long, nr - i, ARRAY_SIZE(pmes)), j;
+		off_t off = PAGE_PFN(vaddr) * sizeof(u64) + i * sizeof(u64);
+
+		if (pread(pm_fd, pmes, n * sizeof(u64), off) != n * sizeof(u64)) {
+			pr_perror("Can't read pagemap at %#lx", vaddr + i * PAGE_SIZE);
+			return -1;
+		}
+
+		for (j = 0; j < n; j++) {
+			unsigned long pfn = PME_PFRAME(pmes[j]);
+
+			if (!(pmes[j] & PME_PRESENT) || !pfn)
+				continue;
+
+			if (window_load(fd, pfn, true))
+				return -1;
+
+			pfn -= window_start;
+			window[pfn / 64] |= 1ULL << (pfn % 64);
+			window_dirty = true;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Mark the pages just pre-dumped idle, so that the next dump can find
+ * which of them were not touched in between. This is done after the
+ * pages are transferred, as reading them would make them young again.
+ */
+int page_idle_mark(int pid, struct page_pipe *pp)
+{
+	struct page_pipe_buf *ppb;
+	int fd, pm_fd, i, ret = 0;
+
+	fd = idle_bitmap_fd();
+	if (fd < 0)
+		return 0;
+
+	pm_fd = open_proc(pid, "pagemap");
+	if (pm_fd < 0)
+		return -1;
+
+	window_start = -1UL;
+	list_for_each_entry(ppb, &pp->bufs, l) {
+		for (i = 0; i < ppb->nr_segs && !ret; i++)
+			ret = mark_iov_idle(fd, pm_fd, &ppb->iov[i]);
+		if (ret)
+			break;
+	}
+
+	if (window_flush(fd))
+		ret = -1;
+	window_start = -1UL;
+
+	close(pm_fd);
+	return ret;
+}
+
+void page_idle_fini(void)
+{
+	if (idle_fd >= 0)
+		close(idle_fd);
+	idle_fd = -2;
+	window_start = -1UL;
+	window_dirty = false;
+}
@@ -232,6 +232,7 @@ void destroy_page_pipe(struct page_pipe *pp)
 
 	if (pp->flags & PP_OWN_IOVS)
 		xfree(pp->iovs);
+	xfree(pp->cold);
 	xfree(pp);
 }
 
@@ -247,6 +248,7 @@ void page_pipe_reinit(struct page_pipe *pp)
 		list_move(&ppb->l, &pp->free_bufs);
 
 	pp->free_hole = 0;
+	pp->free_cold = 0;
 
 	if (page_pipe_grow(pp, 0))
 		BUG(); /* It can't fail, because ppb is in free_bufs */
@@ -324,6 +326,59 @@ out:
 	return 0;
 }
 
+/*
+ * Cold pages are also added with page_pipe_add_page(), this only
+ * remembers them so that their pagemap entries can be split off.
+ * Pages must come in the ascending order.
+ */
+int page_pipe_add_cold(struct page_pipe *pp, unsigned long addr)
+{
+	if (pp->free_cold && iov_grow_page(&pp->cold[pp->free_cold - 1], addr))
+		return 0;
+
+	if (pp->free_cold >= pp->nr_cold) {
+		if (xrealloc_safe(&pp->cold, (pp->nr_cold + PP_HOLES_BATCH) * sizeof(struct iovec)))
+			return -1;
+		pp->nr_cold += PP_HOLES_BATCH;
+	}
+
+	iov_init(&pp->cold[pp->free_cold++], addr);
+	return 0;
+}
+
+/*
+ * Find where the run of pages starting at @addr, that are either
+ * all cold or all not, ends. The run is cut at @end, @cold tells
+ * which of the two it is.
+ */
+unsigned long page_pipe_cold_split(struct page_pipe *pp, unsigned long addr, unsigned long end, bool *cold)
+{
+	unsigned int lo = 0, hi = pp->free_cold;
+	unsigned long start;
+
+	/* The first cold iov ending after @addr */
+	while (lo < hi) {
+		unsigned int mid = (lo + hi) / 2;
+		struct iovec *iov = &pp->cold[mid];
+
+		if ((unsigned long)iov->iov_base + iov->iov_len <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	*cold = false;
+	if (lo == pp->free_cold)
+		return end;
+
+	start = (unsigned long)pp->cold[lo].iov_base;
+	if (start > addr)
+		return min(start, end);
+
+	*cold = true;
+	return min(start + pp->cold[lo].iov_len, end);
+}
+
 /*
  * Get ppb and iov that contain addr and count amount of data between
  * beginning of the pipe belonging to the ppb and addr
@@ -7,25 +7,30 @@
 #include <sys/wait.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/sendfile.h>
 
 #undef LOG_PREFIX
 #define LOG_PREFIX "page-xfer: "
 
 #include "types.h"
+#include "crtools.h"
 #include "cr_options.h"
 #include "servicefd.h"
 #include "image.h"
+#include "img-store.h"
 #include "page-xfer.h"
 #include "page-pipe.h"
 #include "util.h"
 #include "protobuf.h"
 #include "images/pagemap.pb-c.h"
+#include "page-delta.h"
 #include "fcntl.h"
 #include "pstree.h"
 #include "parasite-syscall.h"
 #include "rst_info.h"
 #include "stats.h"
 #include "tls.h"
+#include "io-limit.h"
 
 static int page_server_sk = -1;
 
@@ -49,6 +54,10 @@ static void psi2iovec(struct page_server_iov *ps, struct iovec *iov)
 #define PS_IOV_PARENT 5
 #define PS_IOV_ADD_F  6
 #define PS_IOV_GET    7
+#define PS_IOV_FILE   8 /* whole image file, see page_xfer_send_image() */
+
+/* Lift the I/O limits, see page_server_full_speed() */
+#define PS_IOV_FULL_SPEED 9
 
 #define PS_IOV_CLOSE	   0x1023
 #define PS_IOV_FORCE_CLOSE 0x1024
@@ -236,12 +245,46 @@ static int open_page_server_xfer(struct page_xfer *xfer, int fd_type, unsigned l
 	return 0;
 }
 
+/*
+ * With --delta-pages the pages dumped on top of parent images are
+ * compared with their parent copies as they come from the pipe. Runs of
+ * pages that changed a little become PE_DELTA entries with the deltas
+ * in the pages-delta image, the rest is written as usual. The pagemap
+ * entry of a run is written once the run is over.
+ */
+#define DELTA_RUN_MAX 64
+
+struct page_xfer_delta {
+	struct cr_img *pdi;
+	unsigned int max; /* largest delta of one page */
+
+	/* Pages of the last write_pagemap() still to come */
+	unsigned long vaddr, end;
+
+	void *page, *base;
+	unsigned long fill;
+
+	unsigned long run_start;
+	unsigned int run_nr;
+	bool run_delta;
+	u32 sizes[DELTA_RUN_MAX];
+	u8 *data;
+	unsigned long data_len;
+
+	unsigned long nr_full, nr_delta, delta_bytes;
+};
+
 /* local xfer */
+static int write_pages_delta(struct page_xfer *xfer, int p, unsigned long len);
+
 static int write_pages_loc(struct page_xfer *xfer, int p, unsigned long len)
 {
 	ssize_t ret;
 	ssize_t curr = 0;
 
+	if (xfer->delta && xfer->delta->vaddr < xfer->delta->end)
+		return write_pages_delta(xfer, p, len);
+
 	while (1) {
 		ret = splice(p, NULL, img_raw_fd(xfer->pi), NULL, len - curr, SPLICE_F_MOVE);
 		if (ret == -1) {
@@ -302,6 +345,186 @@ static int check_pagehole_in_parent(struct page_read *p, struct iovec *iov)
 	}
 }
 
+static int write_pagemap_entry(struct page_xfer *xfer, PagemapEntry *pe)
+{
+	if (xfer->compact) {
+		u8 rec[PMC_RECORD_MAX];
+		int ret;
+
+		ret = pmc_encode(&xfer->pmc, rec, pe->vaddr, pe->nr_pages, pe->flags, pe->delta_size);
+		if (ret < 0) {
+			pr_err("Can't encode pagemap entry %" PRIx64 "/%u\n", pe->vaddr, pe->nr_pages);
+			return -1;
+		}
+		if (write_img_buf(xfer->pmi, rec, ret) < 0)
+			return -1;
+	} else if (pb_write_one(xfer->pmi, pe, PB_PAGEMAP) < 0)
+		return -1;
+
+	return 0;
+}
+
+static int flush_delta_run(struct page_xfer *xfer)
+{
+	struct page_xfer_delta *d = xfer->delta;
+	PagemapEntry pe = PAGEMAP_ENTRY__INIT;
+
+	if (!d->run_nr)
+		return 0;
+
+	pe.vaddr = d->run_start;
+	pe.nr_pages = d->run_nr;
+	pe.has_flags = true;
+
+	if (d->run_delta) {
+		size_t tbl_len = d->run_nr * sizeof(u32);
+		int fd = img_raw_fd(d->pdi);
+
+		if (fd < 0 || write_all(fd, d->sizes, tbl_len) != tbl_len ||
+		    write_all(fd, d->data, d->data_len) != d->data_len) {
+			pr_perror("Can't write page deltas");
+			return -1;
+		}
+
+		pe.flags = PE_DELTA;
+		pe.has_delta_size = true;
+		pe.delta_size = tbl_len + d->data_len;
+	} else
+		pe.flags = PE_PRESENT;
+
+	d->run_nr = 0;
+	d->data_len = 0;
+
+	return write_pagemap_entry(xfer, &pe);
+}
+
+static int delta_one_page(struct page_xfer *xfer)
+{
+	struct page_xfer_delta *d = xfer->delta;
+	unsigned long vaddr = d->vaddr;
+	bool is_delta = false;
+	int ret, size = 0;
+
+	if (d->run_nr == DELTA_RUN_MAX && flush_delta_run(xfer))
+		return -1;
+
+	ret = page_read_peek(xfer->parent, vaddr, d->base);
+	if (ret < 0)
+		return -1;
+	if (ret > 0) {
+		size = page_delta_encode(d->page, d->base, d->data + d->data_len, d->max);
+		is_delta = size >= 0;
+	}
+
+	/* Flushing a run of full pages leaves the new delta in place */
+	if (d->run_nr && is_delta != d->run_delta && flush_delta_run(xfer))
+		return -1;
+
+	if (!d->run_nr) {
+		d->run_start = vaddr;
+		d->run_delta = is_delta;
+	}
+
+	if (is_delta) {
+		d->sizes[d->run_nr] = size;
+		d->data_len += size;
+		d->nr_delta++;
+		d->delta_bytes += size;
+	} else {
+		if (write_all(img_raw_fd(xfer->pi), d->page, PAGE_SIZE) != PAGE_SIZE) {
+			pr_perror("Can't write page %lx", vaddr);
+			return -1;
+		}
+
+		if (opts.auto_dedup && dedup_one_iovec(xfer->parent, vaddr, PAGE_SIZE) == -1) {
+			pr_perror("Auto-deduplication failed");
+			return -1;
+		}
+		d->nr_full++;
+	}
+
+	d->run_nr++;
+	d->vaddr += PAGE_SIZE;
+	if (d->vaddr == d->end)
+		return flush_delta_run(xfer);
+
+	return 0;
+}
+
+static int write_pages_delta(struct page_xfer *xfer, int p, unsigned long len)
+{
+	struct page_xfer_delta *d = xfer->delta;
+
+	while (len) {
+		ssize_t ret;
+
+		if (d->vaddr >= d->end) {
+			pr_err("Got more pages than the pagemap has\n");
+			return -1;
+		}
+
+		ret = read(p, d->page + d->fill, min(len, PAGE_SIZE - d->fill));
+		if (ret == -1) {
+			pr_perror("Unable to read pages from pipe");
+			return -1;
+		}
+		if (ret == 0) {
+			pr_err("A pipe was closed unexpectedly\n");
+			return -1;
+		}
+
+		d->fill += ret;
+		len -= ret;
+		if (d->fill < PAGE_SIZE)
+			continue;
+
+		d->fill = 0;
+		if (delta_one_page(xfer))
+			return -1;
+	}
+
+	return 0;
+}
+
+static int open_page_xfer_delta(struct page_xfer *xfer, u32 pages_id)
+{
+	struct page_xfer_delta *d;
+
+	d = xzalloc(sizeof(*d));
+	if (!d)
+		return -1;
+
+	d->max = opts.delta_pages_max ?: PAGE_SIZE / 4;
+	d->page = xmalloc(2 * PAGE_SIZE);
+	d->data = xmalloc(DELTA_RUN_MAX * d->max);
+	d->pdi = open_image(CR_FD_PAGES_DELTA, O_DUMP, pages_id);
+	if (!d->page || !d->data || !d->pdi) {
+		if (d->pdi)
+			close_image(d->pdi);
+		xfree(d->data);
+		xfree(d->page);
+		xfree(d);
+		return -1;
+	}
+	d->base = d->page + PAGE_SIZE;
+
+	xfer->delta = d;
+	return 0;
+}
+
+static void close_page_xfer_delta(struct page_xfer *xfer)
+{
+	struct page_xfer_delta *d = xfer->delta;
+
+	pr_info("Wrote %lu pages in full and %lu as %lu bytes of deltas\n", d->nr_full, d->nr_delta, d->delta_bytes);
+
+	close_image(d->pdi);
+	xfree(d->data);
+	xfree(d->page);
+	xfree(d);
+	xfer->delta = NULL;
+}
+
 static int write_pagemap_loc(struct page_xfer *xfer, struct iovec *iov, u32 flags)
 {
 	int ret;
@@ -312,6 +535,13 @@ static int write_pagemap_loc(struct page_xfer *xfer, struct iovec *iov, u32 flag
 	pe.has_flags = true;
 	pe.flags = flags;
 
+	if (xfer->delta && flags == PE_PRESENT) {
+		/* The entries are written once the pages are compared */
+		xfer->delta->vaddr = pe.vaddr;
+		xfer->delta->end = pe.vaddr + pagemap_len(&pe);
+		return 0;
+	}
+
 	if (flags & PE_PRESENT) {
 		if (opts.auto_dedup && xfer->parent != NULL) {
 			ret = dedup_one_iovec(xfer->parent, pe.vaddr, pagemap_len(&pe));
@@ -330,14 +560,13 @@ static int write_pagemap_loc(struct page_xfer *xfer, struct iovec *iov, u32 flag
 		}
 	}
 
-	if (pb_write_one(xfer->pmi, &pe, PB_PAGEMAP) < 0)
-		return -1;
-
-	return 0;
+	return write_pagemap_entry(xfer, &pe);
 }
 
 static void close_page_xfer(struct page_xfer *xfer)
 {
+	if (xfer->delta)
+		close_page_xfer_delta(xfer);
 	if (xfer->parent != NULL) {
 		xfer->parent->close(xfer->parent);
 		xfree(xfer->parent);
@@ -355,9 +584,10 @@ static int open_page_local_xfer(struct page_xfer *xfer, int fd_type, unsigned lo
 	if (!xfer->pmi)
 		return -1;
 
-	xfer->pi = open_pages_image(O_DUMP, xfer->pmi, &pages_id);
+	xfer->pi = open_pages_image(O_DUMP, xfer->pmi, &pages_id, &xfer->compact);
 	if (!xfer->pi)
 		goto err_pmi;
+	xfer->pmc.prev_end = 0;
 
 	/*
 	 * Open page-read for parent images (if it exists). It will
@@ -367,13 +597,14 @@ static int open_page_local_xfer(struct page_xfer *xfer, int fd_type, unsigned lo
 	 *    to exist in parent (either pagemap or hole)
 	 */
 	xfer->parent = NULL;
+	xfer->delta = NULL;
 	if (fd_type == CR_FD_PAGEMAP || fd_type == CR_FD_SHMEM_PAGEMAP) {
 		int ret;
 		int pfd;
 		int pr_flags = (fd_type == CR_FD_PAGEMAP) ? PR_TASK : PR_SHMEM;
 
-		/* Image streaming lacks support for incremental images */
-		if (opts.stream)
+		/* Image streaming and in-memory images lack support for incremental images */
+		if (opts.stream || opts.mem_images)
 			goto out;
 
 		if (open_parent(get_service_fd(IMG_FD_OFF), &pfd))
@@ -396,6 +627,9 @@ static int open_page_local_xfer(struct page_xfer *xfer, int fd_type, unsigned lo
 			goto out;
 		}
 		close(pfd);
+
+		if (opts.delta_pages && open_page_xfer_delta(xfer, pages_id))
+			goto err_parent;
 	}
 
 out:
@@ -404,6 +638,9 @@ out:
 	xfer->close = close_page_xfer;
 	return 0;
 
+err_parent:
+	xfer->parent->close(xfer->parent);
+	xfree(xfer->parent);
 err_pi:
 	close_image(xfer->pi);
 err_pmi:
@@ -437,9 +674,10 @@ static int page_xfer_dump_hole(struct page_xfer *xfer, struct iovec *hole, u32 f
 static int get_hole_flags(struct page_pipe *pp, int n)
 {
 	unsigned int hole_flags = pp->hole_flags[n];
+	u32 cold = (hole_flags & PP_HOLE_COLD) ? PE_COLD : 0;
 
-	if (hole_flags == PP_HOLE_PARENT)
-		return PE_PARENT;
+	if ((hole_flags & ~PP_HOLE_COLD) == PP_HOLE_PARENT)
+		return PE_PARENT | cold;
 	else
 		BUG();
 
@@ -479,6 +717,42 @@ static inline u32 ppb_xfer_flags(struct page_xfer *xfer, struct page_pipe_buf *p
 		return PE_PRESENT;
 }
 
+/*
+ * Write the pagemap and the pages of one page pipe iovec. The iovec
+ * is split into several pagemap entries where it crosses the bounds
+ * of the cold pages found by generate_iovs().
+ */
+static int xfer_iov(struct page_xfer *xfer, struct page_pipe *pp, struct page_pipe_buf *ppb, struct iovec *iov,
+		    u32 flags)
+{
+	unsigned long addr = (unsigned long)iov->iov_base, end = addr + iov->iov_len;
+
+	BUG_ON(addr < xfer->offset);
+
+	while (addr < end) {
+		struct iovec piece;
+		unsigned long next;
+		bool cold;
+
+		next = page_pipe_cold_split(pp, addr, end, &cold);
+		piece.iov_base = (void *)(addr - xfer->offset);
+		piece.iov_len = next - addr;
+		pr_debug("\tp %p [%u]%s\n", piece.iov_base, (unsigned int)(piece.iov_len / PAGE_SIZE), cold ? " cold" : "");
+
+		if (xfer->write_pagemap(xfer, &piece, flags | (cold ? PE_COLD : 0)))
+			return -1;
+		if (flags & PE_PRESENT) {
+			if (xfer->write_pages(xfer, ppb->p[0], piece.iov_len))
+				return -1;
+			io_limit(piece.iov_len);
+		}
+
+		addr = next;
+	}
+
+	return 0;
+}
+
 /*
  * Optimized pre-dump algorithm
  * ==============================
@@ -825,23 +1099,11 @@ int page_xfer_predump_pages(int pid, struct page_xfer *xfer, struct page_pipe *p
 
 		/* generating pagemap */
 		for (i = 0; i < aux_len; i++) {
-			struct iovec iov = aux_iov[i];
-			u32 flags;
-
-			ret = dump_holes(xfer, pp, &cur_hole, iov.iov_base);
+			ret = dump_holes(xfer, pp, &cur_hole, aux_iov[i].iov_base);
 			if (ret)
 				goto err;
 
-			BUG_ON(iov.iov_base < (void *)xfer->offset);
-			iov.iov_base -= xfer->offset;
-			pr_debug("\t p %p [%u]\n", iov.iov_base, (unsigned int)(iov.iov_len / PAGE_SIZE));
-
-			flags = ppb_xfer_flags(xfer, ppb);
-
-			if (xfer->write_pagemap(xfer, &iov, flags))
-				goto err;
-
-			if (xfer->write_pages(xfer, ppb->p[0], iov.iov_len))
+			if (xfer_iov(xfer, pp, ppb, &aux_iov[i], ppb_xfer_flags(xfer, ppb)))
 				goto err;
 		}
 
@@ -859,41 +1121,48 @@ err:
 	return -1;
 }
 
-int page_xfer_dump_pages(struct page_xfer *xfer, struct page_pipe *pp)
+/*
+ * Transfer one page pipe buffer together with the holes preceding it.
+ * With @ppb == NULL the holes left after the last buffer are dumped.
+ * The @cur_hole is the position in pp->holes carried between calls.
+ */
+int page_xfer_dump_buf(struct page_xfer *xfer, struct page_pipe *pp, struct page_pipe_buf *ppb, unsigned int *cur_hole)
 {
-	struct page_pipe_buf *ppb;
-	unsigned int cur_hole = 0;
+	unsigned int i;
 	int ret;
 
-	pr_debug("Transferring pages:\n");
+	if (!ppb)
+		return dump_holes(xfer, pp, cur_hole, NULL);
 
-	list_for_each_entry(ppb, &pp->bufs, l) {
-		unsigned int i;
+	pr_debug("\tbuf %d/%d\n", ppb->pages_in, ppb->nr_segs);
 
-		pr_debug("\tbuf %d/%d\n", ppb->pages_in, ppb->nr_segs);
+	for (i = 0; i < ppb->nr_segs; i++) {
+		ret = dump_holes(xfer, pp, cur_hole, ppb->iov[i].iov_base);
+		if (ret)
+			return ret;
 
-		for (i = 0; i < ppb->nr_segs; i++) {
-			struct iovec iov = ppb->iov[i];
-			u32 flags;
+		if (xfer_iov(xfer, pp, ppb, &ppb->iov[i], ppb_xfer_flags(xfer, ppb)))
+			return -1;
+	}
 
-			ret = dump_holes(xfer, pp, &cur_hole, iov.iov_base);
-			if (ret)
-				return ret;
+	return 0;
+}
 
-			BUG_ON(iov.iov_base < (void *)xfer->offset);
-			iov.iov_base -= xfer->offset;
-			pr_debug("\tp %p [%u]\n", iov.iov_base, (unsigned int)(iov.iov_len / PAGE_SIZE));
+int page_xfer_dump_pages(struct page_xfer *xfer, struct page_pipe *pp)
+{
+	struct page_pipe_buf *ppb;
+	unsigned int cur_hole = 0;
+	int ret;
 
-			flags = ppb_xfer_flags(xfer, ppb);
+	pr_debug("Transferring pages:\n");
 
-			if (xfer->write_pagemap(xfer, &iov, flags))
-				return -1;
-			if ((flags & PE_PRESENT) && xfer->write_pages(xfer, ppb->p[0], iov.iov_len))
-				return -1;
-		}
+	list_for_each_entry(ppb, &pp->bufs, l) {
+		ret = page_xfer_dump_buf(xfer, pp, ppb, &cur_hole);
+		if (ret)
+			return ret;
 	}
 
-	return dump_holes(xfer, pp, &cur_hole, NULL);
+	return page_xfer_dump_buf(xfer, pp, NULL, &cur_hole);
 }
 
 /*
@@ -908,8 +1177,8 @@ int check_parent_local_xfer(int fd_type, unsigned long img_id)
 	struct stat st;
 	int ret, pfd;
 
-	/* Image streaming lacks support for incremental images */
-	if (opts.stream)
+	/* Image streaming and in-memory images lack support for incremental images */
+	if (opts.stream || opts.mem_images)
 		return 0;
 
 	if (open_parent(get_service_fd(IMG_FD_OFF), &pfd))
@@ -1049,25 +1318,12 @@ static int prep_loc_xfer(struct page_server_iov *pi)
 		return 0;
 }
 
-static int page_server_add(int sk, struct page_server_iov *pi, u32 flags)
+/*
+ * Receive @len bytes of data from the socket into the xfer pipe
+ * and feed them chunk by chunk to @sink.
+ */
+static int page_server_recv_data(int sk, size_t len, int (*sink)(void *arg, int p, unsigned long len), void *arg)
 {
-	size_t len;
-	struct page_xfer *lxfer = &cxfer.loc_xfer;
-	struct iovec iov;
-
-	pr_debug("Adding %" PRIx64 "/%u\n", pi->vaddr, pi->nr_pages);
-
-	if (prep_loc_xfer(pi))
-		return -1;
-
-	psi2iovec(pi, &iov);
-	if (lxfer->write_pagemap(lxfer, &iov, flags))
-		return -1;
-
-	if (!(flags & PE_PRESENT))
-		return 0;
-
-	len = iov.iov_len;
 	while (len > 0) {
 		ssize_t chunk;
 
@@ -1107,8 +1363,9 @@ static int page_server_add(int sk, struct page_server_iov *pi, u32 flags)
 			}
 		}
 
-		if (lxfer->write_pages(lxfer, cxfer.p[0], chunk))
+		if (sink(arg, cxfer.p[0], chunk))
 			return -1;
+		io_limit(chunk);
 
 		len -= chunk;
 	}
@@ -1116,6 +1373,97 @@ static int page_server_add(int sk, struct page_server_iov *pi, u32 flags)
 	return 0;
 }
 
+static int xfer_pages_sink(void *arg, int p, unsigned long len)
+{
+	struct page_xfer *lxfer = arg;
+
+	return lxfer->write_pages(lxfer, p, len);
+}
+
+static int page_server_add(int sk, struct page_server_iov *pi, u32 flags)
+{
+	struct page_xfer *lxfer = &cxfer.loc_xfer;
+	struct iovec iov;
+
+	pr_debug("Adding %" PRIx64 "/%u\n", pi->vaddr, pi->nr_pages);
+
+	if (prep_loc_xfer(pi))
+		return -1;
+
+	psi2iovec(pi, &iov);
+	if (lxfer->write_pagemap(lxfer, &iov, flags))
+		return -1;
+
+	if (!(flags & PE_PRESENT))
+		return 0;
+
+	return page_server_recv_data(sk, iov.iov_len, xfer_pages_sink, lxfer);
+}
+
+static int image_file_sink(void *arg, int p, unsigned long len)
+{
+	int fd = *(int *)arg;
+
+	while (len > 0) {
+		ssize_t ret;
+
+		ret = splice(p, NULL, fd, NULL, len, SPLICE_F_MOVE);
+		if (ret <= 0) {
+			pr_perror("Unable to splice image data");
+			return -1;
+		}
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/*
+ * PS_IOV_FILE carries the image name length in nr_pages and the
+ * image size in vaddr, the name and the contents follow.
+ */
+static int page_server_recv_image(int sk, struct page_server_iov *pi)
+{
+	int dfd = get_service_fd(IMG_FD_OFF);
+	char name[PATH_MAX];
+	int fd, ret;
+
+	if (pi->nr_pages == 0 || pi->nr_pages > sizeof(name)) {
+		pr_err("Bad image name length %u\n", pi->nr_pages);
+		return -1;
+	}
+
+	if (__recv(sk, name, pi->nr_pages, MSG_WAITALL) != pi->nr_pages) {
+		pr_perror("Can't read image name");
+		return -1;
+	}
+	name[pi->nr_pages - 1] = '\0';
+
+	if (strchr(name, '/') || !strcmp(name, ".") || !strcmp(name, "..")) {
+		pr_err("Bad image name %s\n", name);
+		return -1;
+	}
+
+	pr_debug("Receiving image %s (%" PRIu64 " bytes)\n", name, pi->vaddr);
+
+	if (img_store_handles(dfd, O_DUMP))
+		fd = img_store_open(name, O_DUMP);
+	else
+		fd = openat(dfd, name, O_DUMP, CR_FD_PERM);
+	if (fd < 0) {
+		pr_perror("Unable to create %s", name);
+		return -1;
+	}
+
+	ret = page_server_recv_data(sk, pi->vaddr, image_file_sink, &fd);
+
+	close(fd);
+	if (opts.mem_images)
+		img_store_close(fd);
+
+	return ret;
+}
+
 static int page_server_get_pages(int sk, struct page_server_iov *pi)
 {
 	struct pstree_item *item;
@@ -1156,6 +1504,7 @@ static int page_server_get_pages(int sk, struct page_server_iov *pi)
 	}
 
 	tcp_nodelay(sk, true);
+	io_limit(len);
 
 	return 0;
 }
@@ -1191,6 +1540,12 @@ static int page_server_serve(int sk)
 		struct page_server_iov pi;
 		u32 cmd;
 
+		/* Let restore pick up images while the rest is arriving */
+		if (opts.mem_images && img_store_wait(sk)) {
+			ret = -1;
+			break;
+		}
+
 		ret = __recv(sk, &pi, sizeof(pi), MSG_WAITALL);
 		if (!ret)
 			break;
@@ -1250,6 +1605,13 @@ static int page_server_serve(int sk)
 		case PS_IOV_GET:
 			ret = page_server_get_pages(sk, &pi);
 			break;
+		case PS_IOV_FILE:
+			ret = page_server_recv_image(sk, &pi);
+			break;
+		case PS_IOV_FULL_SPEED:
+			io_limit_full_speed();
+			ret = 0;
+			break;
 		default:
 			pr_err("Unknown command %u\n", pi.cmd);
 			ret = -1;
@@ -1283,6 +1645,8 @@ static int page_server_serve(int sk)
 	}
 
 	page_server_close();
+	if (opts.mem_images && ret == 0)
+		img_store_transfer_done();
 
 	pr_info("Session over\n");
 
@@ -1300,6 +1664,15 @@ static int fill_page_pipe(struct page_read *pr, struct page_pipe *pp)
 	while (pr->advance(pr)) {
 		unsigned long vaddr = pr->pe->vaddr;
 
+		/*
+		 * The pages are spliced from pages-*.img as is, while the
+		 * deltas would have to be applied to the parent copies.
+		 */
+		if (pagemap_delta(pr->pe)) {
+			pr_err("Can't serve page deltas at %lx lazily\n", vaddr);
+			return -1;
+		}
+
 		for (i = 0; i < pr->pe->nr_pages; i++, vaddr += PAGE_SIZE) {
 			if (pagemap_in_parent(pr->pe))
 				ret = page_pipe_add_hole(pp, vaddr, PP_HOLE_PARENT);
@@ -1398,6 +1771,9 @@ int cr_page_server(bool daemon_mode, bool lazy_dump, int cfd)
 	if (init_stats(DUMP_STATS))
 		return -1;
 
+	if (io_limit_init())
+		return -1;
+
 	if (!opts.lazy_pages)
 		up_page_ids_base();
 	else if (!lazy_dump)
@@ -1439,6 +1815,9 @@ no_server:
 	if (ask >= 0)
 		ret = page_server_serve(ask);
 
+	if (ret == 0 && opts.mem_images)
+		ret = img_store_serve();
+
 	if (daemon_mode)
 		exit(ret);
 
@@ -1476,7 +1855,75 @@ out:
 
 int connect_to_page_server_to_send(void)
 {
-	return connect_to_page_server();
+	if (connect_to_page_server())
+		return -1;
+
+	if (opts.mem_images && img_store_flush())
+		return -1;
+
+	return 0;
+}
+
+int page_xfer_send_image(const char *name, int fd)
+{
+	struct page_server_iov pi = {
+		.cmd = PS_IOV_FILE,
+	};
+	size_t nlen = strlen(name) + 1;
+	struct stat st;
+	off_t off = 0;
+
+	if (fstat(fd, &st)) {
+		pr_perror("Unable to stat %s", name);
+		return -1;
+	}
+
+	pi.nr_pages = nlen;
+	pi.vaddr = st.st_size;
+
+	pr_debug("Sending image %s (%" PRIu64 " bytes)\n", name, pi.vaddr);
+
+	if (send_psi(page_server_sk, &pi))
+		return -1;
+
+	if (__send(page_server_sk, name, nlen, 0) != nlen) {
+		pr_perror("Can't send image name %s", name);
+		return -1;
+	}
+
+	if (opts.tls) {
+		if (lseek(fd, 0, SEEK_SET) || tls_send_data_from_fd(fd, st.st_size))
+			return -1;
+		return 0;
+	}
+
+	while (off < st.st_size) {
+		ssize_t ret;
+
+		ret = sendfile(page_server_sk, fd, &off, st.st_size - off);
+		if (ret <= 0) {
+			pr_perror("Can't send image %s", name);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * The dumped tasks are frozen, the page server can take the pages
+ * without the I/O limits too.
+ */
+int page_server_full_speed(void)
+{
+	struct page_server_iov pi = {
+		.cmd = PS_IOV_FULL_SPEED,
+	};
+
+	if (!opts.use_page_server || page_server_sk == -1)
+		return 0;
+
+	return send_psi(page_server_sk, &pi);
 }
 
 int disconnect_from_page_server(void)
@@ -1493,6 +1940,12 @@ int disconnect_from_page_server(void)
 
 	pr_info("Disconnect from the page server\n");
 
+	if (opts.mem_images) {
+		if (img_store_flush())
+			goto out;
+		img_store_stop_shipping();
+	}
+
 	if (opts.ps_socket != -1)
 		/*
 		 * The socket might not get closed (held by
@@ -0,0 +1,97 @@
+#include "page.h"
+#include "pagemap-compact.h"
+
+static int put_varint(u8 *buf, u64 val)
+{
+	int n = 0;
+
+	while (val >= 0x80) {
+		buf[n++] = (val & 0x7f) | 0x80;
+		val >>= 7;
+	}
+	buf[n++] = val;
+
+	return n;
+}
+
+/* Returns the number of bytes used, 0 if @buf is too short, -1 on overflow */
+static int get_varint(const u8 *buf, size_t len, int max_bits, u64 *val)
+{
+	u64 v = 0;
+	int n, shift;
+
+	for (n = 0, shift = 0; n < len; n++, shift += 7) {
+		if (shift >= max_bits)
+			return -1;
+
+		v |= (u64)(buf[n] & 0x7f) << shift;
+		if (!(buf[n] & 0x80)) {
+			if (max_bits < 64 && (v >> max_bits))
+				return -1;
+			*val = v;
+			return n + 1;
+		}
+	}
+
+	return 0;
+}
+
+int pmc_encode(struct pmc_state *st, void *buf, u64 vaddr, u32 nr_pages, u32 flags, u64 delta_size)
+{
+	s64 delta;
+	u64 zz;
+	int n;
+
+	if (vaddr & ~PAGE_MASK)
+		return -1;
+
+	delta = (s64)(vaddr - st->prev_end) / (s64)PAGE_SIZE;
+	zz = ((u64)delta << 1) ^ (u64)(delta >> 63);
+
+	n = put_varint(buf, zz);
+	n += put_varint(buf + n, nr_pages);
+	n += put_varint(buf + n, flags);
+	if (flags & PMC_DELTA)
+		n += put_varint(buf + n, delta_size);
+
+	st->prev_end = vaddr + (u64)nr_pages * PAGE_SIZE;
+	return n;
+}
+
+int pmc_decode(struct pmc_state *st, const void *buf, size_t len, u64 *vaddr, u32 *nr_pages, u32 *flags,
+	       u64 *delta_size)
+{
+	const u8 *p = buf;
+	u64 zz, nr, fl, ds = 0;
+	int n, ret;
+
+	ret = get_varint(p, len, 64, &zz);
+	if (ret <= 0)
+		return ret;
+	n = ret;
+
+	ret = get_varint(p + n, len - n, 32, &nr);
+	if (ret <= 0)
+		return ret;
+	n += ret;
+
+	ret = get_varint(p + n, len - n, 32, &fl);
+	if (ret <= 0)
+		return ret;
+	n += ret;
+
+	if (fl & PMC_DELTA) {
+		ret = get_varint(p + n, len - n, 64, &ds);
+		if (ret <= 0)
+			return ret;
+		n += ret;
+	}
+
+	*vaddr = st->prev_end + (u64)((s64)(zz >> 1) ^ -(s64)(zz & 1)) * PAGE_SIZE;
+	*nr_pages = nr;
+	*flags = fl;
+	*delta_size = ds;
+
+	st->prev_end = *vaddr + nr * PAGE_SIZE;
+	return n;
+}
@@ -13,6 +13,10 @@
 #include "restorer.h"
 #include "rst-malloc.h"
 #include "page-xfer.h"
+#include "pagemap-compact.h"
+#include "page-delta.h"
+#include "io-limit.h"
+#include "bfd.h"
 
 #include "fault-injection.h"
 #include "xmalloc.h"
@@ -96,14 +100,16 @@ int dedup_one_iovec(struct page_read *pr, unsigned long off, unsigned long len)
 		if (!pr->pe)
 			return -1;
 		piov_end = pr->pe->vaddr + pagemap_len(pr->pe);
-		if (!pagemap_in_parent(pr->pe)) {
+		/* Only present pages have data in pages-*.img */
+		if (pagemap_present(pr->pe)) {
 			ret = punch_hole(pr, pr->pi_off, min(piov_end, iov_end) - off, false);
 			if (ret == -1)
 				return ret;
 		}
 
+		/* The parent pages under a delta are its base, keep them */
 		prp = pr->parent;
-		if (prp) {
+		if (prp && !pagemap_delta(pr->pe)) {
 			/* recursively */
 			pr_debug("pr%lu-%u:Go to next parent level\n", pr->img_id, pr->id);
 			len = min(piov_end, iov_end) - off;
@@ -123,11 +129,14 @@ int dedup_one_iovec(struct page_read *pr, unsigned long off, unsigned long len)
 
 static int advance(struct page_read *pr)
 {
+	if (pr->pe && pagemap_delta(pr->pe))
+		pr->pd_off += pr->pe->delta_size;
+
 	pr->curr_pme++;
 	if (pr->curr_pme >= pr->nr_pmes)
 		return 0;
 
-	pr->pe = pr->pmes[pr->curr_pme];
+	pr->pe = &pr->pmes[pr->curr_pme];
 	pr->cvaddr = pr->pe->vaddr;
 
 	return 1;
@@ -260,6 +269,7 @@ static int read_local_page(struct page_read *pr, unsigned long vaddr, unsigned l
 		if (curr == len)
 			break;
 	}
+	io_limit(len);
 
 	if (opts.auto_dedup) {
 		ret = punch_hole(pr, pr->pi_off, len, false);
@@ -474,6 +484,140 @@ static int maybe_read_page_remote(struct page_read *pr, unsigned long vaddr, int
 	return ret;
 }
 
+static int pread_delta(struct page_read *pr, void *buf, size_t len, off_t off)
+{
+	size_t curr = 0;
+	ssize_t ret;
+	int fd;
+
+	fd = img_raw_fd(pr->pdi);
+	if (fd < 0) {
+		pr_err("No page deltas image for pr%lu-%u\n", pr->img_id, pr->id);
+		return -1;
+	}
+
+	while (curr < len) {
+		ret = pread(fd, buf + curr, len - curr, off + curr);
+		if (ret < 1) {
+			pr_perror("Can't read page deltas %zd", ret);
+			return -1;
+		}
+		curr += ret;
+	}
+
+	return 0;
+}
+
+/*
+ * The data of a PE_DELTA entry in the page deltas image is an array of
+ * u32 delta sizes, one per page, followed by the deltas themselves.
+ * Apply the deltas of @nr pages starting at @vaddr to the parent copies
+ * of these pages in @buf.
+ */
+static int apply_page_deltas(struct page_read *pr, unsigned long vaddr, int nr, void *buf)
+{
+	PagemapEntry *pe = pr->pe;
+	unsigned long first = (vaddr - pe->vaddr) / PAGE_SIZE;
+	size_t tbl_len = pe->nr_pages * sizeof(u32), len = 0;
+	u32 *sizes = NULL;
+	u8 *data = NULL, *d;
+	off_t off;
+	int i, ret = -1;
+
+	sizes = xmalloc(tbl_len);
+	if (!sizes)
+		return -1;
+	if (pread_delta(pr, sizes, tbl_len, pr->pd_off))
+		goto out;
+
+	off = pr->pd_off + tbl_len;
+	for (i = 0; i < first; i++)
+		off += sizes[i];
+	for (i = 0; i < nr; i++)
+		len += sizes[first + i];
+
+	if (off + len > pr->pd_off + pe->delta_size) {
+		pr_err("Page deltas of %" PRIx64 "/%u overflow the entry\n", pe->vaddr, pe->nr_pages);
+		goto out;
+	}
+
+	if (len) {
+		data = xmalloc(len);
+		if (!data)
+			goto out;
+		if (pread_delta(pr, data, len, off))
+			goto out;
+	}
+
+	for (i = 0, d = data; i < nr; d += sizes[first + i], i++) {
+		if (page_delta_apply(buf + i * PAGE_SIZE, d, sizes[first + i])) {
+			pr_err("Malformed delta of page %lx\n", vaddr + i * PAGE_SIZE);
+			goto out;
+		}
+	}
+
+	ret = 0;
+out:
+	xfree(data);
+	xfree(sizes);
+	return ret;
+}
+
+static int read_delta_pages(struct page_read *pr, unsigned long vaddr, int nr, void *buf)
+{
+	/* The deltas are applied right away, so the base must be read in sync */
+	if (read_parent_page(pr, vaddr, nr, buf, 0) < 0)
+		return -1;
+
+	if (apply_page_deltas(pr, vaddr, nr, buf))
+		return -1;
+
+	if (pr->io_complete)
+		return pr->io_complete(pr, vaddr, nr);
+
+	return 0;
+}
+
+/*
+ * Read one page at @vaddr into @buf without moving @pr past it, so that
+ * the page can still be found with seek_pagemap() afterwards, e.g. by
+ * dedup_one_iovec(). Returns 0 if the images don't have the page.
+ */
+int page_read_peek(struct page_read *pr, unsigned long vaddr, void *buf)
+{
+	int ret;
+
+	ret = pr->seek_pagemap(pr, vaddr);
+	if (ret <= 0)
+		return ret;
+
+	if (pagemap_in_parent(pr->pe))
+		return pr->parent ? page_read_peek(pr->parent, vaddr, buf) : 0;
+
+	if (pagemap_delta(pr->pe)) {
+		ret = pr->parent ? page_read_peek(pr->parent, vaddr, buf) : 0;
+		if (ret <= 0) {
+			pr_err("No base for the delta of page %lx\n", vaddr);
+			return -1;
+		}
+		if (apply_page_deltas(pr, vaddr, 1, buf))
+			return -1;
+		return 1;
+	}
+
+	if (!pagemap_present(pr->pe))
+		return 0;
+
+	/* seek_pagemap() has moved pi_off to @vaddr */
+	ret = pread(img_raw_fd(pr->pi), buf, PAGE_SIZE, pr->pi_off);
+	if (ret != PAGE_SIZE) {
+		pr_perror("Can't read page %lx from pr%lu-%u", vaddr, pr->img_id, pr->id);
+		return -1;
+	}
+
+	return 1;
+}
+
 static int read_pagemap_page(struct page_read *pr, unsigned long vaddr, int nr, void *buf, unsigned flags)
 {
 	pr_info("pr%lu-%u Read %lx %u pages\n", pr->img_id, pr->id, vaddr, nr);
@@ -482,6 +626,9 @@ static int read_pagemap_page(struct page_read *pr, unsigned long vaddr, int nr,
 	if (pagemap_in_parent(pr->pe)) {
 		if (read_parent_page(pr, vaddr, nr, buf, flags) < 0)
 			return -1;
+	} else if (pagemap_delta(pr->pe)) {
+		if (read_delta_pages(pr, vaddr, nr, buf) < 0)
+			return -1;
 	} else {
 		if (pr->maybe_read_page(pr, vaddr, nr, buf, flags) < 0)
 			return -1;
@@ -494,11 +641,6 @@ static int read_pagemap_page(struct page_read *pr, unsigned long vaddr, int nr,
 
 static void free_pagemaps(struct page_read *pr)
 {
-	int i;
-
-	for (i = 0; i < pr->nr_pmes; i++)
-		pagemap_entry__free_unpacked(pr->pmes[i], NULL);
-
 	xfree(pr->pmes);
 	pr->pmes = NULL;
 }
@@ -562,6 +704,8 @@ static int process_async_reads(struct page_read *pr)
 		if (opts.auto_dedup && punch_hole(pr, piov->from, ret, false))
 			return -1;
 
+		io_limit(ret);
+
 		if (ret != piov->end - piov->from) {
 			/*
 			 * The preadv() can return less than requested. It's
@@ -612,6 +756,8 @@ static void close_page_read(struct page_read *pr)
 		close_image(pr->pmi);
 	if (pr->pi)
 		close_image(pr->pi);
+	if (pr->pdi)
+		close_image(pr->pdi);
 
 	if (pr->pmes)
 		free_pagemaps(pr);
@@ -621,6 +767,7 @@ static void reset_pagemap(struct page_read *pr)
 {
 	pr->cvaddr = 0;
 	pr->pi_off = 0;
+	pr->pd_off = 0;
 	pr->curr_pme = -1;
 	pr->pe = NULL;
 
@@ -691,11 +838,130 @@ static void init_compat_pagemap_entry(PagemapEntry *pe)
  * number to minimize {over,under}-allocations
  */
 #define PAGEMAP_ENTRY_SIZE_ESTIMATE 16
+/* Compact records of neighbouring entries are mostly 3-5 bytes */
+#define PAGEMAP_COMPACT_ENTRY_SIZE_ESTIMATE 4
+/* Compact pagemaps are read and decoded by blocks of this size */
+#define PAGEMAP_COMPACT_BLOCK_SIZE (64 << 10)
+
+static PagemapEntry *next_pagemap(struct page_read *pr, int *nr_pmes, int nr_realloc)
+{
+	if (pr->nr_pmes >= *nr_pmes) {
+		PagemapEntry *new;
+
+		new = xrealloc(pr->pmes, (*nr_pmes + nr_realloc) * sizeof(*pr->pmes));
+		if (!new)
+			return NULL;
+		pr->pmes = new;
+		*nr_pmes += nr_realloc;
+	}
+
+	return &pr->pmes[pr->nr_pmes++];
+}
+
+static int read_pagemaps(struct page_read *pr, int *nr_pmes, int nr_realloc)
+{
+	while (1) {
+		PagemapEntry *pe, *dst;
+		int ret;
+
+		ret = pb_read_one_eof(pr->pmi, &pe, PB_PAGEMAP);
+		if (ret <= 0)
+			return ret;
+
+		init_compat_pagemap_entry(pe);
+
+		dst = next_pagemap(pr, nr_pmes, nr_realloc);
+		if (!dst) {
+			pagemap_entry__free_unpacked(pe, NULL);
+			return -1;
+		}
 
-static int init_pagemaps(struct page_read *pr)
+		/* All the fields live in the message itself, keep a copy of it */
+		*dst = *pe;
+		dst->base.n_unknown_fields = 0;
+		dst->base.unknown_fields = NULL;
+		pagemap_entry__free_unpacked(pe, NULL);
+	}
+}
+
+static int read_compact_pagemaps(struct page_read *pr, int *nr_pmes, int nr_realloc)
+{
+	struct pmc_state st = {};
+	size_t len = 0, off = 0;
+	bool eof = false;
+	int ret = -1;
+	u8 *buf;
+
+	BUILD_BUG_ON(PMC_DELTA != PE_DELTA);
+
+	buf = xmalloc(PAGEMAP_COMPACT_BLOCK_SIZE);
+	if (!buf)
+		return -1;
+
+	while (1) {
+		PagemapEntry *pe;
+		u32 nr_pages, flags;
+		u64 vaddr, delta_size;
+		int n;
+
+		n = pmc_decode(&st, buf + off, len - off, &vaddr, &nr_pages, &flags, &delta_size);
+		if (n < 0) {
+			pr_err("Malformed compact pagemap record #%d\n", pr->nr_pmes);
+			goto out;
+		}
+
+		if (n == 0) {
+			int want;
+
+			if (eof) {
+				if (off == len)
+					break;
+				pr_err("Compact pagemap trimmed %zu bytes\n", len - off);
+				goto out;
+			}
+
+			/* Move the partial record to the front and read the next block */
+			memmove(buf, buf + off, len - off);
+			len -= off;
+			off = 0;
+
+			want = PAGEMAP_COMPACT_BLOCK_SIZE - len;
+			n = bread(&pr->pmi->_x, buf + len, want);
+			if (n < 0) {
+				pr_perror("Can't read pagemap");
+				goto out;
+			}
+			eof = n < want;
+			len += n;
+			continue;
+		}
+		off += n;
+
+		pe = next_pagemap(pr, nr_pmes, nr_realloc);
+		if (!pe)
+			goto out;
+
+		pagemap_entry__init(pe);
+		pe->vaddr = vaddr;
+		pe->nr_pages = nr_pages;
+		pe->has_flags = true;
+		pe->flags = flags;
+		if (flags & PE_DELTA) {
+			pe->has_delta_size = true;
+			pe->delta_size = delta_size;
+		}
+	}
+
+	ret = 0;
+out:
+	xfree(buf);
+	return ret;
+}
+
+static int init_pagemaps(struct page_read *pr, bool compact)
 {
 	off_t fsize;
-	int nr_pmes, nr_realloc;
+	int nr_pmes, nr_realloc, ret;
 
 	if (opts.stream) {
 		/*
@@ -713,35 +979,25 @@ static int init_pagemaps(struct page_read *pr)
 	if (fsize < 0)
 		return -1;
 
-	nr_pmes = fsize / PAGEMAP_ENTRY_SIZE_ESTIMATE + 1;
-	nr_realloc = nr_pmes / 2;
+	if (compact)
+		nr_pmes = fsize / PAGEMAP_COMPACT_ENTRY_SIZE_ESTIMATE + 1;
+	else
+		nr_pmes = fsize / PAGEMAP_ENTRY_SIZE_ESTIMATE + 1;
+	nr_realloc = nr_pmes / 2 + 1;
 
-	pr->pmes = xzalloc(nr_pmes * sizeof(*pr->pmes));
+	pr->pmes = xmalloc(nr_pmes * sizeof(*pr->pmes));
 	if (!pr->pmes)
 		return -1;
 
 	pr->nr_pmes = 0;
 	pr->curr_pme = -1;
 
-	while (1) {
-		int ret = pb_read_one_eof(pr->pmi, &pr->pmes[pr->nr_pmes], PB_PAGEMAP);
-		if (ret < 0)
-			goto free_pagemaps;
-		if (ret == 0)
-			break;
-
-		init_compat_pagemap_entry(pr->pmes[pr->nr_pmes]);
-
-		pr->nr_pmes++;
-		if (pr->nr_pmes >= nr_pmes) {
-			PagemapEntry **new;
-			nr_pmes += nr_realloc;
-			new = xrealloc(pr->pmes, nr_pmes * sizeof(*pr->pmes));
-			if (!new)
-				goto free_pagemaps;
-			pr->pmes = new;
-		}
-	}
+	if (compact)
+		ret = read_compact_pagemaps(pr, &nr_pmes, nr_realloc);
+	else
+		ret = read_pagemaps(pr, &nr_pmes, nr_realloc);
+	if (ret < 0)
+		goto free_pagemaps;
 
 	close_image(pr->pmi);
 	pr->pmi = NULL;
@@ -758,6 +1014,7 @@ int open_page_read_at(int dfd, unsigned long img_id, struct page_read *pr, int p
 	int flags, i_typ;
 	static unsigned ids = 1;
 	bool remote = pr_flags & PR_REMOTE;
+	bool compact;
 
 	/*
 	 * Only the top-most page-read can be remote, all the
@@ -788,6 +1045,8 @@ int open_page_read_at(int dfd, unsigned long img_id, struct page_read *pr, int p
 	pr->parent = NULL;
 	pr->cvaddr = 0;
 	pr->pi_off = 0;
+	pr->pd_off = 0;
+	pr->pdi = NULL;
 	pr->bunch.iov_len = 0;
 	pr->bunch.iov_base = NULL;
 	pr->pmes = NULL;
@@ -807,13 +1066,22 @@ int open_page_read_at(int dfd, unsigned long img_id, struct page_read *pr, int p
 		return -1;
 	}
 
-	pr->pi = open_pages_image_at(dfd, flags, pr->pmi, &pr->pages_img_id);
+	pr->pi = open_pages_image_at(dfd, flags, pr->pmi, &pr->pages_img_id, &compact);
 	if (!pr->pi) {
 		close_page_read(pr);
 		return -1;
 	}
 
-	if (init_pagemaps(pr)) {
+	/* Deltas are made against the parent images only */
+	if (pr->parent) {
+		pr->pdi = open_image_at(dfd, CR_FD_PAGES_DELTA, O_RSTR, pr->pages_img_id);
+		if (!pr->pdi) {
+			close_page_read(pr);
+			return -1;
+		}
+	}
+
+	if (init_pagemaps(pr, compact)) {
 		close_page_read(pr);
 		return -1;
 	}
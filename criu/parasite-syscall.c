@@ -38,6 +38,7 @@
 #include <elf.h>
 
 #include "dump.h"
+#include "stats.h"
 #include "restorer.h"
 
 #include "infect.h"
@@ -150,6 +151,7 @@ int parasite_dump_thread_leader_seized(struct parasite_ctl *ctl, int pid, CoreEn
 
 	pc = args->creds;
 	pc->cap_last_cap = kdat.last_cap;
+	args->mpol.mode = opts.numa ? 0 : NUMA_NO_POLICY;
 
 	init_parasite_rseq_arg(&args->rseq);
 
@@ -184,6 +186,7 @@ int parasite_dump_thread_seized(struct parasite_thread_ctl *tctl, struct parasit
 
 	pc = args->creds;
 	pc->cap_last_cap = kdat.last_cap;
+	args->mpol.mode = opts.numa ? 0 : NUMA_NO_POLICY;
 
 	tc->has_blk_sigset = true;
 #ifdef CONFIG_MIPS
@@ -575,11 +578,14 @@ struct parasite_ctl *parasite_infect_seized(pid_t pid, struct pstree_item *item,
 {
 	struct parasite_ctl *ctl;
 	struct infect_ctx *ictx;
+	struct timeval start;
 	unsigned long p;
 	int ret;
 
 	BUG_ON(item->threads[0].real != pid);
 
+	gettimeofday(&start, NULL);
+
 	p = get_exec_start(vma_area_list);
 	if (!p) {
 		pr_err("No suitable VM found\n");
@@ -637,6 +643,7 @@ struct parasite_ctl *parasite_infect_seized(pid_t pid, struct pstree_item *item,
 	}
 
 	parasite_args_size = PARASITE_ARG_SIZE_MIN; /* reset for next task */
+	account_parasite_infect(pid, &start);
 #ifdef CONFIG_MIPS
 	memcpy(&item->core[0]->tc->blk_sigset, (unsigned long *)compel_task_sigmask(ctl),
 	       sizeof(item->core[0]->tc->blk_sigset));
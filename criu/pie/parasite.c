@@ -206,6 +206,13 @@ static int dump_thread_common(struct parasite_dump_thread *ti)
 		goto out;
 	}
 
+	/*
+	 * Without --numa criu asks for no policy. Kernels without
+	 * NUMA have no policies to dump.
+	 */
+	if (ti->mpol.mode != NUMA_NO_POLICY && sys_get_mempolicy(&ti->mpol.mode, ti->mpol.nodes, NUMA_MAX_NODES, 0, 0))
+		ti->mpol.mode = NUMA_NO_POLICY;
+
 	ret = dump_creds(ti->creds);
 out:
 	return ret;
@@ -10,6 +10,7 @@
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <sys/time.h>
+#include <time.h>
 #include <sys/shm.h>
 #include <fcntl.h>
 #include <unistd.h>
@@ -77,6 +78,7 @@
 
 static struct task_entries *task_entries_local;
 static futex_t thread_inprogress;
+static futex_t threads_started;
 static pid_t *helpers;
 static int n_helpers;
 static pid_t *zombies;
@@ -396,6 +398,88 @@ static void restore_sched_info(struct rst_sched_param *p)
 	sys_sched_setscheduler(0, p->policy, &param);
 }
 
+static int restore_mempolicy(struct numa_policy *pol)
+{
+	long ret;
+
+	if (pol->mode == NUMA_NO_POLICY)
+		return 0;
+
+	ret = sys_set_mempolicy(pol->mode, pol->nodes, NUMA_MAX_NODES + 1);
+	if (ret) {
+		pr_err("Unable to set memory policy %#x: %ld\n", pol->mode, ret);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int numa_set_policy(struct rst_numa_vma *v)
+{
+	long ret;
+
+	ret = sys_mbind(v->start, v->end - v->start, v->pol.mode, v->pol.nodes, NUMA_MAX_NODES + 1, 0);
+	if (ret) {
+		pr_err("Unable to set memory policy %#x on %" PRIx64 "-%" PRIx64 ": %ld\n", v->pol.mode, v->start,
+		       v->end, ret);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Before the pages are read in, the ranges get the node they were on
+ * as the preferred one, so that the pages are allocated there. VMAs
+ * without ranges get their policy right away.
+ */
+static int numa_prepare_placement(struct task_restore_args *args)
+{
+	unsigned long nodes[NUMA_NODE_LONGS];
+	int i;
+
+	for (i = 0; i < args->numa_vmas_n; i++)
+		if (!args->numa_vmas[i].placed && numa_set_policy(&args->numa_vmas[i]))
+			return -1;
+
+	for (i = 0; i < args->numa_ranges_n; i++) {
+		struct rst_numa_range *r = &args->numa_ranges[i];
+		long ret;
+
+		memset(nodes, 0, sizeof(nodes));
+		nodes[r->node / BITS_PER_LONG] = 1UL << (r->node % BITS_PER_LONG);
+
+		ret = sys_mbind(r->start, r->end - r->start, MPOL_PREFERRED, nodes, NUMA_MAX_NODES + 1, 0);
+		if (ret)
+			pr_warn("Can't prefer node %d for %" PRIx64 "-%" PRIx64 ": %ld\n", r->node, r->start, r->end,
+				ret);
+	}
+
+	return 0;
+}
+
+/* Once the pages are in, drop the preferred nodes and set the real policies */
+static int numa_finish_placement(struct task_restore_args *args)
+{
+	int i;
+
+	for (i = 0; i < args->numa_ranges_n; i++) {
+		struct rst_numa_range *r = &args->numa_ranges[i];
+		long ret;
+
+		ret = sys_mbind(r->start, r->end - r->start, MPOL_DEFAULT, NULL, 0, 0);
+		if (ret)
+			pr_warn("Can't drop the preferred node of %" PRIx64 "-%" PRIx64 ": %ld\n", r->start, r->end,
+				ret);
+	}
+
+	for (i = 0; i < args->numa_vmas_n; i++)
+		if (args->numa_vmas[i].placed && numa_set_policy(&args->numa_vmas[i]))
+			return -1;
+
+	return 0;
+}
+
 static void restore_rlims(struct task_restore_args *ta)
 {
 	int r;
@@ -571,6 +655,9 @@ static int restore_thread_common(struct thread_restore_args *args)
 
 	restore_sched_info(&args->sp);
 
+	if (restore_mempolicy(&args->mpol))
+		return -1;
+
 	if (restore_nonsigframe_gpregs(&args->gpregs))
 		return -1;
 
@@ -684,6 +771,98 @@ static int recv_cg_set_restore_ack(int sk)
 	return 0;
 }
 
+/* How many threads each thread creates when they are created as a tree */
+#define THREAD_FANOUT 2
+
+/*
+ * Creates the thread at @i in ta->thread_args. @fd is ns_last_pid
+ * opened when there is no clone3() with set_tid. Never inlined, as
+ * the clone asm can only be put into the code once.
+ */
+static noinline long clone_thread(struct task_restore_args *ta, int i, int fd)
+{
+	struct thread_restore_args *thread_args = ta->thread_args;
+	long clone_flags = CLONE_VM | CLONE_FILES | CLONE_SIGHAND | CLONE_THREAD | CLONE_SYSVSEM | CLONE_FS;
+	unsigned long new_sp = restorer_stack(thread_args[i].mz);
+	long parent_tid, ret;
+
+	if (ta->has_clone3_set_tid) {
+		struct _clone_args c_args = {};
+		pid_t thread_pid = thread_args[i].pid;
+
+		c_args.set_tid = ptr_to_u64(&thread_pid);
+		c_args.flags = clone_flags;
+		c_args.set_tid_size = 1;
+		/* The kernel does stack + stack_size. */
+		c_args.stack = new_sp - RESTORE_STACK_SIZE;
+		c_args.stack_size = RESTORE_STACK_SIZE;
+		c_args.child_tid = ptr_to_u64(&thread_args[i].pid);
+		c_args.parent_tid = ptr_to_u64(&parent_tid);
+		pr_debug("Using clone3 to restore the process\n");
+		RUN_CLONE3_RESTORE_FN(ret, c_args, sizeof(c_args), &thread_args[i], ta->clone_restore_fn);
+	} else {
+		char last_pid_buf[16], *s;
+		long last_pid_len;
+
+		last_pid_len = std_vprint_num(last_pid_buf, sizeof(last_pid_buf), thread_args[i].pid - 1, &s);
+		sys_lseek(fd, 0, SEEK_SET);
+		ret = sys_write(fd, s, last_pid_len);
+		if (ret < 0) {
+			pr_err("Can't set last_pid %ld/%s\n", ret, s);
+			return ret;
+		}
+
+		/*
+		 * To achieve functionality like libc's clone()
+		 * we need a pure assembly here, because clone()'ed
+		 * thread will run with own stack and we must not
+		 * have any additional instructions... oh, dear...
+		 */
+		RUN_CLONE_RESTORE_FN(ret, clone_flags, new_sp, parent_tid, thread_args, ta->clone_restore_fn);
+	}
+
+	if (ret != thread_args[i].pid) {
+		pr_err("Unable to create a thread: %ld\n", ret);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * With clone3() and set_tid nobody else's pids get in the way, so
+ * the threads are created as a tree: the one at place p creates the
+ * ones at places p * THREAD_FANOUT + 1 ... + THREAD_FANOUT. This way
+ * it takes log(nr_threads) steps and no locks. The leader is at place
+ * 0, the thread at index 0 of thread_args takes its place instead.
+ */
+static int thread_tree_place(struct task_restore_args *ta, int i)
+{
+	int leader = ta->t - ta->thread_args;
+
+	if (i == leader)
+		return 0;
+	if (i == 0)
+		return leader;
+	return i;
+}
+
+static int create_thread_subtree(struct task_restore_args *ta, int i)
+{
+	int place = thread_tree_place(ta, i), child, n;
+
+	for (n = 1; n <= THREAD_FANOUT; n++) {
+		child = place * THREAD_FANOUT + n;
+		if (child >= ta->nr_threads)
+			break;
+
+		if (clone_thread(ta, thread_tree_place(ta, child), -1))
+			return -1;
+	}
+
+	return 0;
+}
+
 /*
  * Threads restoration via sigreturn. Note it's locked
  * routine and calls for unlock at the end.
@@ -709,6 +888,10 @@ long __export_restore_thread(struct thread_restore_args *args)
 		goto core_restore_end;
 	}
 
+	if (args->ta->has_clone3_set_tid && create_thread_subtree(args->ta, args - args->ta->thread_args))
+		goto core_restore_end;
+	futex_inc_and_wake(&threads_started);
+
 	rt_sigframe = (void *)&args->mz->rt_sigframe;
 
 	if (args->cg_set != -1) {
@@ -1674,6 +1857,9 @@ long __export_restore_task(struct task_restore_args *args)
 		}
 	}
 
+	if (numa_prepare_placement(args))
+		goto core_restore_end;
+
 	/*
 	 * Now read the contents (if any)
 	 */
@@ -1725,6 +1911,9 @@ long __export_restore_task(struct task_restore_args *args)
 	if (args->vma_ios_fd != -1)
 		sys_close(args->vma_ios_fd);
 
+	if (numa_finish_placement(args))
+		goto core_restore_end;
+
 	/*
 	 * Proxify vDSO.
 	 */
@@ -1784,6 +1973,30 @@ long __export_restore_task(struct task_restore_args *args)
 		}
 	}
 
+	/*
+	 * Push the pages that were cold at dump time out of the active
+	 * list. This is only a hint, so failures are not fatal.
+	 */
+	for (i = 0; i < args->cold_n; i++) {
+		struct iovec *iov = &args->cold[i];
+
+		ret = sys_madvise((unsigned long)iov->iov_base, iov->iov_len, args->cold_advice);
+		if (ret)
+			pr_debug("madvise(%p, %zu, %d) on cold pages failed with %ld\n", iov->iov_base, iov->iov_len,
+				 args->cold_advice, ret);
+	}
+
+	/* The application asked to drop these on checkpoint */
+	for (i = 0; i < args->discard_n; i++) {
+		struct iovec *iov = &args->discard[i];
+
+		ret = sys_munmap(iov->iov_base, iov->iov_len);
+		if (ret) {
+			pr_err("Unable to unmap discarded %p:%zu: %ld\n", iov->iov_base, iov->iov_len, ret);
+			goto core_restore_end;
+		}
+	}
+
 	/*
 	 * Tune up the task fields.
 	 */
@@ -1898,77 +2111,44 @@ long __export_restore_task(struct task_restore_args *args)
 	 */
 
 	if (args->nr_threads > 1) {
-		struct thread_restore_args *thread_args = args->thread_args;
-		long clone_flags = CLONE_VM | CLONE_FILES | CLONE_SIGHAND | CLONE_THREAD | CLONE_SYSVSEM | CLONE_FS;
-		long last_pid_len;
-		pid_t thread_pid;
-		long parent_tid;
-		int i, fd = -1;
+		struct timespec start, end;
+		int i, fd;
+
+		sys_clock_gettime(CLOCK_MONOTONIC, &start);
 
-		if (!args->has_clone3_set_tid) {
+		if (args->has_clone3_set_tid) {
+			if (create_thread_subtree(args, args->t - args->thread_args))
+				goto core_restore_end;
+		} else {
 			/* One level pid ns hierarhy */
 			fd = sys_openat(args->proc_fd, LAST_PID_PATH, O_RDWR, 0);
 			if (fd < 0) {
 				pr_err("can't open last pid fd %d\n", fd);
 				goto core_restore_end;
 			}
-		}
-		mutex_lock(&task_entries_local->last_pid_mutex);
 
-		for (i = 0; i < args->nr_threads; i++) {
-			char last_pid_buf[16], *s;
-
-			/* skip self */
-			if (thread_args[i].pid == args->t->pid)
-				continue;
+			mutex_lock(&task_entries_local->last_pid_mutex);
+			for (i = 0; i < args->nr_threads; i++) {
+				/* skip self */
+				if (args->thread_args[i].pid == args->t->pid)
+					continue;
 
-			new_sp = restorer_stack(thread_args[i].mz);
-			if (args->has_clone3_set_tid) {
-				struct _clone_args c_args = {};
-				thread_pid = thread_args[i].pid;
-				c_args.set_tid = ptr_to_u64(&thread_pid);
-				c_args.flags = clone_flags;
-				c_args.set_tid_size = 1;
-				/* The kernel does stack + stack_size. */
-				c_args.stack = new_sp - RESTORE_STACK_SIZE;
-				c_args.stack_size = RESTORE_STACK_SIZE;
-				c_args.child_tid = ptr_to_u64(&thread_args[i].pid);
-				c_args.parent_tid = ptr_to_u64(&parent_tid);
-				pr_debug("Using clone3 to restore the process\n");
-				RUN_CLONE3_RESTORE_FN(ret, c_args, sizeof(c_args), &thread_args[i],
-						      args->clone_restore_fn);
-			} else {
-				last_pid_len =
-					std_vprint_num(last_pid_buf, sizeof(last_pid_buf), thread_args[i].pid - 1, &s);
-				sys_lseek(fd, 0, SEEK_SET);
-				ret = sys_write(fd, s, last_pid_len);
-				if (ret < 0) {
-					pr_err("Can't set last_pid %ld/%s\n", ret, s);
+				if (clone_thread(args, i, fd)) {
 					sys_close(fd);
 					mutex_unlock(&task_entries_local->last_pid_mutex);
 					goto core_restore_end;
 				}
-
-				/*
-				 * To achieve functionality like libc's clone()
-				 * we need a pure assembly here, because clone()'ed
-				 * thread will run with own stack and we must not
-				 * have any additional instructions... oh, dear...
-				 */
-				RUN_CLONE_RESTORE_FN(ret, clone_flags, new_sp, parent_tid, thread_args,
-						     args->clone_restore_fn);
-			}
-			if (ret != thread_args[i].pid) {
-				pr_err("Unable to create a thread: %ld\n", ret);
-				sys_close(fd);
-				mutex_unlock(&task_entries_local->last_pid_mutex);
-				goto core_restore_end;
 			}
+			mutex_unlock(&task_entries_local->last_pid_mutex);
+			sys_close(fd);
 		}
 
-		mutex_unlock(&task_entries_local->last_pid_mutex);
-		if (fd >= 0)
-			sys_close(fd);
+		/* Timers and the rest below may be aimed at any of them */
+		futex_wait_until(&threads_started, args->nr_threads - 1);
+
+		sys_clock_gettime(CLOCK_MONOTONIC, &end);
+		atomic_add((end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000,
+			   &task_entries_local->thread_create_time);
 	}
 
 	restore_rlims(args);
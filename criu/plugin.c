@@ -5,6 +5,7 @@
 #include <stdio.h>
 #include <errno.h>
 #include <dlfcn.h>
+#include <sys/time.h>
 
 #include "cr_options.h"
 #include "common/compiler.h"
@@ -19,6 +20,17 @@ cr_plugin_ctl_t cr_plugin_ctl = {
 	.head.prev = &cr_plugin_ctl.head,
 };
 
+/* Operations started by hooks and not yet completed */
+struct plugin_pending {
+	struct list_head l;
+	cr_plugin_wait_t *wait;
+	void *arg;
+	pid_t owner;
+	struct timeval since;
+};
+
+static LIST_HEAD(plugin_pending);
+
 /*
  * If we met old version of a plugin, selfgenerate a plugin descriptor for it.
  */
@@ -98,6 +110,63 @@ int criu_get_image_dir(void)
 	return get_service_fd(IMG_FD_OFF);
 }
 
+int criu_plugin_add_pending(cr_plugin_wait_t *wait, void *arg)
+{
+	struct plugin_pending *p;
+
+	p = xmalloc(sizeof(*p));
+	if (!p)
+		return -1;
+
+	p->wait = wait;
+	p->arg = arg;
+	p->owner = getpid();
+	gettimeofday(&p->since, NULL);
+	list_add_tail(&p->l, &plugin_pending);
+
+	return 0;
+}
+
+static long tv_delta_us(const struct timeval *from, const struct timeval *to)
+{
+	return (to->tv_sec - from->tv_sec) * 1000000L + (to->tv_usec - from->tv_usec);
+}
+
+/*
+ * Wait for all the operations started by hooks in this process.
+ */
+int cr_plugin_join(void)
+{
+	struct plugin_pending *p, *tmp;
+	pid_t pid = getpid();
+	int ret = 0;
+
+	list_for_each_entry_safe(p, tmp, &plugin_pending, l) {
+		struct timeval start, end;
+
+		list_del(&p->l);
+
+		/* Inherited from the parent, that one waits for it */
+		if (p->owner != pid) {
+			xfree(p);
+			continue;
+		}
+
+		gettimeofday(&start, NULL);
+		if (p->wait(p->arg)) {
+			pr_err("plugin: pending operation %p failed\n", p->wait);
+			ret = -1;
+		}
+		gettimeofday(&end, NULL);
+
+		pr_info("plugin: pending operation %p overlapped %ld us of other work, waited %ld us\n", p->wait,
+			tv_delta_us(&p->since, &start), tv_delta_us(&start, &end));
+		xfree(p);
+	}
+
+	return ret;
+}
+
 static int cr_lib_load(int stage, char *path)
 {
 	cr_plugin_desc_t *d;
@@ -178,6 +247,10 @@ void cr_plugin_fini(int stage, int ret)
 {
 	plugin_desc_t *this, *tmp;
 
+	/* Nothing may be left running in a plugin which is unloaded */
+	if (cr_plugin_join())
+		pr_err("Pending plugin operations failed\n");
+
 	list_for_each_entry_safe(this, tmp, &cr_plugin_ctl.head, list) {
 		void *h = this->dlhandle;
 		size_t i;
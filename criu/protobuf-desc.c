@@ -68,6 +68,8 @@
 #include "images/bpfmap-file.pb-c.h"
 #include "images/bpfmap-data.pb-c.h"
 #include "images/apparmor.pb-c.h"
+#include "images/page-cache.pb-c.h"
+#include "images/numa.pb-c.h"
 
 struct cr_pb_message_desc cr_pb_descs[PB_MAX];
 
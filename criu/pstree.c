@@ -27,8 +27,12 @@ void core_entry_free(CoreEntry *core)
 {
 	if (core->tc && core->tc->timers)
 		xfree(core->tc->timers->posix);
-	if (core->thread_core)
+	if (core->thread_core) {
 		xfree(core->thread_core->creds->groups);
+		if (core->thread_core->mempolicy)
+			xfree(core->thread_core->mempolicy->nodes);
+		xfree(core->thread_core->mempolicy);
+	}
 	arch_free_thread_info(core);
 	xfree(core);
 }
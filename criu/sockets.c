@@ -1,8 +1,11 @@
 #include <sched.h>
 #include <unistd.h>
+#include <stdio.h>
+#include <dirent.h>
 #include <sys/socket.h>
 #include <linux/netlink.h>
 #include <linux/rtnetlink.h>
+#include <libnl3/netlink/msg.h>
 #include <netinet/tcp.h>
 #include <errno.h>
 #include <linux/if.h>
@@ -30,6 +33,7 @@
 #include "util.h"
 #include "fdstore.h"
 #include "cr_options.h"
+#include "stats.h"
 
 #undef LOG_PREFIX
 #define LOG_PREFIX "sockets: "
@@ -430,14 +434,22 @@ struct socket_desc *lookup_socket_ino(unsigned int ino, int family)
 	return NULL;
 }
 
+static struct socket_desc *collect_socket_late(unsigned int ino, int family, int proto);
+
 struct socket_desc *lookup_socket(unsigned int ino, int family, int proto)
 {
+	struct socket_desc *sd;
+
 	if (!socket_test_collect_bit(family, proto)) {
 		pr_err("Sockets (family %d proto %d) are not collected\n", family, proto);
 		return ERR_PTR(-EINVAL);
 	}
 
-	return lookup_socket_ino(ino, family);
+	sd = lookup_socket_ino(ino, family);
+	if (!sd)
+		sd = collect_socket_late(ino, family, proto);
+
+	return sd;
 }
 
 int sk_collect_one(unsigned ino, int family, struct socket_desc *d, struct ns_id *ns)
@@ -456,6 +468,26 @@ int sk_collect_one(unsigned ino, int family, struct socket_desc *d, struct ns_id
 	return 0;
 }
 
+/* Calls @cb for every socket of @family collected in @ns */
+int for_each_ns_socket(struct ns_id *ns, int family, int (*cb)(struct socket_desc *sd, void *arg), void *arg)
+{
+	struct socket_desc *sd;
+	int i, ret;
+
+	for (i = 0; i < SK_HASH_SIZE; i++) {
+		for (sd = sockets[i]; sd; sd = sd->next) {
+			if (sd->sk_ns != ns || sd->family != family)
+				continue;
+
+			ret = cb(sd, arg);
+			if (ret)
+				return ret;
+		}
+	}
+
+	return 0;
+}
+
 int do_restore_opt(int sk, int level, int name, void *val, int len)
 {
 	if (setsockopt(sk, level, name, val, len) < 0) {
@@ -840,121 +872,429 @@ static int collect_err(int err, struct ns_id *ns, void *arg)
 	return err;
 }
 
-int collect_sockets(struct ns_id *ns)
+/*
+ * When the tasks share the netns with the rest of the system (it is
+ * criu's one or an external one), asking sock diag for all sockets
+ * brings in every socket on the machine to find the few the tasks
+ * have. Instead the inodes of the sockets in the tasks' fds and
+ * mappings are gathered first. Unix sockets are then asked for one by
+ * one together with their peers and embryos, while the rest, which
+ * can't be looked up by inode, are dumped in full but only the ones
+ * in the scope are kept. Sockets found later, e.g. in unix queues,
+ * are collected by collect_socket_late().
+ */
+static struct {
+	unsigned int *ino; /* in the order added */
+	unsigned int nr, size;
+	unsigned int *hash; /* open addressing, 0 is empty */
+	unsigned int hash_size;
+	bool ready;
+} sk_scope;
+
+static struct {
+	unsigned long collected;
+	unsigned long skipped;
+	unsigned long bytes;
+} sk_collect_stat;
+
+static unsigned int *scope_slot(unsigned int *hash, unsigned int size, unsigned int ino)
 {
-	int err = 0, tmp;
-	int nl = ns->net.nlsk;
+	unsigned int i = (ino * 2654435761U) & (size - 1);
+
+	while (hash[i] && hash[i] != ino)
+		i = (i + 1) & (size - 1);
+
+	return &hash[i];
+}
+
+static bool scope_has(unsigned int ino)
+{
+	return sk_scope.hash_size && *scope_slot(sk_scope.hash, sk_scope.hash_size, ino) == ino;
+}
+
+static int scope_add(unsigned int ino)
+{
+	if (!ino || scope_has(ino))
+		return 0;
+
+	if (sk_scope.nr == sk_scope.size) {
+		unsigned int size = sk_scope.size ? sk_scope.size * 2 : 64, i;
+		unsigned int *hash;
+
+		if (xrealloc_safe(&sk_scope.ino, size * sizeof(*sk_scope.ino)))
+			return -1;
+
+		hash = xzalloc(2 * size * sizeof(*hash));
+		if (!hash)
+			return -1;
+		for (i = 0; i < sk_scope.nr; i++)
+			*scope_slot(hash, 2 * size, sk_scope.ino[i]) = sk_scope.ino[i];
+
+		xfree(sk_scope.hash);
+		sk_scope.hash = hash;
+		sk_scope.hash_size = 2 * size;
+		sk_scope.size = size;
+	}
+
+	sk_scope.ino[sk_scope.nr++] = ino;
+	*scope_slot(sk_scope.hash, sk_scope.hash_size, ino) = ino;
+	return 0;
+}
+
+static int scope_collect_task(pid_t pid)
+{
+	unsigned int ino;
+	struct dirent *de;
+	char buf[64];
+	FILE *maps;
+	DIR *fds;
+	int ret = 0;
+
+	fds = opendir_proc(pid, "fd");
+	if (!fds)
+		return -1;
+
+	while ((de = readdir(fds))) {
+		ssize_t len;
+
+		if (dir_dots(de))
+			continue;
+
+		len = readlinkat(dirfd(fds), de->d_name, buf, sizeof(buf) - 1);
+		if (len < 0)
+			continue;
+		buf[len] = '\0';
+
+		if (sscanf(buf, "socket:[%u]", &ino) == 1 && scope_add(ino)) {
+			ret = -1;
+			break;
+		}
+	}
+	closedir(fds);
+	if (ret)
+		return ret;
+
+	/* Packet sockets may be mapped and closed */
+	maps = fopen_proc(pid, "maps");
+	if (!maps)
+		return -1;
+
+	while (fgets(buf, sizeof(buf), maps)) {
+		char *sk = strstr(buf, "socket:[");
+
+		if (sk && sscanf(sk, "socket:[%u]", &ino) == 1 && scope_add(ino)) {
+			ret = -1;
+			break;
+		}
+	}
+	fclose(maps);
+
+	return ret;
+}
+
+static int scope_init(void)
+{
+	struct pstree_item *item;
+
+	if (sk_scope.ready)
+		return 0;
+
+	for_each_pstree_item(item) {
+		if (item->pid->state == TASK_DEAD)
+			continue;
+		if (scope_collect_task(item->pid->real))
+			return -1;
+	}
+
+	pr_info("Found %u sockets in the tasks\n", sk_scope.nr);
+	sk_scope.ready = true;
+	return 0;
+}
+
+struct sk_collect_desc {
+	int family;
+	int protocol;
+	int (*receive)(struct nlmsghdr *h, struct ns_id *ns, void *arg);
+};
+
+static const struct sk_collect_desc sk_collect_descs[] = {
+	{ AF_UNIX, 0, unix_receive_one },
+	{ AF_INET, IPPROTO_TCP, inet_receive_one },
+	{ AF_INET, IPPROTO_UDP, inet_receive_one },
+	{ AF_INET, IPPROTO_UDPLITE, inet_receive_one },
+	{ AF_INET, IPPROTO_RAW, inet_receive_one },
+	{ AF_INET6, IPPROTO_TCP, inet_receive_one },
+	{ AF_INET6, IPPROTO_UDP, inet_receive_one },
+	{ AF_INET6, IPPROTO_UDPLITE, inet_receive_one },
+	{ AF_INET6, IPPROTO_RAW, inet_receive_one },
+	{ AF_PACKET, 0, packet_receive_one },
+	{ AF_NETLINK, NDIAG_PROTO_ALL, netlink_receive_one },
+};
+
+struct sk_collect_req {
 	struct sock_diag_req req;
+	const struct sk_collect_desc *desc;
+	bool scoped;
+};
 
-	memset(&req, 0, sizeof(req));
-	req.hdr.nlmsg_len = sizeof(req);
-	req.hdr.nlmsg_type = SOCK_DIAG_BY_FAMILY;
-	req.hdr.nlmsg_flags = NLM_F_DUMP | NLM_F_REQUEST;
-	req.hdr.nlmsg_seq = CR_NLMSG_SEQ;
+static void fill_collect_req(struct sk_collect_req *cr, const struct sk_collect_desc *d, bool scoped)
+{
+	struct sock_diag_req *req = &cr->req;
 
-	/* Collect UNIX sockets */
-	req.r.u.sdiag_family = AF_UNIX;
-	req.r.u.udiag_states = -1; /* All */
-	req.r.u.udiag_show = UDIAG_SHOW_NAME | UDIAG_SHOW_VFS | UDIAG_SHOW_PEER | UDIAG_SHOW_ICONS | UDIAG_SHOW_RQLEN;
-	tmp = do_collect_req(nl, &req, sizeof(req), unix_receive_one, collect_err, ns, &req.r.u);
-	if (tmp)
-		err = tmp;
+	memset(req, 0, sizeof(*req));
+	req->hdr.nlmsg_len = sizeof(*req);
+	req->hdr.nlmsg_type = SOCK_DIAG_BY_FAMILY;
+	req->hdr.nlmsg_flags = NLM_F_DUMP | NLM_F_REQUEST;
+	req->hdr.nlmsg_seq = CR_NLMSG_SEQ;
 
-	/* Collect IPv4 TCP sockets */
-	req.r.i.sdiag_family = AF_INET;
-	req.r.i.sdiag_protocol = IPPROTO_TCP;
-	req.r.i.idiag_ext = 0;
-	/* Only listening and established sockets supported yet */
-	req.r.i.idiag_states = (1 << TCP_LISTEN) | (1 << TCP_ESTABLISHED) | (1 << TCP_FIN_WAIT1) |
-			       (1 << TCP_FIN_WAIT2) | (1 << TCP_CLOSE_WAIT) | (1 << TCP_LAST_ACK) | (1 << TCP_CLOSING) |
-			       (1 << TCP_SYN_SENT);
-	tmp = do_collect_req(nl, &req, sizeof(req), inet_receive_one, collect_err, ns, &req.r.i);
-	if (tmp)
-		err = tmp;
-
-	/* Collect IPv4 UDP sockets */
-	req.r.i.sdiag_family = AF_INET;
-	req.r.i.sdiag_protocol = IPPROTO_UDP;
-	req.r.i.idiag_ext = 0;
-	req.r.i.idiag_states = -1; /* All */
-	tmp = do_collect_req(nl, &req, sizeof(req), inet_receive_one, collect_err, ns, &req.r.i);
-	if (tmp)
-		err = tmp;
-
-	/* Collect IPv4 UDP-lite sockets */
-	req.r.i.sdiag_family = AF_INET;
-	req.r.i.sdiag_protocol = IPPROTO_UDPLITE;
-	req.r.i.idiag_ext = 0;
-	req.r.i.idiag_states = -1; /* All */
-	tmp = do_collect_req(nl, &req, sizeof(req), inet_receive_one, collect_err, ns, &req.r.i);
-	if (tmp)
-		err = tmp;
-
-	/* Collect IPv4 RAW sockets */
-	req.r.i.sdiag_family = AF_INET;
-	req.r.i.sdiag_protocol = IPPROTO_RAW;
-	req.r.i.idiag_ext = 0;
-	req.r.i.idiag_states = -1; /* All */
-	tmp = do_collect_req(nl, &req, sizeof(req), inet_receive_one, collect_err, ns, &req.r.i);
-	if (tmp)
-		err = tmp;
-
-	/* Collect IPv6 TCP sockets */
-	req.r.i.sdiag_family = AF_INET6;
-	req.r.i.sdiag_protocol = IPPROTO_TCP;
-	req.r.i.idiag_ext = 0;
-	/* Only listening sockets supported yet */
-	req.r.i.idiag_states = (1 << TCP_LISTEN) | (1 << TCP_ESTABLISHED) | (1 << TCP_FIN_WAIT1) |
-			       (1 << TCP_FIN_WAIT2) | (1 << TCP_CLOSE_WAIT) | (1 << TCP_LAST_ACK) | (1 << TCP_CLOSING) |
-			       (1 << TCP_SYN_SENT);
-	tmp = do_collect_req(nl, &req, sizeof(req), inet_receive_one, collect_err, ns, &req.r.i);
-	if (tmp)
-		err = tmp;
-
-	/* Collect IPv6 UDP sockets */
-	req.r.i.sdiag_family = AF_INET6;
-	req.r.i.sdiag_protocol = IPPROTO_UDP;
-	req.r.i.idiag_ext = 0;
-	req.r.i.idiag_states = -1; /* All */
-	tmp = do_collect_req(nl, &req, sizeof(req), inet_receive_one, collect_err, ns, &req.r.i);
-	if (tmp)
-		err = tmp;
-
-	/* Collect IPv6 UDP-lite sockets */
-	req.r.i.sdiag_family = AF_INET6;
-	req.r.i.sdiag_protocol = IPPROTO_UDPLITE;
-	req.r.i.idiag_ext = 0;
-	req.r.i.idiag_states = -1; /* All */
-	tmp = do_collect_req(nl, &req, sizeof(req), inet_receive_one, collect_err, ns, &req.r.i);
-	if (tmp)
-		err = tmp;
-
-	/* Collect IPv6 RAW sockets */
-	req.r.i.sdiag_family = AF_INET6;
-	req.r.i.sdiag_protocol = IPPROTO_RAW;
-	req.r.i.idiag_ext = 0;
-	req.r.i.idiag_states = -1; /* All */
-	tmp = do_collect_req(nl, &req, sizeof(req), inet_receive_one, collect_err, ns, &req.r.i);
-	if (tmp)
-		err = tmp;
-
-	req.r.p.sdiag_family = AF_PACKET;
-	req.r.p.sdiag_protocol = 0;
-	req.r.p.pdiag_show = PACKET_SHOW_INFO | PACKET_SHOW_MCLIST | PACKET_SHOW_FANOUT | PACKET_SHOW_RING_CFG;
-	tmp = do_collect_req(nl, &req, sizeof(req), packet_receive_one, collect_err, ns, &req.r.p);
-	if (tmp)
-		err = tmp;
-
-	req.r.n.sdiag_family = AF_NETLINK;
-	req.r.n.sdiag_protocol = NDIAG_PROTO_ALL;
-	req.r.n.ndiag_show = NDIAG_SHOW_GROUPS;
-	tmp = do_collect_req(nl, &req, sizeof(req), netlink_receive_one, collect_err, ns, &req.r.n);
-	if (tmp)
-		err = tmp;
-
-	/* don't need anymore */
-	close(nl);
-	ns->net.nlsk = -1;
+	switch (d->family) {
+	case AF_UNIX:
+		req->r.u.sdiag_family = AF_UNIX;
+		req->r.u.udiag_states = -1; /* All */
+		req->r.u.udiag_show = UDIAG_SHOW_NAME | UDIAG_SHOW_VFS | UDIAG_SHOW_PEER | UDIAG_SHOW_ICONS |
+				      UDIAG_SHOW_RQLEN;
+		break;
+	case AF_INET:
+	case AF_INET6:
+		req->r.i.sdiag_family = d->family;
+		req->r.i.sdiag_protocol = d->protocol;
+		req->r.i.idiag_ext = 0;
+		if (d->protocol == IPPROTO_TCP)
+			/* Only listening and established sockets supported yet */
+			req->r.i.idiag_states = (1 << TCP_LISTEN) | (1 << TCP_ESTABLISHED) | (1 << TCP_FIN_WAIT1) |
+						(1 << TCP_FIN_WAIT2) | (1 << TCP_CLOSE_WAIT) | (1 << TCP_LAST_ACK) |
+						(1 << TCP_CLOSING) | (1 << TCP_SYN_SENT);
+		else
+			req->r.i.idiag_states = -1; /* All */
+		break;
+	case AF_PACKET:
+		req->r.p.sdiag_family = AF_PACKET;
+		req->r.p.sdiag_protocol = 0;
+		req->r.p.pdiag_show = PACKET_SHOW_INFO | PACKET_SHOW_MCLIST | PACKET_SHOW_FANOUT |
+				      PACKET_SHOW_RING_CFG;
+		break;
+	case AF_NETLINK:
+		req->r.n.sdiag_family = AF_NETLINK;
+		req->r.n.sdiag_protocol = NDIAG_PROTO_ALL;
+		req->r.n.ndiag_show = NDIAG_SHOW_GROUPS;
+		break;
+	}
+
+	cr->desc = d;
+	cr->scoped = scoped;
+}
+
+static unsigned int diag_msg_ino(int family, struct nlmsghdr *h)
+{
+	switch (family) {
+	case AF_UNIX:
+		return ((struct unix_diag_msg *)NLMSG_DATA(h))->udiag_ino;
+	case AF_INET:
+	case AF_INET6:
+		return ((struct inet_diag_msg *)NLMSG_DATA(h))->idiag_inode;
+	case AF_PACKET:
+		return ((struct packet_diag_msg *)NLMSG_DATA(h))->pdiag_ino;
+	case AF_NETLINK:
+		return ((struct netlink_diag_msg *)NLMSG_DATA(h))->ndiag_ino;
+	}
+
+	return 0;
+}
+
+/* The peer and the embryos of a unix socket have to be collected too */
+static int scope_add_unix_peers(struct nlmsghdr *h)
+{
+	struct nlattr *tb[UNIX_DIAG_MAX + 1];
+	unsigned int *icons, i;
+
+	nlmsg_parse(h, sizeof(struct unix_diag_msg), tb, UNIX_DIAG_MAX, NULL);
+
+	if (tb[UNIX_DIAG_PEER] && scope_add(nla_get_u32(tb[UNIX_DIAG_PEER])))
+		return -1;
+
+	if (tb[UNIX_DIAG_ICONS]) {
+		icons = nla_data(tb[UNIX_DIAG_ICONS]);
+		for (i = 0; i < nla_len(tb[UNIX_DIAG_ICONS]) / sizeof(u32); i++)
+			if (scope_add(icons[i]))
+				return -1;
+	}
+
+	return 0;
+}
+
+static int collect_one(struct nlmsghdr *h, struct ns_id *ns, void *arg)
+{
+	struct sk_collect_req *cr = arg;
+	int family = cr->desc->family;
+
+	sk_collect_stat.bytes += h->nlmsg_len;
+
+	if (cr->scoped) {
+		unsigned int ino = diag_msg_ino(family, h);
+
+		if (!scope_has(ino) || lookup_socket_ino(ino, family)) {
+			sk_collect_stat.skipped++;
+			return 0;
+		}
+
+		if (family == AF_UNIX && scope_add_unix_peers(h))
+			return -1;
+	}
+
+	sk_collect_stat.collected++;
+	return cr->desc->receive(h, ns, &cr->req.r);
+}
+
+static int collect_one_err(int err, struct ns_id *ns, void *arg)
+{
+	struct sk_collect_req *cr = arg;
+
+	return collect_err(err, ns, &cr->req.r);
+}
+
+static int collect_unix_err(int err, struct ns_id *ns, void *arg)
+{
+	/* Not a unix socket or not in this netns */
+	if (err == -ENOENT)
+		return 0;
+
+	return collect_one_err(err, ns, arg);
+}
+
+static int collect_unix_one(int nl, struct ns_id *ns, struct sk_collect_req *cr, unsigned int ino)
+{
+	cr->req.hdr.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+	cr->req.r.u.udiag_ino = ino;
+	cr->req.r.u.udiag_cookie[0] = INET_DIAG_NOCOOKIE;
+	cr->req.r.u.udiag_cookie[1] = INET_DIAG_NOCOOKIE;
+
+	return do_rtnl_req(nl, &cr->req, sizeof(cr->req), collect_one, collect_unix_err, ns, cr);
+}
+
+static int collect_unix_scoped(int nl, struct ns_id *ns, struct sk_collect_req *cr)
+{
+	unsigned int i;
+	int ret;
+
+	/* The scope grows with peers and embryos while we walk it */
+	for (i = 0; i < sk_scope.nr; i++) {
+		if (lookup_socket_ino(sk_scope.ino[i], AF_UNIX))
+			continue;
+
+		ret = collect_unix_one(nl, ns, cr, sk_scope.ino[i]);
+		if (ret)
+			return ret;
+	}
+
+	set_collect_bit(AF_UNIX, 0);
+	return 0;
+}
+
+static const struct sk_collect_desc *find_collect_desc(int family, int proto)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(sk_collect_descs); i++) {
+		const struct sk_collect_desc *d = &sk_collect_descs[i];
+
+		if (d->family != family)
+			continue;
+		if (family != AF_INET && family != AF_INET6)
+			return d;
+		if (d->protocol == proto)
+			return d;
+	}
+
+	return NULL;
+}
+
+/*
+ * The socket was not found by the scoped collection. Ask the netnses
+ * collected that way for it, unix ones by inode and the rest with a
+ * full dump, keeping only this one.
+ */
+static struct socket_desc *collect_socket_late(unsigned int ino, int family, int proto)
+{
+	const struct sk_collect_desc *d;
+	struct sk_collect_req cr;
+	struct ns_id *ns;
+	int ret;
+
+	/* Sockets in the scope were looked for already */
+	if (!sk_scope.ready || scope_has(ino))
+		return NULL;
+
+	d = find_collect_desc(family, proto);
+	if (!d || scope_add(ino))
+		return NULL;
+
+	for (ns = ns_ids; ns; ns = ns->next) {
+		struct socket_desc *sd;
+
+		if (ns->nd != &net_ns_desc || ns->net.nlsk < 0)
+			continue;
+
+		pr_info("Collecting socket %#x family %d late in netns %d\n", ino, family, ns->id);
+		fill_collect_req(&cr, d, true);
+		if (family == AF_UNIX)
+			ret = collect_unix_one(ns->net.nlsk, ns, &cr, ino);
+		else
+			ret = do_rtnl_req(ns->net.nlsk, &cr.req, sizeof(cr.req), collect_one, collect_one_err, ns, &cr);
+		if (ret)
+			return NULL;
+
+		sd = lookup_socket_ino(ino, family);
+		if (sd)
+			return sd;
+	}
+
+	return NULL;
+}
+
+int collect_sockets(struct ns_id *ns, bool for_dump)
+{
+	int err = 0, tmp, i;
+	int nl = ns->net.nlsk;
+	struct sk_collect_req cr;
+	bool scoped = false;
+
+	if (for_dump) {
+		timing_start(TIME_SK_COLLECT);
+
+		if (ns->type == NS_CRIU || ns->ext_key) {
+			if (scope_init())
+				return -1;
+			scoped = true;
+		}
+	}
+
+	memset(&sk_collect_stat, 0, sizeof(sk_collect_stat));
+
+	for (i = 0; i < ARRAY_SIZE(sk_collect_descs); i++) {
+		fill_collect_req(&cr, &sk_collect_descs[i], scoped);
+
+		if (scoped && cr.desc->family == AF_UNIX)
+			tmp = collect_unix_scoped(nl, ns, &cr);
+		else
+			tmp = do_collect_req(nl, &cr.req, sizeof(cr.req), collect_one, collect_one_err, ns, &cr);
+		if (tmp)
+			err = tmp;
+	}
+
+	/* Kept to collect the sockets missed by the scope later */
+	if (!scoped) {
+		close(nl);
+		ns->net.nlsk = -1;
+	}
+
+	pr_info("Collected %lu sockets%s, skipped %lu, got %lu bytes of diag messages\n", sk_collect_stat.collected,
+		scoped ? " of the tasks" : "", sk_collect_stat.skipped, sk_collect_stat.bytes);
+
+	if (for_dump) {
+		timing_stop(TIME_SK_COLLECT);
+		cnt_add(CNT_SK_COLLECTED, sk_collect_stat.collected);
+		cnt_add(CNT_SK_DIAG_BYTES, sk_collect_stat.bytes);
+	}
 
 	if (err && (ns->type == NS_CRIU)) {
 		/*
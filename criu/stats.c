@@ -9,6 +9,10 @@
 #include "stats.h"
 #include "util.h"
 #include "image.h"
+#include "servicefd.h"
+#include "log.h"
+#include "page.h"
+#include "common/lock.h"
 #include "images/stats.pb-c.h"
 
 struct timing {
@@ -19,11 +23,28 @@ struct timing {
 struct dump_stats {
 	struct timing timings[DUMP_TIME_NR_STATS];
 	unsigned long counts[DUMP_CNT_NR_STATS];
+	DiscardStatsEntry **discarded;
+	size_t n_discarded;
+	/* Pages the parent pre-dump wrote, -1 if unknown */
+	long parent_written;
+};
+
+/*
+ * Images may arrive while restore is already running (--mem-images).
+ * Track how long the tasks were blocked waiting for them and for how
+ * long restore was going on in parallel with the transfer.
+ */
+struct img_wait {
+	mutex_t lock;
+	struct timeval since; /* restore start */
+	struct timeval total; /* time spent waiting for images */
+	struct timeval last;  /* when the last awaited image arrived */
 };
 
 struct restore_stats {
 	struct timing timings[RESTORE_TIME_NS_STATS];
 	atomic_t counts[RESTORE_CNT_NR_STATS];
+	struct img_wait img_wait;
 };
 
 struct dump_stats *dstats;
@@ -53,6 +74,63 @@ void cnt_sub(int c, unsigned long val)
 		BUG();
 }
 
+/* Report the bytes not dumped from a discarded region of a task */
+int stats_add_discard(int pid, unsigned long start, unsigned long end, unsigned long bytes)
+{
+	DiscardStatsEntry *de;
+
+	if (!dstats)
+		return 0;
+
+	de = xmalloc(sizeof(*de));
+	if (!de)
+		return -1;
+	discard_stats_entry__init(de);
+	de->pid = pid;
+	de->start = start;
+	de->end = end;
+	de->bytes = bytes;
+
+	if (xrealloc_safe(&dstats->discarded, (dstats->n_discarded + 1) * sizeof(de))) {
+		xfree(de);
+		return -1;
+	}
+	dstats->discarded[dstats->n_discarded++] = de;
+	return 0;
+}
+
+/*
+ * Find how many pages the parent pre-dump wrote, to see how much less
+ * is written after --freeze-notify. Its stats are only found next to
+ * its images if its work dir was the images dir.
+ */
+void stats_load_parent(void)
+{
+	StatsEntry *se = NULL;
+	struct cr_img *img;
+	int dir;
+
+	dstats->parent_written = -1;
+
+	if (open_parent(get_service_fd(IMG_FD_OFF), &dir) || dir < 0)
+		return;
+
+	img = open_image_at(dir, CR_FD_STATS, O_RSTR, "dump");
+	close(dir);
+	if (!img)
+		return;
+
+	if (!empty_image(img) && pb_read_one(img, &se, PB_STATS) > 0 && se->dump) {
+		dstats->parent_written = se->dump->pages_written + se->dump->shpages_written;
+		pr_info("Parent pre-dump wrote %ld pages\n", dstats->parent_written);
+	} else
+		pr_info("No stats of the parent pre-dump\n");
+
+	if (se)
+		stats_entry__free_unpacked(se, NULL);
+	close_image(img);
+}
+
 static void timeval_accumulate(const struct timeval *from, const struct timeval *to, struct timeval *res)
 {
 	suseconds_t usec;
@@ -70,6 +148,67 @@ static void timeval_accumulate(const struct timeval *from, const struct timeval
 	}
 }
 
+void account_img_wait(const struct timeval *start)
+{
+	struct img_wait *w;
+	struct timeval now;
+
+	/* Images needed to set up stats are not accounted */
+	if (!rstats)
+		return;
+
+	w = &rstats->img_wait;
+	gettimeofday(&now, NULL);
+
+	mutex_lock(&w->lock);
+	timeval_accumulate(start, &now, &w->total);
+	if (timercmp(&now, &w->last, >))
+		w->last = now;
+	mutex_unlock(&w->lock);
+}
+
+/*
+ * Infecting is done task by task while the whole tree is frozen, so
+ * besides the total the slowest task is tracked, it shows whether one
+ * task or the number of tasks makes the frozen time longer.
+ */
+void account_parasite_infect(pid_t pid, const struct timeval *start)
+{
+	struct timing *max;
+	struct timeval now, lat = {};
+
+	if (!dstats)
+		return;
+
+	gettimeofday(&now, NULL);
+	timeval_accumulate(start, &now, &lat);
+	pr_debug("Infected %d in %ld.%06ld s\n", pid, (long)lat.tv_sec, (long)lat.tv_usec);
+
+	timeval_accumulate(start, &now, &dstats->timings[TIME_PARASITE_INFECT].total);
+	dstats->counts[CNT_PARASITE_INFECTED]++;
+
+	max = &dstats->timings[TIME_PARASITE_INFECT_MAX];
+	if (timercmp(&lat, &max->total, >))
+		max->total = lat;
+}
+
+static void encode_img_wait(RestoreStatsEntry *rs)
+{
+	struct img_wait *w = &rstats->img_wait;
+	struct timeval overlap = {};
+
+	if (!timerisset(&w->last))
+		return;
+
+	if (timercmp(&w->last, &w->since, >))
+		timeval_accumulate(&w->since, &w->last, &overlap);
+
+	rs->has_image_wait_time = true;
+	rs->image_wait_time = w->total.tv_sec * USEC_PER_SEC + w->total.tv_usec;
+	rs->has_transfer_overlap_time = true;
+	rs->transfer_overlap_time = overlap.tv_sec * USEC_PER_SEC + overlap.tv_usec;
+}
+
 static struct timing *get_timing(int t)
 {
 	if (dstats != NULL) {
@@ -110,6 +249,23 @@ void timing_stop(int t)
 	timeval_accumulate(&tm->start, &now, &tm->total);
 }
 
+/* For times measured by someone else, e.g. by the restorer */
+void timing_add(int t, unsigned long usec)
+{
+	struct timing *tm;
+
+	if (!dstats && !rstats)
+		return;
+
+	tm = get_timing(t);
+	tm->total.tv_sec += usec / USEC_PER_SEC;
+	tm->total.tv_usec += usec % USEC_PER_SEC;
+	if (tm->total.tv_usec >= USEC_PER_SEC) {
+		tm->total.tv_usec -= USEC_PER_SEC;
+		tm->total.tv_sec += 1;
+	}
+}
+
 static void encode_time(int t, u_int32_t *to)
 {
 	struct timing *tm;
@@ -120,12 +276,16 @@ static void encode_time(int t, u_int32_t *to)
 
 static void display_stats(int what, StatsEntry *stats)
 {
+	size_t i;
+
 	if (what == DUMP_STATS) {
 		pr_msg("Displaying dump stats:\n");
 		pr_msg("Freezing time: %d us\n", stats->dump->freezing_time);
 		pr_msg("Frozen time: %d us\n", stats->dump->frozen_time);
 		pr_msg("Memory dump time: %d us\n", stats->dump->memdump_time);
 		pr_msg("Memory write time: %d us\n", stats->dump->memwrite_time);
+		if (stats->dump->has_memwrite_overlap_time)
+			pr_msg("Memory write overlapped with drain: %d us\n", stats->dump->memwrite_overlap_time);
 		if (stats->dump->has_irmap_resolve)
 			pr_msg("IRMAP resolve time: %d us\n", stats->dump->irmap_resolve);
 		pr_msg("Memory pages scanned: %" PRIu64 " (0x%" PRIx64 ")\n", stats->dump->pages_scanned,
@@ -136,6 +296,35 @@ static void display_stats(int what, StatsEntry *stats)
 		       stats->dump->pages_written);
 		pr_msg("Lazy memory pages: %" PRIu64 " (0x%" PRIx64 ")\n", stats->dump->pages_lazy,
 		       stats->dump->pages_lazy);
+		if (stats->dump->has_pages_cold)
+			pr_msg("Cold memory pages: %" PRIu64 " (0x%" PRIx64 ")\n", stats->dump->pages_cold,
+			       stats->dump->pages_cold);
+		if (stats->dump->has_sk_collect_time) {
+			pr_msg("Sockets collect time: %d us\n", stats->dump->sk_collect_time);
+			pr_msg("Sockets collected: %" PRIu64 " (%" PRIu64 " bytes of diag messages)\n",
+			       stats->dump->sk_collected, stats->dump->sk_diag_bytes);
+		}
+		if (stats->dump->has_nf_ct_time) {
+			pr_msg("Conntrack dump time: %d us\n", stats->dump->nf_ct_time);
+			pr_msg("Conntrack entries dumped: %" PRIu64 " (%" PRIu64 " bytes received)\n",
+			       stats->dump->nf_ct_entries, stats->dump->nf_ct_bytes);
+		}
+		if (stats->dump->has_parasite_infected) {
+			pr_msg("Parasite infection time: %d us (max %d us per task)\n",
+			       stats->dump->parasite_infect_time, stats->dump->parasite_infect_max_time);
+			pr_msg("Tasks infected: %" PRIu64 "\n", stats->dump->parasite_infected);
+		}
+		if (stats->dump->has_freeze_notify_time)
+			pr_msg("Freeze notify time: %d us\n", stats->dump->freeze_notify_time);
+		if (stats->dump->has_freeze_notify_pages_delta)
+			pr_msg("Pages written against the parent pre-dump: %+" PRId64 "\n",
+			       stats->dump->freeze_notify_pages_delta);
+		for (i = 0; i < stats->dump->n_discarded; i++) {
+			DiscardStatsEntry *de = stats->dump->discarded[i];
+
+			pr_msg("Discarded %d:%" PRIx64 "-%" PRIx64 ": %" PRIu64 " bytes\n", de->pid, de->start, de->end,
+			       de->bytes);
+		}
 	} else if (what == RESTORE_STATS) {
 		pr_msg("Displaying restore stats:\n");
 		pr_msg("Pages compared: %" PRIu64 " (0x%" PRIx64 ")\n", stats->restore->pages_compared,
@@ -145,8 +334,31 @@ static void display_stats(int what, StatsEntry *stats)
 		if (stats->restore->has_pages_restored)
 			pr_msg("Pages restored: %" PRIu64 " (0x%" PRIx64 ")\n", stats->restore->pages_restored,
 			       stats->restore->pages_restored);
+		if (stats->restore->has_pages_prefetched)
+			pr_msg("Page cache pages prefetched: %" PRIu64 " (0x%" PRIx64 ")\n",
+			       stats->restore->pages_prefetched, stats->restore->pages_prefetched);
+		if (stats->restore->has_pages_placed_cold) {
+			u64 cold = stats->restore->pages_placed_cold, lazy = stats->restore->pages_lazy;
+
+			pr_msg("Pages placed cold: %" PRIu64 " (0x%" PRIx64 ")\n", cold, cold);
+			pr_msg("Resident memory: %" PRIu64 " bytes, deferred: %" PRIu64 " bytes (cold %" PRIu64
+			       ", lazy %" PRIu64 ")\n",
+			       (stats->restore->pages_restored - cold) * PAGE_SIZE, (cold + lazy) * PAGE_SIZE,
+			       cold * PAGE_SIZE, lazy * PAGE_SIZE);
+		}
 		pr_msg("Restore time: %d us\n", stats->restore->restore_time);
 		pr_msg("Forking time: %d us\n", stats->restore->forking_time);
+		if (stats->restore->has_thread_create_time)
+			pr_msg("Thread creation time: %d us\n", stats->restore->thread_create_time);
+		if (stats->restore->has_nf_ct_time) {
+			pr_msg("Conntrack restore time: %d us\n", stats->restore->nf_ct_time);
+			pr_msg("Conntrack entries restored: %" PRIu64 " in %" PRIu64 " batches\n",
+			       stats->restore->nf_ct_entries, stats->restore->nf_ct_batches);
+		}
+		if (stats->restore->has_transfer_overlap_time) {
+			pr_msg("Image wait time: %d us\n", stats->restore->image_wait_time);
+			pr_msg("Transfer overlap time: %d us\n", stats->restore->transfer_overlap_time);
+		}
 	} else
 		return;
 }
@@ -169,6 +381,8 @@ void write_stats(int what)
 		encode_time(TIME_MEMWRITE, &ds_entry.memwrite_time);
 		ds_entry.has_irmap_resolve = true;
 		encode_time(TIME_IRMAP_RESOLVE, &ds_entry.irmap_resolve);
+		ds_entry.has_memwrite_overlap_time = true;
+		encode_time(TIME_MEMWRITE_OVERLAP, &ds_entry.memwrite_overlap_time);
 
 		ds_entry.pages_scanned = dstats->counts[CNT_PAGES_SCANNED];
 		ds_entry.pages_skipped_parent = dstats->counts[CNT_PAGES_SKIPPED_PARENT];
@@ -186,6 +400,52 @@ void write_stats(int what)
 		ds_entry.shpages_written = dstats->counts[CNT_SHPAGES_WRITTEN];
 		ds_entry.has_shpages_written = true;
 
+		if (opts.cold_pages) {
+			ds_entry.has_pages_cold = true;
+			ds_entry.pages_cold = dstats->counts[CNT_PAGES_COLD];
+		}
+
+		if (opts.freeze_notify) {
+			ds_entry.has_freeze_notify_time = true;
+			encode_time(TIME_FREEZE_NOTIFY, &ds_entry.freeze_notify_time);
+		}
+
+		if (opts.freeze_notify && dstats->parent_written >= 0) {
+			ds_entry.has_freeze_notify_pages_delta = true;
+			ds_entry.freeze_notify_pages_delta = (long)(ds_entry.pages_written + ds_entry.shpages_written) -
+							     dstats->parent_written;
+			pr_info("Pages written against the parent pre-dump: %+" PRId64 "\n",
+				ds_entry.freeze_notify_pages_delta);
+		}
+
+		ds_entry.has_sk_collect_time = true;
+		encode_time(TIME_SK_COLLECT, &ds_entry.sk_collect_time);
+		ds_entry.has_sk_collected = true;
+		ds_entry.sk_collected = dstats->counts[CNT_SK_COLLECTED];
+		ds_entry.has_sk_diag_bytes = true;
+		ds_entry.sk_diag_bytes = dstats->counts[CNT_SK_DIAG_BYTES];
+
+		if (dstats->counts[CNT_NF_CT_DUMP_BYTES]) {
+			ds_entry.has_nf_ct_time = true;
+			encode_time(TIME_NF_CT_DUMP, &ds_entry.nf_ct_time);
+			ds_entry.has_nf_ct_entries = true;
+			ds_entry.nf_ct_entries = dstats->counts[CNT_NF_CT_DUMPED];
+			ds_entry.has_nf_ct_bytes = true;
+			ds_entry.nf_ct_bytes = dstats->counts[CNT_NF_CT_DUMP_BYTES];
+		}
+
+		if (dstats->counts[CNT_PARASITE_INFECTED]) {
+			ds_entry.has_parasite_infect_time = true;
+			encode_time(TIME_PARASITE_INFECT, &ds_entry.parasite_infect_time);
+			ds_entry.has_parasite_infect_max_time = true;
+			encode_time(TIME_PARASITE_INFECT_MAX, &ds_entry.parasite_infect_max_time);
+			ds_entry.has_parasite_infected = true;
+			ds_entry.parasite_infected = dstats->counts[CNT_PARASITE_INFECTED];
+		}
+
+		ds_entry.n_discarded = dstats->n_discarded;
+		ds_entry.discarded = dstats->discarded;
+
 		name = "dump";
 	} else if (what == RESTORE_STATS) {
 		stats.restore = &rs_entry;
@@ -194,9 +454,31 @@ void write_stats(int what)
 		rs_entry.pages_skipped_cow = atomic_read(&rstats->counts[CNT_PAGES_SKIPPED_COW]);
 		rs_entry.has_pages_restored = true;
 		rs_entry.pages_restored = atomic_read(&rstats->counts[CNT_PAGES_RESTORED]);
+		if (opts.page_cache_warmth) {
+			rs_entry.has_pages_prefetched = true;
+			rs_entry.pages_prefetched = atomic_read(&rstats->counts[CNT_PAGES_PREFETCHED]);
+		}
+		if (opts.cold_pages) {
+			rs_entry.has_pages_placed_cold = true;
+			rs_entry.pages_placed_cold = atomic_read(&rstats->counts[CNT_PAGES_PLACED_COLD]);
+			rs_entry.has_pages_lazy = true;
+			rs_entry.pages_lazy = atomic_read(&rstats->counts[CNT_PAGES_RESTORE_LAZY]);
+		}
 
 		encode_time(TIME_FORK, &rs_entry.forking_time);
 		encode_time(TIME_RESTORE, &rs_entry.restore_time);
+		encode_img_wait(&rs_entry);
+		rs_entry.has_thread_create_time = true;
+		encode_time(TIME_THREAD_CREATE, &rs_entry.thread_create_time);
+
+		if (atomic_read(&rstats->counts[CNT_NF_CT_BATCHES])) {
+			rs_entry.has_nf_ct_time = true;
+			encode_time(TIME_NF_CT_RESTORE, &rs_entry.nf_ct_time);
+			rs_entry.has_nf_ct_entries = true;
+			rs_entry.nf_ct_entries = atomic_read(&rstats->counts[CNT_NF_CT_RESTORED]);
+			rs_entry.has_nf_ct_batches = true;
+			rs_entry.nf_ct_batches = atomic_read(&rstats->counts[CNT_NF_CT_BATCHES]);
+		}
 
 		name = "restore";
 	} else
@@ -224,9 +506,18 @@ int init_stats(int what)
 		 * to have them in shmem.
 		 */
 		dstats = shmalloc(sizeof(*dstats));
-		return dstats ? 0 : -1;
+		if (!dstats)
+			return -1;
+
+		dstats->parent_written = -1;
+		return 0;
 	}
 
 	rstats = shmalloc(sizeof(struct restore_stats));
-	return rstats ? 0 : -1;
+	if (!rstats)
+		return -1;
+
+	mutex_init(&rstats->img_wait.lock);
+	gettimeofday(&rstats->img_wait.since, NULL);
+	return 0;
 }
@@ -5,6 +5,9 @@
 #include "log.h"
 #include "util.h"
 #include "criu-log.h"
+#include "page.h"
+#include "pagemap-compact.h"
+#include "page-delta.h"
 
 int parse_statement(int i, char *line, char **configuration);
 
@@ -143,6 +146,92 @@ int main(int argc, char *argv[], char *envp[])
 	/* leaves punctuation in returned string as is */
 	assert(!strcmp(get_relative_path("./a////.///./b//././c", "a"), "b//././c"));
 
+	/* compact pagemap records round-trip, going both up and down */
+	{
+		struct pmc_state enc = {}, dec = {};
+		u64 vaddrs[] = { 0x400000, 0x401000, 0x7fff0000, 0x10000, 0xfffffffffffff000ULL, 0 };
+		u32 nrs[] = { 1, 3, 0xffffffff, 7, 1, 5 };
+		u32 fls[] = { 0, 1, 4, PMC_DELTA, 5, PMC_DELTA | 4 };
+		u64 dss[] = { 0, 0, 0, 12345, 0, 1ULL << 40 };
+		u8 buf[6 * PMC_RECORD_MAX], rec[PMC_RECORD_MAX];
+		int len = 0, off = 0, n;
+		u64 vaddr, ds;
+		u32 nr, flags;
+
+		for (i = 0; i < 6; i++) {
+			n = pmc_encode(&enc, buf + len, vaddrs[i], nrs[i], fls[i], dss[i]);
+			assert(n > 0 && n <= PMC_RECORD_MAX);
+			len += n;
+		}
+		/* neighbouring small entries take 3 bytes */
+		assert(pmc_encode(&enc, rec, 0x400000, 2, 0, 0) > 0);
+		assert(pmc_encode(&enc, rec, 0x402000, 2, 0, 0) == 3);
+
+		for (i = 0; i < 6; i++) {
+			/* a record cut short asks for more data */
+			assert(pmc_decode(&dec, buf + off, 1, &vaddr, &nr, &flags, &ds) == 0);
+			n = pmc_decode(&dec, buf + off, len - off, &vaddr, &nr, &flags, &ds);
+			assert(n > 0);
+			assert(vaddr == vaddrs[i] && nr == nrs[i] && flags == fls[i] && ds == dss[i]);
+			off += n;
+		}
+		assert(off == len);
+		assert(pmc_decode(&dec, buf + off, 0, &vaddr, &nr, &flags, &ds) == 0);
+
+		/* unaligned addresses can't be encoded */
+		assert(pmc_encode(&enc, rec, 0x400010, 1, 0, 0) == -1);
+
+		/* nr_pages wider than 32 bits is malformed */
+		memcpy(buf, "\x00\xff\xff\xff\xff\x7f\x00", 7);
+		assert(pmc_decode(&dec, buf, 7, &vaddr, &nr, &flags, &ds) == -1);
+	}
+
+	/* page deltas */
+	{
+		u8 *base = malloc(2 * PAGE_SIZE), *page = base + PAGE_SIZE;
+		u8 out[PAGE_SIZE + PAGE_DELTA_RUN_HDR], copy[PAGE_SIZE];
+		int n;
+
+		assert(base);
+		for (i = 0; i < PAGE_SIZE; i++)
+			base[i] = i * 7;
+		memcpy(page, base, PAGE_SIZE);
+
+		/* unchanged page is an empty delta */
+		assert(page_delta_encode(page, base, out, 16) == 0);
+
+		/* two bytes 3 apart are one run, a far one is another run */
+		page[10] ^= 1;
+		page[13] ^= 1;
+		page[PAGE_SIZE - 1] ^= 1;
+		n = page_delta_encode(page, base, out, PAGE_SIZE);
+		assert(n == 2 * PAGE_DELTA_RUN_HDR + 4 + 1);
+
+		memcpy(copy, base, PAGE_SIZE);
+		assert(page_delta_apply(copy, out, n) == 0);
+		assert(!memcmp(copy, page, PAGE_SIZE));
+
+		/* too big */
+		assert(page_delta_encode(page, base, out, n - 1) == -1);
+
+		/* fully rewritten page still applies */
+		for (i = 0; i < PAGE_SIZE; i++)
+			page[i] = ~base[i];
+		n = page_delta_encode(page, base, out, PAGE_SIZE + PAGE_DELTA_RUN_HDR);
+		assert(n == PAGE_SIZE + PAGE_DELTA_RUN_HDR);
+		memcpy(copy, base, PAGE_SIZE);
+		assert(page_delta_apply(copy, out, n) == 0);
+		assert(!memcmp(copy, page, PAGE_SIZE));
+
+		/* runs past the page end or the delta are malformed */
+		assert(page_delta_apply(copy, out, n - 1) == -1);
+		assert(page_delta_apply(copy, out, 3) == -1);
+		memcpy(out, "\xff\xff\x01\x00", 4);
+		assert(page_delta_apply(copy, out, 6) == -1);
+
+		free(base);
+	}
+
 	pr_msg("OK\n");
 	return 0;
 }
@@ -30,6 +30,8 @@ struct criu_opts {
 		const char *service_binary;
 	};
 	int swrk_pid;
+	/* Connection of the request being served, for criu_local_update_io_limits() */
+	int req_sk;
 };
 
 static criu_opts *global_opts;
@@ -226,6 +228,13 @@ void criu_local_free_opts(criu_opts *opts)
 	}
 	opts->rpc->n_join_ns = 0;
 
+	if (opts->rpc->discard_regions) {
+		for (i = 0; i < opts->rpc->n_discard_regions; i++)
+			free(opts->rpc->discard_regions[i]);
+		free(opts->rpc->discard_regions);
+	}
+	opts->rpc->n_discard_regions = 0;
+
 	if (opts->rpc->ps) {
 		free(opts->rpc->ps->address);
 		free(opts->rpc->ps);
@@ -239,6 +248,7 @@ void criu_local_free_opts(criu_opts *opts)
 	free(opts->rpc->log_file);
 	free(opts->rpc->lsm_profile);
 	free(opts->rpc->lsm_mount_context);
+	free(opts->rpc->freeze_notify);
 	free(opts->rpc);
 	criu_free_service(opts);
 	free(opts);
@@ -272,6 +282,7 @@ int criu_local_init_opts(criu_opts **o)
 
 	opts->rpc = rpc;
 	opts->notify = NULL;
+	opts->req_sk = -1;
 
 	opts->service_comm = CRIU_COMM_BIN;
 	opts->service_binary = strdup(CR_DEFAULT_SERVICE_BIN);
@@ -1203,6 +1214,147 @@ void criu_set_mntns_compat_mode(bool val)
 	criu_local_set_mntns_compat_mode(global_opts, val);
 }
 
+void criu_local_set_discard_dontdump(criu_opts *opts, bool val)
+{
+	opts->rpc->has_discard_dontdump = true;
+	opts->rpc->discard_dontdump = val;
+}
+
+void criu_set_discard_dontdump(bool val)
+{
+	criu_local_set_discard_dontdump(global_opts, val);
+}
+
+/*
+ * Register a range of memory of task @pid that is not to be dumped,
+ * e.g. a cache the application can rebuild. Applications dumping
+ * themselves pass their own pid.
+ */
+int criu_local_add_discard_region(criu_opts *opts, int pid, unsigned long start, unsigned long len)
+{
+	DiscardRegion *dr, **m;
+	int nr;
+
+	dr = malloc(sizeof(*dr));
+	if (!dr)
+		return -ENOMEM;
+	discard_region__init(dr);
+
+	dr->pid = pid;
+	dr->start = start;
+	dr->len = len;
+
+	nr = opts->rpc->n_discard_regions + 1;
+	m = realloc(opts->rpc->discard_regions, nr * sizeof(*m));
+	if (!m) {
+		free(dr);
+		return -ENOMEM;
+	}
+
+	m[nr - 1] = dr;
+
+	opts->rpc->n_discard_regions = nr;
+	opts->rpc->discard_regions = m;
+
+	return 0;
+}
+
+int criu_add_discard_region(int pid, unsigned long start, unsigned long len)
+{
+	return criu_local_add_discard_region(global_opts, pid, start, len);
+}
+
+void criu_local_set_discard_unmap(criu_opts *opts, bool val)
+{
+	opts->rpc->has_discard_unmap = true;
+	opts->rpc->discard_unmap = val;
+}
+
+void criu_set_discard_unmap(bool val)
+{
+	criu_local_set_discard_unmap(global_opts, val);
+}
+
+void criu_local_set_discard_signal(criu_opts *opts, int sig)
+{
+	opts->rpc->has_discard_signal = true;
+	opts->rpc->discard_signal = sig;
+}
+
+void criu_set_discard_signal(int sig)
+{
+	criu_local_set_discard_signal(global_opts, sig);
+}
+
+int criu_local_set_freeze_notify(criu_opts *opts, const char *path)
+{
+	free(opts->rpc->freeze_notify);
+	opts->rpc->freeze_notify = strdup(path);
+	if (opts->rpc->freeze_notify == NULL)
+		return -ENOMEM;
+	return 0;
+}
+
+int criu_set_freeze_notify(const char *path)
+{
+	return criu_local_set_freeze_notify(global_opts, path);
+}
+
+void criu_local_set_freeze_notify_timeout(criu_opts *opts, unsigned int ms)
+{
+	opts->rpc->has_freeze_notify_timeout = true;
+	opts->rpc->freeze_notify_timeout = ms;
+}
+
+void criu_set_freeze_notify_timeout(unsigned int ms)
+{
+	criu_local_set_freeze_notify_timeout(global_opts, ms);
+}
+
+void criu_local_set_io_rate(criu_opts *opts, uint64_t bytes)
+{
+	opts->rpc->has_io_rate = true;
+	opts->rpc->io_rate = bytes;
+}
+
+void criu_set_io_rate(uint64_t bytes)
+{
+	criu_local_set_io_rate(global_opts, bytes);
+}
+
+void criu_local_set_io_iops(criu_opts *opts, unsigned int iops)
+{
+	opts->rpc->has_io_iops = true;
+	opts->rpc->io_iops = iops;
+}
+
+void criu_set_io_iops(unsigned int iops)
+{
+	criu_local_set_io_iops(global_opts, iops);
+}
+
+void criu_local_set_io_burst(criu_opts *opts, uint64_t bytes)
+{
+	opts->rpc->has_io_burst = true;
+	opts->rpc->io_burst = bytes;
+}
+
+void criu_set_io_burst(uint64_t bytes)
+{
+	criu_local_set_io_burst(global_opts, bytes);
+}
+
+void criu_local_set_io_full_speed_frozen(criu_opts *opts, bool val)
+{
+	opts->rpc->has_io_full_speed_frozen = true;
+	opts->rpc->io_full_speed_frozen = val;
+}
+
+void criu_set_io_full_speed_frozen(bool val)
+{
+	criu_local_set_io_full_speed_frozen(global_opts, val);
+}
+
 static CriuResp *recv_resp(int socket_fd)
 {
 	struct msghdr msg_hdr = { 0 };
@@ -1521,13 +1673,44 @@ static int send_req_and_recv_resp(criu_opts *opts, CriuReq *req, CriuResp **resp
 		perror("Can't connect to criu");
 		ret = -ECONNREFUSED;
 	} else {
+		opts->req_sk = fd;
 		ret = send_req_and_recv_resp_sk(fd, opts, req, resp);
+		opts->req_sk = -1;
 		close(fd);
 	}
 
 	return ret;
 }
 
+int criu_local_update_io_limits(criu_opts *opts)
+{
+	CriuReq req = CRIU_REQ__INIT;
+	CriuOpts rpc = CRIU_OPTS__INIT;
+	int sk = opts->req_sk;
+
+	if (sk < 0)
+		return -EBADF;
+
+	rpc.has_io_rate = opts->rpc->has_io_rate;
+	rpc.io_rate = opts->rpc->io_rate;
+	rpc.has_io_iops = opts->rpc->has_io_iops;
+	rpc.io_iops = opts->rpc->io_iops;
+	rpc.has_io_burst = opts->rpc->has_io_burst;
+	rpc.io_burst = opts->rpc->io_burst;
+	rpc.has_io_full_speed_frozen = opts->rpc->has_io_full_speed_frozen;
+	rpc.io_full_speed_frozen = opts->rpc->io_full_speed_frozen;
+
+	req.type = CRIU_REQ_TYPE__IO_LIMITS;
+	req.opts = &rpc;
+
+	return send_req(sk, &req) < 0 ? -ECOMM : 0;
+}
+
+int criu_update_io_limits(void)
+{
+	return criu_local_update_io_limits(global_opts);
+}
+
 int criu_local_check(criu_opts *opts)
 {
 	int ret = -1;
@@ -1640,6 +1823,7 @@ int criu_local_dump_iters(criu_opts *opts, int (*more)(criu_predump_info pi))
 	fd = criu_connect(opts, false);
 	if (fd < 0)
 		goto exit;
+	opts->req_sk = fd;
 
 	while (1) {
 		ret = send_req_and_recv_resp_sk(fd, opts, &req, &resp);
@@ -1668,6 +1852,7 @@ int criu_local_dump_iters(criu_opts *opts, int (*more)(criu_predump_info pi))
 	if (!ret)
 		ret = (resp->success ? 0 : -EBADE);
 exit:
+	opts->req_sk = -1;
 	if (fd >= 0)
 		close(fd);
 	if (resp)
@@ -2030,3 +2215,79 @@ int criu_feature_check(struct criu_feature_check *features, size_t size)
 {
 	return criu_local_feature_check(global_opts, features, size);
 }
+
+int criu_freeze_notify_listen(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	int sk, ret;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return -ENAMETOOLONG;
+	strcpy(addr.sun_path, path);
+
+	sk = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (sk < 0)
+		return -errno;
+
+	if (bind(sk, (struct sockaddr *)&addr, sizeof(addr)) || listen(sk, 1)) {
+		ret = -errno;
+		close(sk);
+		return ret;
+	}
+
+	return sk;
+}
+
+int criu_freeze_notify_accept(int lsk, unsigned int *deadline_ms, bool *pre_dump)
+{
+	CriuFreezeNotify *fn;
+	unsigned char buf[64];
+	int sk, len, ret;
+
+	sk = accept4(lsk, NULL, NULL, SOCK_CLOEXEC);
+	if (sk < 0)
+		return -errno;
+
+	len = recv(sk, buf, sizeof(buf), 0);
+	if (len <= 0) {
+		ret = len ? -errno : -ECONNRESET;
+		goto err;
+	}
+
+	fn = criu_freeze_notify__unpack(NULL, len, buf);
+	if (!fn) {
+		ret = -EBADMSG;
+		goto err;
+	}
+
+	if (deadline_ms)
+		*deadline_ms = fn->deadline_ms;
+	if (pre_dump)
+		*pre_dump = fn->has_pre_dump && fn->pre_dump;
+	criu_freeze_notify__free_unpacked(fn, NULL);
+
+	return sk;
+err:
+	close(sk);
+	return ret;
+}
+
+int criu_freeze_notify_ack(int sk)
+{
+	CriuFreezeAck ack = CRIU_FREEZE_ACK__INIT;
+	unsigned char buf[16];
+	size_t len;
+	int ret = 0;
+
+	ack.has_ready = true;
+	ack.ready = true;
+
+	len = criu_freeze_ack__get_packed_size(&ack);
+	criu_freeze_ack__pack(&ack, buf);
+
+	if (send(sk, buf, len, MSG_NOSIGNAL) != len)
+		ret = -errno;
+	close(sk);
+
+	return ret;
+}
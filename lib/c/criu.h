@@ -20,6 +20,7 @@
 #define __CRIU_LIB_H__
 
 #include <stdbool.h>
+#include <stdint.h>
 
 #include "version.h"
 #include "rpc.pb-c.h"
@@ -115,6 +116,16 @@ void criu_set_pidfd_store_sk(int sk);
 int criu_set_network_lock(enum criu_network_lock_method method);
 int criu_join_ns_add(const char *ns, const char *ns_file, const char *extra_opt);
 void criu_set_mntns_compat_mode(bool val);
+void criu_set_discard_dontdump(bool val);
+int criu_add_discard_region(int pid, unsigned long start, unsigned long len);
+void criu_set_discard_unmap(bool val);
+void criu_set_discard_signal(int sig);
+int criu_set_freeze_notify(const char *path);
+void criu_set_freeze_notify_timeout(unsigned int ms);
+void criu_set_io_rate(uint64_t bytes);
+void criu_set_io_iops(unsigned int iops);
+void criu_set_io_burst(uint64_t bytes);
+void criu_set_io_full_speed_frozen(bool val);
 
 /*
  * The criu_notify_arg_t na argument is an opaque
@@ -280,6 +291,16 @@ void criu_local_set_pidfd_store_sk(criu_opts *opts, int sk);
 int criu_local_set_network_lock(criu_opts *opts, enum criu_network_lock_method method);
 int criu_local_join_ns_add(criu_opts *opts, const char *ns, const char *ns_file, const char *extra_opt);
 void criu_local_set_mntns_compat_mode(criu_opts *opts, bool val);
+void criu_local_set_discard_dontdump(criu_opts *opts, bool val);
+int criu_local_add_discard_region(criu_opts *opts, int pid, unsigned long start, unsigned long len);
+void criu_local_set_discard_unmap(criu_opts *opts, bool val);
+void criu_local_set_discard_signal(criu_opts *opts, int sig);
+int criu_local_set_freeze_notify(criu_opts *opts, const char *path);
+void criu_local_set_freeze_notify_timeout(criu_opts *opts, unsigned int ms);
+void criu_local_set_io_rate(criu_opts *opts, uint64_t bytes);
+void criu_local_set_io_iops(criu_opts *opts, unsigned int iops);
+void criu_local_set_io_burst(criu_opts *opts, uint64_t bytes);
+void criu_local_set_io_full_speed_frozen(criu_opts *opts, bool val);
 
 void criu_local_set_notify_cb(criu_opts *opts, int (*cb)(char *action, criu_notify_arg_t na));
 
@@ -322,6 +343,34 @@ struct criu_feature_check {
 int criu_feature_check(struct criu_feature_check *features, size_t size);
 int criu_local_feature_check(criu_opts *opts, struct criu_feature_check *features, size_t size);
 
+/*
+ * Send the I/O limits set with criu_set_io_rate() and the others to
+ * the dump, pre-dump or restore being served. It can be called from
+ * the notify callback or from another thread while criu_dump() and
+ * the others run, and takes effect within 100ms. Returns -EBADF if
+ * no request is in progress, negative errno on other failures.
+ */
+int criu_update_io_limits(void);
+int criu_local_update_io_limits(criu_opts *opts);
+
+/*
+ * The application side of the freeze notification (see
+ * criu_set_freeze_notify()). The application listens on a unix
+ * socket, and before freezing its tasks CRIU connects to it and
+ * asks it to get ready for the dump, e.g. to run GC or to give
+ * freed memory back. The application acknowledges when it is done
+ * or gets frozen anyway once the deadline passes.
+ *
+ * criu_freeze_notify_listen() returns the listening socket, which
+ * becomes readable when CRIU connects. criu_freeze_notify_accept()
+ * then returns the connection and reports the deadline in ms and
+ * whether this is a pre-dump. criu_freeze_notify_ack() answers and
+ * closes the connection. All return negative errno on failure.
+ */
+int criu_freeze_notify_listen(const char *path);
+int criu_freeze_notify_accept(int lsk, unsigned int *deadline_ms, bool *pre_dump);
+int criu_freeze_notify_ack(int sk);
+
 #ifdef __GNUG__
 }
 #endif
@@ -203,8 +203,68 @@ class pagemap_handler:
     Special entry handler for pagemap.img, which is unique in a way
     that it has a header of pagemap_head type followed by entries
     of pagemap_entry type.
+
+    With pagemap_head.compact set, the entries are not protobuf
+    messages, but records of three varints each: zigzag encoded
+    distance in pages from the end of the previous entry, nr_pages
+    and flags, followed by delta_size for PE_DELTA entries (see
+    criu/include/pagemap-compact.h).
     """
 
+    page_size = os.sysconf('SC_PAGE_SIZE')
+    PE_DELTA = 1 << 3
+
+    @staticmethod
+    def _get_varint(buf, off):
+        val = 0
+        shift = 0
+        while True:
+            if off >= len(buf):
+                raise Exception("Compact pagemap trimmed")
+            b = ord(buf[off:off + 1])
+            val |= (b & 0x7f) << shift
+            off += 1
+            if not (b & 0x80):
+                return val, off
+            shift += 7
+
+    @staticmethod
+    def _put_varint(val):
+        out = bytearray()
+        while val >= 0x80:
+            out.append((val & 0x7f) | 0x80)
+            val >>= 7
+        out.append(val)
+        return bytes(out)
+
+    def _load_compact(self, f, pretty):
+        entries = []
+        buf = f.read()
+        off = 0
+        prev_end = 0
+
+        while off < len(buf):
+            zz, off = self._get_varint(buf, off)
+            nr_pages, off = self._get_varint(buf, off)
+            flags, off = self._get_varint(buf, off)
+            delta_size = None
+            if flags & self.PE_DELTA:
+                delta_size, off = self._get_varint(buf, off)
+
+            delta = (zz >> 1) ^ -(zz & 1)
+            vaddr = (prev_end + delta * self.page_size) & 0xffffffffffffffff
+            prev_end = (vaddr + nr_pages * self.page_size) & 0xffffffffffffffff
+
+            pbuff = pb.pagemap_entry()
+            pbuff.vaddr = vaddr
+            pbuff.nr_pages = nr_pages
+            pbuff.flags = flags
+            if delta_size is not None:
+                pbuff.delta_size = delta_size
+            entries.append(pb2dict.pb2dict(pbuff, pretty))
+
+        return entries
+
     def load(self, f, pretty=False, no_payload=False):
         entries = []
 
@@ -217,6 +277,9 @@ class pagemap_handler:
             pbuff.ParseFromString(f.read(size))
             entries.append(pb2dict.pb2dict(pbuff, pretty))
 
+            if len(entries) == 1 and pbuff.compact:
+                return entries + self._load_compact(f, pretty)
+
             pbuff = pb.pagemap_entry()
 
         return entries
@@ -226,13 +289,33 @@ class pagemap_handler:
         return self.load(f, pretty)
 
     def dump(self, entries, f):
+        compact = False
+        prev_end = 0
+
         pbuff = pb.pagemap_head()
         for item in entries:
             pb2dict.dict2pb(item, pbuff)
-            pb_str = pbuff.SerializeToString()
-            size = len(pb_str)
-            f.write(struct.pack('i', size))
-            f.write(pb_str)
+
+            if compact:
+                delta = (pbuff.vaddr - prev_end) & 0xffffffffffffffff
+                if delta >= 1 << 63:
+                    delta -= 1 << 64
+                delta //= self.page_size
+                zz = ((delta << 1) ^ (delta >> 63)) & 0xffffffffffffffff
+                prev_end = pbuff.vaddr + pbuff.nr_pages * self.page_size
+                prev_end &= 0xffffffffffffffff
+                f.write(self._put_varint(zz))
+                f.write(self._put_varint(pbuff.nr_pages))
+                f.write(self._put_varint(pbuff.flags))
+                if pbuff.flags & self.PE_DELTA:
+                    f.write(self._put_varint(pbuff.delta_size))
+            else:
+                pb_str = pbuff.SerializeToString()
+                size = len(pb_str)
+                f.write(struct.pack('i', size))
+                f.write(pb_str)
+                if isinstance(pbuff, pb.pagemap_head):
+                    compact = pbuff.compact
 
             pbuff = pb.pagemap_entry()
 
@@ -242,7 +325,15 @@ class pagemap_handler:
         return f.read()
 
     def count(self, f):
-        return entry_handler(None).count(f) - 1
+        buf = f.read(4)
+        if len(buf) == 0:
+            return 0
+        size, = struct.unpack('i', buf)
+        head = pb.pagemap_head()
+        head.ParseFromString(f.read(size))
+        if head.compact:
+            return len(self._load_compact(f, False))
+        return entry_handler(None).count(f)
 
 
 # Special handler for ghost-file.img
@@ -535,6 +626,7 @@ handlers = {
     'TUNFILE': entry_handler(pb.tunfile_entry),
     'EXT_FILES': entry_handler(pb.ext_file_entry),
     'IRMAP_CACHE': entry_handler(pb.irmap_cache_entry),
+    'BUILD_ID_CACHE': entry_handler(pb.build_id_cache_entry),
     'FILE_LOCKS': entry_handler(pb.file_lock_entry),
     'FDINFO': entry_handler(pb.fdinfo_entry),
     'UNIXSK': entry_handler(pb.unix_sk_entry),
@@ -562,6 +654,8 @@ handlers = {
     'BPFMAP_DATA': entry_handler(pb.bpfmap_data_entry,
                                  bpfmap_data_extra_handler()),
     'APPARMOR': entry_handler(pb.apparmor_entry),
+    'PAGE_CACHE': entry_handler(pb.page_cache_entry),
+    'NUMA': entry_handler(pb.numa_entry),
 }
 
 
@@ -632,7 +726,7 @@ def dump(img, f):
     # Images v1.1 NOTE: use "second" magic to identify what "first"
     # should be written.
     if m != 'INVENTORY':
-        if m in ('STATS', 'IRMAP_CACHE'):
+        if m in ('STATS', 'IRMAP_CACHE', 'BUILD_ID_CACHE'):
             f.write(struct.pack('i', magic.by_name['IMG_SERVICE']))
         else:
             f.write(struct.pack('i', magic.by_name['IMG_COMMON']))
@@ -137,6 +137,8 @@ pmap_flags_map = [
     ('PE_PARENT', 1 << 0),
     ('PE_LAZY', 1 << 1),
     ('PE_PRESENT', 1 << 2),
+    ('PE_DELTA', 1 << 3),
+    ('PE_COLD', 1 << 4),
 ]
 
 flags_maps = {
@@ -5,6 +5,7 @@
 #include <string.h>
 #include <unistd.h>
 
+#include <dirent.h>
 #include <linux/limits.h>
 
 #include <sys/ioctl.h>
@@ -31,6 +32,8 @@
 
 #include "common/list.h"
 #include "amdgpu_plugin_topology.h"
+#include "amdgpu_plugin_incr.h"
+#include "amdgpu_plugin_upload.h"
 
 #include "img-streamer.h"
 #include "image.h"
@@ -74,6 +77,9 @@
 #define SDMA_NOP		    0
 #define SDMA_LINEAR_COPY_MAX_SIZE   (1ULL << 21)
 
+/* Upper bound of host staging memory per GPU when restoring BO contents */
+#define RESTORE_STAGING_SIZE (64 * INCR_CHUNK_SIZE)
+
 enum sdma_op_type {
 	SDMA_OP_VRAM_READ,
 	SDMA_OP_VRAM_WRITE,
@@ -107,6 +113,8 @@ extern bool kfd_vram_size_check;
 extern bool kfd_numa_check;
 extern bool kfd_capability_check;
 
+static bool kfd_incremental_dump;
+
 /**************************************************************************************************/
 
 int write_fp(FILE *fp, const void *buf, const size_t buf_len)
@@ -145,15 +153,15 @@ int read_fp(FILE *fp, void *buf, const size_t buf_len)
  * @param size Size of actual contents
  * @return FILE *if successful, NULL if failed
  */
-FILE *open_img_file(char *path, bool write, size_t *size)
+static FILE *open_img_file_at(int dirfd, char *path, bool write, size_t *size)
 {
 	FILE *fp = NULL;
 	int fd, ret;
 
-	if (opts.stream)
+	if (opts.stream && dirfd == criu_get_image_dir())
 		fd = img_streamer_open(path, write ? O_DUMP : O_RSTR);
 	else
-		fd = openat(criu_get_image_dir(), path, write ? (O_WRONLY | O_CREAT) : O_RDONLY, 0600);
+		fd = openat(dirfd, path, write ? (O_WRONLY | O_CREAT) : O_RDONLY, 0600);
 
 	if (fd < 0) {
 		pr_perror("%s: Failed to open for %s", path, write ? "write" : "read");
@@ -181,6 +189,11 @@ FILE *open_img_file(char *path, bool write, size_t *size)
 	return fp;
 }
 
+FILE *open_img_file(char *path, bool write, size_t *size)
+{
+	return open_img_file_at(criu_get_image_dir(), path, write, size);
+}
+
 /**
  * @brief Write an image file
  *
@@ -243,8 +256,11 @@ int kmtIoctl(int fd, unsigned long request, void *arg)
 static void free_e(CriuKfd *e)
 {
 	for (int i = 0; i < e->n_bo_entries; i++) {
-		if (e->bo_entries[i])
+		if (e->bo_entries[i]) {
+			xfree(e->bo_entries[i]->chunk_hashes);
+			xfree(e->bo_entries[i]->parent_chunks.data);
 			xfree(e->bo_entries[i]);
+		}
 	}
 
 	for (int i = 0; i < e->n_device_entries; i++) {
@@ -476,6 +492,12 @@ int amdgpu_plugin_init(int stage)
 		getenv_bool("KFD_NUMA_CHECK", &kfd_numa_check);
 		getenv_bool("KFD_CAPABILITY_CHECK", &kfd_capability_check);
 	}
+
+	if (stage == CR_PLUGIN_STAGE__DUMP) {
+		/* Restore would depend on the parent images, so it's opt-in */
+		kfd_incremental_dump = false;
+		getenv_bool("KFD_INCREMENTAL_DUMP", &kfd_incremental_dump);
+	}
 	return 0;
 }
 
@@ -495,6 +517,8 @@ void amdgpu_plugin_fini(int stage, int ret)
 
 CR_PLUGIN_REGISTER("amdgpu_plugin", amdgpu_plugin_init, amdgpu_plugin_fini)
 
+struct incr_chain;
+
 struct thread_data {
 	pthread_t thread;
 	uint64_t num_of_bos;
@@ -502,9 +526,19 @@ struct thread_data {
 	pid_t pid;
 	struct kfd_criu_bo_bucket *bo_buckets;
 	BoEntry **bo_entries;
+	CriuKfd *parent; /* KFD image of the parent checkpoint, dump only */
+	bool has_parent_id;
+	uint32_t parent_id; /* File ID of the parent KFD image, restore only */
 	int drm_fd;
 	int ret;
 	int id; /* File ID used by CRIU to identify KFD image for this process */
+
+	/* Restore only, see restore_bo_ops */
+	struct bo_upload upload;
+	struct incr_chain *chain;
+	FILE *bo_contents_fp;
+	amdgpu_device_handle h_dev;
+	uint64_t max_copy_size;
 };
 
 int amdgpu_plugin_handle_device_vma(int fd, const struct stat *st_buf)
@@ -607,10 +641,15 @@ void free_and_unmap(uint64_t size, amdgpu_bo_handle h_bo, amdgpu_va_handle h_va,
 	amdgpu_bo_free(h_bo);
 }
 
+/*
+ * Copy @size bytes between @userptr and offset @offset of bo_buckets[i]. The whole BO is mapped on the
+ * GPU side, only the userptr side is limited to @size.
+ */
 int sdma_copy_bo(struct kfd_criu_bo_bucket *bo_buckets, void *userptr, int i, amdgpu_device_handle h_dev,
-		 uint64_t max_copy_size, enum sdma_op_type type)
+		 uint64_t max_copy_size, enum sdma_op_type type, uint64_t offset, uint64_t size)
 {
-	uint64_t size, gpu_addr_src, gpu_addr_dest, gpu_addr_ib;
+	uint64_t bo_size, src_size, dest_size, src_off, dest_off;
+	uint64_t gpu_addr_src, gpu_addr_dest, gpu_addr_ib;
 	uint64_t gpu_addr_src_orig, gpu_addr_dest_orig;
 	amdgpu_va_handle h_va_src, h_va_dest, h_va_ib;
 	amdgpu_bo_handle h_bo_src, h_bo_dest, h_bo_ib;
@@ -628,14 +667,31 @@ int sdma_copy_bo(struct kfd_criu_bo_bucket *bo_buckets, void *userptr, int i, am
 	int err, shared_fd;
 
 	shared_fd = bo_buckets[i].dmabuf_fd;
-	size = bo_buckets[i].size;
+	bo_size = bo_buckets[i].size;
 
 	plugin_log_msg("Enter %s\n", __func__);
 
+	if (offset + size > bo_size) {
+		pr_err("Copy range %lx+%lx is outside of BO (size = %lx)\n", offset, size, bo_size);
+		return -EINVAL;
+	}
+
+	if (type == SDMA_OP_VRAM_READ) {
+		src_size = bo_size;
+		src_off = offset;
+		dest_size = size;
+		dest_off = 0;
+	} else {
+		src_size = size;
+		src_off = 0;
+		dest_size = bo_size;
+		dest_off = offset;
+	}
+
 	/* prepare src buffer */
 	switch (type) {
 	case SDMA_OP_VRAM_WRITE:
-		err = amdgpu_create_bo_from_user_mem(h_dev, userptr, size, &h_bo_src);
+		err = amdgpu_create_bo_from_user_mem(h_dev, userptr, src_size, &h_bo_src);
 		if (err) {
 			pr_perror("failed to create userptr for sdma");
 			return -EFAULT;
@@ -658,17 +714,18 @@ int sdma_copy_bo(struct kfd_criu_bo_bucket *bo_buckets, void *userptr, int i, am
 		return -EINVAL;
 	}
 
-	err = amdgpu_va_range_alloc(h_dev, amdgpu_gpu_va_range_general, size, 0x1000, 0, &gpu_addr_src, &h_va_src, 0);
+	err = amdgpu_va_range_alloc(h_dev, amdgpu_gpu_va_range_general, src_size, 0x1000, 0, &gpu_addr_src, &h_va_src,
+				    0);
 	if (err) {
 		pr_perror("failed to alloc VA for src bo");
 		goto err_src_va;
 	}
-	err = amdgpu_bo_va_op(h_bo_src, 0, size, gpu_addr_src, 0, AMDGPU_VA_OP_MAP);
+	err = amdgpu_bo_va_op(h_bo_src, 0, src_size, gpu_addr_src, 0, AMDGPU_VA_OP_MAP);
 	if (err) {
 		pr_perror("failed to GPU map the src BO");
 		goto err_src_bo_map;
 	}
-	plugin_log_msg("Source BO: GPU VA: %lx, size: %lx\n", gpu_addr_src, size);
+	plugin_log_msg("Source BO: GPU VA: %lx, size: %lx\n", gpu_addr_src, src_size);
 	/* prepare dest buffer */
 	switch (type) {
 	case SDMA_OP_VRAM_WRITE:
@@ -682,7 +739,7 @@ int sdma_copy_bo(struct kfd_criu_bo_bucket *bo_buckets, void *userptr, int i, am
 		break;
 
 	case SDMA_OP_VRAM_READ:
-		err = amdgpu_create_bo_from_user_mem(h_dev, userptr, size, &h_bo_dest);
+		err = amdgpu_create_bo_from_user_mem(h_dev, userptr, dest_size, &h_bo_dest);
 		if (err) {
 			pr_perror("failed to create userptr for sdma");
 			goto err_dest_bo_prep;
@@ -694,17 +751,18 @@ int sdma_copy_bo(struct kfd_criu_bo_bucket *bo_buckets, void *userptr, int i, am
 		goto err_dest_bo_prep;
 	}
 
-	err = amdgpu_va_range_alloc(h_dev, amdgpu_gpu_va_range_general, size, 0x1000, 0, &gpu_addr_dest, &h_va_dest, 0);
+	err = amdgpu_va_range_alloc(h_dev, amdgpu_gpu_va_range_general, dest_size, 0x1000, 0, &gpu_addr_dest, &h_va_dest,
+				    0);
 	if (err) {
 		pr_perror("failed to alloc VA for dest bo");
 		goto err_dest_va;
 	}
-	err = amdgpu_bo_va_op(h_bo_dest, 0, size, gpu_addr_dest, 0, AMDGPU_VA_OP_MAP);
+	err = amdgpu_bo_va_op(h_bo_dest, 0, dest_size, gpu_addr_dest, 0, AMDGPU_VA_OP_MAP);
 	if (err) {
 		pr_perror("failed to GPU map the dest BO");
 		goto err_dest_bo_map;
 	}
-	plugin_log_msg("Dest BO: GPU VA: %lx, size: %lx\n", gpu_addr_dest, size);
+	plugin_log_msg("Dest BO: GPU VA: %lx, size: %lx\n", gpu_addr_dest, dest_size);
 
 	n_packets = (size + max_copy_size) / max_copy_size;
 	/* prepare ring buffer/indirect buffer for command submission
@@ -736,6 +794,8 @@ int sdma_copy_bo(struct kfd_criu_bo_bucket *bo_buckets, void *userptr, int i, am
 	bytes_remain = size;
 	gpu_addr_src_orig = gpu_addr_src;
 	gpu_addr_dest_orig = gpu_addr_dest;
+	gpu_addr_src += src_off;
+	gpu_addr_dest += dest_off;
 	while (bytes_remain > 0) {
 		copy_size = min(bytes_remain, max_copy_size);
 
@@ -812,9 +872,9 @@ err_ctx:
 err_bo_list:
 	free_and_unmap(n_packets * 28, h_bo_ib, h_va_ib, gpu_addr_ib, ib);
 err_ib_gpu_alloc:
-	err = amdgpu_bo_va_op(h_bo_dest, 0, size, gpu_addr_dest, 0, AMDGPU_VA_OP_UNMAP);
+	err = amdgpu_bo_va_op(h_bo_dest, 0, dest_size, gpu_addr_dest, 0, AMDGPU_VA_OP_UNMAP);
 	if (err)
-		pr_perror("failed to GPU unmap the dest BO %lx, size = %lx", gpu_addr_dest, size);
+		pr_perror("failed to GPU unmap the dest BO %lx, size = %lx", gpu_addr_dest, dest_size);
 err_dest_bo_map:
 	err = amdgpu_va_range_free(h_va_dest);
 	if (err)
@@ -825,9 +885,9 @@ err_dest_va:
 		pr_perror("dest bo free failed");
 
 err_dest_bo_prep:
-	err = amdgpu_bo_va_op(h_bo_src, 0, size, gpu_addr_src, 0, AMDGPU_VA_OP_UNMAP);
+	err = amdgpu_bo_va_op(h_bo_src, 0, src_size, gpu_addr_src, 0, AMDGPU_VA_OP_UNMAP);
 	if (err)
-		pr_perror("failed to GPU unmap the src BO %lx, size = %lx", gpu_addr_src, size);
+		pr_perror("failed to GPU unmap the src BO %lx, size = %lx", gpu_addr_src, src_size);
 err_src_bo_map:
 	err = amdgpu_va_range_free(h_va_src);
 	if (err)
@@ -841,6 +901,363 @@ err_src_va:
 	return err;
 }
 
+/**************************************************************************************************
+ * Incremental BO contents, see amdgpu_plugin_incr.h
+ **************************************************************************************************/
+
+static CriuKfd *read_kfd_img(int dirfd, uint32_t id)
+{
+	char img_path[PATH_MAX];
+	unsigned char *buf;
+	CriuKfd *e = NULL;
+	size_t img_size;
+	FILE *img_fp;
+
+	snprintf(img_path, sizeof(img_path), IMG_KFD_FILE, id);
+	img_fp = open_img_file_at(dirfd, img_path, false, &img_size);
+	if (!img_fp)
+		return NULL;
+
+	buf = xmalloc(img_size);
+	if (buf && !read_fp(img_fp, buf, img_size)) {
+		e = criu_kfd__unpack(NULL, img_size, buf);
+		if (!e)
+			pr_err("Unable to parse %s\n", img_path);
+	}
+
+	xfree(buf);
+	fclose(img_fp);
+	return e;
+}
+
+/* Find the KFD image of the same process in the parent checkpoint, if there is one */
+static CriuKfd *find_parent_kfd(uint32_t pid, uint32_t *parent_id)
+{
+	CriuKfd *e = NULL;
+	struct dirent *de;
+	int dfd;
+	DIR *d;
+
+	dfd = openat(criu_get_image_dir(), CR_PARENT_LINK, O_RDONLY | O_DIRECTORY);
+	if (dfd < 0) {
+		if (errno != ENOENT)
+			pr_perror("Unable to open parent images directory");
+		return NULL;
+	}
+
+	d = fdopendir(dfd);
+	if (!d) {
+		pr_perror("Unable to open parent images directory");
+		close(dfd);
+		return NULL;
+	}
+
+	while ((de = readdir(d))) {
+		char img_path[PATH_MAX];
+		int id;
+
+		if (sscanf(de->d_name, IMG_KFD_FILE, &id) != 1)
+			continue;
+		snprintf(img_path, sizeof(img_path), IMG_KFD_FILE, id);
+		if (strcmp(img_path, de->d_name))
+			continue;
+
+		e = read_kfd_img(dfd, id);
+		if (!e)
+			continue;
+
+		if (e->pid == pid && e->has_chunk_size && e->chunk_size == INCR_CHUNK_SIZE) {
+			*parent_id = id;
+			break;
+		}
+
+		criu_kfd__free_unpacked(e, NULL);
+		e = NULL;
+	}
+
+	closedir(d);
+
+	if (e)
+		pr_info("amdgpu_plugin: Using %s/" IMG_KFD_FILE " as parent for pid %d\n", CR_PARENT_LINK, *parent_id,
+			pid);
+	return e;
+}
+
+static bool bo_entry_match(BoEntry *a, BoEntry *b)
+{
+	return a->addr == b->addr && a->size == b->size && a->gpu_id == b->gpu_id && a->alloc_flags == b->alloc_flags;
+}
+
+static int find_parent_bo(CriuKfd *parent, BoEntry *bo, int hint)
+{
+	/* BOs are usually listed in the same order by consecutive checkpoints */
+	if (hint < parent->n_bo_entries && bo_entry_match(parent->bo_entries[hint], bo))
+		return hint;
+
+	for (int i = 0; i < parent->n_bo_entries; i++) {
+		if (bo_entry_match(parent->bo_entries[i], bo))
+			return i;
+	}
+	return -1;
+}
+
+static int write_bo_chunks(void *priv, const void *buf, uint64_t len)
+{
+	return write_fp(priv, buf, len);
+}
+
+/* Write out the chunks of bo_entries[i] that are not in the parent checkpoint */
+static int dump_bo_incremental(struct thread_data *thread_data, int i, void *buffer, FILE *fp, size_t *written)
+{
+	BoEntry *boinfo = thread_data->bo_entries[i];
+	uint64_t nr_chunks = incr_nr_chunks(boinfo->size);
+	BoEntry *parent_bo = NULL;
+	int64_t ret;
+
+	if (!nr_chunks)
+		return 0;
+
+	if (thread_data->parent) {
+		int idx = find_parent_bo(thread_data->parent, boinfo, i);
+
+		if (idx >= 0) {
+			parent_bo = thread_data->parent->bo_entries[idx];
+			boinfo->has_parent_bo = true;
+			boinfo->parent_bo = idx;
+		}
+	}
+
+	boinfo->chunk_hashes = xmalloc(nr_chunks * INCR_HASH_WORDS * sizeof(*boinfo->chunk_hashes));
+	boinfo->parent_chunks.data = xmalloc(nr_chunks);
+	if (!boinfo->chunk_hashes || !boinfo->parent_chunks.data)
+		return -ENOMEM;
+	boinfo->n_chunk_hashes = nr_chunks * INCR_HASH_WORDS;
+
+	ret = incr_dump_bo(buffer, boinfo->size, parent_bo ? parent_bo->chunk_hashes : NULL,
+			   parent_bo ? parent_bo->n_chunk_hashes : 0, boinfo->chunk_hashes, boinfo->parent_chunks.data,
+			   write_bo_chunks, fp);
+	if (ret < 0)
+		return ret;
+
+	*written += ret;
+
+	if (ret == boinfo->size) {
+		/* Nothing is shared with the parent, keep the entry self-contained */
+		xfree(boinfo->parent_chunks.data);
+		boinfo->parent_chunks.data = NULL;
+		boinfo->has_parent_bo = false;
+	} else {
+		boinfo->has_parent_chunks = true;
+		boinfo->parent_chunks.len = nr_chunks;
+		plugin_log_msg("bo_entries[%d]: %ld of %ld bytes unchanged since parent\n", i, boinfo->size - ret,
+			       boinfo->size);
+	}
+	return 0;
+}
+
+/*
+ * One level of the parent chain as seen from the image being restored. Each restore thread keeps
+ * its own chain, levels are loaded the first time a BO refers to them.
+ */
+struct incr_level {
+	int dirfd;
+	uint32_t id; /* File ID of the KFD image at this level */
+	CriuKfd *e;
+	uint64_t *bo_offsets; /* Where the present data of each BO starts in its pages image */
+	int pages_fd;
+	uint32_t pages_gpu_id;
+};
+
+struct incr_chain {
+	struct thread_data *thread_data;
+	struct incr_level *levels;
+	int nr_levels;
+};
+
+struct incr_read_ctx {
+	struct incr_chain *chain;
+	int level; /* -1 for the image being restored */
+	BoEntry *bo;
+	int bo_idx;
+	FILE *fp; /* Pages image being restored, level -1 only */
+};
+
+static int incr_level_offsets(struct incr_level *lvl)
+{
+	CriuKfd *e = lvl->e;
+	uint64_t *sums;
+
+	lvl->bo_offsets = xzalloc(sizeof(*lvl->bo_offsets) * (e->n_bo_entries ?: 1));
+	sums = xzalloc(sizeof(*sums) * (e->n_device_entries ?: 1));
+	if (!lvl->bo_offsets || !sums) {
+		xfree(sums);
+		return -ENOMEM;
+	}
+
+	/* Pages images are per GPU and hold the present data of its BOs in BO order */
+	for (int i = 0; i < e->n_bo_entries; i++) {
+		BoEntry *bo = e->bo_entries[i];
+		int d;
+
+		if (!(bo->alloc_flags & (KFD_IOC_ALLOC_MEM_FLAGS_VRAM | KFD_IOC_ALLOC_MEM_FLAGS_GTT)))
+			continue;
+
+		for (d = 0; d < e->n_device_entries; d++)
+			if (e->device_entries[d]->gpu_id == bo->gpu_id)
+				break;
+		if (d == e->n_device_entries) {
+			pr_err("amdgpu_plugin: No device for gpu_id:0x%04x in parent image\n", bo->gpu_id);
+			xfree(sums);
+			return -EINVAL;
+		}
+
+		lvl->bo_offsets[i] = sums[d];
+		sums[d] += incr_present_size(bo->size, bo->has_parent_chunks ? bo->parent_chunks.data : NULL,
+					     bo->parent_chunks.len);
+	}
+
+	xfree(sums);
+	return 0;
+}
+
+static struct incr_level *incr_chain_get(struct incr_chain *chain, int level)
+{
+	while (chain->nr_levels <= level) {
+		int n = chain->nr_levels, prev_dirfd;
+		struct incr_level *lvl, *levels;
+		uint32_t id;
+
+		if (n == 0) {
+			if (!chain->thread_data->has_parent_id)
+				goto no_parent;
+			prev_dirfd = criu_get_image_dir();
+			id = chain->thread_data->parent_id;
+		} else {
+			if (!chain->levels[n - 1].e->has_parent_id)
+				goto no_parent;
+			prev_dirfd = chain->levels[n - 1].dirfd;
+			id = chain->levels[n - 1].e->parent_id;
+		}
+
+		levels = xrealloc(chain->levels, sizeof(*levels) * (n + 1));
+		if (!levels)
+			return NULL;
+		chain->levels = levels;
+
+		lvl = &chain->levels[n];
+		memset(lvl, 0, sizeof(*lvl));
+		lvl->pages_fd = -1;
+		lvl->id = id;
+		lvl->dirfd = openat(prev_dirfd, CR_PARENT_LINK, O_RDONLY | O_DIRECTORY);
+		if (lvl->dirfd < 0) {
+			pr_perror("amdgpu_plugin: Unable to open parent images at level %d", n + 1);
+			return NULL;
+		}
+		chain->nr_levels++;
+
+		lvl->e = read_kfd_img(lvl->dirfd, id);
+		if (!lvl->e || incr_level_offsets(lvl))
+			return NULL;
+	}
+
+	return &chain->levels[level];
+
+no_parent:
+	pr_err("amdgpu_plugin: BO refers to a parent image that was not recorded (level %d)\n", level + 1);
+	return NULL;
+}
+
+static void incr_chain_free(struct incr_chain *chain)
+{
+	for (int i = 0; i < chain->nr_levels; i++) {
+		struct incr_level *lvl = &chain->levels[i];
+
+		if (lvl->pages_fd >= 0)
+			close(lvl->pages_fd);
+		if (lvl->e)
+			criu_kfd__free_unpacked(lvl->e, NULL);
+		xfree(lvl->bo_offsets);
+		close(lvl->dirfd);
+	}
+	xfree(chain->levels);
+}
+
+static int incr_read_cur(void *priv, uint64_t off, void *buf, uint64_t len)
+{
+	struct incr_read_ctx *ctx = priv;
+	struct incr_level *lvl;
+	char img_path[PATH_MAX];
+	ssize_t ret;
+
+	if (ctx->level < 0)
+		return read_fp(ctx->fp, buf, len);
+
+	lvl = &ctx->chain->levels[ctx->level];
+	if (lvl->pages_fd < 0 || lvl->pages_gpu_id != ctx->bo->gpu_id) {
+		if (lvl->pages_fd >= 0)
+			close(lvl->pages_fd);
+
+		snprintf(img_path, sizeof(img_path), IMG_PAGES_FILE, lvl->id, ctx->bo->gpu_id);
+		lvl->pages_fd = openat(lvl->dirfd, img_path, O_RDONLY);
+		if (lvl->pages_fd < 0) {
+			pr_perror("amdgpu_plugin: Unable to open parent %s", img_path);
+			return -errno;
+		}
+		lvl->pages_gpu_id = ctx->bo->gpu_id;
+	}
+
+	/* Skip the size header, see open_img_file() */
+	off += sizeof(uint64_t) + lvl->bo_offsets[ctx->bo_idx];
+	while (len) {
+		ret = pread(lvl->pages_fd, buf, len, off);
+		if (ret <= 0) {
+			pr_perror("amdgpu_plugin: Short read from parent pages image");
+			return -EIO;
+		}
+		buf = (char *)buf + ret;
+		off += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static int incr_read_parent(void *priv, uint64_t off, void *buf, uint64_t len)
+{
+	struct incr_read_ctx *ctx = priv, pctx;
+	struct incr_level *lvl;
+	BoEntry *parent_bo;
+
+	if (!ctx->bo->has_parent_bo) {
+		pr_err("amdgpu_plugin: BO 0x%lx refers to parent chunks but has no parent BO\n", ctx->bo->addr);
+		return -EINVAL;
+	}
+
+	lvl = incr_chain_get(ctx->chain, ctx->level + 1);
+	if (!lvl)
+		return -EINVAL;
+
+	if (ctx->bo->parent_bo >= lvl->e->n_bo_entries) {
+		pr_err("amdgpu_plugin: Parent BO index %d out of range\n", ctx->bo->parent_bo);
+		return -EINVAL;
+	}
+
+	parent_bo = lvl->e->bo_entries[ctx->bo->parent_bo];
+	if (!bo_entry_match(parent_bo, ctx->bo)) {
+		pr_err("amdgpu_plugin: Parent BO 0x%lx does not match BO 0x%lx\n", parent_bo->addr, ctx->bo->addr);
+		return -EINVAL;
+	}
+
+	pctx.chain = ctx->chain;
+	pctx.level = ctx->level + 1;
+	pctx.bo = parent_bo;
+	pctx.bo_idx = ctx->bo->parent_bo;
+	pctx.fp = NULL;
+
+	return incr_restore_range(buf, parent_bo->size, off, len,
+				  parent_bo->has_parent_chunks ? parent_bo->parent_chunks.data : NULL,
+				  parent_bo->parent_chunks.len, incr_read_cur, incr_read_parent, &pctx);
+}
+
 void *dump_bo_contents(void *_thread_data)
 {
 	struct thread_data *thread_data = (struct thread_data *)_thread_data;
@@ -848,7 +1265,7 @@ void *dump_bo_contents(void *_thread_data)
 	BoEntry **bo_info = thread_data->bo_entries;
 	struct amdgpu_gpu_info gpu_info = { 0 };
 	amdgpu_device_handle h_dev;
-	size_t max_bo_size = 0, image_size = 0;
+	size_t max_bo_size = 0, image_size = 0, written = 0;
 	uint64_t max_copy_size;
 	uint32_t major, minor;
 	int num_bos = 0;
@@ -910,17 +1327,34 @@ void *dump_bo_contents(void *_thread_data)
 		num_bos++;
 
 		/* perform sDMA based vram copy */
-		ret = sdma_copy_bo(bo_buckets, buffer, i, h_dev, max_copy_size, SDMA_OP_VRAM_READ);
+		ret = sdma_copy_bo(bo_buckets, buffer, i, h_dev, max_copy_size, SDMA_OP_VRAM_READ, 0, bo_buckets[i].size);
 		if (ret) {
 			pr_err("Failed to drain the BO using sDMA: bo_buckets[%d]\n", i);
 			break;
 		}
 		plugin_log_msg("** Successfully drained the BO using sDMA: bo_buckets[%d] **\n", i);
-		ret = write_fp(bo_contents_fp, buffer, bo_info[i]->size);
+		if (kfd_incremental_dump) {
+			ret = dump_bo_incremental(thread_data, i, buffer, bo_contents_fp, &written);
+		} else {
+			ret = write_fp(bo_contents_fp, buffer, bo_info[i]->size);
+			written += bo_info[i]->size;
+		}
 		if (ret)
 			break;
 	}
 
+	/*
+	 * Chunks found in the parent were skipped, fix up the size header. There is no parent
+	 * when streaming, so the header written up front is correct in that case.
+	 */
+	if (!ret && written != image_size) {
+		if (fflush(bo_contents_fp) ||
+		    pwrite(fileno(bo_contents_fp), &written, sizeof(written), 0) != sizeof(written)) {
+			pr_perror("Failed to update size of %s", img_path);
+			ret = -EIO;
+		}
+	}
+
 exit:
 	pr_info("amdgpu_plugin: Thread[0x%x] done num_bos:%d ret:%d\n", thread_data->gpu_id, num_bos, ret);
 
@@ -935,107 +1369,120 @@ exit:
 	return NULL;
 };
 
-void *restore_bo_contents(void *_thread_data)
+static int restore_bo_open(void *priv)
 {
-	struct thread_data *thread_data = (struct thread_data *)_thread_data;
-	struct kfd_criu_bo_bucket *bo_buckets = thread_data->bo_buckets;
-	size_t image_size = 0, total_bo_size = 0, max_bo_size = 0;
+	struct thread_data *thread_data = priv;
 	BoEntry **bo_info = thread_data->bo_entries;
 	struct amdgpu_gpu_info gpu_info = { 0 };
-	amdgpu_device_handle h_dev;
-	uint64_t max_copy_size;
+	size_t image_size = 0, total_bo_size = 0;
 	uint32_t major, minor;
-	FILE *bo_contents_fp = NULL;
-	void *buffer;
 	char img_path[40];
-	int num_bos = 0;
-	int i, ret = 0;
+	int i, ret;
 
 	pr_info("amdgpu_plugin: Thread[0x%x] started\n", thread_data->gpu_id);
 
-	ret = amdgpu_device_initialize(thread_data->drm_fd, &major, &minor, &h_dev);
+	ret = amdgpu_device_initialize(thread_data->drm_fd, &major, &minor, &thread_data->h_dev);
 	if (ret) {
 		pr_perror("failed to initialize device");
-		goto exit;
+		thread_data->h_dev = NULL;
+		return ret;
 	}
 	plugin_log_msg("libdrm initialized successfully\n");
 
-	ret = amdgpu_query_gpu_info(h_dev, &gpu_info);
+	ret = amdgpu_query_gpu_info(thread_data->h_dev, &gpu_info);
 	if (ret) {
 		pr_perror("failed to query gpuinfo via libdrm");
-		goto exit;
+		return ret;
 	}
 
-	max_copy_size = (gpu_info.family_id >= AMDGPU_FAMILY_AI) ? SDMA_LINEAR_COPY_MAX_SIZE :
-								   SDMA_LINEAR_COPY_MAX_SIZE - 1;
+	thread_data->max_copy_size = (gpu_info.family_id >= AMDGPU_FAMILY_AI) ? SDMA_LINEAR_COPY_MAX_SIZE :
+										SDMA_LINEAR_COPY_MAX_SIZE - 1;
+
+	thread_data->chain = xzalloc(sizeof(*thread_data->chain));
+	if (!thread_data->chain)
+		return -ENOMEM;
+	thread_data->chain->thread_data = thread_data;
 
 	snprintf(img_path, sizeof(img_path), IMG_PAGES_FILE, thread_data->id, thread_data->gpu_id);
-	bo_contents_fp = open_img_file(img_path, false, &image_size);
-	if (!bo_contents_fp) {
+	thread_data->bo_contents_fp = open_img_file(img_path, false, &image_size);
+	if (!thread_data->bo_contents_fp) {
 		pr_perror("Cannot fopen %s", img_path);
-		ret = -errno;
-		goto exit;
+		return -errno;
 	}
 
-	/* Allocate buffer to fit biggest BO */
-	for (i = 0; i < thread_data->num_of_bos; i++) {
-		if (bo_buckets[i].gpu_id == thread_data->gpu_id &&
-		    (bo_buckets[i].alloc_flags & (KFD_IOC_ALLOC_MEM_FLAGS_VRAM | KFD_IOC_ALLOC_MEM_FLAGS_GTT))) {
-			total_bo_size += bo_buckets[i].size;
+	for (i = 0; i < thread_data->upload.nr_items; i++) {
+		BoEntry *bo = bo_info[thread_data->upload.items[i].bo];
 
-			if (bo_buckets[i].size > max_bo_size)
-				max_bo_size = bo_buckets[i].size;
-		}
+		/* Only chunks that changed since the parent checkpoint are in this image */
+		total_bo_size += incr_present_size(bo->size, bo->has_parent_chunks ? bo->parent_chunks.data : NULL,
+						   bo->parent_chunks.len);
 	}
 
 	if (total_bo_size != image_size) {
 		pr_err("amdgpu_plugin: %s size mismatch (current:%ld:expected:%ld)\n", img_path, image_size,
 		       total_bo_size);
-
-		ret = -EINVAL;
-		goto exit;
+		return -EINVAL;
 	}
 
-	/* Allocate buffer to fit biggest BO */
-	posix_memalign(&buffer, sysconf(_SC_PAGE_SIZE), max_bo_size);
-	if (!buffer) {
-		pr_perror("Failed to alloc aligned memory");
-		ret = -ENOMEM;
-		goto exit;
-	}
+	return 0;
+}
 
-	for (i = 0; i < thread_data->num_of_bos; i++) {
-		if (bo_buckets[i].gpu_id != thread_data->gpu_id)
-			continue;
+static void restore_bo_close(void *priv)
+{
+	struct thread_data *thread_data = priv;
 
-		if (!(bo_buckets[i].alloc_flags & (KFD_IOC_ALLOC_MEM_FLAGS_VRAM | KFD_IOC_ALLOC_MEM_FLAGS_GTT)))
-			continue;
+	if (thread_data->bo_contents_fp)
+		fclose(thread_data->bo_contents_fp);
 
-		num_bos++;
+	if (thread_data->chain) {
+		incr_chain_free(thread_data->chain);
+		xfree(thread_data->chain);
+	}
 
-		ret = read_fp(bo_contents_fp, buffer, bo_info[i]->size);
-		if (ret)
-			goto exit;
+	if (thread_data->h_dev)
+		amdgpu_device_deinitialize(thread_data->h_dev);
 
-		ret = sdma_copy_bo(bo_buckets, buffer, i, h_dev, max_copy_size, SDMA_OP_VRAM_WRITE);
-		if (ret) {
-			pr_err("Failed to fill the BO using sDMA: bo_buckets[%d]\n", i);
-			break;
-		}
-		plugin_log_msg("** Successfully filled the BO using sDMA: bo_buckets[%d] **\n", i);
-	}
+	pr_info("amdgpu_plugin: Thread[0x%x] done num_bos:%d\n", thread_data->gpu_id, thread_data->upload.nr_items);
+}
 
-exit:
-	pr_info("amdgpu_plugin: Thread[0x%x] done num_bos:%d ret:%d\n", thread_data->gpu_id, num_bos, ret);
+static int restore_bo_fill(void *priv, int bo, uint64_t off, void *buf, uint64_t len)
+{
+	struct thread_data *thread_data = priv;
+	BoEntry *bo_info = thread_data->bo_entries[bo];
+	struct incr_read_ctx ctx = {
+		.chain = thread_data->chain,
+		.level = -1,
+		.bo = bo_info,
+		.bo_idx = bo,
+		.fp = thread_data->bo_contents_fp,
+	};
+
+	return incr_restore_range(buf, bo_info->size, off, len,
+				  bo_info->has_parent_chunks ? bo_info->parent_chunks.data : NULL,
+				  bo_info->parent_chunks.len, incr_read_cur, incr_read_parent, &ctx);
+}
 
-	if (bo_contents_fp)
-		fclose(bo_contents_fp);
+static int restore_bo_write(void *priv, int bo, uint64_t off, void *buf, uint64_t len)
+{
+	struct thread_data *thread_data = priv;
+	int ret;
 
-	xfree(buffer);
+	ret = sdma_copy_bo(thread_data->bo_buckets, buf, bo, thread_data->h_dev, thread_data->max_copy_size,
+			   SDMA_OP_VRAM_WRITE, off, len);
+	if (ret) {
+		pr_err("Failed to fill the BO using sDMA: bo_buckets[%d]\n", bo);
+		return ret;
+	}
 
-	amdgpu_device_deinitialize(h_dev);
-	thread_data->ret = ret;
-	return NULL;
+	plugin_log_msg("** Successfully filled the BO using sDMA: bo_buckets[%d] %lx+%lx **\n", bo, off, len);
+	return 0;
+}
+
+static const struct bo_upload_ops restore_bo_ops = {
+	.open = restore_bo_open,
+	.close = restore_bo_close,
+	.fill = restore_bo_fill,
+	.write = restore_bo_write,
 };
 
 int check_hsakmt_shared_mem(uint64_t *shared_mem_size, uint32_t *shared_mem_magic)
@@ -1160,7 +1607,8 @@ exit:
 	return ret;
 }
 
-static int save_bos(int id, int fd, struct kfd_ioctl_criu_args *args, struct kfd_criu_bo_bucket *bo_buckets, CriuKfd *e)
+static int save_bos(int id, int fd, struct kfd_ioctl_criu_args *args, struct kfd_criu_bo_bucket *bo_buckets, CriuKfd *e,
+		    CriuKfd *parent)
 {
 	struct thread_data *thread_datas;
 	int ret = 0, i;
@@ -1203,6 +1651,7 @@ static int save_bos(int id, int fd, struct kfd_ioctl_criu_args *args, struct kfd
 		thread_datas[i].gpu_id = dev->gpu_id;
 		thread_datas[i].bo_buckets = bo_buckets;
 		thread_datas[i].bo_entries = e->bo_entries;
+		thread_datas[i].parent = parent;
 		thread_datas[i].pid = e->pid;
 		thread_datas[i].num_of_bos = args->num_bos;
 		thread_datas[i].drm_fd = node_get_drm_render_device(dev);
@@ -1281,7 +1730,7 @@ int amdgpu_plugin_dump_file(int fd, int id)
 	char img_path[PATH_MAX];
 	struct stat st, st_kfd;
 	unsigned char *buf;
-	CriuKfd *e = NULL;
+	CriuKfd *e = NULL, *parent = NULL;
 	int ret = 0;
 	size_t len;
 
@@ -1409,7 +1858,16 @@ int amdgpu_plugin_dump_file(int fd, int id)
 	if (ret)
 		goto exit;
 
-	ret = save_bos(id, fd, &args, (struct kfd_criu_bo_bucket *)args.bos, e);
+	if (kfd_incremental_dump) {
+		e->has_chunk_size = true;
+		e->chunk_size = INCR_CHUNK_SIZE;
+
+		if (!opts.stream)
+			parent = find_parent_kfd(e->pid, &e->parent_id);
+		e->has_parent_id = !!parent;
+	}
+
+	ret = save_bos(id, fd, &args, (struct kfd_criu_bo_bucket *)args.bos, e, parent);
 	if (ret)
 		goto exit;
 
@@ -1451,6 +1909,8 @@ exit:
 	xfree((void *)args.priv_data);
 
 	free_e(e);
+	if (parent)
+		criu_kfd__free_unpacked(parent, NULL);
 
 	if (ret)
 		pr_err("amdgpu_plugin: Failed to dump (ret:%d)\n", ret);
@@ -1544,16 +2004,80 @@ static int restore_bos(struct kfd_ioctl_criu_args *args, CriuKfd *e)
 	return 0;
 }
 
+/*
+ * BO contents are uploaded in the background while CRIU goes on restoring the task. The job owns
+ * everything the upload threads look at and is released by wait_bo_restore().
+ */
+struct bo_restore_job {
+	CriuKfd *e;
+	struct kfd_criu_bo_bucket *bo_buckets;
+	struct thread_data *thread_datas;
+	int nr_threads;
+};
+
+static int wait_bo_restore(void *arg)
+{
+	struct bo_restore_job *job = arg;
+	int ret = 0;
+
+	for (int i = 0; i < job->nr_threads; i++) {
+		int ret_thread = bo_upload_join(&job->thread_datas[i].upload);
+
+		pr_info("Thread[0x%x] finished ret:%d\n", job->thread_datas[i].gpu_id, ret_thread);
+		if (ret_thread && !ret)
+			ret = ret_thread;
+	}
+
+	for (int i = 0; i < job->e->num_of_bos; i++) {
+		if (job->bo_buckets[i].dmabuf_fd != KFD_INVALID_FD)
+			close(job->bo_buckets[i].dmabuf_fd);
+	}
+
+	if (job->thread_datas) {
+		for (int i = 0; i < job->e->num_of_gpus; i++)
+			xfree(job->thread_datas[i].upload.items);
+	}
+
+	xfree(job->thread_datas);
+	xfree(job->bo_buckets);
+	criu_kfd__free_unpacked(job->e, NULL);
+	xfree(job);
+
+	if (ret)
+		pr_err("amdgpu_plugin: Failed to restore BO contents (ret:%d)\n", ret);
+	return ret;
+}
+
+/*
+ * Start uploading BO contents and return without waiting for it. Takes over @bo_buckets and @e,
+ * they are released once the upload has been joined.
+ */
 static int restore_bo_data(int id, struct kfd_criu_bo_bucket *bo_buckets, CriuKfd *e)
 {
 	struct thread_data *thread_datas;
+	struct bo_restore_job *job;
 	int thread_i, ret = 0;
 
+	job = xzalloc(sizeof(*job));
+	if (!job) {
+		for (int i = 0; i < e->num_of_bos; i++) {
+			if (bo_buckets[i].dmabuf_fd != KFD_INVALID_FD)
+				close(bo_buckets[i].dmabuf_fd);
+		}
+		xfree(bo_buckets);
+		criu_kfd__free_unpacked(e, NULL);
+		return -ENOMEM;
+	}
+
+	job->e = e;
+	job->bo_buckets = bo_buckets;
+
 	thread_datas = xzalloc(sizeof(*thread_datas) * e->num_of_gpus);
 	if (!thread_datas) {
 		ret = -ENOMEM;
 		goto exit;
 	}
+	job->thread_datas = thread_datas;
 
 	for (int i = 0; i < e->num_of_bos; i++) {
 		struct kfd_criu_bo_bucket *bo_bucket = &bo_buckets[i];
@@ -1596,11 +2120,36 @@ static int restore_bo_data(int id, struct kfd_criu_bo_bucket *bo_buckets, CriuKf
 		}
 	}
 
+	/*
+	 * The uploads outlive this hook while CRIU restores the task's own file descriptors, which
+	 * could land on the numbers KFD picked for the dmabuf fds. Move them out of the way like the
+	 * render node fds.
+	 */
+	for (int i = 0; i < e->num_of_bos; i++) {
+		int fd;
+
+		if (bo_buckets[i].dmabuf_fd == KFD_INVALID_FD)
+			continue;
+
+		fd = fcntl(bo_buckets[i].dmabuf_fd, F_DUPFD_CLOEXEC, fd_next);
+		if (fd < 0) {
+			pr_perror("Failed to move dmabuf fd %d (fd_next:%d)", bo_buckets[i].dmabuf_fd, fd_next);
+			ret = -errno;
+			goto exit;
+		}
+		fd_next = fd + 1;
+
+		close(bo_buckets[i].dmabuf_fd);
+		bo_buckets[i].dmabuf_fd = fd;
+	}
+
 	thread_i = 0;
 	for (int i = 0; i < e->num_of_gpus + e->num_of_cpus; i++) {
-		struct tp_node *dev;
-		int ret_thread = 0;
+		struct thread_data *thread_data = &thread_datas[thread_i];
+		struct bo_upload_item *items;
 		uint32_t target_gpu_id;
+		struct tp_node *dev;
+		int nr_items = 0;
 
 		if (!e->device_entries[i]->gpu_id)
 			continue;
@@ -1616,45 +2165,60 @@ static int restore_bo_data(int id, struct kfd_criu_bo_bucket *bo_buckets, CriuKf
 			goto exit;
 		}
 
-		thread_datas[thread_i].id = id;
-		thread_datas[thread_i].gpu_id = e->device_entries[i]->gpu_id;
-		thread_datas[thread_i].bo_buckets = bo_buckets;
-		thread_datas[thread_i].bo_entries = e->bo_entries;
-		thread_datas[thread_i].pid = e->pid;
-		thread_datas[thread_i].num_of_bos = e->num_of_bos;
-
-		thread_datas[thread_i].drm_fd = node_get_drm_render_device(dev);
-		if (thread_datas[thread_i].drm_fd < 0) {
-			ret = -thread_datas[thread_i].drm_fd;
+		thread_data->id = id;
+		thread_data->gpu_id = e->device_entries[i]->gpu_id;
+		thread_data->bo_buckets = bo_buckets;
+		thread_data->bo_entries = e->bo_entries;
+		thread_data->has_parent_id = e->has_parent_id;
+		thread_data->parent_id = e->parent_id;
+		thread_data->pid = e->pid;
+		thread_data->num_of_bos = e->num_of_bos;
+
+		thread_data->drm_fd = node_get_drm_render_device(dev);
+		if (thread_data->drm_fd < 0) {
+			ret = thread_data->drm_fd;
 			goto exit;
 		}
 
-		ret_thread = pthread_create(&thread_datas[thread_i].thread, NULL, restore_bo_contents,
-					    (void *)&thread_datas[thread_i]);
-		if (ret_thread) {
-			pr_err("Failed to create thread[%i] ret:%d\n", thread_i, ret_thread);
-			ret = -ret_thread;
+		items = xzalloc(sizeof(*items) * (e->num_of_bos ?: 1));
+		if (!items) {
+			ret = -ENOMEM;
 			goto exit;
 		}
-		thread_i++;
-	}
+		thread_data->upload.items = items;
 
-	for (int i = 0; i < e->num_of_gpus; i++) {
-		pthread_join(thread_datas[i].thread, NULL);
-		pr_info("Thread[0x%x] finished ret:%d\n", thread_datas[i].gpu_id, thread_datas[i].ret);
+		for (int j = 0; j < e->num_of_bos; j++) {
+			if (bo_buckets[j].gpu_id != thread_data->gpu_id)
+				continue;
 
-		if (thread_datas[i].ret) {
-			ret = thread_datas[i].ret;
-			goto exit;
+			if (!(bo_buckets[j].alloc_flags & (KFD_IOC_ALLOC_MEM_FLAGS_VRAM | KFD_IOC_ALLOC_MEM_FLAGS_GTT)))
+				continue;
+
+			items[nr_items].bo = j;
+			items[nr_items].size = e->bo_entries[j]->size;
+			nr_items++;
 		}
-	}
-exit:
-	for (int i = 0; i < e->num_of_bos; i++) {
-		if (bo_buckets[i].dmabuf_fd != KFD_INVALID_FD)
-			close(bo_buckets[i].dmabuf_fd);
+
+		thread_data->upload.ops = &restore_bo_ops;
+		thread_data->upload.priv = thread_data;
+		thread_data->upload.nr_items = nr_items;
+		thread_data->upload.staging_size = RESTORE_STAGING_SIZE;
+
+		ret = bo_upload_start(&thread_data->upload);
+		if (ret)
+			goto exit;
+
+		job->nr_threads = ++thread_i;
 	}
 
-	xfree(thread_datas);
+	if (!criu_plugin_add_pending(wait_bo_restore, job))
+		return 0;
+
+	pr_warn("Unable to defer BO upload, waiting for it now\n");
+	return wait_bo_restore(job);
+
+exit:
+	wait_bo_restore(job);
 	return ret;
 }
 
@@ -1782,6 +2346,13 @@ int amdgpu_plugin_restore_file(int id)
 
 	plugin_log_msg("amdgpu_plugin: read image file data\n");
 
+	if (e->has_chunk_size && e->chunk_size != INCR_CHUNK_SIZE) {
+		pr_err("amdgpu_plugin: Unsupported BO chunk size %#lx (expected:%#llx)\n", e->chunk_size,
+		       INCR_CHUNK_SIZE);
+		ret = -EINVAL;
+		goto exit;
+	}
+
 	/*
 	 * Initialize fd_next to be 1 greater than the biggest file descriptor in use by the target restore process.
 	 * This way, we know that the file descriptors we store will not conflict with file descriptors inside core
@@ -1832,11 +2403,17 @@ int amdgpu_plugin_restore_file(int id)
 		goto exit;
 	}
 
-	ret = restore_bo_data(id, (struct kfd_criu_bo_bucket *)args.bos, e);
+	ret = restore_hsakmt_shared_mem(e->shared_mem_size, e->shared_mem_magic);
 	if (ret)
 		goto exit;
 
-	ret = restore_hsakmt_shared_mem(e->shared_mem_size, e->shared_mem_magic);
+	/*
+	 * BO contents keep being uploaded after this hook returns, they are waited for before the
+	 * task switches to the restorer. From here on the upload owns the image data and BO buckets.
+	 */
+	ret = restore_bo_data(id, (struct kfd_criu_bo_bucket *)args.bos, e);
+	args.bos = 0;
+	e = NULL;
 
 exit:
 	if (e)
@@ -0,0 +1,200 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "xmalloc.h"
+#include "amdgpu_plugin_incr.h"
+
+#ifdef COMPILE_TESTS
+#undef pr_err
+#define pr_err(format, arg...) fprintf(stdout, "%s:%d ERROR:" format, __FILE__, __LINE__, ##arg)
+#endif
+
+#define INCR_PRIME1 0x9E3779B185EBCA87ULL
+#define INCR_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define INCR_PRIME3 0x165667B19E3779F9ULL
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t fmix64(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+static inline uint64_t incr_round(uint64_t acc, uint64_t w)
+{
+	return rotl64(acc + w * INCR_PRIME2, 31) * INCR_PRIME1;
+}
+
+/*
+ * Four independent 64-bit lanes over the chunk words, folded into 128 bits at the end. This is not a
+ * cryptographic hash, but 128 bits keep the odds of two different chunk contents colliding negligible
+ * for the chunk counts we see, and the independent lanes let it keep up with the staging copies.
+ */
+void incr_hash_chunk(const void *buf, uint64_t len, uint64_t *hash)
+{
+	const unsigned char *p = buf;
+	uint64_t v[4] = { INCR_PRIME1 + INCR_PRIME2, INCR_PRIME2, 0, -INCR_PRIME1 };
+	uint64_t i, w[4];
+
+	for (i = 0; i + sizeof(w) <= len; i += sizeof(w)) {
+		memcpy(w, p + i, sizeof(w));
+		v[0] = incr_round(v[0], w[0]);
+		v[1] = incr_round(v[1], w[1]);
+		v[2] = incr_round(v[2], w[2]);
+		v[3] = incr_round(v[3], w[3]);
+	}
+
+	if (i < len) {
+		memset(w, 0, sizeof(w));
+		memcpy(w, p + i, len - i);
+		v[0] = incr_round(v[0], w[0]);
+		v[1] = incr_round(v[1], w[1]);
+		v[2] = incr_round(v[2], w[2]);
+		v[3] = incr_round(v[3], w[3]);
+	}
+
+	hash[0] = fmix64(rotl64(v[0], 1) + rotl64(v[1], 7) + rotl64(v[2], 12) + rotl64(v[3], 18) + len);
+	hash[1] = fmix64((v[0] * INCR_PRIME3) ^ rotl64(v[1] * INCR_PRIME1, 23) ^ rotl64(v[2] * INCR_PRIME2, 41) ^
+			 rotl64(v[3], 53) ^ len);
+}
+
+/* Number of bytes of the BO that are stored in its own pages image */
+uint64_t incr_present_size(uint64_t size, const uint8_t *in_parent, uint64_t nr_in_parent)
+{
+	uint64_t nr_chunks = incr_nr_chunks(size), c, ret = size;
+
+	for (c = 0; c < nr_chunks; c++) {
+		if (!incr_chunk_in_parent(in_parent, nr_in_parent, c))
+			continue;
+		ret -= (c == nr_chunks - 1) ? size - c * INCR_CHUNK_SIZE : INCR_CHUNK_SIZE;
+	}
+
+	return ret;
+}
+
+/**
+ * @brief Hash a BO staging copy and write out the chunks that changed
+ *
+ * @param data Staging copy of the BO contents
+ * @param size Size of the BO
+ * @param parent_hashes Chunk hashes of the matching BO in the parent checkpoint, or NULL
+ * @param nr_parent_hashes Number of entries in parent_hashes
+ * @param hashes Output, incr_nr_chunks(size) * INCR_HASH_WORDS entries
+ * @param in_parent Output, incr_nr_chunks(size) entries, set for chunks that were not written
+ * @param write Callback to write present chunk data, consecutive chunks are coalesced
+ * @param priv Passed to write
+ * @return number of bytes written or -errno on failure
+ */
+int64_t incr_dump_bo(const void *data, uint64_t size, const uint64_t *parent_hashes, uint64_t nr_parent_hashes,
+		     uint64_t *hashes, uint8_t *in_parent, incr_write_t write, void *priv)
+{
+	uint64_t nr_chunks = incr_nr_chunks(size), c, run_start = 0, run_len = 0;
+	const unsigned char *p = data;
+	int64_t written = 0;
+	int ret;
+
+	/* A parent BO with a different size cannot be diffed against chunk by chunk */
+	if (nr_parent_hashes != nr_chunks * INCR_HASH_WORDS)
+		parent_hashes = NULL;
+
+	for (c = 0; c < nr_chunks; c++) {
+		uint64_t off = c * INCR_CHUNK_SIZE;
+		uint64_t len = (size - off < INCR_CHUNK_SIZE) ? size - off : INCR_CHUNK_SIZE;
+		uint64_t *h = &hashes[c * INCR_HASH_WORDS];
+
+		incr_hash_chunk(p + off, len, h);
+
+		in_parent[c] = parent_hashes && !memcmp(h, &parent_hashes[c * INCR_HASH_WORDS],
+							sizeof(*h) * INCR_HASH_WORDS);
+		if (!in_parent[c]) {
+			if (!run_len)
+				run_start = off;
+			run_len += len;
+			continue;
+		}
+
+		if (run_len) {
+			ret = write(priv, p + run_start, run_len);
+			if (ret)
+				return ret;
+			written += run_len;
+			run_len = 0;
+		}
+	}
+
+	if (run_len) {
+		ret = write(priv, p + run_start, run_len);
+		if (ret)
+			return ret;
+		written += run_len;
+	}
+
+	return written;
+}
+
+/**
+ * @brief Fill in part of a BO from its pages image and its parents
+ *
+ * Runs of consecutive present chunks are fetched with a single read_cur call, runs of parent
+ * chunks with a single read_parent call. A read_parent callback typically calls back into this
+ * function for the matching BO one level up the checkpoint chain.
+ *
+ * @param data Buffer receiving bytes [off, off + len) of the BO
+ * @param size Size of the BO
+ * @param off Chunk aligned start of the range to restore
+ * @param len Length of the range to restore
+ * @param in_parent Per chunk flags from the BO entry, or NULL if all chunks are present
+ * @param nr_in_parent Number of entries in in_parent
+ * @return 0 if successful, -errno on failure
+ */
+int incr_restore_range(void *data, uint64_t size, uint64_t off, uint64_t len, const uint8_t *in_parent,
+		       uint64_t nr_in_parent, incr_read_t read_cur, incr_read_t read_parent, void *priv)
+{
+	uint64_t start = off, end = off + len, c, data_off = 0;
+	unsigned char *p = data;
+
+	if (off % INCR_CHUNK_SIZE || end > size) {
+		pr_err("Bad BO range %#lx+%#lx (size %#lx)\n", (unsigned long)off, (unsigned long)len,
+		       (unsigned long)size);
+		return -EINVAL;
+	}
+
+	/* Position of the range within the present data of the BO */
+	for (c = 0; c < off / INCR_CHUNK_SIZE; c++)
+		if (!incr_chunk_in_parent(in_parent, nr_in_parent, c))
+			data_off += INCR_CHUNK_SIZE;
+
+	while (off < end) {
+		bool parent = incr_chunk_in_parent(in_parent, nr_in_parent, off / INCR_CHUNK_SIZE);
+		uint64_t run = 0;
+		int ret;
+
+		while (off + run < end &&
+		       incr_chunk_in_parent(in_parent, nr_in_parent, (off + run) / INCR_CHUNK_SIZE) == parent)
+			run += (end - off - run < INCR_CHUNK_SIZE) ? end - off - run : INCR_CHUNK_SIZE;
+
+		if (parent) {
+			ret = read_parent(priv, off, p + off - start, run);
+		} else {
+			ret = read_cur(priv, data_off, p + off - start, run);
+			data_off += run;
+		}
+		if (ret)
+			return ret;
+
+		off += run;
+	}
+
+	return 0;
+}
@@ -0,0 +1,49 @@
+#ifndef __AMDGPU_PLUGIN_INCR_H__
+#define __AMDGPU_PLUGIN_INCR_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Incremental BO dump
+ *
+ * BO contents are hashed in fixed size chunks. When a parent checkpoint holds a BO with the same
+ * address, size and placement, chunks whose hash did not change are not written again, the BO
+ * entry marks them as living in the parent image instead. The pages image of a BO then only
+ * carries its "present" chunks, back to back and in chunk order.
+ *
+ * Nothing in here touches libdrm or KFD, the callers hand in the staging copy of a BO and
+ * callbacks that move bytes to and from the images, so the logic can be unit-tested and
+ * benchmarked on machines without a GPU.
+ */
+
+#define INCR_CHUNK_SIZE (2ULL << 20)
+#define INCR_HASH_WORDS 2 /* 128-bit hash per chunk */
+
+/* Write @len bytes of present chunk data */
+typedef int (*incr_write_t)(void *priv, const void *buf, uint64_t len);
+/*
+ * Read @len bytes of chunk data. For present chunks @off is the offset within the present data
+ * of the BO, for parent chunks it is the offset within the BO itself.
+ */
+typedef int (*incr_read_t)(void *priv, uint64_t off, void *buf, uint64_t len);
+
+static inline uint64_t incr_nr_chunks(uint64_t size)
+{
+	return (size + INCR_CHUNK_SIZE - 1) / INCR_CHUNK_SIZE;
+}
+
+static inline bool incr_chunk_in_parent(const uint8_t *in_parent, uint64_t nr_in_parent, uint64_t chunk)
+{
+	return in_parent && chunk < nr_in_parent && in_parent[chunk];
+}
+
+extern void incr_hash_chunk(const void *buf, uint64_t len, uint64_t *hash);
+extern uint64_t incr_present_size(uint64_t size, const uint8_t *in_parent, uint64_t nr_in_parent);
+
+extern int64_t incr_dump_bo(const void *data, uint64_t size, const uint64_t *parent_hashes, uint64_t nr_parent_hashes,
+			    uint64_t *hashes, uint8_t *in_parent, incr_write_t write, void *priv);
+extern int incr_restore_range(void *data, uint64_t size, uint64_t off, uint64_t len, const uint8_t *in_parent,
+			      uint64_t nr_in_parent, incr_read_t read_cur, incr_read_t read_parent, void *priv);
+
+#endif /* __AMDGPU_PLUGIN_INCR_H__ */
@@ -0,0 +1,136 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "xmalloc.h"
+#include "amdgpu_plugin_incr.h"
+#include "amdgpu_plugin_upload.h"
+
+#ifdef COMPILE_TESTS
+#undef pr_err
+#define pr_err(format, arg...) fprintf(stdout, "%s:%d ERROR:" format, __FILE__, __LINE__, ##arg)
+#undef pr_info
+#define pr_info(format, arg...) fprintf(stdout, "%s:%d INFO:" format, __FILE__, __LINE__, ##arg)
+#endif
+
+static long ts_diff_us(const struct timespec *from, const struct timespec *to)
+{
+	return (to->tv_sec - from->tv_sec) * 1000000L + (to->tv_nsec - from->tv_nsec) / 1000;
+}
+
+static void *bo_upload_thread(void *arg)
+{
+	struct bo_upload *up = arg;
+	uint64_t max_size = 0, staging;
+	void *buffer = NULL;
+	int i, ret;
+
+	ret = up->ops->open(up->priv);
+	if (ret)
+		goto close;
+
+	for (i = 0; i < up->nr_items; i++)
+		if (up->items[i].size > max_size)
+			max_size = up->items[i].size;
+
+	staging = (max_size < up->staging_size) ? max_size : up->staging_size;
+	if (staging && posix_memalign(&buffer, sysconf(_SC_PAGE_SIZE), staging)) {
+		pr_err("Failed to alloc %lu bytes of staging memory\n", (unsigned long)staging);
+		buffer = NULL;
+		ret = -ENOMEM;
+		goto close;
+	}
+
+	for (i = 0; i < up->nr_items && !ret; i++) {
+		struct bo_upload_item *item = &up->items[i];
+		uint64_t off, len;
+
+		for (off = 0; off < item->size; off += len) {
+			len = (item->size - off < staging) ? item->size - off : staging;
+
+			ret = up->ops->fill(up->priv, item->bo, off, buffer, len);
+			if (ret)
+				break;
+
+			ret = up->ops->write(up->priv, item->bo, off, buffer, len);
+			if (ret) {
+				pr_err("Failed to upload BO %d at %#lx+%#lx\n", item->bo, (unsigned long)off,
+				       (unsigned long)len);
+				break;
+			}
+		}
+	}
+
+close:
+	free(buffer);
+	up->ops->close(up->priv);
+
+	clock_gettime(CLOCK_MONOTONIC, &up->done);
+	up->ret = ret;
+	return NULL;
+}
+
+/**
+ * @brief Start uploading BO contents in the background
+ *
+ * ops->close is called at the end of the upload even if ops->open failed.
+ *
+ * @return 0 if the upload thread is running, -errno otherwise
+ */
+int bo_upload_start(struct bo_upload *up)
+{
+	int ret;
+
+	/* Pieces have to start on chunk boundaries, see incr_restore_range() */
+	up->staging_size -= up->staging_size % INCR_CHUNK_SIZE;
+	if (!up->staging_size)
+		up->staging_size = INCR_CHUNK_SIZE;
+
+	up->ret = 0;
+	clock_gettime(CLOCK_MONOTONIC, &up->start);
+
+	ret = pthread_create(&up->thread, NULL, bo_upload_thread, up);
+	if (ret) {
+		pr_err("Failed to create upload thread (ret:%d)\n", ret);
+		return -ret;
+	}
+
+	up->started = true;
+	return 0;
+}
+
+/**
+ * @brief Wait for a background upload to finish
+ *
+ * Logs how much of the upload ran while the caller was busy with other work and how long the
+ * caller had to wait for the rest.
+ *
+ * @return result of the upload, 0 if successful, -errno on failure
+ */
+int bo_upload_join(struct bo_upload *up)
+{
+	struct timespec joined;
+	long ran, waited;
+
+	if (!up->started)
+		return up->ret;
+
+	clock_gettime(CLOCK_MONOTONIC, &joined);
+	pthread_join(up->thread, NULL);
+	up->started = false;
+
+	ran = ts_diff_us(&up->start, &up->done);
+	waited = ts_diff_us(&joined, &up->done);
+	if (waited < 0)
+		waited = 0;
+
+	pr_info("BO upload of %d BOs took %ld us, %ld us overlapped with restore, waited %ld us (ret:%d)\n",
+		up->nr_items, ran, ran - waited, waited, up->ret);
+	return up->ret;
+}
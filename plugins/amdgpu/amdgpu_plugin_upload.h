@@ -0,0 +1,49 @@
+#ifndef __AMDGPU_PLUGIN_UPLOAD_H__
+#define __AMDGPU_PLUGIN_UPLOAD_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
+
+/*
+ * Background upload of BO contents on restore
+ *
+ * One upload runs per GPU in its own thread. BOs are pushed through a staging buffer of at most
+ * staging_size bytes: a piece of the BO is filled from the images, then written to the device,
+ * then the next piece follows. The device and the images are only reached through bo_upload_ops,
+ * so the pipeline can be driven by a mock device in tests.
+ */
+
+struct bo_upload_ops {
+	/* Called in the upload thread before the first and after the last BO */
+	int (*open)(void *priv);
+	void (*close)(void *priv);
+	/* Fill @buf with bytes [off, off + len) of BO @bo from the images */
+	int (*fill)(void *priv, int bo, uint64_t off, void *buf, uint64_t len);
+	/* Copy @len bytes from @buf to offset @off of BO @bo on the device */
+	int (*write)(void *priv, int bo, uint64_t off, void *buf, uint64_t len);
+};
+
+struct bo_upload_item {
+	int bo;
+	uint64_t size;
+};
+
+struct bo_upload {
+	const struct bo_upload_ops *ops;
+	void *priv;
+	struct bo_upload_item *items;
+	int nr_items;
+	uint64_t staging_size; /* Rounded down to a multiple of INCR_CHUNK_SIZE */
+
+	pthread_t thread;
+	bool started;
+	int ret;
+	struct timespec start, done;
+};
+
+extern int bo_upload_start(struct bo_upload *up);
+extern int bo_upload_join(struct bo_upload *up);
+
+#endif /* __AMDGPU_PLUGIN_UPLOAD_H__ */
@@ -0,0 +1,341 @@
+/**************************************************************************************************
+ * Background BO upload unit tests
+ *
+ * The GPU is replaced by a mock device that keeps BO contents in host memory, and the images by a
+ * buffer holding the checkpointed contents. Both sides can be slowed down to model sDMA and image
+ * read times, which lets us check that the upload overlaps with work done by the caller.
+ *
+ * Test 0: Upload BOs larger than the staging buffer
+ *	EXPECT: contents match, no piece is larger than the staging size
+ *
+ * Test 1: Upload while the caller is busy for about as long as the upload takes
+ *	EXPECT: upload and caller work together take much less than one after the other
+ *
+ * Test 2: Device write fails in the middle of a BO
+ *	EXPECT: FAILURE reported by join, device closed
+ *
+ * Test 3: Device open fails
+ *	EXPECT: FAILURE reported by join, device closed
+ *
+ **************************************************************************************************/
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "amdgpu_plugin_incr.h"
+#include "amdgpu_plugin_upload.h"
+
+#define pr_err(format, arg...)	fprintf(stdout, "%s:%d ERROR:" format, __FILE__, __LINE__, ##arg)
+#define pr_info(format, arg...) fprintf(stdout, "%s:%d INFO:" format, __FILE__, __LINE__, ##arg)
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+
+#define NR_BOS	3
+#define BO_SIZE (5 * INCR_CHUNK_SIZE + 4096)
+
+struct mock_dev {
+	unsigned char *image[NR_BOS];
+	unsigned char *vram[NR_BOS];
+	uint64_t max_piece;
+	useconds_t fill_delay;	/* per piece */
+	useconds_t write_delay; /* per piece */
+	int fail_open;
+	int fail_write_at; /* piece number, 0 = never */
+	int pieces;
+	int opened, closed;
+};
+
+static int mock_open(void *priv)
+{
+	struct mock_dev *dev = priv;
+
+	dev->opened++;
+	return dev->fail_open ? -ENODEV : 0;
+}
+
+static void mock_close(void *priv)
+{
+	struct mock_dev *dev = priv;
+
+	dev->closed++;
+}
+
+static int mock_fill(void *priv, int bo, uint64_t off, void *buf, uint64_t len)
+{
+	struct mock_dev *dev = priv;
+
+	if (dev->fill_delay)
+		usleep(dev->fill_delay);
+	memcpy(buf, dev->image[bo] + off, len);
+	return 0;
+}
+
+static int mock_write(void *priv, int bo, uint64_t off, void *buf, uint64_t len)
+{
+	struct mock_dev *dev = priv;
+
+	if (++dev->pieces == dev->fail_write_at)
+		return -EIO;
+
+	if (dev->write_delay)
+		usleep(dev->write_delay);
+	if (len > dev->max_piece)
+		dev->max_piece = len;
+	memcpy(dev->vram[bo] + off, buf, len);
+	return 0;
+}
+
+static const struct bo_upload_ops mock_ops = {
+	.open = mock_open,
+	.close = mock_close,
+	.fill = mock_fill,
+	.write = mock_write,
+};
+
+static struct bo_upload_item items[NR_BOS];
+
+static int mock_init(struct mock_dev *dev, struct bo_upload *up, uint64_t staging_size)
+{
+	memset(dev, 0, sizeof(*dev));
+	memset(up, 0, sizeof(*up));
+
+	for (int i = 0; i < NR_BOS; i++) {
+		dev->image[i] = malloc(BO_SIZE);
+		dev->vram[i] = calloc(1, BO_SIZE);
+		if (!dev->image[i] || !dev->vram[i])
+			return -ENOMEM;
+
+		for (uint64_t j = 0; j < BO_SIZE; j++)
+			dev->image[i][j] = (j * 2654435761u + i) >> 9;
+
+		/* Upload in reverse order to check that items are honoured */
+		items[i].bo = NR_BOS - 1 - i;
+		items[i].size = BO_SIZE;
+	}
+
+	up->ops = &mock_ops;
+	up->priv = dev;
+	up->items = items;
+	up->nr_items = NR_BOS;
+	up->staging_size = staging_size;
+	return 0;
+}
+
+static void mock_fini(struct mock_dev *dev)
+{
+	for (int i = 0; i < NR_BOS; i++) {
+		free(dev->image[i]);
+		free(dev->vram[i]);
+	}
+}
+
+static int mock_check(struct mock_dev *dev)
+{
+	for (int i = 0; i < NR_BOS; i++) {
+		if (memcmp(dev->image[i], dev->vram[i], BO_SIZE)) {
+			pr_err("BO %d contents do not match\n", i);
+			return -EINVAL;
+		}
+	}
+
+	if (dev->opened != 1 || dev->closed != 1) {
+		pr_err("Device opened %d and closed %d times\n", dev->opened, dev->closed);
+		return -EINVAL;
+	}
+	return 0;
+}
+
+static long elapsed_ms(struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+static int test_0(void)
+{
+	struct mock_dev dev;
+	struct bo_upload up;
+	int ret;
+
+	/* Not a multiple of the chunk size, must be rounded down */
+	ret = mock_init(&dev, &up, 2 * INCR_CHUNK_SIZE + 12345);
+	if (ret)
+		goto exit;
+
+	ret = bo_upload_start(&up);
+	if (ret)
+		goto exit;
+
+	ret = bo_upload_join(&up);
+	if (ret)
+		goto exit;
+
+	ret = mock_check(&dev);
+	if (ret)
+		goto exit;
+
+	if (dev.max_piece != 2 * INCR_CHUNK_SIZE) {
+		pr_err("Largest piece was %lu bytes, expected %llu\n", dev.max_piece, 2 * INCR_CHUNK_SIZE);
+		ret = -EINVAL;
+	}
+exit:
+	mock_fini(&dev);
+	return ret;
+}
+
+static int test_1(void)
+{
+	struct timespec start;
+	struct mock_dev dev;
+	struct bo_upload up;
+	long upload_ms, join_ms, ran_ms;
+	int ret;
+
+	ret = mock_init(&dev, &up, 2 * INCR_CHUNK_SIZE);
+	if (ret)
+		goto exit;
+
+	/* 3 BOs x 3 pieces x 20ms */
+	dev.fill_delay = 5000;
+	dev.write_delay = 15000;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	ret = bo_upload_start(&up);
+	if (ret)
+		goto exit;
+
+	/* The rest of the restore */
+	usleep(180000);
+
+	join_ms = elapsed_ms(&start);
+	ret = bo_upload_join(&up);
+	upload_ms = elapsed_ms(&start);
+	join_ms = upload_ms - join_ms;
+	if (ret)
+		goto exit;
+
+	ret = mock_check(&dev);
+	if (ret)
+		goto exit;
+
+	ran_ms = elapsed_ms(&up.start) - elapsed_ms(&up.done);
+	pr_info("Upload took %ld ms, upload and restore %ld ms, join waited %ld ms\n", ran_ms, upload_ms, join_ms);
+
+	/* Done one after the other, this would have taken ran_ms + 180 */
+	if (upload_ms > ran_ms + 100) {
+		pr_err("Upload did not overlap with the caller\n");
+		ret = -EINVAL;
+	}
+exit:
+	mock_fini(&dev);
+	return ret;
+}
+
+static int test_2(void)
+{
+	struct mock_dev dev;
+	struct bo_upload up;
+	int ret;
+
+	ret = mock_init(&dev, &up, 2 * INCR_CHUNK_SIZE);
+	if (ret)
+		goto exit;
+
+	dev.fail_write_at = 5;
+
+	ret = bo_upload_start(&up);
+	if (ret)
+		goto exit;
+
+	ret = bo_upload_join(&up);
+	if (dev.closed != 1 || dev.pieces != 5) {
+		pr_err("Upload went on after the failure (pieces:%d closed:%d)\n", dev.pieces, dev.closed);
+		ret = 0;
+	}
+exit:
+	mock_fini(&dev);
+	return ret;
+}
+
+static int test_3(void)
+{
+	struct mock_dev dev;
+	struct bo_upload up;
+	int ret;
+
+	ret = mock_init(&dev, &up, 2 * INCR_CHUNK_SIZE);
+	if (ret)
+		goto exit;
+
+	dev.fail_open = 1;
+
+	ret = bo_upload_start(&up);
+	if (ret)
+		goto exit;
+
+	ret = bo_upload_join(&up);
+	if (dev.closed != 1 || dev.pieces) {
+		pr_err("Unexpected device use after failed open (pieces:%d closed:%d)\n", dev.pieces, dev.closed);
+		ret = 0;
+	}
+exit:
+	mock_fini(&dev);
+	return ret;
+}
+
+struct test {
+	int (*test_func)(void);
+	bool success;
+};
+
+int main(int argc, char **argv)
+{
+	int ret;
+	int result = 0;
+
+	struct test tests[] = {
+		{ test_0, true },
+		{ test_1, true },
+		{ test_2, false },
+		{ test_3, false },
+	};
+
+	if (argc > 1) {
+		int run;
+
+		if (sscanf(argv[1], "%d", &run) != 1 || run < 0 || (run >= ARRAY_SIZE(tests))) {
+			pr_err("Usage: test_bo_upload [test_number]\n");
+			pr_err("       Test number range:0-%ld\n", ARRAY_SIZE(tests) - 1);
+			pr_err("       Return codes:\n");
+			pr_err("         0 All tests pass\n");
+			pr_err("         1 At least one test failed\n");
+			pr_err("         2 Invalid parameters\n");
+			return 2;
+		}
+		pr_info("======================================================================\n");
+		pr_info("Starting test %d\n", run);
+		ret = tests[run].test_func();
+		pr_info("\n\nTest %d: %s\n", run, (!ret == tests[run].success) ? "PASS" : "FAILED");
+		pr_info("======================================================================\n");
+		return (!ret == tests[run].success) ? 0 : 1;
+	}
+
+	for (int i = 0; i < ARRAY_SIZE(tests); i++) {
+		pr_info("======================================================================\n");
+		pr_info("Starting test %d\n", i);
+		ret = tests[i].test_func();
+		pr_info("\n\nTest %d: %s\n", i, (!ret == tests[i].success) ? "PASS" : "FAILED");
+		pr_info("======================================================================\n");
+		if (!ret != tests[i].success)
+			result = 1;
+	}
+	return result;
+}
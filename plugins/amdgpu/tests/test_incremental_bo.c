@@ -0,0 +1,480 @@
+/**************************************************************************************************
+ * Incremental BO dump unit tests
+ *
+ * The GPU is replaced by a plain buffer holding the BO contents (what the sDMA engine would leave in
+ * the staging buffer) and checkpoint images are kept in memory. Each image level records the chunk
+ * hashes and parent flags that would go into the BoEntry and the present chunk data that would go
+ * into the pages image.
+ *
+ * Test 0: Dump without a parent
+ *	EXPECT: every chunk is written, restore returns the original contents
+ *
+ * Test 1: Dump an unchanged BO against its parent
+ *	EXPECT: nothing is written, restore returns the contents through the parent
+ *
+ * Test 2: Dump a BO with a few changed chunks against its parent
+ *	Includes the last, partial chunk
+ *	EXPECT: only the changed chunks are written, restore returns the new contents
+ *
+ * Test 3: Chain of four checkpoints with different chunks changing at each level
+ *	EXPECT: restore of every level returns the contents at the time of that checkpoint
+ *
+ * Test 4: Parent BO with a different size
+ *	EXPECT: the parent is ignored and every chunk is written
+ *
+ * Test 5: Restore of a range that does not start on a chunk boundary
+ *	EXPECT: FAILURE
+ *
+ * Running "test_incremental_bo bench [size_mb]" measures the hashing and diffing throughput.
+ *
+ **************************************************************************************************/
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "amdgpu_plugin_incr.h"
+
+#define pr_err(format, arg...)	fprintf(stdout, "%s:%d ERROR:" format, __FILE__, __LINE__, ##arg)
+#define pr_info(format, arg...) fprintf(stdout, "%s:%d INFO:" format, __FILE__, __LINE__, ##arg)
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+
+#define BO_SIZE (5 * INCR_CHUNK_SIZE + 4096)
+
+struct mock_image {
+	uint64_t size;
+	uint64_t *hashes;
+	uint8_t *in_parent;
+	unsigned char *pages;
+	uint64_t pages_len;
+	struct mock_image *parent;
+};
+
+static int mock_write(void *priv, const void *buf, uint64_t len)
+{
+	struct mock_image *img = priv;
+	unsigned char *pages;
+
+	pages = realloc(img->pages, img->pages_len + len);
+	if (!pages)
+		return -ENOMEM;
+
+	memcpy(pages + img->pages_len, buf, len);
+	img->pages = pages;
+	img->pages_len += len;
+	return 0;
+}
+
+static int mock_read_cur(void *priv, uint64_t off, void *buf, uint64_t len)
+{
+	struct mock_image *img = priv;
+
+	if (off + len > img->pages_len) {
+		pr_err("Read past the pages image (%lu+%lu > %lu)\n", off, len, img->pages_len);
+		return -EIO;
+	}
+
+	memcpy(buf, img->pages + off, len);
+	return 0;
+}
+
+static int mock_read_parent(void *priv, uint64_t off, void *buf, uint64_t len)
+{
+	struct mock_image *img = priv, *parent = img->parent;
+
+	if (!parent) {
+		pr_err("Chunk at %#lx refers to a missing parent\n", off);
+		return -EINVAL;
+	}
+
+	return incr_restore_range(buf, parent->size, off, len, parent->in_parent, incr_nr_chunks(parent->size),
+				  mock_read_cur, mock_read_parent, parent);
+}
+
+static void free_image(struct mock_image *img)
+{
+	if (!img)
+		return;
+	free(img->hashes);
+	free(img->in_parent);
+	free(img->pages);
+	free(img);
+}
+
+static struct mock_image *dump_bo(const unsigned char *vram, uint64_t size, struct mock_image *parent)
+{
+	uint64_t nr_chunks = incr_nr_chunks(size);
+	struct mock_image *img;
+	int64_t ret;
+
+	img = calloc(1, sizeof(*img));
+	if (!img)
+		return NULL;
+
+	img->size = size;
+	img->parent = parent;
+	img->hashes = calloc(nr_chunks * INCR_HASH_WORDS, sizeof(*img->hashes));
+	img->in_parent = calloc(nr_chunks, 1);
+	if (!img->hashes || !img->in_parent)
+		goto err;
+
+	ret = incr_dump_bo(vram, size, parent ? parent->hashes : NULL,
+			   parent ? incr_nr_chunks(parent->size) * INCR_HASH_WORDS : 0, img->hashes, img->in_parent,
+			   mock_write, img);
+	if (ret < 0 || ret != img->pages_len) {
+		pr_err("Dump failed (ret:%ld written:%lu)\n", ret, img->pages_len);
+		goto err;
+	}
+
+	return img;
+err:
+	free_image(img);
+	return NULL;
+}
+
+static int check_restore(struct mock_image *img, const unsigned char *expected)
+{
+	unsigned char *out;
+	int ret;
+
+	out = malloc(img->size);
+	if (!out)
+		return -ENOMEM;
+
+	memset(out, 0xa5, img->size);
+	ret = incr_restore_range(out, img->size, 0, img->size, img->in_parent, incr_nr_chunks(img->size),
+				 mock_read_cur, mock_read_parent, img);
+	if (!ret && memcmp(out, expected, img->size)) {
+		pr_err("Restored contents do not match\n");
+		ret = -EINVAL;
+	}
+
+	free(out);
+	return ret;
+}
+
+static unsigned char *alloc_vram(uint64_t size, unsigned int seed)
+{
+	unsigned char *vram = malloc(size);
+
+	if (!vram)
+		return NULL;
+
+	for (uint64_t i = 0; i < size; i++)
+		vram[i] = (i * 2654435761u + seed) >> 7;
+	return vram;
+}
+
+static void touch_chunk(unsigned char *vram, uint64_t size, uint64_t chunk)
+{
+	uint64_t off = chunk * INCR_CHUNK_SIZE;
+
+	/* Flip a single byte in the middle of the chunk */
+	off += ((size - off < INCR_CHUNK_SIZE) ? size - off : INCR_CHUNK_SIZE) / 2;
+	vram[off] ^= 0x5a;
+}
+
+static int test_0(void)
+{
+	unsigned char *vram = alloc_vram(BO_SIZE, 0);
+	struct mock_image *img = NULL;
+	int ret = -1;
+
+	if (!vram)
+		return -ENOMEM;
+
+	img = dump_bo(vram, BO_SIZE, NULL);
+	if (!img)
+		goto exit;
+
+	if (img->pages_len != BO_SIZE) {
+		pr_err("Expected a full dump, got %lu bytes\n", img->pages_len);
+		goto exit;
+	}
+
+	ret = check_restore(img, vram);
+exit:
+	free_image(img);
+	free(vram);
+	return ret;
+}
+
+static int test_1(void)
+{
+	unsigned char *vram = alloc_vram(BO_SIZE, 1);
+	struct mock_image *parent = NULL, *img = NULL;
+	int ret = -1;
+
+	if (!vram)
+		return -ENOMEM;
+
+	parent = dump_bo(vram, BO_SIZE, NULL);
+	if (!parent)
+		goto exit;
+
+	img = dump_bo(vram, BO_SIZE, parent);
+	if (!img)
+		goto exit;
+
+	if (img->pages_len != 0) {
+		pr_err("Expected an empty dump, got %lu bytes\n", img->pages_len);
+		goto exit;
+	}
+
+	ret = check_restore(img, vram);
+exit:
+	free_image(img);
+	free_image(parent);
+	free(vram);
+	return ret;
+}
+
+static int test_2(void)
+{
+	unsigned char *vram = alloc_vram(BO_SIZE, 2);
+	struct mock_image *parent = NULL, *img = NULL;
+	uint64_t last = incr_nr_chunks(BO_SIZE) - 1;
+	int ret = -1;
+
+	if (!vram)
+		return -ENOMEM;
+
+	parent = dump_bo(vram, BO_SIZE, NULL);
+	if (!parent)
+		goto exit;
+
+	touch_chunk(vram, BO_SIZE, 1);
+	touch_chunk(vram, BO_SIZE, last);
+
+	img = dump_bo(vram, BO_SIZE, parent);
+	if (!img)
+		goto exit;
+
+	if (img->pages_len != INCR_CHUNK_SIZE + (BO_SIZE - last * INCR_CHUNK_SIZE)) {
+		pr_err("Expected two chunks to be written, got %lu bytes\n", img->pages_len);
+		goto exit;
+	}
+
+	if (img->in_parent[1] || img->in_parent[last] || !img->in_parent[0] || !img->in_parent[2]) {
+		pr_err("Wrong chunks marked as changed\n");
+		goto exit;
+	}
+
+	ret = check_restore(img, vram);
+	if (ret)
+		goto exit;
+
+	/* The parent itself must still restore to the old contents */
+	touch_chunk(vram, BO_SIZE, 1);
+	touch_chunk(vram, BO_SIZE, last);
+	ret = check_restore(parent, vram);
+exit:
+	free_image(img);
+	free_image(parent);
+	free(vram);
+	return ret;
+}
+
+static int test_3(void)
+{
+	uint64_t touched[][2] = { { 0, 0 }, { 0, 3 }, { 2, 3 }, { 4, 5 } };
+	struct mock_image *imgs[ARRAY_SIZE(touched)] = { NULL };
+	unsigned char *vram[ARRAY_SIZE(touched)] = { NULL };
+	int ret = -1;
+
+	for (int i = 0; i < ARRAY_SIZE(touched); i++) {
+		vram[i] = malloc(BO_SIZE);
+		if (!vram[i])
+			goto exit;
+
+		if (i == 0) {
+			free(vram[i]);
+			vram[i] = alloc_vram(BO_SIZE, 3);
+			if (!vram[i])
+				goto exit;
+		} else {
+			memcpy(vram[i], vram[i - 1], BO_SIZE);
+			touch_chunk(vram[i], BO_SIZE, touched[i][0]);
+			touch_chunk(vram[i], BO_SIZE, touched[i][1]);
+		}
+
+		imgs[i] = dump_bo(vram[i], BO_SIZE, i ? imgs[i - 1] : NULL);
+		if (!imgs[i])
+			goto exit;
+	}
+
+	for (int i = 0; i < ARRAY_SIZE(touched); i++) {
+		pr_info("Level %d: %lu bytes written\n", i, imgs[i]->pages_len);
+		ret = check_restore(imgs[i], vram[i]);
+		if (ret)
+			goto exit;
+	}
+exit:
+	for (int i = 0; i < ARRAY_SIZE(touched); i++) {
+		free_image(imgs[i]);
+		free(vram[i]);
+	}
+	return ret;
+}
+
+static int test_4(void)
+{
+	unsigned char *vram = alloc_vram(BO_SIZE, 4);
+	struct mock_image *parent = NULL, *img = NULL;
+	int ret = -1;
+
+	if (!vram)
+		return -ENOMEM;
+
+	parent = dump_bo(vram, BO_SIZE - INCR_CHUNK_SIZE, NULL);
+	if (!parent)
+		goto exit;
+
+	img = dump_bo(vram, BO_SIZE, parent);
+	if (!img)
+		goto exit;
+
+	if (img->pages_len != BO_SIZE) {
+		pr_err("Expected a full dump, got %lu bytes\n", img->pages_len);
+		goto exit;
+	}
+
+	ret = check_restore(img, vram);
+exit:
+	free_image(img);
+	free_image(parent);
+	free(vram);
+	return ret;
+}
+
+static int test_5(void)
+{
+	unsigned char *vram = alloc_vram(BO_SIZE, 5);
+	struct mock_image *img = NULL;
+	unsigned char buf[4096];
+	int ret = -1;
+
+	if (!vram)
+		return -ENOMEM;
+
+	img = dump_bo(vram, BO_SIZE, NULL);
+	if (!img)
+		goto exit;
+
+	ret = incr_restore_range(buf, img->size, 4096, sizeof(buf), img->in_parent, incr_nr_chunks(img->size),
+				 mock_read_cur, mock_read_parent, img);
+exit:
+	free_image(img);
+	free(vram);
+	return ret;
+}
+
+static double elapsed(struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static int bench(uint64_t size)
+{
+	struct mock_image *parent = NULL, *img = NULL;
+	unsigned char *vram = alloc_vram(size, 6);
+	struct timespec start;
+	int ret = -1;
+	double t;
+
+	if (!vram)
+		return -ENOMEM;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	parent = dump_bo(vram, size, NULL);
+	t = elapsed(&start);
+	if (!parent)
+		goto exit;
+	pr_info("full dump:        %6.2f GB/s (%lu MB in %.3fs)\n", size / t / 1e9, size >> 20, t);
+
+	/* Change one chunk in eight, the rest comes from the parent */
+	for (uint64_t c = 0; c < incr_nr_chunks(size); c += 8)
+		touch_chunk(vram, size, c);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	img = dump_bo(vram, size, parent);
+	t = elapsed(&start);
+	if (!img)
+		goto exit;
+	pr_info("incremental dump: %6.2f GB/s (%lu of %lu MB written in %.3fs)\n", size / t / 1e9,
+		img->pages_len >> 20, size >> 20, t);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	ret = check_restore(img, vram);
+	t = elapsed(&start);
+	pr_info("restore + verify: %6.2f GB/s (%.3fs)\n", size / t / 1e9, t);
+exit:
+	free_image(img);
+	free_image(parent);
+	free(vram);
+	return ret;
+}
+
+struct test {
+	int (*test_func)(void);
+	bool success;
+};
+
+int main(int argc, char **argv)
+{
+	int ret;
+	int result = 0;
+
+	struct test tests[] = {
+		{ test_0, true }, { test_1, true }, { test_2, true }, { test_3, true }, { test_4, true }, { test_5, false },
+	};
+
+	if (argc > 1 && !strcmp(argv[1], "bench")) {
+		unsigned long size_mb = 1024;
+
+		if (argc > 2 && (sscanf(argv[2], "%lu", &size_mb) != 1 || !size_mb)) {
+			pr_err("Usage: test_incremental_bo bench [size_mb]\n");
+			return 2;
+		}
+		return bench((uint64_t)size_mb << 20) ? 1 : 0;
+	}
+
+	if (argc > 1) {
+		int run;
+
+		if (sscanf(argv[1], "%d", &run) != 1 || run < 0 || (run >= ARRAY_SIZE(tests))) {
+			pr_err("Usage: test_incremental_bo [test_number | bench [size_mb]]\n");
+			pr_err("       Test number range:0-%ld\n", ARRAY_SIZE(tests) - 1);
+			pr_err("       Return codes:\n");
+			pr_err("         0 All tests pass\n");
+			pr_err("         1 At least one test failed\n");
+			pr_err("         2 Invalid parameters\n");
+			return 2;
+		}
+		pr_info("======================================================================\n");
+		pr_info("Starting test %d\n", run);
+		ret = tests[run].test_func();
+		pr_info("\n\nTest %d: %s\n", run, (!ret == tests[run].success) ? "PASS" : "FAILED");
+		pr_info("======================================================================\n");
+		return (!ret == tests[run].success) ? 0 : 1;
+	}
+
+	for (int i = 0; i < ARRAY_SIZE(tests); i++) {
+		pr_info("======================================================================\n");
+		pr_info("Starting test %d\n", i);
+		ret = tests[i].test_func();
+		pr_info("\n\nTest %d: %s\n", i, (!ret == tests[i].success) ? "PASS" : "FAILED");
+		pr_info("======================================================================\n");
+		if (!ret != tests[i].success)
+			result = 1;
+	}
+	return result;
+}
@@ -142,6 +142,11 @@ fi
 # Just try to run it everywhere for now.
 time make unittest
 
+# Only check that the memory path benchmark works, the numbers are not compared
+make bench
+./criu/bench/page-bench --size 64 --pattern runs:16:16 --holes --iterations 1
+./criu/bench/page-bench --size 64 --pattern stride:2 --no-chunk --iterations 1
+
 [ -n "$SKIP_CI_TEST" ] && exit 0
 
 # Umount cpuset in cgroupv1 to make it move to cgroupv2
@@ -261,6 +266,8 @@ if [ -n "$TRAVIS" ] || [ -n "$CIRCLECI" ]; then
        make -C test/others/shell-job/ run
 fi
 make -C test/others/skip-file-rwx-check/ run
+make -C test/others/build-id-cache/ run
+make -C test/others/async-plugin/ run
 make -C test/others/rpc/ run
 
 ./test/zdtm.py run -t zdtm/static/env00 --sibling
@@ -270,6 +277,16 @@ make -C test/others/rpc/ run
 ./test/zdtm.py run -t zdtm/transition/maps007 --pre 2 --page-server
 ./test/zdtm.py run -t zdtm/transition/maps007 --pre 2 --page-server --dedup
 ./test/zdtm.py run -t zdtm/transition/maps007 --pre 2 --pre-dump-mode read
+./test/zdtm.py run -t zdtm/transition/maps007 --pre 2 --compact-pagemap
+./test/zdtm.py run -t zdtm/transition/maps007 --pre 2 --page-server --dedup --compact-pagemap
+./test/zdtm.py run -t zdtm/transition/maps007 --pre 2 --delta-pages
+./test/zdtm.py run -t zdtm/transition/maps007 --pre 2 --page-server --dedup --delta-pages
+./test/zdtm.py run -t zdtm/static/maps04 -t zdtm/static/file_shared --page-cache-warmth
+./test/zdtm.py run -t zdtm/transition/maps007 --pre 2 --cold-pages
+./test/zdtm.py run -t zdtm/static/maps00 --cold-pages --lazy-pages
+./test/zdtm.py run -t zdtm/transition/maps007 --pre 2 --numa
+./test/zdtm.py run -t zdtm/transition/maps007 --pre 2 --io-rate 67108864 --io-full-speed-frozen
+./test/zdtm.py run -t zdtm/transition/maps007 --pre 2 --page-server --io-rate 67108864
 
 ./test/zdtm.py run -t zdtm/transition/pid_reuse --pre 2 # start time based pid reuse detection
 ./test/zdtm.py run -t zdtm/transition/pidfd_store_sk --rpc --pre 2 # pidfd based pid reuse detection
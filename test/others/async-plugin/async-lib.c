@@ -0,0 +1,70 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "criu-plugin.h"
+#include "criu-log.h"
+
+/*
+ * Pretends to save or load the state of an external file, which takes
+ * a while. The hooks only start the work in a thread and leave it
+ * pending, CRIU is supposed to go on with the dump or restore
+ * meanwhile and only wait for it at the barrier.
+ */
+#define WORK_SECONDS 2
+
+static pthread_t worker;
+
+static void *do_work(void *arg)
+{
+	sleep(WORK_SECONDS);
+	return NULL;
+}
+
+static int finish_work(void *arg)
+{
+	if (pthread_join(worker, NULL))
+		return -1;
+
+	pr_info("async-plugin: work finished\n");
+	return 0;
+}
+
+static int start_work(void)
+{
+	if (pthread_create(&worker, NULL, do_work, NULL))
+		return -1;
+
+	if (criu_plugin_add_pending(finish_work, NULL)) {
+		pthread_join(worker, NULL);
+		return -1;
+	}
+
+	pr_info("async-plugin: work started\n");
+	return 0;
+}
+
+int async_dump_ext_file(int fd, int id)
+{
+	return start_work();
+}
+CR_PLUGIN_REGISTER_HOOK(CR_PLUGIN_HOOK__DUMP_EXT_FILE, async_dump_ext_file)
+
+int async_restore_ext_file(int id)
+{
+	int fd;
+
+	fd = open("/dev/null", O_RDWR);
+	if (fd < 0)
+		return -1;
+
+	if (start_work()) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+CR_PLUGIN_REGISTER_HOOK(CR_PLUGIN_HOOK__RESTORE_EXT_FILE, async_restore_ext_file)
+
+CR_PLUGIN_REGISTER_DUMMY("async_plugin")
@@ -0,0 +1,40 @@
+#!/bin/bash -x
+
+cd "$(dirname "$0")" || exit 1
+
+source ../env.sh || exit 1
+
+if [ ! -c /dev/fuse ]; then
+	echo "SKIP: /dev/fuse is required"
+	exit 0
+fi
+
+# The work has to be started in the hook and joined only after
+# @marker, a line CRIU prints while doing the rest of its job.
+function check_overlap {
+	local log=$1 marker=$2
+
+	grep "async-plugin: work finished" "$log" || return 1
+	awk -v marker="$marker" '
+		/async-plugin: work started/ { started = 1 }
+		started && $0 ~ marker { overlapped = 1 }
+		started && /plugin: pending operation .* overlapped/ { joined = 1; exit }
+		END { exit !(joined && overlapped) }
+	' "$log"
+}
+
+rm -rf data
+mkdir -p data
+
+# /dev/fuse is not supported by CRIU, so the plugin dumps it
+setsid sleep 1000 3<>/dev/fuse < /dev/null &> /dev/null &
+pid=$!
+
+${CRIU} dump -D data -o dump.log -v4 --lib "$(pwd)" -t $pid || exit 1
+check_overlap data/dump.log "Dumping pages" || exit 1
+
+${CRIU} restore -D data -o restore.log -v4 --lib "$(pwd)" -d || exit 1
+check_overlap data/restore.log "Opening .* vma" || exit 1
+
+kill $pid
+echo PASS
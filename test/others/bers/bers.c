@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
@@ -12,6 +14,7 @@
 #include <sys/wait.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
 #include <fcntl.h>
 #include <dirent.h>
 #include <syscall.h>
@@ -68,6 +71,11 @@ typedef struct {
 	int opt_mem_fill_mode;
 	int opt_mem_cycle_mode;
 	unsigned int opt_refresh_time;
+	size_t opt_mem_dirty;
+
+	size_t opt_threads;
+	size_t opt_sockets;
+	size_t nr_ready;
 
 	char *opt_work_dir;
 	int work_dir_fd;
@@ -106,6 +114,73 @@ static void dirtify_memory(unsigned long *chunks, size_t nr_chunks, size_t chunk
 	}
 }
 
+/* Writes into @size bytes of pages, going on from where it stopped last time */
+static void dirtify_pages(unsigned long *chunks, size_t nr_chunks, size_t chunk_size, size_t size, size_t *pos)
+{
+	size_t i, total = nr_chunks * chunk_size;
+
+	if (!total)
+		return;
+
+	for (i = 0; i < size; i += PAGE_SIZE) {
+		*((unsigned long *)(chunks[*pos / chunk_size] + *pos % chunk_size)) = i;
+		*pos = (*pos + PAGE_SIZE) % total;
+	}
+}
+
+static void *thread_sleep(void *arg)
+{
+	while (1)
+		pause();
+	return NULL;
+}
+
+static int create_threads(shared_data_t *shared)
+{
+	pthread_attr_t attr;
+	pthread_t th;
+	size_t i;
+
+	pr_info("\tCreating %lu threads\n", shared->opt_threads);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, 64 << 10);
+
+	for (i = 0; i < shared->opt_threads; i++) {
+		errno = pthread_create(&th, &attr, thread_sleep, NULL);
+		if (errno) {
+			pr_perror("Can't create thread");
+			shared->err_pid = sys_gettid();
+			shared->err_no = -errno;
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int create_sockets(shared_data_t *shared)
+{
+	int sk[2];
+	size_t i;
+
+	pr_info("\tCreating %lu socket pairs\n", shared->opt_sockets);
+
+	for (i = 0; i < shared->opt_sockets; i++) {
+		if (socketpair(AF_UNIX, i % 2 ? SOCK_DGRAM : SOCK_STREAM, 0, sk)) {
+			pr_perror("Can't create socket pair");
+			shared->err_pid = sys_gettid();
+			shared->err_no = -errno;
+			return -1;
+		}
+
+		/* Something to be dumped from the queue */
+		write(sk[0], &i, sizeof(i));
+	}
+
+	return 0;
+}
+
 static void dirtify_files(int *fd, size_t nr_files, size_t size)
 {
 	size_t buf[8192];
@@ -161,7 +236,7 @@ static void work_on_fork(shared_data_t *shared)
 	const size_t nr_pages = shared->opt_mem_chunk_size / PAGE_SIZE;
 	unsigned long chunks[MAX_CHUNK] = {};
 	int fd[MAX_CHUNK];
-	size_t i;
+	size_t i, dirty_pos = 0;
 	void *mem;
 
 	pr_trace("locking\n");
@@ -190,7 +265,7 @@ static void work_on_fork(shared_data_t *shared)
 
 			shared->err_pid = sys_gettid();
 			shared->err_no = -errno;
-			exit(1);
+			goto err;
 		}
 	}
 
@@ -199,11 +274,18 @@ static void work_on_fork(shared_data_t *shared)
 			       nr_pages);
 
 	if (create_files(shared, fd, shared->opt_files))
-		exit(1);
+		goto err;
 
 	if (shared->opt_file_size)
 		dirtify_files(fd, shared->opt_files, shared->opt_file_size);
 
+	if (create_sockets(shared))
+		goto err;
+
+	if (create_threads(shared))
+		goto err;
+
+	shared->nr_ready++;
 	pr_trace("releasing\n");
 	pthread_mutex_unlock(&shared->mutex);
 
@@ -212,9 +294,17 @@ static void work_on_fork(shared_data_t *shared)
 		if (shared->opt_mem_cycle_mode)
 			dirtify_memory(chunks, shared->opt_mem_chunks, shared->opt_mem_chunk_size,
 				       shared->opt_mem_cycle_mode, nr_pages);
+		if (shared->opt_mem_dirty)
+			dirtify_pages(chunks, shared->opt_mem_chunks, shared->opt_mem_chunk_size,
+				      shared->opt_mem_dirty, &dirty_pos);
 		if (shared->opt_file_size)
 			dirtify_files(fd, shared->opt_files, shared->opt_file_size);
 	}
+
+err:
+	/* The parent waits for nr_ready under the mutex */
+	pthread_mutex_unlock(&shared->mutex);
+	exit(1);
 }
 
 static int parse_mem_mode(int *mode, char *opt)
@@ -247,6 +337,9 @@ int main(int argc, char *argv[])
 		{ "mem-cycle", required_argument, 0, 11 },
 		{ "refresh", required_argument, 0, 12 },
 		{ "file-size", required_argument, 0, 13 },
+		{ "mem-dirty", required_argument, 0, 14 },
+		{ "threads", required_argument, 0, 15 },
+		{ "sockets", required_argument, 0, 16 },
 		{},
 	};
 
@@ -304,6 +397,7 @@ int main(int argc, char *argv[])
 		case 10:
 			if (parse_mem_mode(&shared->opt_mem_fill_mode, optarg))
 				goto usage;
+			break;
 		case 11:
 			if (parse_mem_mode(&shared->opt_mem_cycle_mode, optarg))
 				goto usage;
@@ -313,6 +407,17 @@ int main(int argc, char *argv[])
 			break;
 		case 13:
 			shared->opt_file_size = (size_t)atol(optarg);
+			break;
+		case 14:
+			/* In megabytes */
+			shared->opt_mem_dirty = (size_t)atol(optarg) << 20ul;
+			break;
+		case 15:
+			shared->opt_threads = (size_t)atol(optarg);
+			break;
+		case 16:
+			shared->opt_sockets = (size_t)atol(optarg);
+			break;
 		}
 	}
 
@@ -363,6 +468,20 @@ int main(int argc, char *argv[])
 	 * Once everything is done and we're in cycle,
 	 * create pidfile and go to sleep...
 	 */
+	while (!shared->err_no) {
+		size_t nr_ready;
+
+		pthread_mutex_lock(&shared->mutex);
+		nr_ready = shared->nr_ready;
+		pthread_mutex_unlock(&shared->mutex);
+
+		if (nr_ready == shared->opt_tasks)
+			break;
+		usleep(10000);
+	}
+	if (shared->err_no)
+		goto err_child;
+
 	pid = sys_gettid();
 	pidfd = openat(shared->work_dir_fd, "bers.pid", O_RDWR | O_CREAT | O_TRUNC, 0666);
 	if (pidfd < 0) {
@@ -398,6 +517,9 @@ usage:
 	pr_msg("    --mem-cycle <mode>       same as --mem-fill but for cycling\n");
 	pr_msg("    --refresh <second>       refresh loading of every task each <second>\n");
 	pr_msg("    --file-size <bytes>      write <bytes> of data into each file on every refresh cycle\n");
+	pr_msg("    --mem-dirty <num>        write into <num> megabytes of pages on every refresh cycle\n");
+	pr_msg("    --threads <num>          create <num> threads in each task\n");
+	pr_msg("    --sockets <num>          create <num> unix socket pairs in each task\n");
 
 	return 1;
 }
@@ -0,0 +1,49 @@
+#!/usr/bin/env bash
+
+# Dump a task and restore it, the dump has to fill the build-id
+# cache and the restore has to get its build-ids from there, even
+# though the two use different work dirs.
+
+set -o errexit
+set -o nounset
+set -o pipefail
+set -o xtrace
+
+source ../env.sh
+
+make clean
+mkdir dump-work restore-work
+cache="$(pwd)/cache"
+touch testfile
+tail --follow testfile &
+tailpid=$!
+if ! "$criu" dump --tree=$tailpid --shell-job --verbosity=4 --log-file=dump.log \
+    --work-dir=dump-work --build-id-cache-dir="$cache"
+then
+    kill $tailpid
+    echo "Failed to dump process"
+    echo FAIL
+    exit 1
+fi
+if ! grep -q "build-id-cache: [0-9]* hits, [0-9]* misses" dump-work/dump.log
+then
+    echo "The build-id cache was not set up on dump"
+    echo FAIL
+    exit 1
+fi
+if ! "$criu" restore --restore-detached --shell-job --verbosity=4 --log-file=restore.log \
+    --work-dir=restore-work --build-id-cache-dir="$cache"
+then
+    echo "Failed to restore process"
+    echo FAIL
+    exit 1
+fi
+kill $tailpid
+hits=$(sed -n 's/.*build-id-cache: \([0-9]*\) hits.*/\1/p' restore-work/restore.log)
+if [ -z "$hits" ] || [ "$hits" -eq 0 ]
+then
+    echo "No build-id cache hits on restore"
+    echo FAIL
+    exit 1
+fi
+echo PASS
@@ -59,6 +59,7 @@ if [ "$(uname -m)" = "x86_64" ]; then
 	# Skip this on aarch64 as aarch64 has no dirty page tracking
 	run_test test_iters
 	run_test test_pre_dump
+	run_test test_freeze_notify
 fi
 run_test test_errno
 run_test test_join_ns
@@ -0,0 +1,218 @@
+#include "criu.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "lib.h"
+
+#define GARBAGE_SIZE (16 << 20)
+#define STATS_LINE   "Pages written against the parent pre-dump: "
+
+static int stop = 0;
+static void sh(int sig)
+{
+	stop = 1;
+}
+
+/*
+ * Keep some garbage around, acknowledge the pre-dump notification
+ * as is, give the garbage back when notified of the dump and exit
+ * with SUCC_ECODE if it was asked to.
+ */
+static int loop(const char *path, int status_fd)
+{
+	unsigned int deadline;
+	bool pre_dump;
+	char *garbage;
+	int lsk, sk, ret;
+
+	garbage = mmap(NULL, GARBAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (garbage == MAP_FAILED)
+		return 1;
+	memset(garbage, 0x5a, GARBAGE_SIZE);
+
+	lsk = criu_freeze_notify_listen(path);
+	if (lsk < 0)
+		return 1;
+
+	ret = SUCC_ECODE;
+	write(status_fd, &ret, sizeof(ret));
+	close(status_fd);
+
+	sk = criu_freeze_notify_accept(lsk, &deadline, &pre_dump);
+	if (sk < 0 || !deadline || !pre_dump)
+		return 1;
+	if (criu_freeze_notify_ack(sk))
+		return 1;
+
+	sk = criu_freeze_notify_accept(lsk, &deadline, &pre_dump);
+	if (sk < 0 || !deadline || pre_dump)
+		return 1;
+
+	close(lsk);
+	unlink(path);
+
+	munmap(garbage, GARBAGE_SIZE);
+	if (criu_freeze_notify_ack(sk))
+		return 1;
+
+	while (!stop)
+		sleep(1);
+
+	return SUCC_ECODE;
+}
+
+/* The dump has to have written fewer pages than the pre-dump by the garbage */
+static int check_stats(int dir)
+{
+	long garbage = GARBAGE_SIZE / sysconf(_SC_PAGESIZE);
+	char line[1024], *pos;
+	long delta = 0;
+	bool found = false;
+	FILE *f;
+	int fd;
+
+	fd = openat(dir, "dump.log", O_RDONLY);
+	if (fd < 0 || !(f = fdopen(fd, "r"))) {
+		perror("Can't open dump.log");
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		pos = strstr(line, STATS_LINE);
+		if (pos) {
+			found = sscanf(pos + strlen(STATS_LINE), "%ld", &delta) == 1;
+			break;
+		}
+	}
+	fclose(f);
+
+	if (!found) {
+		printf("No freeze notify stats in dump.log\n");
+		return -1;
+	}
+
+	printf("   `- %ld pages written against the pre-dump\n", delta);
+	if (delta > -garbage / 2) {
+		printf("The %ld pages of garbage given back don't show\n", garbage);
+		return -1;
+	}
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	char path[PATH_MAX];
+	int pid, ret, fd, pre_fd, p[2];
+
+	if (!realpath(argv[2], path)) {
+		perror("Can't resolve wdir");
+		return 1;
+	}
+	strcat(path, "/freeze.sk");
+	unlink(path);
+
+	printf("--- Start loop ---\n");
+	pipe(p);
+	pid = fork();
+	if (pid < 0) {
+		perror("Can't");
+		return -1;
+	}
+
+	if (!pid) {
+		printf("   `- loop: initializing\n");
+		if (setsid() < 0)
+			exit(1);
+		if (signal(SIGUSR1, sh) == SIG_ERR)
+			exit(1);
+
+		close(0);
+		close(1);
+		close(2);
+		close(p[0]);
+
+		exit(loop(path, p[1]));
+	}
+
+	close(p[1]);
+
+	/* Wait for kid to start listening */
+	ret = -1;
+	read(p[0], &ret, sizeof(ret));
+	close(p[0]);
+	if (ret != SUCC_ECODE) {
+		printf("Error starting loop\n");
+		goto err;
+	}
+
+	printf("--- Pre-dump loop ---\n");
+	criu_init_opts();
+	criu_set_service_binary(argv[1]);
+	criu_set_pid(pid);
+	criu_set_log_file("dump.log");
+	criu_set_log_level(CRIU_LOG_DEBUG);
+	criu_set_track_mem(true);
+	criu_set_freeze_notify(path);
+	criu_set_freeze_notify_timeout(5000);
+	fd = open(argv[2], O_DIRECTORY);
+	mkdirat(fd, "pre", 0700);
+	pre_fd = openat(fd, "pre", O_DIRECTORY);
+	criu_set_images_dir_fd(pre_fd);
+
+	ret = criu_pre_dump();
+	if (ret < 0) {
+		what_err_ret_mean(ret);
+		kill(pid, SIGKILL);
+		goto err;
+	}
+
+	printf("   `- Pre-dump succeeded\n");
+
+	printf("--- Dump loop ---\n");
+	criu_set_images_dir_fd(fd);
+	criu_set_parent_images("pre");
+
+	ret = criu_dump();
+	if (ret < 0) {
+		what_err_ret_mean(ret);
+		kill(pid, SIGKILL);
+		goto err;
+	}
+
+	printf("   `- Dump succeeded\n");
+	waitpid(pid, NULL, 0);
+
+	if (check_stats(fd))
+		return 1;
+
+	printf("--- Restore ---\n");
+	criu_init_opts();
+	criu_set_log_level(CRIU_LOG_DEBUG);
+	criu_set_log_file("restore.log");
+	criu_set_images_dir_fd(fd);
+
+	pid = criu_restore_child();
+	if (pid <= 0) {
+		what_err_ret_mean(pid);
+		return -1;
+	}
+
+	printf("   `- Restore returned pid %d\n", pid);
+	kill(pid, SIGUSR1);
+err:
+	if (waitpid(pid, &ret, 0) < 0) {
+		perror("   Can't wait kid");
+		return -1;
+	}
+
+	return chk_exit(ret, SUCC_ECODE);
+}
@@ -0,0 +1,453 @@
+#!/usr/bin/env python3
+#
+# Dump/restore performance regression suite.
+#
+# Every workload is a tree of tasks set up by bers (or a zdtm test)
+# with the given amount of memory, threads, files or sockets.
+# It is checkpointed and restored several times in each of the
+# variants, the wall-clock times and the stats CRIU writes into the
+# images are collected, and their medians are compared against a
+# baseline saved by an earlier run.
+
+import argparse
+import json
+import os
+import platform
+import shutil
+import signal
+import statistics
+import subprocess
+import sys
+import time
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+ROOT = os.path.abspath(os.path.join(HERE, '..', '..', '..'))
+
+sys.path.insert(0, os.path.join(ROOT, 'test'))
+import pycriu as crpc  # noqa: E402
+
+PAGE_SIZE = os.sysconf('SC_PAGE_SIZE')
+
+# The bers options the workload parameters are turned into
+BERS_PARAMS = {
+    'tasks': '--tasks',
+    'rss': '--memory',
+    'chunks': '--mem-chunks',
+    'dirty': '--mem-dirty',
+    'threads': '--threads',
+    'fds': '--files',
+    'sockets': '--sockets',
+}
+
+VARIANTS = ['dump', 'pre-dump', 'lazy']
+
+# Stats to collect: entry field, metric name
+DUMP_STATS = [
+    ('freezing_time', 'freezing'),
+    ('frozen_time', 'frozen'),
+    ('memdump_time', 'memdump'),
+    ('memwrite_time', 'memwrite'),
+    ('pages_written', 'pages_written'),
+    ('parasite_infect_time', 'parasite_infect'),
+    ('parasite_infect_max_time', 'parasite_infect_max'),
+]
+
+RESTORE_STATS = [
+    ('forking_time', 'forking'),
+    ('restore_time', 'restore'),
+    ('thread_create_time', 'thread_create'),
+]
+
+
+class perf_fail(Exception):
+    pass
+
+
+def bers_args(params, wdir):
+    args = ['--dir', wdir]
+
+    for p in sorted(params):
+        if p not in BERS_PARAMS:
+            raise perf_fail("Unknown workload parameter %s" % p)
+        args += [BERS_PARAMS[p], str(params[p])]
+
+    if params.get('rss'):
+        args += ['--mem-fill', 'all']
+    if params.get('dirty'):
+        args += ['--refresh', '1']
+
+    return args
+
+
+class workload:
+    def __init__(self, name, desc, opts):
+        self.name = name
+        self.desc = desc
+        self.params = desc.get('params', {})
+        self.zdtm = desc.get('zdtm')
+        self.variants = desc.get('variants', ['dump'])
+        self.pid = None
+        self.opts = opts
+
+    def start(self, wdir):
+        if self.zdtm:
+            self.__start_zdtm()
+        else:
+            self.__start_bers(wdir)
+
+    def __start_bers(self, wdir):
+        pidfile = os.path.join(wdir, 'bers.pid')
+        cmd = [self.opts.bers] + bers_args(self.params, wdir)
+        p = subprocess.Popen(cmd, stdin=subprocess.DEVNULL,
+                             stdout=subprocess.DEVNULL,
+                             stderr=subprocess.DEVNULL,
+                             start_new_session=True)
+        # bers writes the pidfile when all the tasks are set up
+        while not os.access(pidfile, os.R_OK):
+            if p.poll() is not None:
+                raise perf_fail("bers exited with %d" % p.returncode)
+            time.sleep(0.1)
+        with open(pidfile) as f:
+            self.pid = int(f.read().strip())
+
+    def __zdtm_path(self):
+        return os.path.join(ROOT, 'test', 'zdtm', self.zdtm)
+
+    def __start_zdtm(self):
+        tdir, tname = os.path.split(self.__zdtm_path())
+        subprocess.check_call(['make', '-s', '-C', tdir, tname + '.pid'],
+                              stdout=subprocess.DEVNULL)
+        with open(self.__zdtm_path() + '.pid') as f:
+            self.pid = int(f.read().split()[0])
+
+    def stop(self):
+        if self.pid is None:
+            return
+
+        pid, self.pid = self.pid, None
+        if not self.zdtm:
+            try:
+                os.killpg(pid, signal.SIGKILL)
+            except ProcessLookupError:
+                pass
+            return
+
+        # Let the test check itself after all the restores
+        os.kill(pid, signal.SIGTERM)
+        out = self.__zdtm_path() + '.out'
+        for _ in range(100):
+            if not os.path.exists('/proc/%d' % pid):
+                break
+            time.sleep(0.1)
+        with open(out) as f:
+            res = f.read()
+        tdir, tname = os.path.split(self.__zdtm_path())
+        subprocess.call(['make', '-s', '-C', tdir, tname + '.cleanout'])
+        if 'PASS' not in res.split():
+            raise perf_fail("%s failed after restore:\n%s" % (self.zdtm, res))
+
+
+class criu:
+    def __init__(self, opts):
+        self.bin = opts.criu
+        self.verbosity = '-v%d' % opts.log_level
+
+    def __cmd(self, action, ddir, log, args):
+        return [self.bin, action, '-D', ddir, '-o', log,
+                self.verbosity] + args
+
+    def run(self, action, ddir, log, args):
+        start = time.monotonic()
+        ret = subprocess.call(self.__cmd(action, ddir, log, args))
+        wall = time.monotonic() - start
+        if ret:
+            raise perf_fail("criu %s failed, see %s" %
+                            (action, os.path.join(ddir, log)))
+        return wall
+
+    def start(self, action, ddir, log, args):
+        # Wait for the daemon to get ready, like zdtm.py does
+        rfd, wfd = os.pipe()
+        cmd = self.__cmd(action, ddir, log, args + ['--status-fd', str(wfd)])
+        p = subprocess.Popen(cmd, pass_fds=[wfd])
+        os.close(wfd)
+        status = os.read(rfd, 1)
+        os.close(rfd)
+        if status != b'\0':
+            p.wait()
+            raise perf_fail("criu %s failed to start, see %s" %
+                            (action, os.path.join(ddir, log)))
+        return p
+
+    def has_feature(self, feature):
+        return subprocess.call([self.bin, 'check', '--feature', feature],
+                               stdout=subprocess.DEVNULL,
+                               stderr=subprocess.DEVNULL) == 0
+
+
+def load_stats(ddir, action, fields, prefix, res):
+    path = os.path.join(ddir, 'stats-' + action)
+    with open(path, 'rb') as f:
+        ent = crpc.images.load(f)['entries'][0][action]
+
+    for field, name in fields:
+        if field not in ent:
+            continue
+        val = int(ent[field])
+        if field.endswith('_time'):
+            # us -> ms
+            val /= 1000.
+        res[prefix + '.' + name] = val
+
+
+def throughput(res, prefix):
+    wall = res[prefix + '.wall']
+    pages = res.get(prefix + '.pages_written')
+    if pages is None or not wall:
+        return
+    res[prefix + '.throughput'] = pages * PAGE_SIZE / (1 << 20) / wall * 1000.
+
+
+def do_dump(c, w, ddir, res, prefix='dump', args=()):
+    os.makedirs(ddir)
+    wall = c.run(prefix, ddir, prefix + '.log',
+                 ['-t', str(w.pid)] + list(args))
+    res[prefix + '.wall'] = wall * 1000.
+    load_stats(ddir, 'dump', DUMP_STATS, prefix, res)
+    throughput(res, prefix)
+
+
+def do_restore(c, ddir, res, args=()):
+    wall = c.run('restore', ddir, 'restore.log', ['-d'] + list(args))
+    res['restore.wall'] = wall * 1000.
+    load_stats(ddir, 'restore', RESTORE_STATS, 'restore', res)
+
+
+def variant_dump(c, w, idir, res):
+    ddir = os.path.join(idir, 'dump')
+    do_dump(c, w, ddir, res)
+    do_restore(c, ddir, res)
+
+
+def variant_pre_dump(c, w, idir, res):
+    pdir = os.path.join(idir, 'pre')
+    ddir = os.path.join(idir, 'dump')
+    do_dump(c, w, pdir, res, prefix='pre-dump', args=['--track-mem'])
+    do_dump(c, w, ddir, res,
+            args=['--prev-images-dir', '../pre', '--track-mem'])
+    do_restore(c, ddir, res)
+
+
+def variant_lazy(c, w, idir, res):
+    ddir = os.path.join(idir, 'dump')
+    do_dump(c, w, ddir, res)
+
+    start = time.monotonic()
+    lp = c.start('lazy-pages', ddir, 'lazy-pages.log', [])
+    do_restore(c, ddir, res, ['--lazy-pages'])
+    # The tree runs by now, the rest of the memory is coming in
+    if lp.wait():
+        raise perf_fail("criu lazy-pages failed, see %s" %
+                        os.path.join(ddir, 'lazy-pages.log'))
+    res['lazy.complete'] = (time.monotonic() - start) * 1000.
+
+
+VARIANT_FN = {
+    'dump': variant_dump,
+    'pre-dump': variant_pre_dump,
+    'lazy': variant_lazy,
+}
+
+
+def run_one(c, w, variant, opts):
+    wdir = os.path.join(opts.work_dir, w.name, variant)
+    shutil.rmtree(wdir, ignore_errors=True)
+    os.makedirs(wdir)
+
+    samples = []
+    w.start(wdir)
+    try:
+        # The restored tree is what the next iteration dumps
+        for i in range(opts.iterations):
+            res = {}
+            VARIANT_FN[variant](c, w, os.path.join(wdir, str(i)), res)
+            samples.append(res)
+            if not opts.keep_images:
+                shutil.rmtree(os.path.join(wdir, str(i)))
+    finally:
+        w.stop()
+
+    if not opts.keep_images:
+        shutil.rmtree(wdir, ignore_errors=True)
+
+    keys = set()
+    for s in samples:
+        keys.update(s)
+    return {k: statistics.median([s[k] for s in samples if k in s])
+            for k in sorted(keys)}
+
+
+def higher_is_better(metric):
+    return metric.endswith('.throughput')
+
+
+def is_timing(metric):
+    return not metric.endswith('.pages_written')
+
+
+def compare(results, baseline, opts):
+    regressions = []
+
+    for key in sorted(results):
+        base = baseline.get(key)
+        if base is None:
+            print("%s: no baseline" % key)
+            continue
+
+        for m in sorted(results[key]):
+            val = results[key][m]
+            ref = base.get(m)
+            if ref is None or not is_timing(m):
+                continue
+
+            pct = (val - ref) * 100. / ref if ref else 0.
+            worse = -pct if higher_is_better(m) else pct
+            bad = worse > opts.threshold and abs(val - ref) > opts.min_delta
+            print("%-24s %-24s %12.2f %12.2f %+7.1f%%%s" %
+                  (key, m, ref, val, pct, "  REGRESSION" if bad else ""))
+            if bad:
+                regressions.append((key, m))
+
+    return regressions
+
+
+def environment(c):
+    ver = subprocess.run([c.bin, '--version'], stdout=subprocess.PIPE,
+                         universal_newlines=True).stdout
+    return {
+        'kernel': platform.release(),
+        'machine': platform.machine(),
+        'cpus': os.cpu_count(),
+        'criu': ver.strip(),
+        'date': time.strftime('%Y-%m-%dT%H:%M:%S'),
+    }
+
+
+def load_workloads(opts):
+    with open(opts.workloads) as f:
+        descs = json.load(f)
+
+    ws = []
+    for name in sorted(descs):
+        if opts.workload and name not in opts.workload:
+            continue
+        w = workload(name, descs[name], opts)
+        for s in opts.set:
+            k, _, v = s.partition('=')
+            if not w.zdtm and k in w.params:
+                w.params[k] = int(v)
+        ws.append(w)
+
+    return ws
+
+
+def do_list(opts):
+    for w in load_workloads(opts):
+        what = w.zdtm or ' '.join('%s=%s' % i for i in sorted(w.params.items()))
+        print("%-16s %-24s %s" % (w.name, ','.join(w.variants), what))
+
+
+def do_run(opts):
+    c = criu(opts)
+    results = {}
+    skipped = []
+
+    lazy = c.has_feature('uffd-noncoop')
+    for w in load_workloads(opts):
+        for v in w.variants:
+            if opts.variant and v not in opts.variant:
+                continue
+            if v == 'lazy' and not lazy:
+                skipped.append('%s/%s' % (w.name, v))
+                continue
+
+            key = '%s/%s' % (w.name, v)
+            print("=== %s (%d iterations)" % (key, opts.iterations))
+            results[key] = run_one(c, w, v, opts)
+            for m, val in results[key].items():
+                print("    %-24s %12.2f" % (m, val))
+
+    if skipped:
+        print("Skipped: %s" % ' '.join(skipped))
+
+    out = {'environment': environment(c), 'results': results}
+    if opts.save_baseline:
+        with open(opts.save_baseline, 'w') as f:
+            json.dump(out, f, indent=2, sort_keys=True)
+    if opts.output:
+        with open(opts.output, 'w') as f:
+            json.dump(out, f, indent=2, sort_keys=True)
+
+    if not opts.baseline:
+        return 0
+
+    with open(opts.baseline) as f:
+        baseline = json.load(f)
+    print("=== Against %s (%s)" % (opts.baseline,
+                                   baseline['environment'].get('criu', '?')))
+    regressions = compare(results, baseline['results'], opts)
+    if regressions:
+        print("%d regression(s) above %.1f%%" %
+              (len(regressions), opts.threshold))
+        return 1
+
+    return 0
+
+
+def main():
+    p = argparse.ArgumentParser(description="CRIU performance regressions")
+    p.add_argument('action', choices=['run', 'list'])
+    p.add_argument('--workloads', default=os.path.join(HERE, 'workloads.json'),
+                   help="Workloads description")
+    p.add_argument('-w', '--workload', action='append',
+                   help="Only run this workload")
+    p.add_argument('-V', '--variant', action='append', choices=VARIANTS,
+                   help="Only run this variant")
+    p.add_argument('--set', action='append', default=[],
+                   metavar='PARAM=VALUE',
+                   help="Override a parameter of the bers workloads")
+    p.add_argument('-i', '--iterations', type=int, default=5)
+    p.add_argument('-b', '--baseline', help="Compare with this baseline")
+    p.add_argument('-s', '--save-baseline', help="Save results as baseline")
+    p.add_argument('-o', '--output', help="Save results here")
+    p.add_argument('-t', '--threshold', type=float, default=10.,
+                   help="Regression threshold in percent")
+    p.add_argument('--min-delta', type=float, default=5.,
+                   help="Ignore differences smaller than that, in ms or MB/s")
+    p.add_argument('--criu', default=os.path.join(ROOT, 'criu', 'criu'))
+    p.add_argument('--bers', default=os.path.join(ROOT, 'test', 'others',
+                                                  'bers', 'bers'))
+    p.add_argument('--work-dir', default=os.path.join(HERE, 'work'))
+    p.add_argument('--keep-images', action='store_true')
+    p.add_argument('--log-level', type=int, default=2)
+    opts = p.parse_args()
+
+    opts.work_dir = os.path.abspath(opts.work_dir)
+
+    if opts.action == 'list':
+        do_list(opts)
+        return 0
+
+    if os.getuid():
+        print("The suite has to be run as root")
+        return 1
+
+    try:
+        return do_run(opts)
+    except perf_fail as e:
+        print("FAIL: %s" % e)
+        return 1
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,77 @@
+#!/usr/bin/python
+# Test changing the I/O limits of a dump while it runs
+
+import socket, os, sys, time, subprocess
+import rpc_pb2 as rpc
+import argparse
+
+parser = argparse.ArgumentParser(description="Test IO_LIMITS requests via CRIU RPC")
+parser.add_argument('socket', type=str, help="CRIU service socket")
+parser.add_argument('dir',
+                    type=str,
+                    help="Directory where CRIU images should be placed")
+
+args = vars(parser.parse_args())
+
+MEM_MB = 64
+LOG = 'dump-io-limits.log'
+
+# A task with MEM_MB of memory to dump, it would take MEM_MB
+# seconds at the 1M/s the dump starts with
+child = subprocess.Popen([
+    sys.executable, '-c',
+    'import sys, time\nb = b"\\1" * (%d << 20)\nprint("ready")\nsys.stdout.flush()\ntime.sleep(1000)' % MEM_MB
+],
+                         stdout=subprocess.PIPE,
+                         start_new_session=True)
+if child.stdout.readline().strip() != b'ready':
+    print('Child did not start')
+    sys.exit(1)
+
+s = socket.socket(socket.AF_UNIX, socket.SOCK_SEQPACKET)
+s.connect(args['socket'])
+
+req = rpc.criu_req()
+req.type = rpc.DUMP
+req.opts.images_dir_fd = os.open(args['dir'], os.O_DIRECTORY)
+req.opts.pid = child.pid
+req.opts.log_file = LOG
+req.opts.log_level = 4
+req.opts.io_rate = 1 << 20
+
+print('Dumping %d at 1M/s' % child.pid)
+start = time.time()
+s.send(req.SerializeToString())
+
+time.sleep(2)
+
+print('Lifting the limit')
+req = rpc.criu_req()
+req.type = rpc.IO_LIMITS
+req.opts.images_dir_fd = -1
+req.opts.io_rate = 0
+s.send(req.SerializeToString())
+
+resp = rpc.criu_resp()
+MAX_MSG_SIZE = 1024
+resp.ParseFromString(s.recv(MAX_MSG_SIZE))
+took = time.time() - start
+
+if child.poll() is None:
+    child.kill()
+child.wait()
+
+if resp.type != rpc.DUMP or not resp.success:
+    print('Dump failed')
+    sys.exit(1)
+
+if took >= MEM_MB / 2:
+    print('Dump took %.1fs, the limit was not lifted' % took)
+    sys.exit(1)
+
+with open(os.path.join(args['dir'], LOG)) as f:
+    if 'Limits changed to 0 bytes/s' not in f.read():
+        print('No limits change in the log')
+        sys.exit(1)
+
+print('Success, dump took %.1fs' % took)
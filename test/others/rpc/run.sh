@@ -80,6 +80,13 @@ function test_errno {
 	setsid ./errno.py build/criu_service.socket build/imgs_errno < /dev/null &>> build/output_errno
 }
 
+function test_io_limits {
+	mkdir -p build/imgs_io_limits
+
+	title_print "Run io_limits"
+	setsid ./io_limits.py build/criu_service.socket build/imgs_io_limits < /dev/null &>> build/output_io_limits
+}
+
 trap 'echo "FAIL"; stop_server' EXIT
 
 test_c
@@ -87,6 +94,7 @@ test_py
 test_restore_loop
 test_ps
 test_errno
+test_io_limits
 
 stop_server
 
@@ -971,6 +971,24 @@ class criu_rpc:
                 criu.opts.pidfd_store_sk = criu_rpc.pidfd_store_socket.fileno()
             elif "--mntns-compat-mode" == arg:
                 criu.opts.mntns_compat_mode = True
+            elif "--compact-pagemap" == arg:
+                criu.opts.compact_pagemap = True
+            elif "--delta-pages" == arg:
+                criu.opts.delta_pages = True
+            elif "--page-cache-warmth" == arg:
+                criu.opts.page_cache_warmth = True
+            elif "--cold-pages" == arg:
+                criu.opts.cold_pages = True
+            elif "--discard-dontdump" == arg:
+                criu.opts.discard_dontdump = True
+            elif "--discard-signal" == arg:
+                criu.opts.discard_signal = int(args.pop(0))
+            elif "--numa" == arg:
+                criu.opts.numa = True
+            elif "--io-rate" == arg:
+                criu.opts.io_rate = int(args.pop(0))
+            elif "--io-full-speed-frozen" == arg:
+                criu.opts.io_full_speed_frozen = True
             else:
                 raise test_fail_exc('RPC for %s(%s) required' % (arg, args.pop(0)))
 
@@ -1066,6 +1084,13 @@ class criu:
         self.__crit_bin = opts['crit_bin']
         self.__pre_dump_mode = opts['pre_dump_mode']
         self.__mntns_compat_mode = bool(opts['mntns_compat_mode'])
+        self.__compact_pagemap = bool(opts['compact_pagemap'])
+        self.__delta_pages = bool(opts['delta_pages'])
+        self.__page_cache_warmth = bool(opts['page_cache_warmth'])
+        self.__cold_pages = bool(opts['cold_pages'])
+        self.__numa = bool(opts['numa'])
+        self.__io_rate = opts['io_rate']
+        self.__io_full_speed_frozen = bool(opts['io_full_speed_frozen'])
 
         if opts['rpc']:
             self.__criu = criu_rpc
@@ -1364,6 +1389,10 @@ class criu:
             ps_opts = ["--port", "12345"] + self.__tls
             if self.__dedup:
                 ps_opts += ["--auto-dedup"]
+            if self.__compact_pagemap:
+                ps_opts += ["--compact-pagemap"]
+            if self.__delta_pages:
+                ps_opts += ["--delta-pages"]
 
             self.__page_server_p = self.__criu_act("page-server",
                                                    opts=ps_opts,
@@ -1381,6 +1410,27 @@ class criu:
         if self.__dedup:
             a_opts += ["--auto-dedup"]
 
+        if self.__compact_pagemap:
+            a_opts += ["--compact-pagemap"]
+
+        if self.__delta_pages:
+            a_opts += ["--delta-pages"]
+
+        if self.__page_cache_warmth:
+            a_opts += ["--page-cache-warmth"]
+
+        if self.__cold_pages:
+            a_opts += ["--cold-pages"]
+
+        if self.__numa:
+            a_opts += ["--numa"]
+
+        if self.__io_rate:
+            a_opts += ["--io-rate", self.__io_rate]
+
+        if self.__io_full_speed_frozen:
+            a_opts += ["--io-full-speed-frozen"]
+
         a_opts += ["--timeout", "10"]
 
         criu_dir = os.path.dirname(os.getcwd())
@@ -1444,6 +1494,15 @@ class criu:
         if self.__dedup:
             r_opts += ["--auto-dedup"]
 
+        if self.__page_cache_warmth:
+            r_opts += ["--page-cache-warmth"]
+
+        if self.__cold_pages:
+            r_opts += ["--cold-pages"]
+
+        if self.__io_rate:
+            r_opts += ["--io-rate", self.__io_rate]
+
         self.__prev_dump_iter = None
         criu_dir = os.path.dirname(os.getcwd())
         if os.getenv("GCOV"):
@@ -2074,6 +2133,8 @@ class Launcher:
               'dedup', 'sbs', 'freezecg', 'user', 'dry_run', 'noauto_dedup',
               'remote_lazy_pages', 'show_stats', 'lazy_migrate', 'stream',
               'tls', 'criu_bin', 'crit_bin', 'pre_dump_mode', 'mntns_compat_mode',
+              'compact_pagemap', 'delta_pages', 'page_cache_warmth',
+              'cold_pages', 'numa', 'io_rate', 'io_full_speed_frozen',
               'rootless')
         arg = repr((name, desc, flavor, {d: self.__opts[d] for d in nd}))
 
@@ -2767,6 +2828,26 @@ def get_cli_args():
     rp.add_argument("--mntns-compat-mode",
                     help="Use old compat mounts restore engine",
                     action='store_true')
+    rp.add_argument("--compact-pagemap",
+                    help="Dump pagemaps in the compact encoding",
+                    action='store_true')
+    rp.add_argument("--delta-pages",
+                    help="Dump re-dirtied pages as deltas against the parent",
+                    action='store_true')
+    rp.add_argument("--page-cache-warmth",
+                    help="Record page cache residency and read it ahead on restore",
+                    action='store_true')
+    rp.add_argument("--cold-pages",
+                    help="Restore pages found cold on dump with MADV_COLD",
+                    action='store_true')
+    rp.add_argument("--numa",
+                    help="Dump memory policies and page nodes",
+                    action='store_true')
+    rp.add_argument("--io-rate",
+                    help="Limit image I/O to that many bytes per second")
+    rp.add_argument("--io-full-speed-frozen",
+                    help="Lift the I/O limit once the tasks are frozen",
+                    action='store_true')
 
     lp = sp.add_parser("list", help="List tests")
     lp.set_defaults(action=list_tests)
@@ -0,0 +1,75 @@
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "zdtmtst.h"
+
+const char *test_doc = "Check that MADV_DONTDUMP memory is discarded and the task is notified";
+const char *test_author = "agent <agent@local>";
+
+#define MEM_SIZE    (1 << 22)
+#define DISCARD_SIG 40 /* see --discard-signal in the .desc */
+
+static void *volatile notified;
+
+static void discard_handler(int sig, siginfo_t *info, void *ctx)
+{
+	if (info->si_code == SI_QUEUE)
+		notified = info->si_value.sival_ptr;
+}
+
+int main(int argc, char **argv)
+{
+	struct sigaction act = {};
+	uint8_t *keep, *drop;
+	uint32_t crc;
+	int i;
+
+	test_init(argc, argv);
+
+	act.sa_sigaction = discard_handler;
+	act.sa_flags = SA_SIGINFO;
+	if (sigaction(DISCARD_SIG, &act, NULL)) {
+		pr_perror("sigaction");
+		return 1;
+	}
+
+	keep = mmap(NULL, MEM_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	drop = mmap(NULL, MEM_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (keep == MAP_FAILED || drop == MAP_FAILED) {
+		pr_perror("mmap");
+		return 1;
+	}
+
+	crc = ~0;
+	datagen(keep, MEM_SIZE, &crc);
+	memset(drop, 0x5a, MEM_SIZE);
+
+	if (madvise(drop, MEM_SIZE, MADV_DONTDUMP)) {
+		pr_perror("madvise");
+		return 1;
+	}
+
+	test_daemon();
+	test_waitsig();
+
+	crc = ~0;
+	if (datachk(keep, MEM_SIZE, &crc)) {
+		fail("Dumped memory corrupted");
+		return 1;
+	}
+
+	for (i = 0; i < MEM_SIZE; i++)
+		if (drop[i]) {
+			fail("Discarded memory is not zero at %d", i);
+			return 1;
+		}
+
+	if (notified != drop) {
+		fail("Expected notification for %p, got %p", drop, notified);
+		return 1;
+	}
+
+	pass();
+	return 0;
+}
@@ -0,0 +1,156 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <linux/limits.h>
+#include "zdtmtst.h"
+
+const char *test_doc = "Test mappings of one file in many tasks with different open modes";
+const char *test_author = "agent <agent@local>";
+
+char *filename;
+TEST_OPTION(filename, string, "file name", 1);
+
+#define NR_TASKS 16
+
+/* Even tasks map the file read-write, odd ones map it read-only */
+static int child(int i, int go, int ready)
+{
+	unsigned char *shared, *private;
+	int fd, rw = !(i % 2);
+
+	fd = open(filename, rw ? O_RDWR : O_RDONLY);
+	if (fd < 0) {
+		pr_perror("Can't open %s", filename);
+		return 1;
+	}
+
+	shared = mmap(NULL, PAGE_SIZE, PROT_READ | (rw ? PROT_WRITE : 0), MAP_SHARED, fd, 0);
+	private = mmap(NULL, PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, PAGE_SIZE);
+	close(fd);
+	if (shared == MAP_FAILED || private == MAP_FAILED) {
+		pr_perror("Can't map %s", filename);
+		return 1;
+	}
+	private[0] = i;
+
+	/* Let the parent know the mappings are there before it gets dumped */
+	if (write(ready, &i, sizeof(i)) != sizeof(i)) {
+		pr_perror("Can't report readiness");
+		return 1;
+	}
+	close(ready);
+
+	/* Parent closes the pipe after restore */
+	if (read(go, &fd, sizeof(fd)) != 0) {
+		pr_err("Unexpected data in the pipe\n");
+		return 1;
+	}
+
+	if (private[0] != i) {
+		pr_err("Task %d sees %d in its private mapping\n", i, private[0]);
+		return 1;
+	}
+
+	if (rw) {
+		shared[i] = i + 1;
+		return 0;
+	}
+
+	if (!mprotect(shared, PAGE_SIZE, PROT_READ | PROT_WRITE)) {
+		pr_err("Read-only mapping of task %d became writable\n", i);
+		return 1;
+	}
+	if (errno != EACCES) {
+		pr_perror("Unexpected mprotect error");
+		return 1;
+	}
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int fd, go[2], ready[2], i, status, ret = 0;
+	unsigned char *shared;
+	pid_t pids[NR_TASKS];
+
+	test_init(argc, argv);
+
+	fd = open(filename, O_RDWR | O_CREAT, 0644);
+	if (fd < 0) {
+		pr_perror("open failed");
+		return 1;
+	}
+	if (ftruncate(fd, 2 * PAGE_SIZE)) {
+		pr_perror("ftruncate failed");
+		return 1;
+	}
+
+	shared = mmap(NULL, PAGE_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (shared == MAP_FAILED) {
+		pr_perror("mmap failed");
+		return 1;
+	}
+
+	if (pipe(go) || pipe(ready)) {
+		pr_perror("pipe");
+		return 1;
+	}
+
+	for (i = 0; i < NR_TASKS; i++) {
+		pids[i] = fork();
+		if (pids[i] < 0) {
+			pr_perror("fork");
+			return 1;
+		}
+		if (pids[i] == 0) {
+			close(go[1]);
+			close(ready[0]);
+			exit(child(i, go[0], ready[1]));
+		}
+	}
+	close(go[0]);
+	close(ready[1]);
+
+	for (i = 0; i < NR_TASKS; i++) {
+		if (read(ready[0], &fd, sizeof(fd)) != sizeof(fd)) {
+			pr_perror("Task didn't map the file");
+			return 1;
+		}
+	}
+	close(ready[0]);
+
+	test_daemon();
+	test_waitsig();
+
+	close(go[1]);
+
+	for (i = 0; i < NR_TASKS; i++) {
+		if (waitpid(pids[i], &status, 0) != pids[i]) {
+			pr_perror("waitpid %d", pids[i]);
+			return 1;
+		}
+
+		if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+			fail("Task %d failed: status %x", i, status);
+			ret = 1;
+		}
+	}
+
+	for (i = 0; i < NR_TASKS; i++) {
+		if (shared[i] != (i % 2 ? 0 : i + 1)) {
+			fail("Byte %d of the shared mapping is %d", i, shared[i]);
+			ret = 1;
+		}
+	}
+
+	if (!ret)
+		pass();
+	return ret;
+}
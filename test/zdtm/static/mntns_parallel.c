@@ -0,0 +1,222 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <limits.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "zdtmtst.h"
+
+const char *test_doc = "Check several mount namespaces with many mounts each";
+const char *test_author = "agent <agent@local>";
+
+char *dirname;
+TEST_OPTION(dirname, string, "directory name", 1);
+
+#define NR_NS	  8
+#define NR_MOUNTS 24
+
+static int check_mount(int ns, int i, bool visible)
+{
+	char path[PATH_MAX], buf[64], expected[64];
+	int fd, len;
+
+	snprintf(path, sizeof(path), "%s/mnt-%d/marker-%d", dirname, i, ns);
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		if (!visible)
+			return 0;
+		pr_perror("Can't open %s", path);
+		return -1;
+	}
+
+	if (!visible) {
+		pr_err("Mount %d of mntns %d is visible\n", i, ns);
+		close(fd);
+		return -1;
+	}
+
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len < 0) {
+		pr_perror("Can't read %s", path);
+		return -1;
+	}
+	buf[len] = 0;
+
+	snprintf(expected, sizeof(expected), "%d:%d", ns, i);
+	if (strcmp(buf, expected)) {
+		pr_err("%s contains \"%s\" instead of \"%s\"\n", path, buf, expected);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int ns_child(int ns, int ready, int go)
+{
+	char path[PATH_MAX], buf[64];
+	int i, fd, len;
+
+	if (unshare(CLONE_NEWNS)) {
+		pr_perror("unshare");
+		return 1;
+	}
+
+	if (mount(NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL)) {
+		pr_perror("Can't remount / private");
+		return 1;
+	}
+
+	for (i = 0; i < NR_MOUNTS; i++) {
+		snprintf(path, sizeof(path), "%s/mnt-%d", dirname, i);
+		if (mount("zdtm", path, "tmpfs", 0, NULL)) {
+			pr_perror("Can't mount tmpfs on %s", path);
+			return 1;
+		}
+
+		snprintf(path, sizeof(path), "%s/mnt-%d/marker-%d", dirname, i, ns);
+		fd = open(path, O_CREAT | O_WRONLY, 0600);
+		if (fd < 0) {
+			pr_perror("Can't create %s", path);
+			return 1;
+		}
+		len = snprintf(buf, sizeof(buf), "%d:%d", ns, i);
+		if (write(fd, buf, len) != len) {
+			pr_perror("Can't write %s", path);
+			close(fd);
+			return 1;
+		}
+		close(fd);
+	}
+
+	/* Every namespace has a bind of its first mount and an unbindable one */
+	snprintf(path, sizeof(path), "%s/mnt-0", dirname);
+	snprintf(buf, sizeof(buf), "%s/bind", dirname);
+	if (mount(path, buf, NULL, MS_BIND, NULL)) {
+		pr_perror("Can't bind %s to %s", path, buf);
+		return 1;
+	}
+
+	snprintf(path, sizeof(path), "%s/mnt-%d", dirname, NR_MOUNTS - 1);
+	if (mount(NULL, path, NULL, MS_UNBINDABLE, NULL)) {
+		pr_perror("Can't make %s unbindable", path);
+		return 1;
+	}
+
+	if (write(ready, &ns, sizeof(ns)) != sizeof(ns)) {
+		pr_perror("Can't report readiness");
+		return 1;
+	}
+	close(ready);
+
+	/* Parent closes the pipe after restore */
+	if (read(go, &i, sizeof(i)) != 0) {
+		pr_err("Unexpected data in the pipe\n");
+		return 1;
+	}
+
+	for (i = 0; i < NR_MOUNTS; i++) {
+		int other = (ns + 1) % NR_NS;
+
+		if (check_mount(ns, i, true) || check_mount(other, i, false))
+			return 1;
+	}
+
+	snprintf(path, sizeof(path), "%s/bind/marker-%d", dirname, ns);
+	if (access(path, F_OK)) {
+		pr_perror("Bind-mount of mntns %d is lost", ns);
+		return 1;
+	}
+
+	snprintf(path, sizeof(path), "%s/mnt-%d", dirname, NR_MOUNTS - 1);
+	if (mount(path, buf, NULL, MS_BIND, NULL) == 0) {
+		pr_err("Mount %s is bindable after restore\n", path);
+		return 1;
+	}
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int ready[2], go[2], i, status, ns, ret = 0;
+	char path[PATH_MAX];
+	pid_t pids[NR_NS];
+
+	test_init(argc, argv);
+
+	if (mkdir(dirname, 0700)) {
+		pr_perror("mkdir %s", dirname);
+		return 1;
+	}
+
+	for (i = 0; i < NR_MOUNTS; i++) {
+		snprintf(path, sizeof(path), "%s/mnt-%d", dirname, i);
+		if (mkdir(path, 0700)) {
+			pr_perror("mkdir %s", path);
+			return 1;
+		}
+	}
+
+	snprintf(path, sizeof(path), "%s/bind", dirname);
+	if (mkdir(path, 0700)) {
+		pr_perror("mkdir %s", path);
+		return 1;
+	}
+
+	if (pipe(ready) || pipe(go)) {
+		pr_perror("pipe");
+		return 1;
+	}
+
+	for (i = 0; i < NR_NS; i++) {
+		pids[i] = fork();
+		if (pids[i] < 0) {
+			pr_perror("fork");
+			return 1;
+		}
+		if (pids[i] == 0) {
+			close(ready[0]);
+			close(go[1]);
+			exit(ns_child(i, ready[1], go[0]));
+		}
+	}
+	close(ready[1]);
+	close(go[0]);
+
+	for (i = 0; i < NR_NS; i++) {
+		if (read(ready[0], &ns, sizeof(ns)) != sizeof(ns)) {
+			pr_err("Child failed to prepare its mntns\n");
+			return 1;
+		}
+	}
+	close(ready[0]);
+
+	test_daemon();
+	test_waitsig();
+
+	close(go[1]);
+
+	for (i = 0; i < NR_NS; i++) {
+		if (waitpid(pids[i], &status, 0) != pids[i]) {
+			pr_perror("waitpid %d", pids[i]);
+			return 1;
+		}
+
+		if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+			fail("Mntns %d is broken: status %x", i, status);
+			ret = 1;
+		}
+	}
+
+	if (!ret)
+		pass();
+
+	return ret;
+}
@@ -0,0 +1,96 @@
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#include "zdtmtst.h"
+
+const char *test_doc = "Check that memory policies of the task and its mappings are restored";
+const char *test_author = "agent <agent@local>";
+
+#ifndef MPOL_LOCAL
+#define MPOL_LOCAL 4
+#endif
+
+#define MEM_SIZE  (1 << 20)
+#define MAX_NODES 1024
+
+static unsigned long node0[MAX_NODES / (8 * sizeof(unsigned long))] = { 1 };
+
+static int check_policy(void *addr, int flags, int mode, const char *what)
+{
+	unsigned long nodes[MAX_NODES / (8 * sizeof(unsigned long))] = {};
+	int got;
+
+	if (syscall(__NR_get_mempolicy, &got, nodes, MAX_NODES, addr, flags)) {
+		pr_perror("get_mempolicy %s", what);
+		return -1;
+	}
+
+	if (got != mode) {
+		fail("Policy of %s is %#x, expected %#x", what, got, mode);
+		return -1;
+	}
+
+	if (mode != MPOL_DEFAULT && mode != MPOL_LOCAL && memcmp(nodes, node0, sizeof(nodes))) {
+		fail("Nodes of %s are %#lx, expected node 0", what, nodes[0]);
+		return -1;
+	}
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	uint8_t *bound, *preferred, *plain;
+	uint32_t crc;
+
+	test_init(argc, argv);
+
+	bound = mmap(NULL, MEM_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	preferred = mmap(NULL, MEM_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	plain = mmap(NULL, MEM_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (bound == MAP_FAILED || preferred == MAP_FAILED || plain == MAP_FAILED) {
+		pr_perror("mmap");
+		return 1;
+	}
+
+	if (syscall(__NR_mbind, bound, MEM_SIZE, MPOL_BIND, node0, MAX_NODES + 1, 0) ||
+	    syscall(__NR_mbind, preferred, MEM_SIZE, MPOL_PREFERRED | MPOL_F_STATIC_NODES, node0, MAX_NODES + 1,
+		    0)) {
+		pr_perror("mbind");
+		return 1;
+	}
+
+	if (syscall(__NR_set_mempolicy, MPOL_LOCAL, NULL, 0)) {
+		pr_perror("set_mempolicy");
+		return 1;
+	}
+
+	crc = ~0;
+	datagen(bound, MEM_SIZE, &crc);
+	crc = ~0;
+	datagen(preferred, MEM_SIZE, &crc);
+	crc = ~0;
+	datagen(plain, MEM_SIZE, &crc);
+
+	test_daemon();
+	test_waitsig();
+
+	crc = ~0;
+	if (datachk(bound, MEM_SIZE, &crc) || (crc = ~0, datachk(preferred, MEM_SIZE, &crc)) ||
+	    (crc = ~0, datachk(plain, MEM_SIZE, &crc))) {
+		fail("Memory corrupted");
+		return 1;
+	}
+
+	if (check_policy(bound, MPOL_F_ADDR, MPOL_BIND, "bound mapping") ||
+	    check_policy(preferred, MPOL_F_ADDR, MPOL_PREFERRED | MPOL_F_STATIC_NODES, "preferred mapping") ||
+	    check_policy(plain, MPOL_F_ADDR, MPOL_DEFAULT, "plain mapping") ||
+	    check_policy(NULL, 0, MPOL_LOCAL, "task"))
+		return 1;
+
+	pass();
+	return 0;
+}
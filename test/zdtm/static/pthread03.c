@@ -0,0 +1,84 @@
+/*
+ * A testee program with many threads
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include <pthread.h>
+
+#include "zdtmtst.h"
+
+const char *test_doc = "Check that many threads keep their tids and TLS\n";
+const char *test_author = "agent <agent@local>";
+
+#define NR_THREADS 300
+
+static __thread int tls_id;
+static pid_t tids[NR_THREADS];
+static int restored[NR_THREADS];
+static pthread_barrier_t barrier;
+
+static void *thread_func(void *arg)
+{
+	int id = (long)arg;
+
+	tls_id = id;
+	tids[id] = syscall(SYS_gettid);
+
+	/* Everybody is started */
+	pthread_barrier_wait(&barrier);
+	/* Everybody is restored */
+	pthread_barrier_wait(&barrier);
+
+	restored[id] = tls_id == id && tids[id] == syscall(SYS_gettid);
+
+	pthread_barrier_wait(&barrier);
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	pthread_attr_t attr;
+	pthread_t th;
+	int i;
+
+	test_init(argc, argv);
+
+	if (pthread_barrier_init(&barrier, NULL, NR_THREADS + 1)) {
+		pr_perror("Can't init a barrier");
+		return 1;
+	}
+
+	if (pthread_attr_init(&attr) || pthread_attr_setstacksize(&attr, 64 << 10)) {
+		pr_perror("Can't set up thread attributes");
+		return 1;
+	}
+
+	for (i = 0; i < NR_THREADS; i++) {
+		if (pthread_create(&th, &attr, thread_func, (void *)(long)i)) {
+			pr_perror("Can't create thread %d", i);
+			return 1;
+		}
+	}
+
+	pthread_barrier_wait(&barrier);
+
+	test_daemon();
+	test_waitsig();
+
+	pthread_barrier_wait(&barrier);
+	pthread_barrier_wait(&barrier);
+
+	for (i = 0; i < NR_THREADS; i++) {
+		if (!restored[i]) {
+			fail("Thread %d (tid %d) is not restored right", i, tids[i]);
+			return 1;
+		}
+	}
+
+	pass();
+	return 0;
+}